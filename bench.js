@@ -0,0 +1,100 @@
+// Benchmarks for the Javascript side of the library.  These time the same
+// verifications as src/bench.c, so that comparing the two shows the cost of
+// index.js, N-API and converting the arguments to Buffers.  Run from the root
+// of the repository after building the addon with `node-gyp rebuild`.
+const fs = require('fs');
+const addon = require('bindings')('glue');
+const verify = require('./');
+
+const iterations = parseInt(process.env.BENCH_ITERATIONS || '1000', 10);
+
+const read = name => fs.readFileSync(`./test-files/${name}`);
+
+const inputs = {
+  pkcs7: [read('pkcs7-pubkey'), read('document'), read('pkcs7')],
+  rsa2048: [read('rsa2048-pubkey'), read('document'), read('rsa2048')],
+};
+
+let incorrect = Buffer.from(inputs.rsa2048[1]);
+incorrect[20] ^= 1;
+inputs['rsa2048 fail'] = [inputs.rsa2048[0], incorrect, inputs.rsa2048[2]];
+inputs.malformed = [inputs.rsa2048[0], inputs.rsa2048[1], read('not-valid-datastructure')];
+
+const percentile = (sorted, p) => sorted[Math.floor(p * (sorted.length - 1))];
+
+function report(name, latencies, elapsed) {
+  latencies.sort((a, b) => a - b);
+  let us = ns => (ns / 1000).toFixed(1).padStart(9);
+  console.log([
+    name.padEnd(40),
+    (latencies.length / (elapsed / 1e9)).toFixed(0).padStart(10),
+    us(percentile(latencies, 0.5)),
+    us(percentile(latencies, 0.99)),
+    us(percentile(latencies, 0.999)),
+  ].join(' '));
+}
+
+// Time each call of fn on its own.  Exceptions are expected for the malformed
+// input and are part of what is being measured
+function bench(name, fn) {
+  let latencies = new Array(iterations);
+  for (let i = 0; i < 10; i++) {
+    try { fn(); } catch (err) { }
+  }
+  let start = process.hrtime.bigint();
+  for (let i = 0; i < iterations; i++) {
+    let before = process.hrtime.bigint();
+    try { fn(); } catch (err) { }
+    latencies[i] = Number(process.hrtime.bigint() - before);
+  }
+  report(name, latencies, Number(process.hrtime.bigint() - start));
+}
+
+// Keep concurrency calls in flight at once and time each one from when it was
+// started until its promise settled
+async function benchAsync(name, concurrency, fn) {
+  let latencies = [];
+  let started = 0;
+  let worker = async () => {
+    while (started < iterations) {
+      started++;
+      let before = process.hrtime.bigint();
+      try { await fn(); } catch (err) { }
+      latencies.push(Number(process.hrtime.bigint() - before));
+    }
+  };
+  let start = process.hrtime.bigint();
+  await Promise.all(Array.from({length: concurrency}, worker));
+  report(name, latencies, Number(process.hrtime.bigint() - start));
+}
+
+async function main() {
+  console.log(['benchmark'.padEnd(40), 'ops/s'.padStart(10), 'p50 us'.padStart(9),
+    'p99 us'.padStart(9), 'p999 us'.padStart(9)].join(' '));
+
+  for (let [name, [pubkey, document, pkcs7]] of Object.entries(inputs)) {
+    let key = verify.loadKey(pubkey);
+    let strings = [pubkey.toString(), document.toString(), pkcs7.toString()];
+
+    bench(`${name} addon`, () => addon.verify(pubkey, document, pkcs7));
+    bench(`${name} verify`, () => verify(pubkey, document, pkcs7));
+    bench(`${name} verify strings`, () => verify(...strings));
+    bench(`${name} addon key`, () => addon.verify(key._handle, document, pkcs7));
+    bench(`${name} verify key`, () => verify(key, document, pkcs7));
+  }
+
+  let [pubkey, document, pkcs7] = inputs.rsa2048;
+  let key = verify.loadKey(pubkey);
+  let batch = Array.from({length: 100}, () => ({pubkey: key, document, pkcs7}));
+
+  bench('rsa2048 verifyMany x100', () => verify.verifyMany(batch));
+  await benchAsync('rsa2048 verifyAsync key x1', 1,
+    () => verify.verifyAsync(key, document, pkcs7));
+  await benchAsync('rsa2048 verifyAsync key x16', 16,
+    () => verify.verifyAsync(key, document, pkcs7));
+}
+
+main().catch(err => {
+  console.error(err);
+  process.exit(1);
+});
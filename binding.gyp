@@ -16,10 +16,18 @@
         '-Werror'
       ],
       'ldflags': [
-        '-lcrypto'
+        '-lcrypto',
+        '-pthread'
       ],
       'sources': [
         'src/glue.c',
+        'src/cache.c',
+        'src/claims.c',
+        'src/policy.c',
+        'src/registry.c',
+        'src/sched.c',
+        'src/seen.c',
+        'src/stats.c',
         'src/verify.c',
         'src/verify.h'
       ],
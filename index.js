@@ -1,20 +1,123 @@
 
 const addon = require('bindings')('glue');
+const os = require('os');
+const {Writable} = require('stream');
 
-const pkcs7_header = Buffer.from('-----BEGIN PKCS7-----');
-const pkcs7_footer = Buffer.from('-----END PKCS7-----');
-const nl = Buffer.from('\n');
+/**
+ * A public key which has been parsed once by loadKey().  A Key can be passed
+ * in place of the pubkey argument of verify() and verifyAsync()
+ */
+class Key {
+  constructor(handle) {
+    this._handle = handle;
+  }
+}
 
 /**
- * Verify a document given a public key, document and a PKCS#7 encoded
- * signature.  All parameters should either be strings, Buffers or something
- * which can be converted into a Buffer safely with a call to Buffer.from(),
- * with an encoding parameter of 'utf-8'.
- *
- * For more detailed explanation of this functions return values and error
- * handling, please refer to README.md in the Api and Errors sections
+ * A set of public keys for many regions and endpoints, loaded by
+ * loadRegistry().  A Registry can be passed in place of the pubkey argument of
+ * verify() and the other verification functions, and the key for each
+ * document is then chosen from it
+ */
+class Registry {
+  constructor(handle) {
+    this._handle = handle;
+  }
+
+  /**
+   * Replace every key in the registry with those from source, which is the
+   * same as for loadRegistry().  Verifications which have already started
+   * finish with the old keys.  When any key can not be loaded, the registry
+   * is left unchanged and the error is thrown
+   */
+  reload(source) {
+    addon.loadRegistry(this._handle, registrySource(source));
+  }
+
+  /**
+   * The number of keys in the registry
+   */
+  get size() {
+    return addon.registrySize(this._handle);
+  }
+}
+
+/**
+ * Convert a {bundle} or {directory} source of keys into the Buffer or string
+ * which is passed to the native code
+ */
+function registrySource(source = {}) {
+  if (typeof source.directory === 'string') {
+    return source.directory;
+  }
+  if (typeof source.bundle === 'undefined') {
+    throw new Error('bundle or directory must be provided');
+  }
+  return Buffer.isBuffer(source.bundle) ? source.bundle : Buffer.from(source.bundle, 'utf-8');
+}
+
+/**
+ * A policy which has been compiled once by compilePolicy().  A Policy is
+ * checked in the native code against every document whose signature is valid
+ */
+class Policy {
+  constructor(handle) {
+    this._handle = handle;
+  }
+}
+
+/**
+ * A bounded set of the documents which a Policy has accepted, from
+ * createSeenSet().  A SeenSet can be shared by any number of policies, which
+ * then accept each document only once between them
  */
-module.exports = function verify(pubkey, document, pkcs7) {
+class SeenSet {
+  constructor(handle) {
+    this._handle = handle;
+  }
+
+  /**
+   * Return the size, memory and false positive rate of the set, and its
+   * counters, optionally setting the insertion, replay and eviction counters
+   * back to zero
+   */
+  stats(options = {}) {
+    return addon.seenStats(this._handle, !!options.reset);
+  }
+}
+
+/**
+ * Create a SeenSet with room for options.capacity documents, identified by
+ * their instanceId and pendingTime, using fingerprints short enough to save
+ * memory but long enough that at most options.falsePositiveRate of the new
+ * documents are mistaken for replays.  Documents are only forgotten, to make
+ * room for new ones, once the set is nearly full
+ */
+function createSeenSet(options = {}) {
+  let {capacity = 1000000, falsePositiveRate = 1e-6} = options;
+  return new SeenSet(addon.createSeenSet(capacity, falsePositiveRate));
+}
+
+/**
+ * Return the native handle of a Policy, or undefined when there is none
+ */
+function policyHandle(policy) {
+  if (typeof policy === 'undefined') {
+    return undefined;
+  }
+  if (!(policy instanceof Policy)) {
+    throw new Error('policy must be a Policy from compilePolicy');
+  }
+  return policy._handle;
+}
+
+/**
+ * Check and convert the arguments to verify() and verifyAsync() into the
+ * Buffers which are passed to the native code.  The PKCS#7 signature is
+ * passed through as is, since the native code accepts it with or without the
+ * PEM headers, or DER encoded
+ */
+function prepare(pubkey, document, pkcs7) {
   if (typeof pubkey === 'undefined') {
     throw new Error('pubkey must be provided');
   }
@@ -27,7 +130,9 @@ module.exports = function verify(pubkey, document, pkcs7) {
     throw new Error('pkcs7 signature must be provided');
   }
 
-  if (!Buffer.isBuffer(pubkey)) {
+  if (pubkey instanceof Key || pubkey instanceof Registry) {
+    pubkey = pubkey._handle;
+  } else if (!Buffer.isBuffer(pubkey)) {
     pubkey = Buffer.from(pubkey, 'utf-8');
   }
 
@@ -39,34 +144,406 @@ module.exports = function verify(pubkey, document, pkcs7) {
     pkcs7 = Buffer.from(pkcs7, 'utf-8');
   }
 
-  let hasHeader = false;
-  if (pkcs7.length > pkcs7_header.length - 1) {
-    if (Buffer.compare(pkcs7_header, pkcs7.slice(0, pkcs7_header.length)) === 0) {
-      hasHeader = true;
+  return [pubkey, document, pkcs7];
+}
+
+/**
+ * Verify a document given a public key, document and a PKCS#7 encoded
+ * signature.  All parameters should either be strings, Buffers or something
+ * which can be converted into a Buffer safely with a call to Buffer.from(),
+ * with an encoding parameter of 'utf-8'.
+ *
+ * For more detailed explanation of this functions return values and error
+ * handling, please refer to README.md in the Api and Errors sections
+ */
+function verify(pubkey, document, pkcs7) {
+  let outcome = addon.verify(...prepare(pubkey, document, pkcs7));
+  return outcome;
+}
+
+/**
+ * The claims returned by verifyAndExtract() when none are given
+ */
+const defaultClaims = ['instanceId', 'region', 'accountId', 'imageId', 'pendingTime'];
+
+/**
+ * Verify a document like verify(), but instead of true, return an object
+ * with only the named claims from the document, which are found by a single
+ * pass over the document in the native code without parsing the rest of it.
+ * Claims which are not in the document are left out of the object.  Returns
+ * false when the document is not valid
+ */
+function verifyAndExtract(pubkey, document, pkcs7, claims = defaultClaims) {
+  if (!Array.isArray(claims)) {
+    throw new Error('claims must be an array');
+  }
+  return addon.verifyAndExtract(...prepare(pubkey, document, pkcs7), claims);
+}
+
+/**
+ * Load a Registry of public keys from source, which is either
+ * {bundle}, a string or Buffer holding PEM encoded certificates, or
+ * {directory}, the path of a directory of .pem files.  See README.md for how
+ * certificates are labelled with their region and endpoint
+ */
+function loadRegistry(source) {
+  return new Registry(addon.loadRegistry(undefined, registrySource(source)));
+}
+
+/**
+ * Compile a policy from a spec of the form
+ * {allow: {claim: [values]}, regionMatchesKey, maxAge, firstUse}.  A document
+ * is only accepted when each claim in allow is one of its values, its region
+ * claim is the region of the Key it was verified with, if regionMatchesKey is
+ * set, its pendingTime is at most maxAge milliseconds old, if maxAge is set,
+ * and it is not already in the SeenSet firstUse, if that is set.  An
+ * accepted document is added to firstUse, so that verifying it again returns
+ * reasons.REPLAY
+ */
+function compilePolicy(spec = {}) {
+  let {allow = {}, regionMatchesKey = false, maxAge = 0, firstUse} = spec;
+  if (typeof firstUse !== 'undefined' && !(firstUse instanceof SeenSet)) {
+    throw new Error('firstUse must be a SeenSet from createSeenSet');
+  }
+  let claims = Object.keys(allow);
+  let values = claims.map(claim => {
+    if (!Array.isArray(allow[claim])) {
+      throw new Error('allowed values must be an array');
+    }
+    return allow[claim];
+  });
+  return new Policy(addon.compilePolicy(claims, values, !!regionMatchesKey, maxAge,
+                                        firstUse && firstUse._handle));
+}
+
+/**
+ * Verify a document like verify(), then check its claims against a Policy
+ * from compilePolicy().  Returns one of the numbers in reasons, which is
+ * reasons.ACCEPT only when the signature is valid and the policy accepts the
+ * document
+ */
+function verifyPolicy(pubkey, document, pkcs7, policy) {
+  if (typeof policy === 'undefined') {
+    throw new Error('policy must be provided');
+  }
+  return addon.verifyPolicy(...prepare(pubkey, document, pkcs7), policyHandle(policy));
+}
+
+/**
+ * Verify a document against the base64 encoded RSA signature returned by the
+ * metadata service's signature endpoint, instead of a PKCS#7 envelope.  The
+ * arguments are the same as for verify(), except that pubkey can not be a
+ * Registry.  Returns true or false, and throws the same errors as verify()
+ */
+function verifyRaw(pubkey, document, signature) {
+  if (pubkey instanceof Registry) {
+    throw new Error('pubkey must be a Key or a certificate, not a Registry');
+  }
+  return addon.verifyRaw(...prepare(pubkey, document, signature));
+}
+
+/**
+ * Identical to verify(), or to verifyPolicy() when a policy is given, but
+ * the signature verification is done on the libuv thread pool instead of the
+ * calling thread.  Returns a Promise which resolves to the same value and
+ * rejects with the same errors
+ */
+async function verifyAsync(pubkey, document, pkcs7, policy) {
+  return addon.verifyAsync(...prepare(pubkey, document, pkcs7), policyHandle(policy));
+}
+
+/**
+ * A queue of verifications from createScheduler(), which are run on the libuv
+ * thread pool no more than concurrency at a time.  Each verification waits in
+ * a priority lane, and lane 0 is always started first.  When the queue is
+ * full, a verification is shed instead of waiting, or evicts the newest one
+ * in a less urgent lane
+ */
+class Scheduler {
+  constructor(handle, lanes) {
+    this._handle = handle;
+    this._lanes = lanes;
+    this._next = 0;
+  }
+
+  /**
+   * Verify a document like verifyAsync(), once the verifications ahead of it
+   * have started.  options.priority is the lane to wait in, from 0, the most
+   * urgent, up to one less than the lanes of the scheduler.  When
+   * options.timeout milliseconds pass before it starts, it is dropped
+   * instead, unless the timeout is 0 or Infinity.  options.signal is an AbortSignal which cancels it, and
+   * options.policy is a Policy to check, like verifyAsync().  The Promise
+   * rejects with an Error whose shed property is 'full', 'expired' or
+   * 'cancelled' when it is not verified
+   */
+  async verify(pubkey, document, pkcs7, options = {}) {
+    let {priority = 0, timeout = 0, policy, signal} = options;
+    if (!Number.isInteger(priority) || priority < 0 || priority >= this._lanes) {
+      throw new Error('priority must be a lane of the scheduler');
+    }
+    let id = this._next++;
+    let outcome = addon.schedulerVerify(this._handle, ...prepare(pubkey, document, pkcs7),
+                                        policyHandle(policy), priority, timeout, id);
+    if (signal) {
+      let cancel = () => addon.schedulerCancel(this._handle, id);
+      if (signal.aborted) {
+        cancel();
+      } else {
+        signal.addEventListener('abort', cancel, {once: true});
+        let done = () => signal.removeEventListener('abort', cancel);
+        outcome.then(done, done);
+      }
     }
+    return outcome;
+  }
+
+  /**
+   * Cancel every verification which has not started yet
+   */
+  clear() {
+    addon.schedulerClear(this._handle);
+  }
+
+  /**
+   * Return the queue depth of every lane, the number of verifications running
+   * and the counters of those admitted, completed, shed, expired and
+   * cancelled, optionally setting the counters back to zero
+   */
+  stats(options = {}) {
+    return addon.schedulerStats(this._handle, !!options.reset);
+  }
+}
+
+/**
+ * Create a Scheduler which runs at most options.concurrency verifications at
+ * once, with room for options.capacity more waiting in options.lanes
+ * priority lanes
+ */
+function createScheduler(options = {}) {
+  let {concurrency = os.cpus().length, capacity = 1024, lanes = 2} = options;
+  return new Scheduler(addon.createScheduler(lanes, capacity, concurrency), lanes);
+}
+
+/**
+ * Parse a PEM encoded public key certificate once, so that it does not need
+ * to be parsed on every call to verify().  options.region names the region
+ * the key is for, which is checked by policies with regionMatchesKey.  Throws
+ * the same OpenSSL errors as verify() when the certificate is not valid
+ */
+function loadKey(pubkey, options = {}) {
+  if (typeof pubkey === 'undefined') {
+    throw new Error('pubkey must be provided');
+  }
+
+  if (!Buffer.isBuffer(pubkey)) {
+    pubkey = Buffer.from(pubkey, 'utf-8');
   }
 
-  // If the pkcs7 signature has a header, assume that it's totally valid and
-  // ready to pass into the verification routines, if not, trim any leading and
-  // trailing newlines so that the headers are valid
-  if (!hasHeader) {
-    let i;
-    for (i = 0; i < pkcs7.length && pkcs7[i] === nl[0]; i++) {;}
-    pkcs7 = pkcs7.slice(i);
+  return new Key(addon.loadKey(pubkey, options.region));
+}
 
-    for (i = pkcs7.length - 1; i >= 0 && pkcs7[i] === nl[0]; i--) {;}
-    pkcs7 = pkcs7.slice(0, i+1);
+/**
+ * A Writable stream which verifies the document written to it against a
+ * signature, hashing each chunk as it arrives instead of holding the whole
+ * document.  Once the stream is ended, valid is true or false and the
+ * 'verified' event is emitted with it before 'finish'.  An exception is
+ * emitted as an 'error' event instead
+ */
+class Verifier extends Writable {
+  constructor(pubkey, pkcs7, options = {}) {
+    super(options);
 
-    pkcs7 = Buffer.concat([
-      pkcs7_header,
-      nl,
-      pkcs7,
-      nl,
-      pkcs7_footer,
-      nl,
-    ]);
+    if (typeof pubkey === 'undefined') {
+      throw new Error('pubkey must be provided');
+    }
+    if (typeof pkcs7 === 'undefined') {
+      throw new Error('pkcs7 signature must be provided');
+    }
+    if (pubkey instanceof Registry) {
+      throw new Error('pubkey must be a Key or a certificate, not a Registry');
+    }
+
+    // The Key is kept here since the native stream uses it until the end
+    this._key = pubkey instanceof Key ? pubkey : loadKey(pubkey);
+    if (!Buffer.isBuffer(pkcs7)) {
+      pkcs7 = Buffer.from(pkcs7, 'utf-8');
+    }
+    this._handle = addon.streamBegin(this._key._handle, pkcs7);
+    this.valid = undefined;
   }
 
-  let outcome = addon.verify(pubkey, document, pkcs7);
-  return outcome;
-};
+  _write(chunk, encoding, callback) {
+    try {
+      addon.streamUpdate(this._handle, chunk);
+    } catch (err) {
+      return callback(err);
+    }
+    callback();
+  }
+
+  _final(callback) {
+    try {
+      this.valid = addon.streamFinal(this._handle);
+    } catch (err) {
+      return callback(err);
+    }
+    this.emit('verified', this.valid);
+    callback();
+  }
+}
+
+/**
+ * Return a Verifier for a document which is to be written to it in chunks,
+ * such as by piping an HTTP request into it.  pubkey and pkcs7 are the same
+ * as for verify(), except that pubkey can not be a Registry.  Throws the same
+ * errors as verify() when the key or signature can not be read
+ */
+function createVerifier(pubkey, pkcs7, options) {
+  return new Verifier(pubkey, pkcs7, options);
+}
+
+/**
+ * Verify a batch of {pubkey, document, pkcs7} items with a single call into
+ * the native code.  Returns an array with true, false or an Error for each
+ * item, in the same order as the items.  An invalid item does not cause the
+ * whole batch to throw.
+ *
+ * When options.parallel is set, the batch is split across the libuv thread
+ * pool and a Promise for the results array is returned instead.  It can be
+ * true, to use one chunk per cpu, or the number of chunks to use.  When
+ * options.policy is set, every item is checked against it and the result is
+ * its reason, like verifyPolicy(), instead of true or false
+ */
+function verifyMany(items, options = {}) {
+  if (!Array.isArray(items)) {
+    throw new Error('items must be an array');
+  }
+
+  let results = new Array(items.length);
+  let batch = [];
+  let indices = [];
+
+  items.forEach((item, i) => {
+    try {
+      item = item || {};
+      batch.push(prepare(item.pubkey, item.document, item.pkcs7));
+      indices.push(i);
+    } catch (err) {
+      results[i] = err;
+    }
+  });
+
+  let merge = outcomes => {
+    outcomes.forEach((outcome, i) => {
+      results[indices[i]] = outcome;
+    });
+    return results;
+  };
+
+  let policy = policyHandle(options.policy);
+
+  if (options.parallel) {
+    let concurrency = options.parallel === true ? os.cpus().length : options.parallel;
+    return addon.verifyManyAsync(batch, concurrency, policy).then(merge);
+  }
+
+  return merge(addon.verifyMany(batch, policy));
+}
+
+/**
+ * Enable, resize or disable the cache of verification outcomes.  Up to
+ * options.capacity outcomes are kept for options.ttl milliseconds each, or
+ * until evicted by more recently used outcomes.  A ttl of 0 keeps outcomes
+ * until they are evicted, and a capacity of 0 disables the cache.  Any stored
+ * outcomes are dropped.  There is one cache for every thread in the process,
+ * so configuring it in one worker_thread configures it for all of them
+ */
+function configureCache(options = {}) {
+  let {capacity = 0, ttl = 0} = options;
+  addon.configureCache(capacity, ttl);
+}
+
+/**
+ * Change the limits which every input is checked against before it is
+ * parsed, and return the limits now in effect.  Options which are not given
+ * keep their current values.  documentLength, signatureLength and
+ * pubkeyLength are the longest inputs accepted, in bytes, with 0 for no
+ * limit; documentLength applies to the whole of a streamed document.  With
+ * structure set, an envelope must also have the framing and outer shape of a
+ * PKCS#7 signedData envelope.  Rejected inputs throw an Error with a code of
+ * codes.MALFORMED without being given to OpenSSL.  The limits are shared by
+ * every thread in the process
+ */
+function configureLimits(options = {}) {
+  let current = addon.limits();
+  let {
+    documentLength = current.documentLength,
+    signatureLength = current.signatureLength,
+    pubkeyLength = current.pubkeyLength,
+    structure = current.structure,
+  } = options;
+  addon.configureLimits(documentLength, signatureLength, pubkeyLength, !!structure);
+  return addon.limits();
+}
+
+/**
+ * Return the counters of the outcome cache, optionally setting the hit,
+ * miss, insertion, eviction and expiration counters back to zero
+ */
+function cacheStats(options = {}) {
+  return addon.cacheStats(!!options.reset);
+}
+
+/**
+ * Return the number of keys loaded with loadKey() which are still in use, and
+ * the number of Keys referring to them.  Keys are shared by every thread in
+ * the process, so loading the same certificate with the same region in
+ * several worker_threads, or several times, only parses it once
+ */
+function keyStoreStats() {
+  return addon.keyStoreStats();
+}
+
+/**
+ * Return the counters of every verification made in this process: outcomes,
+ * exceptions by code and by OpenSSL library, and latency percentiles in
+ * microseconds.  Cache hits are not verifications and are not counted
+ */
+function stats(options = {}) {
+  return addon.stats(!!options.reset);
+}
+
+/**
+ * Return the verification counters in the Prometheus text exposition format
+ */
+function prometheus() {
+  return addon.prometheus();
+}
+
+module.exports = verify;
+module.exports.verify = verify;
+module.exports.verifyAsync = verifyAsync;
+module.exports.verifyAndExtract = verifyAndExtract;
+module.exports.verifyPolicy = verifyPolicy;
+module.exports.verifyRaw = verifyRaw;
+module.exports.verifyMany = verifyMany;
+module.exports.loadKey = loadKey;
+module.exports.createVerifier = createVerifier;
+module.exports.loadRegistry = loadRegistry;
+module.exports.compilePolicy = compilePolicy;
+module.exports.createSeenSet = createSeenSet;
+module.exports.createScheduler = createScheduler;
+module.exports.configureCache = configureCache;
+module.exports.configureLimits = configureLimits;
+module.exports.cacheStats = cacheStats;
+module.exports.keyStoreStats = keyStoreStats;
+module.exports.stats = stats;
+module.exports.prometheus = prometheus;
+module.exports.codes = addon.codes;
+module.exports.reasons = addon.reasons;
+module.exports.Key = Key;
+module.exports.Policy = Policy;
+module.exports.Registry = Registry;
+module.exports.Scheduler = Scheduler;
+module.exports.SeenSet = SeenSet;
+module.exports.Verifier = Verifier;
@@ -0,0 +1,220 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "./audit.h"
+#include "./verify.h"
+
+// iid-audit re-verifies an archive of documents and signatures against the
+// keys of a registry, and reports which records are no longer valid.  It can
+// also append records to an archive, so that one can be built from the files
+// that the metadata service returned.  See audit.h for the file formats
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s -b bundle | -D directory -i archive [-o results]\n"
+          "          [-t threads]\n"
+          "       %s -a archive -d document -p pkcs7\n",
+          name, name);
+  exit(2);
+}
+
+static VF_return_t read_file(const char *name, uint8_t **buf, size_t *len) {
+  FILE *fd = fopen(name, "rb");
+  VF_return_t rv = VF_SUCCESS;
+  long size;
+
+  *buf = NULL;
+  if (fd == NULL) {
+    return VF_EXCEPTION;
+  }
+  if (0 != fseek(fd, 0, SEEK_END) || (size = ftell(fd)) < 0 ||
+      0 != fseek(fd, 0, SEEK_SET)) {
+    rv = VF_EXCEPTION;
+    goto end;
+  }
+  *buf = malloc(size > 0 ? size : 1);
+  if (*buf == NULL || fread(*buf, 1, size, fd) != (size_t)size) {
+    free(*buf);
+    *buf = NULL;
+    rv = VF_EXCEPTION;
+    goto end;
+  }
+  *len = size;
+
+end:
+  fclose(fd);
+  return rv;
+}
+
+static void print_errbuf(const struct VF_errbuf *errbuf) {
+  char line[512];
+  uint32_t i;
+
+  for (i = 0; i < errbuf->count; i++) {
+    VF_errbuf_fmt(errbuf, i, line, sizeof(line));
+    printf("  %s\n", line);
+  }
+  if (errbuf->dropped > 0) {
+    printf("  ... %u more\n", errbuf->dropped);
+  }
+}
+
+// Print errors formatted by VF_audit, which are one per line
+static void print_errors(const char *errors) {
+  const char *end;
+
+  for (; *errors != '\0'; errors = end + 1) {
+    end = strchr(errors, '\n');
+    printf("  %.*s\n", (int)(end - errors), errors);
+  }
+}
+
+static int append(const char *archive, const char *document,
+                  const char *pkcs7) {
+  uint8_t *document_b = NULL, *pkcs7_b = NULL;
+  size_t document_l, pkcs7_l;
+  int status = 0;
+
+  if (VF_SUCCESS != read_file(document, &document_b, &document_l) ||
+      VF_SUCCESS != read_file(pkcs7, &pkcs7_b, &pkcs7_l)) {
+    fprintf(stderr, "could not read %s or %s\n", document, pkcs7);
+    status = 2;
+  } else if (document_l > UINT32_MAX || pkcs7_l > UINT32_MAX ||
+             VF_SUCCESS != VF_audit_append(archive, document_b, document_l,
+                                           pkcs7_b, pkcs7_l)) {
+    perror(archive);
+    status = 2;
+  }
+
+  free(document_b);
+  free(pkcs7_b);
+  return status;
+}
+
+int main(int argc, char **argv) {
+  const char *bundle = NULL, *directory = NULL, *archive = NULL;
+  const char *results = NULL, *appending = NULL;
+  const char *document = NULL, *pkcs7 = NULL;
+  struct VF_registry *registry = NULL;
+  struct VF_audit_result result;
+  struct VF_errbuf errbuf;
+  uint8_t *bundle_b;
+  size_t bundle_l;
+  long threads = 0;
+  uint64_t i, j;
+  VF_return_t rv;
+  int opt;
+
+  if (VF_SUCCESS != VF_init()) {
+    fprintf(stderr, "could not initialize OpenSSL\n");
+    return 2;
+  }
+
+  while (-1 != (opt = getopt(argc, argv, "b:D:i:o:t:a:d:p:"))) {
+    switch (opt) {
+    case 'b':
+      bundle = optarg;
+      break;
+    case 'D':
+      directory = optarg;
+      break;
+    case 'i':
+      archive = optarg;
+      break;
+    case 'o':
+      results = optarg;
+      break;
+    case 't':
+      threads = strtol(optarg, NULL, 10);
+      break;
+    case 'a':
+      appending = optarg;
+      break;
+    case 'd':
+      document = optarg;
+      break;
+    case 'p':
+      pkcs7 = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (optind != argc || threads < 0) {
+    usage(argv[0]);
+  }
+
+  if (appending != NULL) {
+    if (document == NULL || pkcs7 == NULL || archive != NULL) {
+      usage(argv[0]);
+    }
+    return append(appending, document, pkcs7);
+  }
+
+  if (archive == NULL || (bundle == NULL) == (directory == NULL)) {
+    usage(argv[0]);
+  }
+
+  if (VF_SUCCESS != VF_registry_new(&registry)) {
+    fprintf(stderr, "could not create registry\n");
+    return 2;
+  }
+  if (bundle != NULL) {
+    if (VF_SUCCESS != read_file(bundle, &bundle_b, &bundle_l)) {
+      fprintf(stderr, "could not read key bundle %s\n", bundle);
+      return 2;
+    }
+    rv = VF_registry_load_bundle(registry, bundle_b, bundle_l, &errbuf);
+    free(bundle_b);
+  } else {
+    rv = VF_registry_load_dir(registry, directory, &errbuf);
+  }
+  if (rv != VF_SUCCESS) {
+    fprintf(stderr, "could not load keys from %s\n",
+            bundle != NULL ? bundle : directory);
+    print_errbuf(&errbuf);
+    return 2;
+  }
+
+  if (VF_SUCCESS != VF_audit(archive, registry, threads, &result)) {
+    fprintf(stderr, "could not audit %s: %s\n", archive,
+            errno == EINVAL ? "not an archive" : strerror(errno));
+    return 2;
+  }
+
+  if (results != NULL && VF_SUCCESS != VF_audit_write_results(results,
+                                                              &result)) {
+    perror(results);
+    return 2;
+  }
+
+  // The failures come first so that the counts end the output, where they
+  // are easy to find after a long list.  The errors of the exceptions are in
+  // the same order as the failures
+  for (i = 0, j = 0; i < result.nfailures; i++) {
+    printf("%s %llu at %llu\n",
+           result.failures[i].result == VF_FAIL ? "invalid" : "exception",
+           (unsigned long long)result.failures[i].index,
+           (unsigned long long)result.failures[i].offset);
+    if (j < result.nerrors &&
+        result.errors[j].index == result.failures[i].index) {
+      print_errors(result.errors[j++].errors);
+    }
+  }
+  printf("records %llu valid %llu invalid %llu exceptions %llu%s\n",
+         (unsigned long long)result.count, (unsigned long long)result.valid,
+         (unsigned long long)result.invalid,
+         (unsigned long long)result.exceptions,
+         result.truncated ? " truncated" : "");
+
+  rv = result.valid == result.count && !result.truncated ? 0 : 1;
+  VF_audit_result_free(&result);
+  VF_registry_free(registry);
+  return rv;
+}
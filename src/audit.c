@@ -0,0 +1,506 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "./audit.h"
+#include "./verify.h"
+
+// Records are handed to the threads in chunks of this many.  It is a multiple
+// of 8 so that each byte of the bitmap is only ever written by one thread, and
+// large enough that taking a chunk is rare next to verifying its records
+#define VF_AUDIT_CHUNK 1024
+
+struct VF_audit_ctx {
+  const uint8_t *base;
+  size_t size;
+  struct VF_registry *registry;
+  uint8_t *bitmap;
+  uint64_t count;
+
+  // The offset of the first record of each chunk, found by a scan of the
+  // record headers before any verification starts
+  uint64_t *chunks;
+  uint64_t nchunks;
+
+  pthread_mutex_t lock;
+  uint64_t next;
+};
+
+// A growable array of failures or exceptions, both of which start with their
+// index so that they can be sorted by it
+struct VF_audit_list {
+  void *items;
+  uint64_t n;
+  uint64_t capacity;
+};
+
+// The outcomes of one thread, which are moved into the VF_audit_result once
+// every thread has finished
+struct VF_audit_worker {
+  pthread_t thread;
+  struct VF_audit_ctx *ctx;
+  uint64_t valid;
+  uint64_t invalid;
+  uint64_t exceptions;
+  struct VF_audit_list failures;
+  struct VF_audit_list errors;
+  int oom;
+};
+
+static uint32_t VF_audit_get_u32(const uint8_t *buf) {
+  return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+         (uint32_t)buf[2] << 8 | (uint32_t)buf[3];
+}
+
+static void VF_audit_put_u32(uint8_t *buf, uint32_t value) {
+  buf[0] = value >> 24;
+  buf[1] = value >> 16;
+  buf[2] = value >> 8;
+  buf[3] = value;
+}
+
+// Count the whole records of the archive and find the offset of each chunk
+static VF_return_t VF_audit_index(struct VF_audit_ctx *ctx, int *truncated) {
+  uint64_t offset = VF_AUDIT_MAGIC_SIZE, capacity = 0, *grown;
+  uint64_t length;
+
+  *truncated = 0;
+  while (offset < ctx->size) {
+    if (ctx->size - offset < VF_AUDIT_RECORD_HEADER_SIZE) {
+      *truncated = 1;
+      break;
+    }
+    length = (uint64_t)VF_audit_get_u32(ctx->base + offset) +
+             VF_audit_get_u32(ctx->base + offset + 4);
+    if (ctx->size - offset - VF_AUDIT_RECORD_HEADER_SIZE < length) {
+      *truncated = 1;
+      break;
+    }
+
+    if (ctx->count % VF_AUDIT_CHUNK == 0) {
+      if (ctx->nchunks == capacity) {
+        capacity = capacity == 0 ? 64 : capacity * 2;
+        grown = realloc(ctx->chunks, capacity * sizeof(uint64_t));
+        if (grown == NULL) {
+          return VF_EXCEPTION;
+        }
+        ctx->chunks = grown;
+      }
+      ctx->chunks[ctx->nchunks++] = offset;
+    }
+
+    ctx->count++;
+    offset += VF_AUDIT_RECORD_HEADER_SIZE + length;
+  }
+
+  return VF_SUCCESS;
+}
+
+// Return the next item of list, which has items of size bytes, or NULL when
+// there is no memory for it
+static void *VF_audit_push(struct VF_audit_list *list, size_t size) {
+  uint64_t capacity;
+  void *grown;
+
+  if (list->n == list->capacity) {
+    capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+    grown = realloc(list->items, capacity * size);
+    if (grown == NULL) {
+      return NULL;
+    }
+    list->items = grown;
+    list->capacity = capacity;
+  }
+
+  return (uint8_t *)list->items + list->n++ * size;
+}
+
+// Format the errors of errbuf, one per line
+static char *VF_audit_fmt(const struct VF_errbuf *errbuf) {
+  char line[512], *errors = NULL;
+  size_t errors_l;
+  uint32_t i;
+  FILE *fd = open_memstream(&errors, &errors_l);
+
+  if (fd == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < errbuf->count; i++) {
+    VF_errbuf_fmt(errbuf, i, line, sizeof(line));
+    fprintf(fd, "%s\n", line);
+  }
+  if (errbuf->dropped > 0) {
+    fprintf(fd, "... %u more\n", errbuf->dropped);
+  }
+  if (0 != fclose(fd)) {
+    free(errors);
+    return NULL;
+  }
+  return errors;
+}
+
+static void VF_audit_fail(struct VF_audit_worker *worker, uint64_t index,
+                          uint64_t offset, VF_return_t result,
+                          const struct VF_errbuf *errbuf) {
+  struct VF_audit_failure *failure;
+  struct VF_audit_exception *exception;
+
+  failure = VF_audit_push(&worker->failures, sizeof(*failure));
+  if (failure == NULL) {
+    worker->oom = 1;
+    return;
+  }
+  failure->index = index;
+  failure->offset = offset;
+  failure->result = result;
+  failure->code = errbuf->code;
+
+  // The errors of an invalid record only say that the signature does not
+  // match, so they are only kept for exceptions
+  if (result != VF_EXCEPTION) {
+    return;
+  }
+  exception = VF_audit_push(&worker->errors, sizeof(*exception));
+  if (exception == NULL) {
+    worker->oom = 1;
+    return;
+  }
+  exception->index = index;
+  exception->errors = VF_audit_fmt(errbuf);
+  if (exception->errors == NULL) {
+    worker->errors.n--;
+    worker->oom = 1;
+  }
+}
+
+static void VF_audit_errors_free(struct VF_audit_exception *errors,
+                                 uint64_t nerrors) {
+  for (uint64_t i = 0; i < nerrors; i++) {
+    free(errors[i].errors);
+  }
+  free(errors);
+}
+
+static void *VF_audit_run(void *arg) {
+  struct VF_audit_worker *worker = arg;
+  struct VF_audit_ctx *ctx = worker->ctx;
+  struct VF_errbuf errbuf;
+  uint64_t chunk, index, end, offset;
+  uint32_t document_l, pkcs7_l;
+  uint8_t *record;
+  VF_return_t rv;
+
+  for (;;) {
+    pthread_mutex_lock(&ctx->lock);
+    chunk = ctx->next++;
+    pthread_mutex_unlock(&ctx->lock);
+    if (chunk >= ctx->nchunks) {
+      break;
+    }
+
+    index = chunk * VF_AUDIT_CHUNK;
+    end = index + VF_AUDIT_CHUNK < ctx->count ? index + VF_AUDIT_CHUNK
+                                              : ctx->count;
+    offset = ctx->chunks[chunk];
+    for (; index < end; index++) {
+      // The verify functions do not write to their inputs, so the read only
+      // mapping can be passed to them directly
+      record = (uint8_t *)ctx->base + offset;
+      document_l = VF_audit_get_u32(record);
+      pkcs7_l = VF_audit_get_u32(record + 4);
+
+      rv = VF_registry_verify(ctx->registry, NULL,
+                              record + VF_AUDIT_RECORD_HEADER_SIZE,
+                              document_l,
+                              record + VF_AUDIT_RECORD_HEADER_SIZE +
+                                  document_l,
+                              pkcs7_l, &errbuf, NULL);
+      if (rv == VF_SUCCESS) {
+        ctx->bitmap[index / 8] |= 1 << (index % 8);
+        worker->valid++;
+      } else {
+        if (rv == VF_FAIL) {
+          worker->invalid++;
+        } else {
+          worker->exceptions++;
+        }
+        VF_audit_fail(worker, index, offset, rv, &errbuf);
+      }
+
+      offset += VF_AUDIT_RECORD_HEADER_SIZE + (uint64_t)document_l + pkcs7_l;
+    }
+  }
+
+  return NULL;
+}
+
+// Compare the indexes which begin a failure or an exception
+static int VF_audit_index_cmp(const void *a, const void *b) {
+  const uint64_t *x = a, *y = b;
+  return *x < *y ? -1 : *x > *y;
+}
+
+// Move the list at member of every worker, which has items of size bytes,
+// into one list sorted by index.  The largest list is grown to hold every
+// item, and each of the others is freed as soon as it has been copied in,
+// instead of copying every list into a new one
+static VF_return_t VF_audit_concat(struct VF_audit_worker *workers,
+                                   long threads, size_t member, size_t size,
+                                   void **items, uint64_t *n) {
+  struct VF_audit_list *list, *largest = NULL;
+  uint64_t total = 0;
+  uint8_t *moved;
+  long i;
+
+  for (i = 0; i < threads; i++) {
+    list = (struct VF_audit_list *)((uint8_t *)&workers[i] + member);
+    total += list->n;
+    if (largest == NULL || list->capacity > largest->capacity) {
+      largest = list;
+    }
+  }
+  if (total == 0) {
+    return VF_SUCCESS;
+  }
+
+  moved = realloc(largest->items, total * size);
+  if (moved == NULL) {
+    errno = ENOMEM;
+    return VF_EXCEPTION;
+  }
+  *n = largest->n;
+  largest->items = NULL;
+  largest->n = 0;
+
+  for (i = 0; i < threads; i++) {
+    list = (struct VF_audit_list *)((uint8_t *)&workers[i] + member);
+    if (list->n > 0) {
+      memcpy(moved + *n * size, list->items, list->n * size);
+      *n += list->n;
+      list->n = 0;
+    }
+    free(list->items);
+    list->items = NULL;
+  }
+
+  *items = moved;
+  qsort(*items, *n, size, VF_audit_index_cmp);
+  return VF_SUCCESS;
+}
+
+// Gather the outcomes of the threads into result
+static VF_return_t VF_audit_merge(struct VF_audit_worker *workers,
+                                  long threads,
+                                  struct VF_audit_result *result) {
+  long i;
+
+  for (i = 0; i < threads; i++) {
+    if (workers[i].oom) {
+      errno = ENOMEM;
+      return VF_EXCEPTION;
+    }
+    result->valid += workers[i].valid;
+    result->invalid += workers[i].invalid;
+    result->exceptions += workers[i].exceptions;
+  }
+
+  if (VF_SUCCESS != VF_audit_concat(workers, threads,
+                                    offsetof(struct VF_audit_worker, failures),
+                                    sizeof(struct VF_audit_failure),
+                                    (void **)&result->failures,
+                                    &result->nfailures) ||
+      VF_SUCCESS != VF_audit_concat(workers, threads,
+                                    offsetof(struct VF_audit_worker, errors),
+                                    sizeof(struct VF_audit_exception),
+                                    (void **)&result->errors,
+                                    &result->nerrors)) {
+    return VF_EXCEPTION;
+  }
+
+  return VF_SUCCESS;
+}
+
+VF_return_t VF_audit(const char *path, struct VF_registry *registry,
+                     long threads, struct VF_audit_result *result) {
+  struct VF_audit_ctx ctx;
+  struct VF_audit_worker *workers = NULL;
+  struct stat st;
+  void *base = MAP_FAILED;
+  VF_return_t rv = VF_SUCCESS;
+  long i, started = 0;
+  int fd, err = 0;
+
+  memset(result, 0, sizeof(*result));
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.registry = registry;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return VF_EXCEPTION;
+  }
+  if (0 != fstat(fd, &st)) {
+    close(fd);
+    return VF_EXCEPTION;
+  }
+  if ((uint64_t)st.st_size < VF_AUDIT_MAGIC_SIZE) {
+    close(fd);
+    errno = EINVAL;
+    return VF_EXCEPTION;
+  }
+
+  // The mapping stays valid once the file is closed, and records appended to
+  // the archive while it is being audited are simply not seen
+  ctx.size = st.st_size;
+  base = mmap(NULL, ctx.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return VF_EXCEPTION;
+  }
+  ctx.base = base;
+  posix_madvise(base, ctx.size, POSIX_MADV_SEQUENTIAL);
+
+  if (0 != memcmp(ctx.base, VF_AUDIT_MAGIC, VF_AUDIT_MAGIC_SIZE)) {
+    errno = EINVAL;
+    rv = VF_EXCEPTION;
+    goto end;
+  }
+
+  if (VF_SUCCESS != VF_audit_index(&ctx, &result->truncated)) {
+    rv = VF_EXCEPTION;
+    goto end;
+  }
+  result->count = ctx.count;
+
+  result->bitmap = calloc(ctx.count / 8 + 1, 1);
+  if (result->bitmap == NULL) {
+    rv = VF_EXCEPTION;
+    goto end;
+  }
+  ctx.bitmap = result->bitmap;
+
+  if (threads < 1) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if ((uint64_t)threads > ctx.nchunks) {
+    threads = ctx.nchunks > 0 ? ctx.nchunks : 1;
+  }
+
+  workers = calloc(threads, sizeof(struct VF_audit_worker));
+  if (workers == NULL) {
+    rv = VF_EXCEPTION;
+    goto end;
+  }
+
+  pthread_mutex_init(&ctx.lock, NULL);
+  for (started = 0; started < threads; started++) {
+    workers[started].ctx = &ctx;
+    err = pthread_create(&workers[started].thread, NULL, VF_audit_run,
+                         &workers[started]);
+    if (err != 0) {
+      break;
+    }
+  }
+  // The threads which did start share out every chunk between them, so the
+  // audit only fails when none could be started
+  for (i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  pthread_mutex_destroy(&ctx.lock);
+
+  if (started == 0) {
+    errno = err;
+    rv = VF_EXCEPTION;
+  } else if (VF_SUCCESS != VF_audit_merge(workers, started, result)) {
+    rv = VF_EXCEPTION;
+  }
+
+end:
+  if (workers != NULL) {
+    for (i = 0; i < threads; i++) {
+      free(workers[i].failures.items);
+      VF_audit_errors_free(workers[i].errors.items, workers[i].errors.n);
+    }
+    free(workers);
+  }
+  free(ctx.chunks);
+  munmap(base, ctx.size);
+  if (rv != VF_SUCCESS) {
+    // Freeing the result must not lose the errno of the exception
+    err = errno;
+    VF_audit_result_free(result);
+    errno = err;
+  }
+  return rv;
+}
+
+void VF_audit_result_free(struct VF_audit_result *result) {
+  free(result->bitmap);
+  free(result->failures);
+  VF_audit_errors_free(result->errors, result->nerrors);
+  memset(result, 0, sizeof(*result));
+}
+
+VF_return_t VF_audit_write_results(const char *path,
+                                   const struct VF_audit_result *result) {
+  FILE *fd = fopen(path, "wb");
+  uint8_t count[8];
+  size_t bitmap_l = (result->count + 7) / 8;
+  VF_return_t rv = VF_SUCCESS;
+
+  if (fd == NULL) {
+    return VF_EXCEPTION;
+  }
+
+  VF_audit_put_u32(count, result->count >> 32);
+  VF_audit_put_u32(count + 4, result->count);
+  if (1 != fwrite(VF_AUDIT_RESULTS_MAGIC, VF_AUDIT_MAGIC_SIZE, 1, fd) ||
+      1 != fwrite(count, sizeof(count), 1, fd) ||
+      bitmap_l != fwrite(result->bitmap, 1, bitmap_l, fd)) {
+    rv = VF_EXCEPTION;
+  }
+  if (0 != fclose(fd)) {
+    rv = VF_EXCEPTION;
+  }
+  return rv;
+}
+
+VF_return_t VF_audit_append(const char *path, const uint8_t *document,
+                            uint32_t document_l, const uint8_t *pkcs7,
+                            uint32_t pkcs7_l) {
+  FILE *fd = fopen(path, "ab");
+  uint8_t header[VF_AUDIT_RECORD_HEADER_SIZE];
+  VF_return_t rv = VF_SUCCESS;
+  long size;
+
+  if (fd == NULL) {
+    return VF_EXCEPTION;
+  }
+
+  if (0 != fseek(fd, 0, SEEK_END) || (size = ftell(fd)) < 0) {
+    fclose(fd);
+    return VF_EXCEPTION;
+  }
+
+  VF_audit_put_u32(header, document_l);
+  VF_audit_put_u32(header + 4, pkcs7_l);
+  if ((size == 0 &&
+       1 != fwrite(VF_AUDIT_MAGIC, VF_AUDIT_MAGIC_SIZE, 1, fd)) ||
+      1 != fwrite(header, sizeof(header), 1, fd) ||
+      document_l != fwrite(document, 1, document_l, fd) ||
+      pkcs7_l != fwrite(pkcs7, 1, pkcs7_l, fd)) {
+    rv = VF_EXCEPTION;
+  }
+  if (0 != fclose(fd)) {
+    rv = VF_EXCEPTION;
+  }
+  return rv;
+}
@@ -0,0 +1,82 @@
+#ifndef AUDIT_H
+#define AUDIT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "./verify.h"
+
+// Bulk re-verification of archived documents.  An archive is an append-only
+// file of records, each holding a document and its signature, which is
+// mapped into memory and verified by a pool of threads with the keys of a
+// registry.  Every integer is unsigned and big endian.  The archive starts
+// with the 8 byte VF_AUDIT_MAGIC, followed by any number of records:
+//
+//   document_l (4) | pkcs7_l (4) | document | pkcs7
+//
+// A record which runs past the end of the file, such as one which was being
+// appended when the file was copied, ends the archive and is reported as
+// truncated rather than verified.
+//
+// The results file written by VF_audit_write_results is the 8 byte
+// VF_AUDIT_RESULTS_MAGIC, the record count (8) and a bitmap with one bit per
+// record, least significant bit first, which is set when the record is valid
+#define VF_AUDIT_MAGIC "IIDAUD01"
+#define VF_AUDIT_RESULTS_MAGIC "IIDRES01"
+#define VF_AUDIT_MAGIC_SIZE 8
+#define VF_AUDIT_RECORD_HEADER_SIZE 8
+
+// A record which was not valid.  code is the VF_E_ class from its errbuf.
+// Only the outcome is kept, so that an audit of an archive with millions of
+// invalid records, such as one after a key rotation, fits in memory
+struct VF_audit_failure {
+  uint64_t index;
+  uint64_t offset;
+  VF_return_t result;
+  int code;
+};
+
+// The errors of a record which was an exception, formatted one per line,
+// highest level first, as VF_errbuf_fmt does
+struct VF_audit_exception {
+  uint64_t index;
+  char *errors;
+};
+
+struct VF_audit_result {
+  uint64_t count;
+  uint64_t valid;
+  uint64_t invalid;
+  uint64_t exceptions;
+  int truncated;
+  uint8_t *bitmap;
+
+  // The invalid records and exceptions in the order of the archive, and the
+  // errors of just the exceptions, in the same order
+  struct VF_audit_failure *failures;
+  uint64_t nfailures;
+  struct VF_audit_exception *errors;
+  uint64_t nerrors;
+};
+
+// Verify every record of the archive at path with threads threads, or one
+// per online cpu when threads is zero.  On VF_SUCCESS, *result holds the
+// outcomes and must be freed with VF_audit_result_free.  VF_EXCEPTION is only
+// returned when the archive itself can not be read, or memory runs out, not
+// for records which are invalid, and errno is then set to the cause
+VF_return_t VF_audit(const char *path, struct VF_registry *registry,
+                     long threads, struct VF_audit_result *result);
+
+void VF_audit_result_free(struct VF_audit_result *result);
+
+// Write the results file for result
+VF_return_t VF_audit_write_results(const char *path,
+                                   const struct VF_audit_result *result);
+
+// Append a record to an archive, which is created with its magic if it does
+// not exist yet
+VF_return_t VF_audit_append(const char *path, const uint8_t *document,
+                            uint32_t document_l, const uint8_t *pkcs7,
+                            uint32_t pkcs7_l);
+
+#endif
@@ -0,0 +1,554 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/pkcs7.h>
+#include <openssl/x509.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./verify.h"
+
+// Benchmarks for the verification paths.  Every operation is timed on its own
+// with CLOCK_MONOTONIC so that percentiles can be reported along with the
+// throughput.  The stages of a verification are timed separately by doing the
+// same OpenSSL work that VF_verify does, one step at a time, and the warm key
+// path is run from increasing numbers of threads to show how it scales.  The
+// digest stage is also run with the digest fetched by VF_init, to show what
+// OpenSSL 3 costs when it looks a digest up on every call.  The warm key path
+// is also run with VF_KEY_GENERIC, to compare the direct verification with
+// PKCS7_verify, and alternating between two keys loaded from the same
+// certificate, so that the public key context kept by the thread is never the
+// one for the key and has to be replaced on every call.  The raw signature of
+// the signature endpoint is timed with the same document, to compare with the
+// rsa2048 envelope, which also has to be parsed and whose signed attributes are
+// digested as well as the document.  Its key is 1024 bits, like the endpoint's,
+// so part of the difference is the smaller key, which the rsa2048 stage
+// signature shows the cost of.  With -a, every allocation made through OpenSSL
+// is counted and the average per operation is reported, which slows down every
+// benchmark a little.  This must be run from the root of the repository so that
+// test-files is found
+
+struct bench_input {
+  const char *name;
+  uint8_t *pubkey;
+  size_t pubkey_l;
+  uint8_t *document;
+  size_t document_l;
+  uint8_t *pkcs7;
+  size_t pkcs7_l;
+  VF_return_t expected;
+  struct VF_key *key;
+  struct VF_key *generic;
+  struct VF_key *other;
+  int turn;
+  struct VF_ctx *ctx;
+
+  // Used for timing the stages.  The der buffer is large enough to hold the
+  // decoded pkcs7, and the rest are taken from its only signer
+  uint8_t *der;
+  const EVP_MD *md;
+  const EVP_MD *fetched;
+  EVP_PKEY *pkey;
+  uint8_t *attrs;
+  int attrs_l;
+  uint8_t *signature;
+  int signature_l;
+  EVP_PKEY_CTX *template;
+};
+
+typedef VF_return_t (*bench_fn)(struct bench_input *input);
+
+struct bench_thread {
+  pthread_t thread;
+  bench_fn fn;
+  struct bench_input *input;
+  uint64_t *latencies;
+  int iter;
+  int unexpected;
+};
+
+static int iterations = 1000;
+
+// Allocations are counted with a relaxed atomic so that counting from many
+// threads at once doesn't lose any
+static int count_allocations = 0;
+static uint64_t allocations = 0;
+
+static void *bench_malloc(size_t size, const char *file, int line) {
+  (void)file;
+  (void)line;
+  __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+  return malloc(size);
+}
+
+static void *bench_realloc(void *ptr, size_t size, const char *file,
+                           int line) {
+  (void)file;
+  (void)line;
+  __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+  return realloc(ptr, size);
+}
+
+static void bench_free(void *ptr, const char *file, int line) {
+  (void)file;
+  (void)line;
+  free(ptr);
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint8_t *read_file(const char *name, size_t *len) {
+  FILE *fd = fopen(name, "rb");
+  uint8_t *buf = NULL;
+  long size;
+
+  if (fd == NULL) {
+    fprintf(stderr, "could not open %s\n", name);
+    exit(1);
+  }
+  if (0 != fseek(fd, 0, SEEK_END) || (size = ftell(fd)) < 0 ||
+      0 != fseek(fd, 0, SEEK_SET) ||
+      NULL == (buf = malloc(size > 0 ? size : 1)) ||
+      fread(buf, 1, size, fd) != (size_t)size) {
+    fprintf(stderr, "could not read %s\n", name);
+    exit(1);
+  }
+  fclose(fd);
+  *len = size;
+  return buf;
+}
+
+static VF_return_t bench_verify(struct bench_input *input) {
+  struct VF_errbuf errbuf;
+  return VF_verify_errbuf(input->pubkey, input->pubkey_l, input->document,
+                          input->document_l, input->pkcs7, input->pkcs7_l,
+                          &errbuf);
+}
+
+static VF_return_t bench_verify_key(struct bench_input *input) {
+  struct VF_errbuf errbuf;
+  return VF_verify_key_errbuf(input->key, input->document, input->document_l,
+                              input->pkcs7, input->pkcs7_l, &errbuf);
+}
+
+static VF_return_t bench_verify_ctx(struct bench_input *input) {
+  struct VF_errbuf errbuf;
+  return VF_ctx_verify(input->ctx, input->key, input->document,
+                       input->document_l, input->pkcs7, input->pkcs7_l,
+                       &errbuf);
+}
+
+// The document is passed in pieces of this size, like the chunks of an HTTP
+// request body
+#define BENCH_STREAM_PIECE 1024
+
+static VF_return_t bench_verify_stream(struct bench_input *input) {
+  struct VF_errbuf errbuf;
+  struct VF_stream *stream;
+  VF_return_t rv = VF_stream_begin(input->key, input->pkcs7, input->pkcs7_l,
+                                   &stream, &errbuf);
+  for (size_t off = 0; rv == VF_SUCCESS && off < input->document_l;
+       off += BENCH_STREAM_PIECE) {
+    size_t piece = input->document_l - off < BENCH_STREAM_PIECE
+                       ? input->document_l - off
+                       : BENCH_STREAM_PIECE;
+    rv = VF_stream_update(stream, input->document + off, piece, &errbuf);
+  }
+  if (rv == VF_SUCCESS) {
+    rv = VF_stream_final(stream, &errbuf);
+  }
+  VF_stream_free(stream);
+  return rv;
+}
+
+static VF_return_t bench_verify_switch(struct bench_input *input) {
+  struct VF_errbuf errbuf;
+  input->turn = !input->turn;
+  return VF_ctx_verify(input->ctx, input->turn ? input->other : input->key,
+                       input->document, input->document_l, input->pkcs7,
+                       input->pkcs7_l, &errbuf);
+}
+
+static VF_return_t bench_verify_raw(struct bench_input *input) {
+  struct VF_errbuf errbuf;
+  return VF_verify_raw(input->pubkey, input->pubkey_l, input->document,
+                       input->document_l, input->pkcs7, input->pkcs7_l,
+                       &errbuf);
+}
+
+static VF_return_t bench_verify_raw_key(struct bench_input *input) {
+  struct VF_errbuf errbuf;
+  return VF_verify_raw_key(input->key, input->document, input->document_l,
+                           input->pkcs7, input->pkcs7_l, &errbuf);
+}
+
+static VF_return_t bench_verify_generic(struct bench_input *input) {
+  struct VF_errbuf errbuf;
+  return VF_verify_key_errbuf(input->generic, input->document,
+                              input->document_l, input->pkcs7, input->pkcs7_l,
+                              &errbuf);
+}
+
+static VF_return_t bench_stage_pkcs7(struct bench_input *input) {
+  const uint8_t *p = input->der;
+  uint64_t der_l;
+  PKCS7 *p7;
+
+  if (VF_SUCCESS != VF_base64_decode(input->pkcs7, input->pkcs7_l,
+                                     input->der, &der_l)) {
+    return VF_EXCEPTION;
+  }
+  p7 = d2i_PKCS7(NULL, &p, der_l);
+  if (p7 == NULL) {
+    return VF_EXCEPTION;
+  }
+  PKCS7_free(p7);
+  return VF_SUCCESS;
+}
+
+static VF_return_t bench_stage_cert(struct bench_input *input) {
+  struct VF_key *key = NULL;
+  VF_return_t rv = VF_key_load(input->pubkey, input->pubkey_l, &key, NULL);
+  VF_key_free(key);
+  return rv;
+}
+
+static VF_return_t bench_stage_digest(struct bench_input *input) {
+  uint8_t md[EVP_MAX_MD_SIZE];
+  if (1 != EVP_Digest(input->document, input->document_l, md, NULL,
+                      input->md, NULL)) {
+    return VF_EXCEPTION;
+  }
+  return VF_SUCCESS;
+}
+
+// The same digest with the one fetched by VF_init, which OpenSSL 3 doesn't
+// have to look up in its provider store on every call like input->md
+static VF_return_t bench_stage_digest_fetched(struct bench_input *input) {
+  uint8_t md[EVP_MAX_MD_SIZE];
+  if (1 != EVP_Digest(input->document, input->document_l, md, NULL,
+                      input->fetched, NULL)) {
+    return VF_EXCEPTION;
+  }
+  return VF_SUCCESS;
+}
+
+static VF_return_t bench_stage_signature(struct bench_input *input) {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  VF_return_t rv = VF_EXCEPTION;
+
+  if (ctx != NULL &&
+      1 == EVP_DigestVerifyInit(ctx, NULL, input->md, NULL, input->pkey) &&
+      1 == EVP_DigestVerifyUpdate(ctx, input->attrs, input->attrs_l)) {
+    rv = 1 == EVP_DigestVerifyFinal(ctx, input->signature, input->signature_l)
+             ? VF_SUCCESS
+             : VF_FAIL;
+  }
+  EVP_MD_CTX_free(ctx);
+  return rv;
+}
+
+// The same signature check with a copy of a public key context which was set
+// up once, like the templates of a VF_key, instead of setting one up for
+// every signature
+static VF_return_t bench_stage_template(struct bench_input *input) {
+  uint8_t md[EVP_MAX_MD_SIZE];
+  unsigned int md_l;
+  EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_dup(input->template);
+  VF_return_t rv = VF_EXCEPTION;
+
+  if (ctx != NULL && 1 == EVP_Digest(input->attrs, input->attrs_l, md, &md_l,
+                                     input->md, NULL)) {
+    rv = 1 == EVP_PKEY_verify(ctx, input->signature, input->signature_l, md,
+                              md_l)
+             ? VF_SUCCESS
+             : VF_FAIL;
+  }
+  EVP_PKEY_CTX_free(ctx);
+  return rv;
+}
+
+static void *bench_thread_run(void *arg) {
+  struct bench_thread *t = arg;
+  for (int i = 0; i < t->iter; i++) {
+    uint64_t start = now_ns();
+    VF_return_t rv = t->fn(t->input);
+    t->latencies[i] = now_ns() - start;
+    if (rv != t->input->expected) {
+      t->unexpected++;
+    }
+  }
+  ERR_clear_error();
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_us(uint64_t *sorted, size_t n, double p) {
+  return sorted[(size_t)(p * (n - 1))] / 1000.0;
+}
+
+// Run fn iterations times on each of threads threads and print the combined
+// throughput and latency percentiles.  Returns the number of calls which did
+// not have the expected outcome
+static int bench_run(const char *name, bench_fn fn, struct bench_input *input,
+                     int threads) {
+  struct bench_thread *t = calloc(threads, sizeof(struct bench_thread));
+  uint64_t *latencies = calloc((size_t)threads * iterations, sizeof(uint64_t));
+  size_t total = (size_t)threads * iterations;
+  int unexpected = 0;
+  uint64_t start, elapsed, allocated;
+  char label[64];
+  char per_op[16] = "-";
+
+  if (t == NULL || latencies == NULL) {
+    fprintf(stderr, "could not allocate memory\n");
+    exit(1);
+  }
+
+  // Warm up the code paths and caches before anything is timed
+  for (int i = 0; i < 10; i++) {
+    fn(input);
+  }
+  ERR_clear_error();
+
+  allocated = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+  start = now_ns();
+  for (int i = 0; i < threads; i++) {
+    t[i].fn = fn;
+    t[i].input = input;
+    t[i].latencies = latencies + (size_t)i * iterations;
+    t[i].iter = iterations;
+    if (0 != pthread_create(&t[i].thread, NULL, bench_thread_run, &t[i])) {
+      fprintf(stderr, "could not start benchmark thread\n");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(t[i].thread, NULL);
+    unexpected += t[i].unexpected;
+  }
+  elapsed = now_ns() - start;
+  allocated = __atomic_load_n(&allocations, __ATOMIC_RELAXED) - allocated;
+  if (count_allocations) {
+    snprintf(per_op, sizeof(per_op), "%.1f", (double)allocated / total);
+  }
+
+  qsort(latencies, total, sizeof(uint64_t), compare_u64);
+  snprintf(label, sizeof(label), "%s %s", input->name, name);
+  printf("%-36s %2d %10.0f %9.1f %9.1f %9.1f %7s\n", label, threads,
+         total / (elapsed / 1e9), percentile_us(latencies, total, 0.5),
+         percentile_us(latencies, total, 0.99),
+         percentile_us(latencies, total, 0.999), per_op);
+  if (unexpected != 0) {
+    printf("UNEXPECTED: %d outcomes of %s %s\n", unexpected, input->name, name);
+  }
+
+  free(latencies);
+  free(t);
+  return unexpected;
+}
+
+// Take the pieces which each stage needs from the only signer of the pkcs7
+static void bench_prepare(struct bench_input *input) {
+  const uint8_t *p;
+  uint64_t der_l;
+  PKCS7 *p7;
+  PKCS7_SIGNER_INFO *si;
+  BIO *bio;
+  X509 *cert;
+
+  input->der = malloc(input->pkcs7_l / 4 * 3 + 3);
+  p = input->der;
+  if (input->der == NULL ||
+      VF_SUCCESS != VF_base64_decode(input->pkcs7, input->pkcs7_l,
+                                     input->der, &der_l) ||
+      NULL == (p7 = d2i_PKCS7(NULL, &p, der_l)) ||
+      NULL == (si = sk_PKCS7_SIGNER_INFO_value(PKCS7_get_signer_info(p7), 0)) ||
+      NULL == (input->md = EVP_get_digestbyobj(si->digest_alg->algorithm))) {
+    fprintf(stderr, "could not read the signer of %s\n", input->name);
+    exit(1);
+  }
+  input->fetched = VF_md(EVP_MD_type(input->md));
+
+  input->attrs_l = ASN1_item_i2d((ASN1_VALUE *)si->auth_attr, &input->attrs,
+                                 ASN1_ITEM_rptr(PKCS7_ATTR_VERIFY));
+  input->signature_l = ASN1_STRING_length(si->enc_digest);
+  input->signature = malloc(input->signature_l);
+  memcpy(input->signature, ASN1_STRING_get0_data(si->enc_digest),
+         input->signature_l);
+  PKCS7_free(p7);
+
+  bio = BIO_new_mem_buf(input->pubkey, input->pubkey_l);
+  cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+  if (input->attrs_l <= 0 || cert == NULL) {
+    fprintf(stderr, "could not read the signed attributes of %s\n",
+            input->name);
+    exit(1);
+  }
+  input->pkey = X509_get_pubkey(cert);
+  X509_free(cert);
+  BIO_free(bio);
+
+  input->template = EVP_PKEY_CTX_new(input->pkey, NULL);
+  if (input->template == NULL ||
+      1 != EVP_PKEY_verify_init(input->template) ||
+      0 >= EVP_PKEY_CTX_set_signature_md(input->template, input->md)) {
+    fprintf(stderr, "could not set up the public key of %s\n", input->name);
+    exit(1);
+  }
+}
+
+static void bench_load(struct bench_input *input, const char *name,
+                       const char *pubkey, const char *document,
+                       const char *pkcs7, VF_return_t expected) {
+  memset(input, 0, sizeof(struct bench_input));
+  input->name = name;
+  input->pubkey = read_file(pubkey, &input->pubkey_l);
+  input->document = read_file(document, &input->document_l);
+  input->pkcs7 = read_file(pkcs7, &input->pkcs7_l);
+  input->expected = expected;
+  if (VF_SUCCESS !=
+          VF_key_load(input->pubkey, input->pubkey_l, &input->key, NULL) ||
+      VF_SUCCESS !=
+          VF_key_load(input->pubkey, input->pubkey_l, &input->generic, NULL) ||
+      VF_SUCCESS !=
+          VF_key_load(input->pubkey, input->pubkey_l, &input->other, NULL) ||
+      VF_SUCCESS != VF_ctx_new(&input->ctx)) {
+    fprintf(stderr, "could not load key %s\n", pubkey);
+    exit(1);
+  }
+  VF_key_set_flags(input->generic, VF_KEY_GENERIC);
+}
+
+int main(int argc, char **argv) {
+  long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  struct bench_input inputs[5];
+  int unexpected = 0;
+  int opt;
+
+  while (-1 != (opt = getopt(argc, argv, "n:t:a"))) {
+    switch (opt) {
+    case 'a':
+      count_allocations = 1;
+      break;
+    case 'n':
+      iterations = atoi(optarg);
+      break;
+    case 't':
+      max_threads = atol(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n iterations] [-t max-threads] [-a]\n",
+              argv[0]);
+      return 2;
+    }
+  }
+
+  if (iterations < 1 || max_threads < 1) {
+    fprintf(stderr, "iterations and threads must be positive\n");
+    return 2;
+  }
+
+  // The allocation functions can only be replaced before OpenSSL has
+  // allocated anything, so this has to come before VF_init
+  if (count_allocations &&
+      1 != CRYPTO_set_mem_functions(bench_malloc, bench_realloc,
+                                    bench_free)) {
+    fprintf(stderr, "could not count OpenSSL allocations\n");
+    return 1;
+  }
+
+  if (VF_SUCCESS != VF_init()) {
+    fprintf(stderr, "could not initialize OpenSSL\n");
+    return 1;
+  }
+
+  bench_load(&inputs[0], "pkcs7", "test-files/pkcs7-pubkey",
+             "test-files/document", "test-files/pkcs7", VF_SUCCESS);
+  bench_load(&inputs[1], "rsa2048", "test-files/rsa2048-pubkey",
+             "test-files/document", "test-files/rsa2048", VF_SUCCESS);
+  bench_load(&inputs[2], "rsa2048 fail", "test-files/rsa2048-pubkey",
+             "test-files/document", "test-files/rsa2048", VF_FAIL);
+  inputs[2].document[20] ^= 1;
+  bench_load(&inputs[3], "malformed", "test-files/rsa2048-pubkey",
+             "test-files/document", "test-files/not-valid-datastructure",
+             VF_EXCEPTION);
+  bench_load(&inputs[4], "raw", "test-files/raw-pubkey",
+             "test-files/document", "test-files/raw-signature", VF_SUCCESS);
+
+  printf("%-36s %2s %10s %9s %9s %9s %7s\n", "benchmark", "th", "ops/s",
+         "p50 us", "p99 us", "p999 us", "allocs");
+
+  for (int i = 0; i < 4; i++) {
+    unexpected += bench_run("verify", bench_verify, &inputs[i], 1);
+    unexpected += bench_run("verify key", bench_verify_key, &inputs[i], 1);
+    unexpected += bench_run("verify ctx", bench_verify_ctx, &inputs[i], 1);
+    unexpected += bench_run("verify ctx switch", bench_verify_switch,
+                            &inputs[i], 1);
+    unexpected += bench_run("verify key generic", bench_verify_generic,
+                            &inputs[i], 1);
+    unexpected += bench_run("verify stream", bench_verify_stream, &inputs[i],
+                            1);
+  }
+  unexpected += bench_run("verify", bench_verify_raw, &inputs[4], 1);
+  unexpected += bench_run("verify key", bench_verify_raw_key, &inputs[4], 1);
+
+  // The stages only make sense for envelopes which can be parsed.  The
+  // signature stage is the RSA verification of the signed attributes,
+  // including their small digest
+  for (int i = 0; i < 2; i++) {
+    bench_prepare(&inputs[i]);
+    unexpected += bench_run("stage pkcs7 parse", bench_stage_pkcs7,
+                            &inputs[i], 1);
+    unexpected += bench_run("stage cert parse", bench_stage_cert,
+                            &inputs[i], 1);
+    unexpected += bench_run("stage digest", bench_stage_digest,
+                            &inputs[i], 1);
+    unexpected += bench_run("stage digest fetched",
+                            bench_stage_digest_fetched, &inputs[i], 1);
+    unexpected += bench_run("stage signature", bench_stage_signature,
+                            &inputs[i], 1);
+    unexpected += bench_run("stage signature template", bench_stage_template,
+                            &inputs[i], 1);
+  }
+
+  for (long threads = 1; threads <= max_threads; threads *= 2) {
+    unexpected += bench_run("verify key", bench_verify_key, &inputs[1],
+                            threads);
+    if (threads < max_threads && threads * 2 > max_threads) {
+      threads = max_threads / 2;
+    }
+  }
+
+  for (int i = 0; i < 5; i++) {
+    VF_key_free(inputs[i].key);
+    VF_key_free(inputs[i].generic);
+    VF_key_free(inputs[i].other);
+    VF_ctx_free(inputs[i].ctx);
+    EVP_PKEY_CTX_free(inputs[i].template);
+    EVP_PKEY_free(inputs[i].pkey);
+    OPENSSL_free(inputs[i].attrs);
+    free(inputs[i].signature);
+    free(inputs[i].der);
+    free(inputs[i].pubkey);
+    free(inputs[i].document);
+    free(inputs[i].pkcs7);
+  }
+
+  return unexpected == 0 ? 0 : 1;
+}
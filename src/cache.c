@@ -0,0 +1,455 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "./verify.h"
+
+// A stored outcome.  Entries are kept both in a hash bucket chain, for
+// lookups, and in a doubly linked list ordered from most to least recently
+// used, for eviction
+struct VF_cache_entry {
+  uint8_t digest[VF_FINGERPRINT_SIZE];
+  VF_return_t outcome;
+  uint64_t expires;
+  struct VF_cache_entry *chain;
+  struct VF_cache_entry *prev;
+  struct VF_cache_entry *next;
+};
+
+struct VF_cache {
+  pthread_mutex_t lock;
+  uint64_t capacity;
+  uint64_t ttl_ms;
+
+  // All entries are allocated up front, and unused ones are kept on the free
+  // list, so that the cache never allocates while verifying
+  struct VF_cache_entry *entries;
+  struct VF_cache_entry *free;
+  struct VF_cache_entry **buckets;
+  uint64_t mask;
+  struct VF_cache_entry *head;
+  struct VF_cache_entry *tail;
+  uint64_t size;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t insertions;
+  uint64_t evictions;
+  uint64_t expirations;
+};
+
+static uint64_t VF_cache_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Allocate the entries and buckets for capacity outcomes.  The lock must be
+// held, or the cache not yet shared
+static VF_return_t VF_cache_alloc(struct VF_cache *cache, uint64_t capacity) {
+  struct VF_cache_entry *entries = NULL;
+  struct VF_cache_entry **buckets = NULL;
+  uint64_t nbuckets = 1;
+
+  if (capacity > VF_CACHE_MAX_CAPACITY) {
+    VF_ERROR("cache capacity %lu is too large\n", (unsigned long)capacity);
+    return VF_EXCEPTION;
+  }
+
+  // Twice as many buckets as entries, rounded up to a power of two, keeps the
+  // chains short without a modulo on every lookup.  Comparing with half the
+  // buckets can't overflow however large capacity is
+  while (nbuckets / 2 < capacity) {
+    nbuckets <<= 1;
+  }
+
+  if (capacity > 0) {
+    entries = calloc(capacity, sizeof(struct VF_cache_entry));
+    buckets = calloc(nbuckets, sizeof(struct VF_cache_entry *));
+    if (entries == NULL || buckets == NULL) {
+      free(entries);
+      free(buckets);
+      VF_ERROR("error while allocating cache of %lu entries\n",
+               (unsigned long)capacity);
+      return VF_EXCEPTION;
+    }
+  }
+
+  free(cache->entries);
+  free(cache->buckets);
+
+  cache->entries = entries;
+  cache->buckets = buckets;
+  cache->mask = nbuckets - 1;
+  cache->capacity = capacity;
+  cache->free = NULL;
+  cache->head = NULL;
+  cache->tail = NULL;
+  cache->size = 0;
+
+  for (uint64_t i = 0; i < capacity; i++) {
+    entries[i].next = cache->free;
+    cache->free = &entries[i];
+  }
+
+  return VF_SUCCESS;
+}
+
+VF_return_t VF_cache_new(uint64_t capacity, uint64_t ttl_ms,
+                         struct VF_cache **cache) {
+  struct VF_cache *c = calloc(1, sizeof(struct VF_cache));
+
+  *cache = NULL;
+
+  if (c == NULL) {
+    VF_ERROR("error while allocating cache\n");
+    return VF_EXCEPTION;
+  }
+
+  if (0 != pthread_mutex_init(&c->lock, NULL)) {
+    free(c);
+    VF_ERROR("error while initializing cache lock\n");
+    return VF_EXCEPTION;
+  }
+
+  if (VF_SUCCESS != VF_cache_alloc(c, capacity)) {
+    VF_cache_free(c);
+    return VF_EXCEPTION;
+  }
+
+  c->ttl_ms = ttl_ms;
+  *cache = c;
+  return VF_SUCCESS;
+}
+
+VF_return_t VF_cache_configure(struct VF_cache *cache, uint64_t capacity,
+                               uint64_t ttl_ms) {
+  VF_return_t rv;
+
+  pthread_mutex_lock(&cache->lock);
+  rv = VF_cache_alloc(cache, capacity);
+  if (rv == VF_SUCCESS) {
+    cache->ttl_ms = ttl_ms;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return rv;
+}
+
+void VF_cache_free(struct VF_cache *cache) {
+  if (cache == NULL) {
+    return;
+  }
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->entries);
+  free(cache->buckets);
+  free(cache);
+}
+
+void VF_cache_stats(struct VF_cache *cache, struct VF_cache_stats *stats,
+                    int reset) {
+  pthread_mutex_lock(&cache->lock);
+  stats->hits = cache->hits;
+  stats->misses = cache->misses;
+  stats->insertions = cache->insertions;
+  stats->evictions = cache->evictions;
+  stats->expirations = cache->expirations;
+  stats->size = cache->size;
+  stats->capacity = cache->capacity;
+  stats->ttl_ms = cache->ttl_ms;
+  if (reset) {
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->insertions = 0;
+    cache->evictions = 0;
+    cache->expirations = 0;
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+static uint64_t VF_cache_bucket(struct VF_cache *cache,
+                                const uint8_t *digest) {
+  uint64_t h;
+  memcpy(&h, digest, sizeof(h));
+  return h & cache->mask;
+}
+
+// Remove an entry from its chain and the recently used list and put it on
+// the free list.  The lock must be held
+static void VF_cache_remove(struct VF_cache *cache,
+                            struct VF_cache_entry *entry) {
+  struct VF_cache_entry **link =
+      &cache->buckets[VF_cache_bucket(cache, entry->digest)];
+  while (*link != entry) {
+    link = &(*link)->chain;
+  }
+  *link = entry->chain;
+
+  if (entry->prev != NULL) {
+    entry->prev->next = entry->next;
+  } else {
+    cache->head = entry->next;
+  }
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->tail = entry->prev;
+  }
+
+  entry->next = cache->free;
+  cache->free = entry;
+  cache->size--;
+}
+
+// Make an entry the most recently used.  The lock must be held
+static void VF_cache_touch(struct VF_cache *cache,
+                           struct VF_cache_entry *entry) {
+  if (cache->head == entry) {
+    return;
+  }
+  entry->prev->next = entry->next;
+  if (entry->next != NULL) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->tail = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = cache->head;
+  cache->head->prev = entry;
+  cache->head = entry;
+}
+
+// Look up an outcome, returning VF_EXCEPTION when there isn't a live entry
+static VF_return_t VF_cache_get(struct VF_cache *cache,
+                                const uint8_t *digest) {
+  VF_return_t outcome = VF_EXCEPTION;
+
+  pthread_mutex_lock(&cache->lock);
+  if (cache->capacity > 0) {
+    struct VF_cache_entry *entry =
+        cache->buckets[VF_cache_bucket(cache, digest)];
+    while (entry != NULL &&
+           0 != memcmp(entry->digest, digest, VF_FINGERPRINT_SIZE)) {
+      entry = entry->chain;
+    }
+
+    if (entry != NULL && cache->ttl_ms > 0 &&
+        entry->expires <= VF_cache_now_ms()) {
+      VF_cache_remove(cache, entry);
+      cache->expirations++;
+      entry = NULL;
+    }
+
+    if (entry != NULL) {
+      VF_cache_touch(cache, entry);
+      outcome = entry->outcome;
+      cache->hits++;
+    } else {
+      cache->misses++;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  return outcome;
+}
+
+static void VF_cache_put(struct VF_cache *cache, const uint8_t *digest,
+                         VF_return_t outcome) {
+  pthread_mutex_lock(&cache->lock);
+  if (cache->capacity > 0) {
+    struct VF_cache_entry *entry =
+        cache->buckets[VF_cache_bucket(cache, digest)];
+    while (entry != NULL &&
+           0 != memcmp(entry->digest, digest, VF_FINGERPRINT_SIZE)) {
+      entry = entry->chain;
+    }
+
+    // Another thread may have stored the same outcome since our lookup
+    if (entry != NULL) {
+      VF_cache_remove(cache, entry);
+    } else if (cache->free == NULL) {
+      VF_cache_remove(cache, cache->tail);
+      cache->evictions++;
+    }
+
+    entry = cache->free;
+    cache->free = entry->next;
+
+    memcpy(entry->digest, digest, VF_FINGERPRINT_SIZE);
+    entry->outcome = outcome;
+    entry->expires = cache->ttl_ms > 0 ? VF_cache_now_ms() + cache->ttl_ms : 0;
+
+    uint64_t bucket = VF_cache_bucket(cache, digest);
+    entry->chain = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL) {
+      cache->head->prev = entry;
+    } else {
+      cache->tail = entry;
+    }
+    cache->head = entry;
+
+    cache->size++;
+    cache->insertions++;
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// Compute the cache key of a verification.  The tag separates keys which are
+// identified by a certificate fingerprint from those identified by a digest
+// of the pubkey bytes, and the document length keeps the boundary between
+// the document and signature unambiguous
+static VF_return_t VF_cache_digest(uint8_t tag, const uint8_t *id,
+                                   uint64_t id_l, uint8_t *document,
+                                   uint64_t document_l, uint8_t *pkcs7,
+                                   uint64_t pkcs7_l, uint8_t *digest) {
+  VF_return_t rv = VF_SUCCESS;
+  uint8_t length[8];
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+  for (int i = 0; i < 8; i++) {
+    length[i] = (uint8_t)(document_l >> (i * 8));
+  }
+
+  if (ctx == NULL || 1 != EVP_DigestInit_ex(ctx, VF_md(NID_sha256), NULL) ||
+      1 != EVP_DigestUpdate(ctx, &tag, 1) ||
+      1 != EVP_DigestUpdate(ctx, id, id_l) ||
+      1 != EVP_DigestUpdate(ctx, length, sizeof(length)) ||
+      1 != EVP_DigestUpdate(ctx, document, document_l) ||
+      1 != EVP_DigestUpdate(ctx, pkcs7, pkcs7_l) ||
+      1 != EVP_DigestFinal_ex(ctx, digest, NULL)) {
+    rv = VF_EXCEPTION;
+    VF_ERROR("error while computing cache digest\n");
+  }
+
+  EVP_MD_CTX_free(ctx);
+  return rv;
+}
+
+// Fill in the errbuf for an outcome which came from the cache, in the same
+// way that a verification with that outcome would have
+static void VF_cache_hit_errbuf(VF_return_t rv, struct VF_errbuf *errbuf) {
+  if (errbuf != NULL) {
+    errbuf->code = rv == VF_SUCCESS ? VF_E_NONE : VF_E_SIGNATURE;
+    errbuf->count = 0;
+    errbuf->dropped = 0;
+  }
+}
+
+static int VF_cache_enabled(struct VF_cache *cache) {
+  int enabled;
+  if (cache == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&cache->lock);
+  enabled = cache->capacity > 0;
+  pthread_mutex_unlock(&cache->lock);
+  return enabled;
+}
+
+VF_return_t VF_verify_key_cached(struct VF_cache *cache, struct VF_key *key,
+                                 uint8_t *document, uint64_t document_l,
+                                 uint8_t *pkcs7, uint64_t pkcs7_l,
+                                 struct VF_errbuf *errbuf) {
+  uint8_t digest[VF_FINGERPRINT_SIZE];
+  VF_return_t rv;
+
+  // Inputs over the limits are rejected without digesting them, and never
+  // return an outcome cached before the limits were lowered
+  if (!VF_cache_enabled(cache) || !VF_limits_allow(0, document_l, pkcs7_l) ||
+      VF_SUCCESS != VF_cache_digest('K', VF_key_fingerprint(key),
+                                    VF_FINGERPRINT_SIZE, document, document_l,
+                                    pkcs7, pkcs7_l, digest)) {
+    return VF_verify_key_errbuf(key, document, document_l, pkcs7, pkcs7_l,
+                                errbuf);
+  }
+
+  rv = VF_cache_get(cache, digest);
+  if (rv != VF_EXCEPTION) {
+    VF_cache_hit_errbuf(rv, errbuf);
+    return rv;
+  }
+
+  rv = VF_verify_key_errbuf(key, document, document_l, pkcs7, pkcs7_l,
+                            errbuf);
+  if (rv != VF_EXCEPTION) {
+    VF_cache_put(cache, digest, rv);
+  }
+  return rv;
+}
+
+// Verify with the pubkey bytes, using the certificate parsed once for shared
+// when it is not NULL
+static VF_return_t VF_verify_pubkey(struct VF_shared_key *shared,
+                                    uint8_t *pubkey, uint64_t pubkey_l,
+                                    uint8_t *document, uint64_t document_l,
+                                    uint8_t *pkcs7, uint64_t pkcs7_l,
+                                    struct VF_errbuf *errbuf) {
+  if (shared != NULL) {
+    return VF_verify_shared_errbuf(shared, document, document_l, pkcs7,
+                                   pkcs7_l, errbuf);
+  }
+  return VF_verify_errbuf(pubkey, pubkey_l, document, document_l, pkcs7,
+                          pkcs7_l, errbuf);
+}
+
+// The outcome of VF_verify_cached and VF_verify_shared_cached
+static VF_return_t VF_verify_pubkey_cached(struct VF_cache *cache,
+                                           struct VF_shared_key *shared,
+                                           uint8_t *pubkey, uint64_t pubkey_l,
+                                           uint8_t *document,
+                                           uint64_t document_l, uint8_t *pkcs7,
+                                           uint64_t pkcs7_l,
+                                           struct VF_errbuf *errbuf) {
+  uint8_t id[VF_FINGERPRINT_SIZE];
+  uint8_t digest[VF_FINGERPRINT_SIZE];
+  VF_return_t rv;
+
+  if (!VF_cache_enabled(cache) ||
+      !VF_limits_allow(pubkey_l, document_l, pkcs7_l) ||
+      1 != EVP_Digest(pubkey, pubkey_l, id, NULL, VF_md(NID_sha256), NULL) ||
+      VF_SUCCESS != VF_cache_digest('P', id, sizeof(id), document, document_l,
+                                    pkcs7, pkcs7_l, digest)) {
+    return VF_verify_pubkey(shared, pubkey, pubkey_l, document, document_l,
+                            pkcs7, pkcs7_l, errbuf);
+  }
+
+  rv = VF_cache_get(cache, digest);
+  if (rv != VF_EXCEPTION) {
+    VF_cache_hit_errbuf(rv, errbuf);
+    return rv;
+  }
+
+  rv = VF_verify_pubkey(shared, pubkey, pubkey_l, document, document_l, pkcs7,
+                        pkcs7_l, errbuf);
+  if (rv != VF_EXCEPTION) {
+    VF_cache_put(cache, digest, rv);
+  }
+  return rv;
+}
+
+VF_return_t VF_verify_cached(struct VF_cache *cache, uint8_t *pubkey,
+                             uint64_t pubkey_l, uint8_t *document,
+                             uint64_t document_l, uint8_t *pkcs7,
+                             uint64_t pkcs7_l, struct VF_errbuf *errbuf) {
+  return VF_verify_pubkey_cached(cache, NULL, pubkey, pubkey_l, document,
+                                 document_l, pkcs7, pkcs7_l, errbuf);
+}
+
+VF_return_t VF_verify_shared_cached(struct VF_cache *cache,
+                                    struct VF_shared_key *shared,
+                                    uint8_t *document, uint64_t document_l,
+                                    uint8_t *pkcs7, uint64_t pkcs7_l,
+                                    struct VF_errbuf *errbuf) {
+  return VF_verify_pubkey_cached(cache, shared, shared->pubkey,
+                                 shared->pubkey_l, document, document_l, pkcs7,
+                                 pkcs7_l, errbuf);
+}
@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "./verify.h"
+
+// Nested objects and arrays deeper than this are treated as malformed.  The
+// values in an instance identity document are at most one level deep
+#define VF_CLAIMS_MAX_DEPTH 32
+
+static const uint8_t *VF_skip_ws(const uint8_t *p, const uint8_t *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+    p++;
+  }
+  return p;
+}
+
+// Scan a string starting at its opening quote.  Returns the position after
+// the closing quote, or NULL when it is not terminated.  Escapes are only
+// skipped here, and are checked when the string is unescaped
+static const uint8_t *VF_scan_string(const uint8_t *p, const uint8_t *end,
+                                     int *escaped) {
+  for (p++; p < end; p++) {
+    if (*p == '"') {
+      return p + 1;
+    } else if (*p == '\\') {
+      if (end - p < 2) {
+        return NULL;
+      }
+      *escaped = 1;
+      p++;
+    } else if (*p < 0x20) {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+// Scan a nested object or array starting at its opening bracket, skipping
+// everything inside it except for checking that the brackets match
+static const uint8_t *VF_scan_nested(const uint8_t *p, const uint8_t *end) {
+  uint8_t stack[VF_CLAIMS_MAX_DEPTH];
+  int depth = 0;
+  int escaped;
+
+  while (p < end) {
+    switch (*p) {
+    case '{':
+    case '[':
+      if (depth == VF_CLAIMS_MAX_DEPTH) {
+        return NULL;
+      }
+      stack[depth++] = *p == '{' ? '}' : ']';
+      p++;
+      break;
+    case '}':
+    case ']':
+      if (depth == 0 || stack[--depth] != *p) {
+        return NULL;
+      }
+      p++;
+      if (depth == 0) {
+        return p;
+      }
+      break;
+    case '"':
+      p = VF_scan_string(p, end, &escaped);
+      if (p == NULL) {
+        return NULL;
+      }
+      break;
+    default:
+      p++;
+    }
+  }
+  return NULL;
+}
+
+static const uint8_t *VF_scan_literal(const uint8_t *p, const uint8_t *end,
+                                      const char *literal) {
+  size_t literal_l = strlen(literal);
+  if ((size_t)(end - p) < literal_l || 0 != memcmp(p, literal, literal_l)) {
+    return NULL;
+  }
+  return p + literal_l;
+}
+
+static const uint8_t *VF_scan_digits(const uint8_t *p, const uint8_t *end) {
+  while (p < end && *p >= '0' && *p <= '9') {
+    p++;
+  }
+  return p;
+}
+
+// Scan a number, which must follow the JSON grammar: an optional minus, an
+// integer part without leading zeros, and optional fraction and exponent
+// parts which each have at least one digit
+static const uint8_t *VF_scan_number(const uint8_t *p, const uint8_t *end) {
+  const uint8_t *digits;
+
+  if (p < end && *p == '-') {
+    p++;
+  }
+  if (p < end && *p == '0') {
+    p++;
+  } else {
+    digits = p;
+    p = VF_scan_digits(p, end);
+    if (p == digits) {
+      return NULL;
+    }
+  }
+
+  if (p < end && *p == '.') {
+    digits = ++p;
+    p = VF_scan_digits(p, end);
+    if (p == digits) {
+      return NULL;
+    }
+  }
+
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    if (p < end && (*p == '+' || *p == '-')) {
+      p++;
+    }
+    digits = p;
+    p = VF_scan_digits(p, end);
+    if (p == digits) {
+      return NULL;
+    }
+  }
+  return p;
+}
+
+// Scan any value, returning the position after it and setting its type
+static const uint8_t *VF_scan_value(const uint8_t *p, const uint8_t *end,
+                                    int *type) {
+  int escaped = 0;
+
+  if (p >= end) {
+    return NULL;
+  }
+
+  switch (*p) {
+  case '"':
+    p = VF_scan_string(p, end, &escaped);
+    *type = escaped ? VF_CLAIM_ESCAPED : VF_CLAIM_STRING;
+    return p;
+  case '{':
+    *type = VF_CLAIM_OBJECT;
+    return VF_scan_nested(p, end);
+  case '[':
+    *type = VF_CLAIM_ARRAY;
+    return VF_scan_nested(p, end);
+  case 't':
+    *type = VF_CLAIM_TRUE;
+    return VF_scan_literal(p, end, "true");
+  case 'f':
+    *type = VF_CLAIM_FALSE;
+    return VF_scan_literal(p, end, "false");
+  case 'n':
+    *type = VF_CLAIM_NULL;
+    return VF_scan_literal(p, end, "null");
+  }
+
+  *type = VF_CLAIM_NUMBER;
+  return VF_scan_number(p, end);
+}
+
+static int VF_hex_value(uint8_t c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+static int VF_read_u_escape(const uint8_t *p, const uint8_t *end,
+                            uint32_t *code) {
+  *code = 0;
+  if (end - p < 6 || p[0] != '\\' || p[1] != 'u') {
+    return 0;
+  }
+  for (int i = 2; i < 6; i++) {
+    int v = VF_hex_value(p[i]);
+    if (v < 0) {
+      return 0;
+    }
+    *code = *code << 4 | v;
+  }
+  return 1;
+}
+
+// Decode the character at *in, which may be escaped, into out as UTF-8 and
+// move *in past it.  out must have room for four bytes.  Returns the number
+// of bytes written, or -1 for an invalid escape or a lone surrogate
+static int VF_unescape_char(const uint8_t **in, const uint8_t *end,
+                            uint8_t *out) {
+  const uint8_t *p = *in;
+  uint32_t code;
+
+  if (*p != '\\') {
+    out[0] = *p;
+    *in = p + 1;
+    return 1;
+  }
+
+  if (end - p < 2) {
+    return -1;
+  }
+
+  *in = p + 2;
+  switch (p[1]) {
+  case '"':
+  case '\\':
+  case '/':
+    out[0] = p[1];
+    return 1;
+  case 'b':
+    out[0] = '\b';
+    return 1;
+  case 'f':
+    out[0] = '\f';
+    return 1;
+  case 'n':
+    out[0] = '\n';
+    return 1;
+  case 'r':
+    out[0] = '\r';
+    return 1;
+  case 't':
+    out[0] = '\t';
+    return 1;
+  case 'u':
+    if (!VF_read_u_escape(p, end, &code)) {
+      return -1;
+    }
+    p += 6;
+    break;
+  default:
+    return -1;
+  }
+
+  // A high surrogate followed by a low surrogate is one code point, and a
+  // lone surrogate can't be encoded as UTF-8, so it is rejected
+  if (code >= 0xd800 && code <= 0xdbff) {
+    uint32_t low;
+    if (!VF_read_u_escape(p, end, &low) || low < 0xdc00 || low > 0xdfff) {
+      return -1;
+    }
+    p += 6;
+    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+  } else if (code >= 0xdc00 && code <= 0xdfff) {
+    return -1;
+  }
+  *in = p;
+
+  // Every encoding here is shorter than the escape it came from
+  if (code < 0x80) {
+    out[0] = code;
+    return 1;
+  } else if (code < 0x800) {
+    out[0] = 0xc0 | code >> 6;
+    out[1] = 0x80 | (code & 0x3f);
+    return 2;
+  } else if (code < 0x10000) {
+    out[0] = 0xe0 | code >> 12;
+    out[1] = 0x80 | (code >> 6 & 0x3f);
+    out[2] = 0x80 | (code & 0x3f);
+    return 3;
+  }
+  out[0] = 0xf0 | code >> 18;
+  out[1] = 0x80 | (code >> 12 & 0x3f);
+  out[2] = 0x80 | (code >> 6 & 0x3f);
+  out[3] = 0x80 | (code & 0x3f);
+  return 4;
+}
+
+VF_return_t VF_claim_unescape(const uint8_t *in, uint64_t in_l, uint8_t *out,
+                              uint64_t *out_l) {
+  const uint8_t *end = in + in_l;
+  uint64_t n = 0;
+
+  // Each character is decoded into out directly, which never needs to be
+  // longer than in since no encoding is longer than its escape
+  while (in < end) {
+    int written = VF_unescape_char(&in, end, out + n);
+    if (written < 0) {
+      return VF_EXCEPTION;
+    }
+    n += written;
+  }
+
+  *out_l = n;
+  return VF_SUCCESS;
+}
+
+// Compare a member name which has escapes with the name of a claim, one
+// unescaped character at a time.  Returns 1 when they are the same, 0 when
+// they are not, and -1 when the member name has an invalid escape
+static int VF_escaped_name_is(const uint8_t *in, uint64_t in_l,
+                              const char *name, size_t name_l) {
+  const uint8_t *end = in + in_l;
+  uint8_t c[4];
+  size_t n = 0;
+  int same = 1;
+
+  while (in < end) {
+    int written = VF_unescape_char(&in, end, c);
+    if (written < 0) {
+      return -1;
+    }
+    if (same && (name_l - n < (size_t)written ||
+                 0 != memcmp(name + n, c, written))) {
+      same = 0;
+    }
+    n += written;
+  }
+  return same && n == name_l;
+}
+
+VF_return_t VF_claims_scan(const uint8_t *document, uint64_t document_l,
+                           struct VF_claim *claims, uint32_t nclaims) {
+  const uint8_t *end = document + document_l;
+  const uint8_t *p = VF_skip_ws(document, end);
+
+  for (uint32_t i = 0; i < nclaims; i++) {
+    claims[i].type = VF_CLAIM_MISSING;
+    claims[i].value = NULL;
+    claims[i].value_l = 0;
+  }
+
+  if (p == end || *p != '{') {
+    VF_ERROR("document is not a JSON object\n");
+    return VF_EXCEPTION;
+  }
+  p = VF_skip_ws(p + 1, end);
+
+  if (p < end && *p == '}') {
+    p++;
+  } else {
+    for (;;) {
+      const uint8_t *name, *value;
+      int escaped = 0, type;
+
+      if (p == end || *p != '"') {
+        VF_ERROR("expected a member name in document\n");
+        return VF_EXCEPTION;
+      }
+      name = p + 1;
+      p = VF_scan_string(p, end, &escaped);
+      if (p == NULL) {
+        VF_ERROR("unterminated member name in document\n");
+        return VF_EXCEPTION;
+      }
+      size_t name_l = p - 1 - name;
+
+      p = VF_skip_ws(p, end);
+      if (p == end || *p != ':') {
+        VF_ERROR("expected a ':' in document\n");
+        return VF_EXCEPTION;
+      }
+      p = VF_skip_ws(p + 1, end);
+
+      value = p;
+      p = VF_scan_value(p, end, &type);
+      if (p == NULL) {
+        VF_ERROR("malformed value in document\n");
+        return VF_EXCEPTION;
+      }
+
+      // Like JSON.parse, the last of any duplicate members is the one used,
+      // and names are compared once they are unescaped so that an escape
+      // can't hide a duplicate
+      for (uint32_t i = 0; i < nclaims; i++) {
+        int same;
+        if (escaped) {
+          same = VF_escaped_name_is(name, name_l, claims[i].name,
+                                    claims[i].name_l);
+        } else {
+          same = claims[i].name_l == name_l &&
+                 0 == memcmp(claims[i].name, name, name_l);
+        }
+        if (same < 0) {
+          VF_ERROR("invalid escape in member name in document\n");
+          return VF_EXCEPTION;
+        }
+        if (same) {
+          claims[i].type = type;
+          if (type == VF_CLAIM_STRING || type == VF_CLAIM_ESCAPED) {
+            claims[i].value = value + 1;
+            claims[i].value_l = p - value - 2;
+          } else {
+            claims[i].value = value;
+            claims[i].value_l = p - value;
+          }
+        }
+      }
+
+      p = VF_skip_ws(p, end);
+      if (p < end && *p == ',') {
+        p = VF_skip_ws(p + 1, end);
+      } else if (p < end && *p == '}') {
+        p++;
+        break;
+      } else {
+        VF_ERROR("expected a ',' or '}' in document\n");
+        return VF_EXCEPTION;
+      }
+    }
+  }
+
+  if (VF_skip_ws(p, end) != end) {
+    VF_ERROR("trailing data after document\n");
+    return VF_EXCEPTION;
+  }
+
+  return VF_SUCCESS;
+}
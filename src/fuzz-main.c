@@ -0,0 +1,419 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./fuzz.h"
+#include "./verify.h"
+
+// iid-fuzz runs the fuzz target in fuzz.c without libFuzzer, so that it can be
+// built with any compiler.  It replays a corpus, then mutates it at random for
+// as many runs as asked and reports the executions per second, which is the
+// number to watch for regressions in the verification paths.  It also writes
+// the seed corpus, and writes out the parts of an input for
+// test-fuzz-differential.sh to verify with `openssl smime -verify`
+
+// Inputs larger than this are not read, and mutations never grow past it
+#define MAX_INPUT 16384
+
+struct input {
+  uint8_t *data;
+  size_t size;
+};
+
+static struct input *corpus = NULL;
+static size_t corpus_l = 0;
+static size_t corpus_cap = 0;
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-k keys] [-n runs] [-s seed] [-o dir] corpus...\n"
+          "       %s [-k keys] -c dir\n"
+          "       %s [-k keys] -w dir input\n",
+          name, name, name);
+  exit(2);
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t rng() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static uint8_t *read_file(const char *name, size_t *len) {
+  FILE *fd = fopen(name, "rb");
+  uint8_t *buf = NULL;
+  long size;
+
+  if (fd == NULL) {
+    return NULL;
+  }
+  if (0 == fseek(fd, 0, SEEK_END) && (size = ftell(fd)) >= 0 &&
+      0 == fseek(fd, 0, SEEK_SET)) {
+    buf = malloc(size > 0 ? size : 1);
+    if (buf != NULL && fread(buf, 1, size, fd) != (size_t)size) {
+      free(buf);
+      buf = NULL;
+    }
+    *len = size;
+  }
+  fclose(fd);
+  return buf;
+}
+
+static int write_file(const char *dir, const char *name, const uint8_t *buf,
+                      size_t len) {
+  char path[4096];
+  FILE *fd;
+  int ok;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  fd = fopen(path, "wb");
+  if (fd == NULL) {
+    perror(path);
+    return -1;
+  }
+  ok = fwrite(buf, 1, len, fd) == len;
+  if (0 != fclose(fd) || !ok) {
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+static void add_input(uint8_t *data, size_t size) {
+  if (corpus_l == corpus_cap) {
+    corpus_cap = corpus_cap > 0 ? corpus_cap * 2 : 64;
+    corpus = realloc(corpus, corpus_cap * sizeof(struct input));
+    if (corpus == NULL) {
+      perror("realloc");
+      exit(2);
+    }
+  }
+  corpus[corpus_l].data = data;
+  corpus[corpus_l].size = size;
+  corpus_l++;
+}
+
+// Add a file, or every file in a directory, to the corpus
+static void load_corpus(const char *path) {
+  struct dirent *entry;
+  struct stat st;
+  char name[4096];
+  uint8_t *data;
+  size_t size;
+  DIR *dir;
+
+  if (0 != stat(path, &st)) {
+    perror(path);
+    exit(2);
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    data = read_file(path, &size);
+    if (data == NULL) {
+      perror(path);
+      exit(2);
+    }
+    if (size <= MAX_INPUT) {
+      add_input(data, size);
+    } else {
+      free(data);
+    }
+    return;
+  }
+
+  dir = opendir(path);
+  if (dir == NULL) {
+    perror(path);
+    exit(2);
+  }
+  while (NULL != (entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+    load_corpus(name);
+  }
+  closedir(dir);
+}
+
+// Change one to four bytes of an input, or cut it short, in the ways which
+// most often reach new code in the DER and base64 parsers
+static size_t mutate(uint8_t *data, size_t size) {
+  int changes = 1 + rng() % 4;
+
+  for (int i = 0; i < changes && size > 0; i++) {
+    size_t at = rng() % size;
+    switch (rng() % 5) {
+    case 0:
+      data[at] ^= 1 << (rng() % 8);
+      break;
+    case 1:
+      data[at] = (uint8_t)rng();
+      break;
+    case 2:
+      data[at] = (uint8_t)(data[at] + 1);
+      break;
+    case 3:
+      data[at] = (uint8_t)(data[at] - 1);
+      break;
+    default:
+      size = at;
+      break;
+    }
+  }
+  return size;
+}
+
+// Write the seed corpus: every test-files envelope, as it is and DER encoded,
+// with each key, over the valid and a modified document and in different
+// sizes of pieces
+static int write_corpus(const char *keys, const char *dir) {
+  static const char *envelopes[] = {"rsa2048", "rsa2048-with-header",
+                                    "pkcs7", "pkcs7-with-header",
+                                    "not-valid-datastructure"};
+  static const uint8_t pieces[] = {0, 1, 37};
+  uint8_t *document, *pkcs7, *input;
+  size_t document_l, pkcs7_l, input_l;
+  uint64_t der_l;
+  char name[4096];
+  int count = 0;
+
+  snprintf(name, sizeof(name), "%s/document", keys);
+  document = read_file(name, &document_l);
+  if (document == NULL) {
+    perror(name);
+    return 2;
+  }
+  mkdir(dir, 0755);
+
+  for (size_t e = 0; e < sizeof(envelopes) / sizeof(envelopes[0]); e++) {
+    snprintf(name, sizeof(name), "%s/%s", keys, envelopes[e]);
+    pkcs7 = read_file(name, &pkcs7_l);
+    if (pkcs7 == NULL) {
+      perror(name);
+      return 2;
+    }
+    input = malloc(VF_FUZZ_HEADER + document_l + pkcs7_l);
+    if (input == NULL) {
+      perror("malloc");
+      return 2;
+    }
+
+    for (int der = 0; der < 2; der++) {
+      // The bare base64 envelopes are also written DER encoded
+      if (der && VF_SUCCESS != VF_base64_decode(pkcs7, pkcs7_l, pkcs7,
+                                                &der_l)) {
+        break;
+      }
+      if (der) {
+        pkcs7_l = der_l;
+      }
+      for (int key = 0; key < VF_FUZZ_KEYS; key++) {
+        for (size_t p = 0; p < sizeof(pieces); p++) {
+          for (int modified = 0; modified < 2; modified++) {
+            document[20] ^= modified;
+            input_l = VF_fuzz_join(key, pieces[p], document, document_l,
+                                   pkcs7, pkcs7_l, input);
+            document[20] ^= modified;
+            snprintf(name, sizeof(name), "seed-%s%s-%d-%u-%d", envelopes[e],
+                     der ? "-der" : "", key, pieces[p], modified);
+            if (0 != write_file(dir, name, input, input_l)) {
+              return 2;
+            }
+            count++;
+          }
+        }
+      }
+    }
+
+    free(input);
+    free(pkcs7);
+  }
+
+  free(document);
+  printf("wrote %d inputs to %s\n", count, dir);
+  return 0;
+}
+
+// Write the document and envelope of an input into dir for `openssl smime`,
+// and print the -inform to read the envelope with, the certificate file of
+// the key and the outcome of verifying it here.  A bare base64 envelope is
+// written DER encoded, since openssl has no way to read one.  An envelope
+// which is in none of the forms is "none", and can not be verified by either
+static int write_parts(const char *keys, const char *dir, const char *path) {
+  static const char pem_begin[] = "-----BEGIN";
+  struct VF_fuzz_input input;
+  struct VF_errbuf errbuf;
+  const char *inform;
+  uint8_t *data, *pkcs7, *der = NULL;
+  size_t size, pkcs7_l;
+  uint64_t der_l;
+  VF_return_t rv;
+  char name[4096];
+
+  data = read_file(path, &size);
+  if (data == NULL) {
+    perror(path);
+    return 2;
+  }
+  VF_fuzz_split(data, size, &input);
+
+  snprintf(name, sizeof(name), "%s/%s", keys, VF_fuzz_key_files[input.key]);
+  uint8_t *pubkey = read_file(name, &size);
+  if (pubkey == NULL) {
+    perror(name);
+    return 2;
+  }
+  rv = VF_verify_errbuf(pubkey, size, (uint8_t *)input.document,
+                        input.document_l, (uint8_t *)input.pkcs7,
+                        input.pkcs7_l, &errbuf);
+
+  pkcs7 = (uint8_t *)input.pkcs7;
+  pkcs7_l = input.pkcs7_l;
+  while (pkcs7_l > 0 && strchr(" \t\r\n", pkcs7[0]) != NULL) {
+    pkcs7++;
+    pkcs7_l--;
+  }
+  if (pkcs7_l >= sizeof(pem_begin) - 1 &&
+      0 == memcmp(pkcs7, pem_begin, sizeof(pem_begin) - 1)) {
+    inform = "PEM";
+  } else if (pkcs7_l >= 2 && pkcs7[0] == 0x30 && (pkcs7[1] & 0x80)) {
+    inform = "DER";
+  } else if (NULL != (der = malloc(pkcs7_l / 4 * 3 + 3)) &&
+             VF_SUCCESS == VF_base64_decode(pkcs7, pkcs7_l, der, &der_l)) {
+    inform = "DER";
+    pkcs7 = der;
+    pkcs7_l = der_l;
+  } else {
+    inform = "none";
+  }
+
+  if (0 != write_file(dir, "document", input.document, input.document_l) ||
+      0 != write_file(dir, "pkcs7", pkcs7, pkcs7_l)) {
+    return 2;
+  }
+  printf("%s %s %d\n", inform, VF_fuzz_key_files[input.key], rv);
+
+  free(der);
+  free(pubkey);
+  free(data);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  const char *keys = "test-files", *corpus_out = NULL, *parts = NULL;
+  const char *save = NULL;
+  unsigned long runs = 0;
+  uint8_t *buf;
+  size_t size;
+  uint64_t start, elapsed;
+  char name[4096];
+  int opt;
+
+  while (-1 != (opt = getopt(argc, argv, "k:n:s:o:c:w:"))) {
+    switch (opt) {
+    case 'k':
+      keys = optarg;
+      break;
+    case 'n':
+      runs = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      rng_state = strtoull(optarg, NULL, 10) | 1;
+      break;
+    case 'o':
+      save = optarg;
+      break;
+    case 'c':
+      corpus_out = optarg;
+      break;
+    case 'w':
+      parts = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (0 != VF_fuzz_init(keys)) {
+    return 2;
+  }
+
+  if (corpus_out != NULL) {
+    if (optind != argc) {
+      usage(argv[0]);
+    }
+    return write_corpus(keys, corpus_out);
+  }
+  if (parts != NULL) {
+    if (optind + 1 != argc) {
+      usage(argv[0]);
+    }
+    return write_parts(keys, parts, argv[optind]);
+  }
+
+  if (optind == argc) {
+    usage(argv[0]);
+  }
+  for (int i = optind; i < argc; i++) {
+    load_corpus(argv[i]);
+  }
+  if (corpus_l == 0) {
+    fprintf(stderr, "the corpus is empty\n");
+    return 2;
+  }
+  if (save != NULL) {
+    mkdir(save, 0755);
+  }
+
+  start = now_ns();
+  for (size_t i = 0; i < corpus_l; i++) {
+    LLVMFuzzerTestOneInput(corpus[i].data, corpus[i].size);
+  }
+  elapsed = now_ns() - start;
+  printf("replayed %zu inputs in %.3fs, %.0f exec/s\n", corpus_l,
+         elapsed / 1e9, corpus_l / (elapsed / 1e9));
+
+  buf = malloc(MAX_INPUT);
+  if (buf == NULL) {
+    perror("malloc");
+    return 2;
+  }
+  start = now_ns();
+  for (unsigned long run = 0; run < runs; run++) {
+    struct input *seed = &corpus[rng() % corpus_l];
+    memcpy(buf, seed->data, seed->size);
+    size = mutate(buf, seed->size);
+
+    // The input is saved before it is run, so that one which crashes is kept
+    if (save != NULL) {
+      snprintf(name, sizeof(name), "mutated-%lu", run);
+      if (0 != write_file(save, name, buf, size)) {
+        return 2;
+      }
+    }
+    LLVMFuzzerTestOneInput(buf, size);
+  }
+  elapsed = now_ns() - start;
+  if (runs > 0) {
+    printf("ran %lu mutated inputs in %.3fs, %.0f exec/s\n", runs,
+           elapsed / 1e9, runs / (elapsed / 1e9));
+  }
+
+  free(buf);
+  return 0;
+}
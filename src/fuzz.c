@@ -0,0 +1,200 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./fuzz.h"
+#include "./verify.h"
+
+const char *VF_fuzz_key_files[VF_FUZZ_KEYS] = {"rsa2048-pubkey",
+                                                "pkcs7-pubkey"};
+
+// The certificates, the keys loaded from them and the same keys with
+// VF_KEY_GENERIC set, which live until the process exits
+static uint8_t *pubkeys[VF_FUZZ_KEYS];
+static size_t pubkeys_l[VF_FUZZ_KEYS];
+static struct VF_key *keys[VF_FUZZ_KEYS];
+static struct VF_key *generic[VF_FUZZ_KEYS];
+
+void VF_fuzz_split(const uint8_t *data, size_t size,
+                   struct VF_fuzz_input *input) {
+  size_t document_l;
+
+  input->key = size > 0 ? data[0] & 1 : 0;
+  input->piece = size > 0 ? data[0] >> 1 : 0;
+  if (size < VF_FUZZ_HEADER) {
+    input->document = data;
+    input->document_l = 0;
+    input->pkcs7 = data;
+    input->pkcs7_l = 0;
+    return;
+  }
+
+  document_l = (size_t)data[1] << 8 | data[2];
+  data += VF_FUZZ_HEADER;
+  size -= VF_FUZZ_HEADER;
+  if (document_l > size) {
+    document_l = size;
+  }
+
+  input->document = data;
+  input->document_l = document_l;
+  input->pkcs7 = data + document_l;
+  input->pkcs7_l = size - document_l;
+}
+
+size_t VF_fuzz_join(int key, uint8_t pieces, const uint8_t *document,
+                    size_t document_l, const uint8_t *pkcs7, size_t pkcs7_l,
+                    uint8_t *out) {
+  out[0] = (uint8_t)(pieces << 1 | (key & 1));
+  out[1] = (uint8_t)(document_l >> 8);
+  out[2] = (uint8_t)document_l;
+  memcpy(out + VF_FUZZ_HEADER, document, document_l);
+  memcpy(out + VF_FUZZ_HEADER + document_l, pkcs7, pkcs7_l);
+  return VF_FUZZ_HEADER + document_l + pkcs7_l;
+}
+
+static uint8_t *read_file(const char *name, size_t *len) {
+  FILE *fd = fopen(name, "rb");
+  uint8_t *buf = NULL;
+  long size;
+
+  if (fd == NULL) {
+    return NULL;
+  }
+  if (0 == fseek(fd, 0, SEEK_END) && (size = ftell(fd)) >= 0 &&
+      0 == fseek(fd, 0, SEEK_SET)) {
+    buf = malloc(size > 0 ? size : 1);
+    if (buf != NULL && fread(buf, 1, size, fd) != (size_t)size) {
+      free(buf);
+      buf = NULL;
+    }
+    *len = size;
+  }
+  fclose(fd);
+  return buf;
+}
+
+int VF_fuzz_init(const char *dir) {
+  struct VF_limits limits;
+  char name[4096];
+
+  if (VF_SUCCESS != VF_init()) {
+    fprintf(stderr, "could not initialize OpenSSL\n");
+    return -1;
+  }
+
+  for (int i = 0; i < VF_FUZZ_KEYS; i++) {
+    snprintf(name, sizeof(name), "%s/%s", dir != NULL ? dir : "test-files",
+             VF_fuzz_key_files[i]);
+    pubkeys[i] = read_file(name, &pubkeys_l[i]);
+    if (pubkeys[i] == NULL ||
+        VF_SUCCESS != VF_key_load(pubkeys[i], pubkeys_l[i], &keys[i], NULL) ||
+        VF_SUCCESS !=
+            VF_key_load(pubkeys[i], pubkeys_l[i], &generic[i], NULL)) {
+      fprintf(stderr, "could not load key %s\n", name);
+      return -1;
+    }
+    VF_key_set_flags(generic[i], VF_KEY_GENERIC);
+  }
+
+  // Every path checks the structure of the envelope first, so the
+  // differential test also finds any valid envelope which it rejects
+  VF_limits_get(&limits);
+  limits.structure = 1;
+  VF_limits_set(&limits);
+
+  return 0;
+}
+
+int LLVMFuzzerInitialize(int *argc, char ***argv) {
+  (void)argc;
+  (void)argv;
+  if (0 != VF_fuzz_init(getenv("IID_FUZZ_KEYS"))) {
+    exit(1);
+  }
+  return 0;
+}
+
+// Abort when a path disagrees with the direct verification, printing both
+// outcomes and errors so that the crash report says what differed
+static void compare(const char *path, VF_return_t expected,
+                    const struct VF_errbuf *expected_errbuf,
+                    VF_return_t outcome, const struct VF_errbuf *errbuf) {
+  char line[512];
+
+  if (outcome == expected && errbuf->code == expected_errbuf->code) {
+    return;
+  }
+
+  fprintf(stderr, "%s: outcome %d code %d, expected outcome %d code %d\n",
+          path, outcome, errbuf->code, expected, expected_errbuf->code);
+  for (uint32_t i = 0; i < errbuf->count; i++) {
+    VF_errbuf_fmt(errbuf, i, line, sizeof(line));
+    fprintf(stderr, "  %s: %s\n", path, line);
+  }
+  for (uint32_t i = 0; i < expected_errbuf->count; i++) {
+    VF_errbuf_fmt(expected_errbuf, i, line, sizeof(line));
+    fprintf(stderr, "  direct: %s\n", line);
+  }
+  abort();
+}
+
+// Verify in pieces of the given size, or in one piece when it is zero
+static VF_return_t verify_stream(struct VF_key *key,
+                                 const struct VF_fuzz_input *input,
+                                 struct VF_errbuf *errbuf) {
+  size_t piece = input->piece > 0 ? input->piece : input->document_l;
+  struct VF_stream *stream;
+  VF_return_t rv;
+
+  rv = VF_stream_begin(key, (uint8_t *)input->pkcs7, input->pkcs7_l, &stream,
+                       errbuf);
+  for (size_t off = 0; rv == VF_SUCCESS && off < input->document_l;
+       off += piece) {
+    rv = VF_stream_update(stream, input->document + off,
+                          input->document_l - off < piece
+                              ? input->document_l - off
+                              : piece,
+                          errbuf);
+  }
+  if (rv == VF_SUCCESS) {
+    rv = VF_stream_final(stream, errbuf);
+  }
+  VF_stream_free(stream);
+  return rv;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  struct VF_fuzz_input input;
+  struct VF_errbuf direct, errbuf;
+  VF_return_t expected, outcome;
+
+  // The verify functions take non-const pointers but never write through
+  // them, so the input is passed as it is instead of being copied
+  VF_fuzz_split(data, size, &input);
+  uint8_t *document = (uint8_t *)input.document;
+  uint8_t *pkcs7 = (uint8_t *)input.pkcs7;
+
+  expected = VF_verify_key_errbuf(keys[input.key], document, input.document_l,
+                                  pkcs7, input.pkcs7_l, &direct);
+
+  outcome = VF_verify_key_errbuf(generic[input.key], document,
+                                 input.document_l, pkcs7, input.pkcs7_l,
+                                 &errbuf);
+  compare("PKCS7_verify", expected, &direct, outcome, &errbuf);
+
+  outcome = VF_verify_errbuf(pubkeys[input.key], pubkeys_l[input.key],
+                             document, input.document_l, pkcs7,
+                             input.pkcs7_l, &errbuf);
+  compare("pubkey", expected, &direct, outcome, &errbuf);
+
+  outcome = verify_stream(keys[input.key], &input, &errbuf);
+  compare("stream", expected, &direct, outcome, &errbuf);
+
+  outcome = verify_stream(generic[input.key], &input, &errbuf);
+  compare("stream PKCS7_verify", expected, &direct, outcome, &errbuf);
+
+  return 0;
+}
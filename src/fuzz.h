@@ -0,0 +1,55 @@
+#ifndef FUZZ_H
+#define FUZZ_H
+#include <stddef.h>
+#include <stdint.h>
+
+// The fuzz target verifies a document and signature from each input with
+// every path that can verify them, and aborts when any two disagree about the
+// outcome or error code.  The paths are the direct verification of a loaded
+// key, PKCS7_verify through a key with VF_KEY_GENERIC, which is what
+// `openssl smime -verify` does, parsing the certificate on every call and
+// verifying in pieces with a VF_stream.  Crashes, leaks and out of bounds
+// accesses are left to the sanitizers
+//
+// An input is a header of VF_FUZZ_HEADER bytes followed by the document and
+// then the signature.  The first byte picks the key, with its low bit, and
+// the size of the stream's pieces, with the rest.  The next two are the
+// length of the document, big-endian, which is cut short when the input is.
+// Every input is valid, so that the fuzzer spends its time in the parsers
+#define VF_FUZZ_HEADER 3
+
+// The test-files certificates which the keys are loaded from, in the order
+// that the low bit of the first byte picks them
+#define VF_FUZZ_KEYS 2
+extern const char *VF_fuzz_key_files[VF_FUZZ_KEYS];
+
+struct VF_fuzz_input {
+  int key;
+  size_t piece;
+  const uint8_t *document;
+  size_t document_l;
+  const uint8_t *pkcs7;
+  size_t pkcs7_l;
+};
+
+// Split an input into its parts, which point into data
+void VF_fuzz_split(const uint8_t *data, size_t size,
+                   struct VF_fuzz_input *input);
+
+// Encode a key, piece selector, document and signature as an input, into out,
+// which must have room for VF_FUZZ_HEADER + document_l + pkcs7_l bytes.
+// Returns the length of the input
+size_t VF_fuzz_join(int key, uint8_t pieces, const uint8_t *document,
+                    size_t document_l, const uint8_t *pkcs7, size_t pkcs7_l,
+                    uint8_t *out);
+
+// Load the keys from the certificates in dir, or test-files when dir is NULL.
+// The libFuzzer entry points call this with $IID_FUZZ_KEYS
+int VF_fuzz_init(const char *dir);
+
+// The libFuzzer entry points, which the standalone driver in fuzz-main.c
+// also calls
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+#endif
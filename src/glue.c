@@ -1,21 +1,147 @@
 #include "verify.h"
+#include <math.h>
 #include <node_api.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-napi_status HandleError(napi_env env, struct Error *err) {
+// The state which every instance of this module in the process shares.  The
+// main thread and each worker_thread run init in an environment of their
+// own, but the library is only loaded once, so the outcome cache and the keys
+// from loadKey are kept here instead of once per environment.  Every
+// environment holds a reference from init until its instance data is
+// finalized as it is torn down, as does every piece of async work until it
+// completes, and the cache is freed with the last reference.  All of this is
+// guarded by shared_lock
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t shared_refs = 0;
+
+// The outcome cache shared by every verification made through this module.
+// It is enabled with configureCache, from any environment, for all of them,
+// which may happen at any time since the cache does its own locking.  The
+// pointer itself is only set while there are no references, so it can be read
+// without the lock by anything holding one.  The capacity and ttl it was last
+// configured with are kept under the lock, so that a cache created again
+// after the last reference went away is configured the same
+static struct VF_cache *cache = NULL;
+static uint64_t cache_capacity = 0;
+static uint64_t cache_ttl = 0;
+
+// A key from loadKey.  Loading the same certificate with the same region
+// again, from any environment, returns the same key, which is freed once
+// every external that was returned for it has been finalized
+struct SharedKey {
+  struct VF_key *key;
+  uint32_t refs;
+  struct SharedKey *next;
+  char region[VF_REGION_SIZE];
+  size_t pubkey_l;
+  uint8_t pubkey[];
+};
+
+static struct SharedKey *shared_keys = NULL;
+
+// Every external or wrapped object which this module returns is tagged with
+// the type of what it holds, and every argument is checked for that tag before
+// it is used, so that a handle of the wrong type, from this module or any
+// other, is refused instead of being cast to a type which it is not
+static const napi_type_tag KeyTag = {0x5d9f0a3c1e2b4f67, 0x8a31c7e25b04d9f1};
+static const napi_type_tag StreamTag = {0x2c7e41b9d03a5f86, 0xb16f08d4e2a97c35};
+static const napi_type_tag SchedulerTag = {0x93a0e6f25c1d4b78,
+                                           0x4e2d9b17a6f0c853};
+static const napi_type_tag SeenTag = {0x71f4c2a8e93b0d56, 0xd8a35e0c41b76f29};
+static const napi_type_tag PolicyTag = {0xe6b81d47309c2fa5, 0x0f9c63a2d85e1b74};
+static const napi_type_tag RegistryTag = {0x3b58d0e7a4c21f96,
+                                          0xc47a92f10e6d85b3};
+
+// Read the pointer held by an external which was tagged with tag
+napi_status GetTaggedExternal(napi_env env, napi_value value,
+                              const napi_type_tag *tag, void **data) {
+  bool tagged = false;
+  napi_status status = napi_check_object_type_tag(env, value, tag, &tagged);
+
+  if (status != napi_ok) {
+    return status;
+  }
+  if (!tagged) {
+    return napi_invalid_arg;
+  }
+  return napi_get_value_external(env, value, data);
+}
+
+// Read the pointer wrapped onto an object which was tagged with tag
+napi_status GetTaggedWrap(napi_env env, napi_value value,
+                          const napi_type_tag *tag, void **data) {
+  bool tagged = false;
+  napi_status status = napi_check_object_type_tag(env, value, tag, &tagged);
+
+  if (status != napi_ok) {
+    return status;
+  }
+  if (!tagged) {
+    return napi_invalid_arg;
+  }
+  return napi_unwrap(env, value, data);
+}
+
+// Take a reference to the shared state, creating the cache for the first one
+bool SharedRef(void) {
+  bool ok = true;
+
+  pthread_mutex_lock(&shared_lock);
+  if (cache == NULL) {
+    ok = VF_SUCCESS == VF_cache_new(cache_capacity, cache_ttl, &cache);
+  }
+  if (ok) {
+    shared_refs++;
+  }
+  pthread_mutex_unlock(&shared_lock);
+  return ok;
+}
+
+void SharedUnref(void) {
+  struct VF_cache *unused = NULL;
+
+  pthread_mutex_lock(&shared_lock);
+  if (--shared_refs == 0) {
+    unused = cache;
+    cache = NULL;
+  }
+  pthread_mutex_unlock(&shared_lock);
+  VF_cache_free(unused);
+}
+
+// The instance data of an environment is the cache that it holds a reference
+// to, which is only used to drop the reference when the environment goes away
+void FinalizeInstance(napi_env env, void *data, void *hint) {
+  (void)env;
+  (void)data;
+  (void)hint;
+  SharedUnref();
+}
+
+// Build a js Error object from a linked list of Error structs.  The message
+// of the Error is the root-most cause and the .errors property holds every
+// error in the list as a string.  This does not throw or free the list, so it
+// is safe to use when rejecting a promise as well as when throwing
+napi_status CreateError(napi_env env, struct Error *err, napi_value *error) {
   napi_status status;
-  napi_value error;       // The js Error object
   napi_value errors;      // The js list of error strings
   napi_value errorString; // Used to build the list of strings
 
   char *msg = NULL; // used to build strings
 
   if (err == NULL) {
-    status =
-        napi_throw_error(env, NULL, "Unknown exception verifying document");
     VF_ERROR("received a NULL Error struct pointer\n");
-    return status;
+    status = napi_create_string_utf8(
+        env, "Unknown exception verifying document", NAPI_AUTO_LENGTH,
+        &errorString);
+    if (status != napi_ok) {
+      return status;
+    }
+    return napi_create_error(env, NULL, errorString, error);
   }
 
   status = napi_create_array(env, &errors);
@@ -44,13 +170,10 @@ napi_status HandleError(napi_env env, struct Error *err) {
 
     status = napi_set_element(env, errors, i, errorString);
     if (status != napi_ok) {
-      VF_ERROR("could not set error %s as index %d on Errors.errors array");
-      free(msg);
+      VF_ERROR("could not set error as index %d on Errors.errors array\n", i);
       return status;
     }
 
-    free(msg);
-
     if (err == err->next) {
       VF_ERROR("found simple-cycle in error linked list\n");
       break;
@@ -58,23 +181,338 @@ napi_status HandleError(napi_env env, struct Error *err) {
     err = err->next;
   }
 
-  status = napi_create_error(env, NULL, errorString, &error);
+  status = napi_create_error(env, NULL, errorString, error);
   if (status != napi_ok) {
     VF_ERROR("could not create js Error object\n");
     return status;
   }
 
-  status = napi_set_named_property(env, error, "errors", errors);
+  status = napi_set_named_property(env, *error, "errors", errors);
   if (status != napi_ok) {
     VF_ERROR("could not set js Error.errors property\n");
     return status;
   }
 
-  VF_err_free(err);
+  return napi_ok;
+}
+
+napi_status HandleError(napi_env env, struct Error *err) {
+  napi_status status;
+  napi_value error; // The js Error object
+
+  status = CreateError(env, err, &error);
+  if (status != napi_ok) {
+    return status;
+  }
 
   return napi_throw(env, error);
 }
 
+void FinalizeErrbuf(napi_env env, void *data, void *hint) {
+  (void)env;
+  (void)hint;
+  free(data);
+}
+
+// The getter for Error.errors on errors created by CreateErrbufError.  The
+// strings are only formatted the first time that .errors is read, after which
+// the getter replaces itself with the array
+napi_value GetErrors(napi_env env, napi_callback_info info) {
+  napi_status status;
+  napi_value self;
+  napi_value errors;
+  napi_value errorString;
+  struct VF_errbuf *errbuf;
+  char msg[512];
+
+  status = napi_get_cb_info(env, info, NULL, NULL, &self, NULL);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = napi_remove_wrap(env, self, (void **)&errbuf);
+  if (status != napi_ok) {
+    VF_ERROR("could not get errbuf for Error.errors\n");
+    return NULL;
+  }
+
+  status = napi_create_array_with_length(env, errbuf->count, &errors);
+  for (uint32_t i = 0; status == napi_ok && i < errbuf->count; i++) {
+    VF_errbuf_fmt(errbuf, i, msg, sizeof(msg));
+    status = napi_create_string_utf8(env, msg, NAPI_AUTO_LENGTH, &errorString);
+    if (status == napi_ok) {
+      status = napi_set_element(env, errors, i, errorString);
+    }
+  }
+  free(errbuf);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not create Error.errors");
+    return NULL;
+  }
+
+  napi_property_descriptor desc = {
+      "errors", NULL, NULL, NULL, NULL, errors,
+      napi_writable | napi_enumerable | napi_configurable, NULL};
+  status = napi_define_properties(env, self, 1, &desc);
+  if (status != napi_ok) {
+    VF_ERROR("could not replace Error.errors getter\n");
+  }
+
+  return errors;
+}
+
+// Build a js Error object from an errbuf.  The message is the root-most
+// cause, the .code property is the numeric VF_E_* class and the .errors
+// property lists every error as a string, highest level first, exactly like
+// CreateError.  Only the message is formatted here
+napi_status CreateErrbufError(napi_env env, const struct VF_errbuf *errbuf,
+                              napi_value *error) {
+  napi_status status;
+  napi_value message;
+  napi_value code;
+  char msg[512];
+
+  if (errbuf->count == 0) {
+    snprintf(msg, sizeof(msg), "Unknown exception verifying document");
+  } else {
+    VF_errbuf_fmt(errbuf, errbuf->count - 1, msg, sizeof(msg));
+  }
+
+  status = napi_create_string_utf8(env, msg, NAPI_AUTO_LENGTH, &message);
+  if (status != napi_ok) {
+    return status;
+  }
+
+  status = napi_create_error(env, NULL, message, error);
+  if (status != napi_ok) {
+    VF_ERROR("could not create js Error object\n");
+    return status;
+  }
+
+  status = napi_create_int32(env, errbuf->code, &code);
+  if (status != napi_ok) {
+    return status;
+  }
+
+  status = napi_set_named_property(env, *error, "code", code);
+  if (status != napi_ok) {
+    VF_ERROR("could not set js Error.code property\n");
+    return status;
+  }
+
+  // The errbuf is copied since the caller's is usually on the stack
+  struct VF_errbuf *copy = malloc(sizeof(struct VF_errbuf));
+  if (copy == NULL) {
+    return napi_generic_failure;
+  }
+  *copy = *errbuf;
+
+  status = napi_wrap(env, *error, copy, FinalizeErrbuf, NULL, NULL);
+  if (status != napi_ok) {
+    free(copy);
+    return status;
+  }
+
+  napi_property_descriptor desc = {"errors",
+                                   NULL,
+                                   NULL,
+                                   GetErrors,
+                                   NULL,
+                                   NULL,
+                                   napi_enumerable | napi_configurable,
+                                   NULL};
+  status = napi_define_properties(env, *error, 1, &desc);
+  if (status != napi_ok) {
+    VF_ERROR("could not set js Error.errors property\n");
+    return status;
+  }
+
+  return napi_ok;
+}
+
+// Read the Buffer passed as a js argument, throwing a js Error naming the
+// argument if it is not a Buffer
+napi_status GetBufferArg(napi_env env, napi_value value, const char *name,
+                         uint8_t **data, size_t *length) {
+  napi_status status;
+  char msg[64];
+
+  status = napi_get_buffer_info(env, value, (void **)data, length);
+  if (status != napi_ok) {
+    snprintf(msg, sizeof(msg), "could not get buffer information for %s",
+             name);
+    napi_throw_error(env, NULL, msg);
+  }
+
+  return status;
+}
+
+// Read a js string argument into buf, throwing a js Error naming the argument
+// if it is not a string or does not fit in buf with its terminator.  An
+// undefined argument is read as the empty string
+napi_status GetStringArg(napi_env env, napi_value value, const char *name,
+                         char *buf, size_t buf_l, size_t *length) {
+  napi_status status;
+  napi_valuetype type;
+  char msg[64];
+
+  status = napi_typeof(env, value, &type);
+  if (status == napi_ok && type == napi_undefined) {
+    buf[0] = '\0';
+    *length = 0;
+    return napi_ok;
+  }
+
+  // Measure the string first, since napi_get_value_string_utf8 silently
+  // truncates it to fit the buffer
+  if (status == napi_ok) {
+    status = napi_get_value_string_utf8(env, value, NULL, 0, length);
+  }
+  if (status == napi_ok && *length >= buf_l) {
+    status = napi_generic_failure;
+  }
+  if (status == napi_ok) {
+    status = napi_get_value_string_utf8(env, value, buf, buf_l, length);
+  }
+  if (status != napi_ok) {
+    snprintf(msg, sizeof(msg), "%s must be a string of at most %zu bytes",
+             name, buf_l - 1);
+    napi_throw_error(env, NULL, msg);
+  }
+
+  return status;
+}
+
+// Read the pubkey argument, which is either a Buffer holding a PEM encoded
+// certificate, an external holding a key returned by loadKey or an object
+// wrapping a registry returned by loadRegistry.  Exactly one of *key,
+// *registry or *pubkey is set
+napi_status GetKeyArg(napi_env env, napi_value value, struct VF_key **key,
+                      struct VF_registry **registry, uint8_t **pubkey,
+                      size_t *pubkey_l) {
+  napi_status status;
+  napi_valuetype type;
+  bool is_buffer;
+
+  *key = NULL;
+  *registry = NULL;
+  *pubkey = NULL;
+  *pubkey_l = 0;
+
+  status = napi_typeof(env, value, &type);
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get type of pubkey");
+    return status;
+  }
+
+  if (type == napi_external) {
+    status = GetTaggedExternal(env, value, &KeyTag, (void **)key);
+    if (status != napi_ok || *key == NULL) {
+      napi_throw_error(env, NULL, "could not get key from pubkey");
+      return napi_generic_failure;
+    }
+    return napi_ok;
+  }
+
+  if (type == napi_object &&
+      napi_ok == napi_is_buffer(env, value, &is_buffer) && !is_buffer) {
+    status = GetTaggedWrap(env, value, &RegistryTag, (void **)registry);
+    if (status != napi_ok || *registry == NULL) {
+      napi_throw_error(env, NULL, "could not get registry from pubkey");
+      return napi_generic_failure;
+    }
+    return napi_ok;
+  }
+
+  return GetBufferArg(env, value, "pubkey", pubkey, pubkey_l);
+}
+
+// Read an optional policy argument, which is either undefined or an external
+// holding a policy returned by compilePolicy.  *policy is NULL when there is
+// no policy
+napi_status GetPolicyArg(napi_env env, napi_value value,
+                         struct VF_policy **policy) {
+  napi_status status;
+  napi_valuetype type;
+
+  *policy = NULL;
+
+  status = napi_typeof(env, value, &type);
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get type of policy");
+    return status;
+  }
+
+  if (type == napi_undefined || type == napi_null) {
+    return napi_ok;
+  }
+
+  status = GetTaggedExternal(env, value, &PolicyTag, (void **)policy);
+  if (status != napi_ok || *policy == NULL) {
+    napi_throw_error(env, NULL, "could not get policy");
+    return napi_generic_failure;
+  }
+
+  return napi_ok;
+}
+
+// Read the pubkey, document and signature arguments of a call into an item,
+// which is checked against policy, which may be NULL
+napi_status ReadItem(napi_env env, napi_value *argv,
+                     const struct VF_policy *policy, struct VF_item *item) {
+  size_t lengths[3] = {0, 0, 0};
+  napi_status status =
+      GetKeyArg(env, argv[0], &item->key, &item->registry, &item->pubkey,
+                &lengths[0]);
+  if (status == napi_ok) {
+    status = GetBufferArg(env, argv[1], "document", &item->document,
+                          &lengths[1]);
+  }
+  if (status == napi_ok) {
+    status = GetBufferArg(env, argv[2], "signature", &item->pkcs7, &lengths[2]);
+  }
+
+  item->pubkey_l = lengths[0];
+  item->document_l = lengths[1];
+  item->pkcs7_l = lengths[2];
+  item->policy = policy;
+  return status;
+}
+
+// Verify a single item with the module's cache, which sets its result, reason
+// and errbuf.  This does not call any napi functions, so it can run on a
+// worker thread
+void VerifyItem(struct VF_item *item) { VF_verify_many(item, 1, cache); }
+
+// Verify the pubkey, document and signature arguments of a synchronous call
+// and throw a js Error for an exception.  On napi_ok, the result of the item
+// is VF_SUCCESS or VF_FAIL, and its reason is set
+napi_status VerifyArgs(napi_env env, napi_value *argv,
+                       const struct VF_policy *policy, struct VF_item *item) {
+  napi_status status;
+
+  if (napi_ok != ReadItem(env, argv, policy, item)) {
+    return napi_generic_failure;
+  }
+
+  VerifyItem(item);
+
+  if (item->result == VF_EXCEPTION) {
+    napi_value error;
+    status = CreateErrbufError(env, &item->errbuf, &error);
+    if (status == napi_ok) {
+      status = napi_throw(env, error);
+    }
+    if (status != napi_ok) {
+      napi_throw_error(env, NULL, "could not handle error");
+    }
+    return napi_generic_failure;
+  }
+
+  return napi_ok;
+}
+
 napi_value Call_VF_verify(napi_env env, napi_callback_info info) {
   napi_value outcome = NULL;
   napi_status status;
@@ -87,78 +525,2308 @@ napi_value Call_VF_verify(napi_env env, napi_callback_info info) {
     return NULL;
   }
 
-  // Get the buffer lengths
-  size_t pubkey_l;
-  size_t document_l;
-  size_t signature_l;
+  struct VF_item item;
 
-  uint8_t *pubkey;
-  uint8_t *document;
-  uint8_t *signature;
+  if (napi_ok != VerifyArgs(env, argv, NULL, &item)) {
+    return NULL;
+  }
 
-  status = napi_get_buffer_info(env, argv[0], (void *)&pubkey, &pubkey_l);
+  status = napi_get_boolean(env, item.result == VF_SUCCESS, &outcome);
   if (status != napi_ok) {
-    napi_throw_error(env, NULL, "could not get buffer information for pubkey");
+    napi_throw_error(env, NULL, "could not get reference to boolean");
     return NULL;
   }
 
-  status = napi_get_buffer_info(env, argv[1], (void *)&document, &document_l);
+  return outcome;
+}
+
+// Verify a document and check it against a policy, returning the VF_P_
+// reason as a number instead of true or false
+napi_value Call_VF_verify_policy(napi_env env, napi_callback_info info) {
+  napi_value outcome = NULL;
+  napi_status status;
+  size_t argc = 4;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
   if (status != napi_ok) {
-    napi_throw_error(env, NULL,
-                     "could not get buffer information for document");
+    napi_throw_error(env, NULL, "could not get callback information");
     return NULL;
   }
 
-  status = napi_get_buffer_info(env, argv[2], (void *)&signature, &signature_l);
-  if (status != napi_ok) {
-    napi_throw_error(env, NULL,
-                     "could not get buffer information for signature");
+  struct VF_policy *policy;
+  struct VF_item item;
+
+  if (napi_ok != GetPolicyArg(env, argv[3], &policy)) {
+    return NULL;
+  }
+  if (policy == NULL) {
+    napi_throw_error(env, NULL, "policy must be provided");
     return NULL;
   }
 
-  struct Error *err = NULL;
-  VF_return_t result;
-  result = VF_verify(pubkey, pubkey_l, document, document_l, signature,
-                     signature_l, &err);
+  if (napi_ok != VerifyArgs(env, argv, policy, &item)) {
+    return NULL;
+  }
 
-  if (result == VF_EXCEPTION) {
-    status = HandleError(env, err);
-    VF_err_free(err);
-    if (status != napi_ok) {
-      napi_throw_error(env, NULL, "could not handle error");
-      return NULL;
-    }
-  } else {
-    VF_err_free(err);
-    status = napi_get_boolean(env, result == VF_SUCCESS, &outcome);
-    if (status != napi_ok) {
-      VF_err_free(err);
-      napi_throw_error(env, NULL, "could not get reference to boolean");
-      return NULL;
-    }
+  status = napi_create_int32(env, item.reason, &outcome);
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not create reason");
+    return NULL;
   }
 
   return outcome;
 }
 
-napi_value init(napi_env env, napi_value exports) {
+// Verify a document against a raw signature from the signature endpoint,
+// with a key or certificate but not a registry.  These are not cached, since
+// checking the signature costs little more than looking it up would
+napi_value Call_VF_verify_raw(napi_env env, napi_callback_info info) {
+  napi_value outcome = NULL;
   napi_status status;
-  napi_value fn;
+  size_t argc = 3;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
 
-  // Our verification code requires us to initialise the OpenSSL library
-  // which we're built against
-  if (VF_SUCCESS != VF_init()) {
-    napi_throw_error(env, NULL, "Unable to initialize OpenSSL library");
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  struct VF_item item;
+
+  if (napi_ok != ReadItem(env, argv, NULL, &item)) {
+    return NULL;
+  }
+  if (item.registry != NULL) {
+    napi_throw_error(env, NULL, "raw signatures can not be verified with a "
+                                "registry");
+    return NULL;
+  }
+
+  if (item.key != NULL) {
+    item.result = VF_verify_raw_key(item.key, item.document, item.document_l,
+                                    item.pkcs7, item.pkcs7_l, &item.errbuf);
+  } else {
+    item.result = VF_verify_raw(item.pubkey, item.pubkey_l, item.document,
+                                item.document_l, item.pkcs7, item.pkcs7_l,
+                                &item.errbuf);
+  }
+
+  if (item.result == VF_EXCEPTION) {
+    napi_value error;
+    status = CreateErrbufError(env, &item.errbuf, &error);
+    if (status == napi_ok) {
+      status = napi_throw(env, error);
+    }
+    if (status != napi_ok) {
+      napi_throw_error(env, NULL, "could not handle error");
+    }
     return NULL;
   }
 
-  status = napi_create_function(env, NULL, 0, Call_VF_verify, NULL, &fn);
+  status = napi_get_boolean(env, item.result == VF_SUCCESS, &outcome);
   if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get reference to boolean");
     return NULL;
   }
 
-  status = napi_set_named_property(env, exports, "verify", fn);
+  return outcome;
+}
+
+// The most claims, and the most bytes of claim names, which can be asked for
+// in a single call to verifyAndExtract
+#define MAX_CLAIMS 32
+#define MAX_CLAIM_NAMES 1024
+
+// Parse the JSON text of a claim which is not a plain string or literal,
+// using the JSON.parse of the calling context
+napi_status ParseClaim(napi_env env, const struct VF_claim *claim,
+                       napi_value *value) {
+  napi_status status;
+  napi_value global, json, parse, text;
+
+  status = napi_get_global(env, &global);
+  if (status != napi_ok) {
+    return status;
+  }
+  status = napi_get_named_property(env, global, "JSON", &json);
   if (status != napi_ok) {
+    return status;
+  }
+  status = napi_get_named_property(env, json, "parse", &parse);
+  if (status != napi_ok) {
+    return status;
+  }
+  status = napi_create_string_utf8(env, (const char *)claim->value,
+                                   claim->value_l, &text);
+  if (status != napi_ok) {
+    return status;
+  }
+  return napi_call_function(env, json, parse, 1, &text, value);
+}
+
+// Create the js value of a claim found by VF_claims_scan
+napi_status CreateClaim(napi_env env, const struct VF_claim *claim,
+                        napi_value *value) {
+  napi_status status;
+  uint8_t stack[256];
+  uint8_t *unescaped;
+  uint64_t unescaped_l;
+
+  switch (claim->type) {
+  case VF_CLAIM_STRING:
+    return napi_create_string_utf8(env, (const char *)claim->value,
+                                   claim->value_l, value);
+  case VF_CLAIM_ESCAPED:
+    unescaped = claim->value_l <= sizeof(stack) ? stack
+                                                : malloc(claim->value_l);
+    if (unescaped == NULL) {
+      return napi_generic_failure;
+    }
+    if (VF_SUCCESS == VF_claim_unescape(claim->value, claim->value_l,
+                                        unescaped, &unescaped_l)) {
+      status = napi_create_string_utf8(env, (const char *)unescaped,
+                                       unescaped_l, value);
+    } else {
+      status = napi_generic_failure;
+    }
+    if (unescaped != stack) {
+      free(unescaped);
+    }
+    return status;
+  case VF_CLAIM_TRUE:
+  case VF_CLAIM_FALSE:
+    return napi_get_boolean(env, claim->type == VF_CLAIM_TRUE, value);
+  case VF_CLAIM_NULL:
+    return napi_get_null(env, value);
+  default:
+    return ParseClaim(env, claim, value);
+  }
+}
+
+// Verify a document and, when it is valid, return an object holding only the
+// named claims from it instead of true.  The claims are found with a single
+// pass over the document and claims which are not in it are left out
+napi_value Call_VF_verify_extract(napi_env env, napi_callback_info info) {
+  napi_value outcome = NULL;
+  napi_status status;
+  size_t argc = 4;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  struct VF_claim claims[MAX_CLAIMS];
+  char names[MAX_CLAIM_NAMES];
+  size_t names_used = 0;
+  uint32_t nclaims;
+
+  status = napi_get_array_length(env, argv[3], &nclaims);
+  if (status != napi_ok || nclaims > MAX_CLAIMS) {
+    napi_throw_error(env, NULL, "claims must be an array of at most 32 names");
+    return NULL;
+  }
+
+  // The names are read before verifying so that a bad list of names is
+  // reported whatever the outcome is
+  for (uint32_t i = 0; i < nclaims; i++) {
+    napi_value name;
+    size_t name_l;
+    if (napi_ok != napi_get_element(env, argv[3], i, &name) ||
+        napi_ok != napi_get_value_string_utf8(env, name, names + names_used,
+                                              sizeof(names) - names_used,
+                                              &name_l) ||
+        names_used + name_l + 1 >= sizeof(names)) {
+      napi_throw_error(env, NULL, "claim names must be short strings");
+      return NULL;
+    }
+    claims[i].name = names + names_used;
+    claims[i].name_l = name_l;
+    names_used += name_l + 1;
+  }
+
+  struct VF_item item;
+
+  if (napi_ok != VerifyArgs(env, argv, NULL, &item)) {
+    return NULL;
+  }
+
+  if (item.result != VF_SUCCESS) {
+    status = napi_get_boolean(env, false, &outcome);
+    if (status != napi_ok) {
+      napi_throw_error(env, NULL, "could not get reference to boolean");
+      return NULL;
+    }
+    return outcome;
+  }
+
+  if (VF_SUCCESS !=
+      VF_claims_scan(item.document, item.document_l, claims, nclaims)) {
+    napi_throw_error(env, NULL, "document is not a JSON object");
+    return NULL;
+  }
+
+  status = napi_create_object(env, &outcome);
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not create claims object");
+    return NULL;
+  }
+
+  for (uint32_t i = 0; i < nclaims; i++) {
+    napi_value value;
+    if (claims[i].type == VF_CLAIM_MISSING) {
+      continue;
+    }
+    status = CreateClaim(env, &claims[i], &value);
+    if (status == napi_ok) {
+      status =
+          napi_set_named_property(env, outcome, claims[i].name, value);
+    }
+    if (status != napi_ok) {
+      bool pending;
+      if (napi_ok != napi_is_exception_pending(env, &pending) || !pending) {
+        napi_throw_error(env, NULL, "could not read claim from document");
+      }
+      return NULL;
+    }
+  }
+
+  return outcome;
+}
+
+// State for a verification which is run on the libuv thread pool.  The js
+// Buffers are referenced for the lifetime of the work so that the memory that
+// VF_verify reads from is not garbage collected while the work is in flight
+struct AsyncVerify {
+  napi_async_work work;
+  napi_deferred deferred;
+  napi_ref refs[4];
+  struct VF_item item;
+};
+
+void AsyncVerify_free(napi_env env, struct AsyncVerify *av) {
+  for (int i = 0; i < 4; i++) {
+    if (av->refs[i] != NULL) {
+      napi_delete_reference(env, av->refs[i]);
+    }
+  }
+  if (av->work != NULL) {
+    napi_delete_async_work(env, av->work);
+  }
+  free(av);
+}
+
+// Runs on a worker thread, so this must not call any napi functions
+void AsyncVerify_execute(napi_env env, void *data) {
+  struct AsyncVerify *av = data;
+  (void)env;
+
+  VerifyItem(&av->item);
+}
+
+// Settle a promise with the same value or error that Call_VF_verify, or
+// Call_VF_verify_policy when the item has a policy, would return or throw
+void SettleItem(napi_env env, napi_deferred deferred,
+                const struct VF_item *item) {
+  napi_value value;
+
+  if (item->result == VF_EXCEPTION) {
+    if (napi_ok != CreateErrbufError(env, &item->errbuf, &value)) {
+      napi_create_string_utf8(env, "could not handle error", NAPI_AUTO_LENGTH,
+                              &value);
+      napi_create_error(env, NULL, value, &value);
+    }
+    napi_reject_deferred(env, deferred, value);
+  } else if (item->policy != NULL) {
+    napi_create_int32(env, item->reason, &value);
+    napi_resolve_deferred(env, deferred, value);
+  } else {
+    napi_get_boolean(env, item->result == VF_SUCCESS, &value);
+    napi_resolve_deferred(env, deferred, value);
+  }
+}
+
+// Runs on the main thread once AsyncVerify_execute has finished and settles
+// the promise
+void AsyncVerify_complete(napi_env env, napi_status status, void *data) {
+  struct AsyncVerify *av = data;
+  napi_value value;
+
+  if (status != napi_ok) {
+    napi_create_string_utf8(env, "verification was cancelled",
+                            NAPI_AUTO_LENGTH, &value);
+    napi_create_error(env, NULL, value, &value);
+    napi_reject_deferred(env, av->deferred, value);
+  } else {
+    SettleItem(env, av->deferred, &av->item);
+  }
+
+  AsyncVerify_free(env, av);
+  SharedUnref();
+}
+
+napi_value Call_VF_verifyAsync(napi_env env, napi_callback_info info) {
+  napi_value promise = NULL;
+  napi_value resource_name;
+  napi_status status;
+  size_t argc = 4;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  struct AsyncVerify *av = calloc(1, sizeof(struct AsyncVerify));
+  if (av == NULL) {
+    napi_throw_error(env, NULL, "could not allocate verification state");
+    return NULL;
+  }
+
+  struct VF_policy *policy;
+  if (napi_ok != GetPolicyArg(env, argv[3], &policy) ||
+      napi_ok != ReadItem(env, argv, policy, &av->item)) {
+    AsyncVerify_free(env, av);
+    return NULL;
+  }
+
+  // The policy is referenced along with the buffers, and the key or registry,
+  // so that none of them are finalized while the work is in flight
+  for (int i = 0; i < (policy != NULL ? 4 : 3); i++) {
+    status = napi_create_reference(env, argv[i], 1, &av->refs[i]);
+    if (status != napi_ok) {
+      AsyncVerify_free(env, av);
+      napi_throw_error(env, NULL, "could not reference argument buffer");
+      return NULL;
+    }
+  }
+
+  status = napi_create_string_utf8(env, "iid-verify:verifyAsync",
+                                   NAPI_AUTO_LENGTH, &resource_name);
+  if (status == napi_ok) {
+    status = napi_create_async_work(env, NULL, resource_name,
+                                    AsyncVerify_execute, AsyncVerify_complete,
+                                    av, &av->work);
+  }
+  if (status != napi_ok) {
+    AsyncVerify_free(env, av);
+    napi_throw_error(env, NULL, "could not create async work");
+    return NULL;
+  }
+
+  status = napi_create_promise(env, &av->deferred, &promise);
+  if (status != napi_ok) {
+    AsyncVerify_free(env, av);
+    napi_throw_error(env, NULL, "could not create promise");
+    return NULL;
+  }
+
+  // The work holds a reference to the shared state, so that the cache is
+  // still there if this environment is torn down while it runs.  Taking one
+  // can't fail while the environment holds one
+  SharedRef();
+  status = napi_queue_async_work(env, av->work);
+  if (status != napi_ok) {
+    // The promise is abandoned here, but it can never be observed since we
+    // throw instead of returning it
+    SharedUnref();
+    AsyncVerify_free(env, av);
+    napi_throw_error(env, NULL, "could not queue async work");
+    return NULL;
+  }
+
+  return promise;
+}
+
+// Read a js array of [pubkey, document, signature] arrays into a newly
+// allocated array of VF_item structs, which the caller must free.  The items
+// point into the js Buffers, so the array must be kept alive while they are
+// used.  Every item is checked against policy, which may be NULL
+napi_status ReadItems(napi_env env, napi_value array,
+                      const struct VF_policy *policy, struct VF_item **items,
+                      uint32_t *count) {
+  napi_status status;
+  napi_value item;
+  napi_value argv[3];
+
+  *items = NULL;
+
+  status = napi_get_array_length(env, array, count);
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "items must be an array");
+    return status;
+  }
+
+  *items = calloc(*count > 0 ? *count : 1, sizeof(struct VF_item));
+  if (*items == NULL) {
+    napi_throw_error(env, NULL, "could not allocate items");
+    return napi_generic_failure;
+  }
+
+  for (uint32_t i = 0; i < *count; i++) {
+    struct VF_item *it = &(*items)[i];
+
+    status = napi_get_element(env, array, i, &item);
+    for (uint32_t j = 0; status == napi_ok && j < 3; j++) {
+      status = napi_get_element(env, item, j, &argv[j]);
+    }
+    if (status != napi_ok) {
+      napi_throw_error(env, NULL, "could not get item");
+      break;
+    }
+
+    status = ReadItem(env, argv, policy, it);
+    if (status != napi_ok) {
+      break;
+    }
+  }
+
+  if (status != napi_ok) {
+    free(*items);
+    *items = NULL;
+  }
+
+  return status;
+}
+
+// Build a js array holding true, false or an Error for each item, in the
+// same order as the items.  Items which were checked against a policy have
+// their reason instead of true or false
+napi_status CreateResults(napi_env env, struct VF_item *items, uint32_t count,
+                          napi_value *results) {
+  napi_status status;
+  napi_value value;
+
+  status = napi_create_array_with_length(env, count, results);
+  if (status != napi_ok) {
+    return status;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (items[i].result == VF_EXCEPTION) {
+      status = CreateErrbufError(env, &items[i].errbuf, &value);
+    } else if (items[i].policy != NULL) {
+      status = napi_create_int32(env, items[i].reason, &value);
+    } else {
+      status = napi_get_boolean(env, items[i].result == VF_SUCCESS, &value);
+    }
+    if (status != napi_ok) {
+      return status;
+    }
+
+    status = napi_set_element(env, *results, i, value);
+    if (status != napi_ok) {
+      return status;
+    }
+  }
+
+  return napi_ok;
+}
+
+napi_value Call_VF_verify_many(napi_env env, napi_callback_info info) {
+  napi_value results = NULL;
+  napi_status status;
+  size_t argc = 2;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  struct VF_policy *policy;
+  struct VF_item *items;
+  uint32_t count;
+
+  if (napi_ok != GetPolicyArg(env, argv[1], &policy) ||
+      napi_ok != ReadItems(env, argv[0], policy, &items, &count)) {
+    return NULL;
+  }
+
+  VF_verify_many(items, count, cache);
+
+  status = CreateResults(env, items, count, &results);
+  free(items);
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not create results");
+    return NULL;
+  }
+
+  return results;
+}
+
+// A batch which is split into chunks that are verified in parallel on the
+// libuv thread pool.  The pending count is only touched from the main thread
+// in the complete callbacks, so it needs no locking
+struct AsyncBatch {
+  napi_deferred deferred;
+  napi_ref ref;
+  napi_ref policy_ref;
+  struct VF_item *items;
+  uint32_t count;
+  uint32_t pending;
+};
+
+struct AsyncChunk {
+  napi_async_work work;
+  struct AsyncBatch *batch;
+  struct VF_item *items;
+  uint32_t count;
+};
+
+void AsyncChunk_execute(napi_env env, void *data) {
+  struct AsyncChunk *chunk = data;
+  (void)env;
+
+  VF_verify_many(chunk->items, chunk->count, cache);
+}
+
+void AsyncChunk_complete(napi_env env, napi_status status, void *data) {
+  struct AsyncChunk *chunk = data;
+  struct AsyncBatch *batch = chunk->batch;
+  napi_value value;
+
+  if (status != napi_ok) {
+    // Never verified, so the results are not meaningful.  Mark them as
+    // exceptions, which are reported with the generic unknown exception
+    for (uint32_t i = 0; i < chunk->count; i++) {
+      chunk->items[i].result = VF_EXCEPTION;
+    }
+  }
+
+  napi_delete_async_work(env, chunk->work);
+  free(chunk);
+  SharedUnref();
+
+  if (--batch->pending > 0) {
+    return;
+  }
+
+  if (napi_ok == CreateResults(env, batch->items, batch->count, &value)) {
+    napi_resolve_deferred(env, batch->deferred, value);
+  } else {
+    napi_create_string_utf8(env, "could not create results", NAPI_AUTO_LENGTH,
+                            &value);
+    napi_create_error(env, NULL, value, &value);
+    napi_reject_deferred(env, batch->deferred, value);
+  }
+
+  napi_delete_reference(env, batch->ref);
+  if (batch->policy_ref != NULL) {
+    napi_delete_reference(env, batch->policy_ref);
+  }
+  free(batch->items);
+  free(batch);
+}
+
+napi_value Call_VF_verify_many_async(napi_env env, napi_callback_info info) {
+  napi_value promise = NULL;
+  napi_value resource_name;
+  napi_status status;
+  size_t argc = 3;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  struct VF_policy *policy;
+  if (napi_ok != GetPolicyArg(env, argv[2], &policy)) {
+    return NULL;
+  }
+
+  uint32_t chunks;
+  status = napi_get_value_uint32(env, argv[1], &chunks);
+  if (status != napi_ok || chunks == 0) {
+    napi_throw_error(env, NULL, "concurrency must be a positive integer");
+    return NULL;
+  }
+
+  struct AsyncBatch *batch = calloc(1, sizeof(struct AsyncBatch));
+  if (batch == NULL) {
+    napi_throw_error(env, NULL, "could not allocate batch");
+    return NULL;
+  }
+
+  if (napi_ok !=
+      ReadItems(env, argv[0], policy, &batch->items, &batch->count)) {
+    free(batch);
+    return NULL;
+  }
+
+  if (napi_ok != napi_create_reference(env, argv[0], 1, &batch->ref) ||
+      (policy != NULL &&
+       napi_ok != napi_create_reference(env, argv[2], 1, &batch->policy_ref)) ||
+      napi_ok != napi_create_string_utf8(env, "iid-verify:verifyMany",
+                                         NAPI_AUTO_LENGTH, &resource_name) ||
+      napi_ok != napi_create_promise(env, &batch->deferred, &promise)) {
+    if (batch->ref != NULL) {
+      napi_delete_reference(env, batch->ref);
+    }
+    if (batch->policy_ref != NULL) {
+      napi_delete_reference(env, batch->policy_ref);
+    }
+    free(batch->items);
+    free(batch);
+    napi_throw_error(env, NULL, "could not create batch");
+    return NULL;
+  }
+
+  if (chunks > batch->count) {
+    chunks = batch->count > 0 ? batch->count : 1;
+  }
+
+  // Every chunk is created before any is queued so that a failure part way
+  // through can still be cleaned up without racing a running chunk
+  struct AsyncChunk **queued = calloc(chunks, sizeof(struct AsyncChunk *));
+  uint32_t offset = 0;
+  status = queued == NULL ? napi_generic_failure : napi_ok;
+  for (uint32_t i = 0; status == napi_ok && i < chunks; i++) {
+    struct AsyncChunk *chunk = calloc(1, sizeof(struct AsyncChunk));
+    if (chunk == NULL) {
+      status = napi_generic_failure;
+      break;
+    }
+    uint32_t size = batch->count / chunks + (i < batch->count % chunks);
+    chunk->batch = batch;
+    chunk->items = batch->items + offset;
+    chunk->count = size;
+    offset += size;
+    queued[i] = chunk;
+    status = napi_create_async_work(env, NULL, resource_name,
+                                    AsyncChunk_execute, AsyncChunk_complete,
+                                    chunk, &chunk->work);
+  }
+
+  if (status != napi_ok) {
+    for (uint32_t i = 0; queued != NULL && i < chunks; i++) {
+      if (queued[i] != NULL && queued[i]->work != NULL) {
+        napi_delete_async_work(env, queued[i]->work);
+      }
+      free(queued[i]);
+    }
+    free(queued);
+    napi_delete_reference(env, batch->ref);
+    if (batch->policy_ref != NULL) {
+      napi_delete_reference(env, batch->policy_ref);
+    }
+    free(batch->items);
+    free(batch);
+    napi_throw_error(env, NULL, "could not create async work");
+    return NULL;
+  }
+
+  batch->pending = chunks;
+  for (uint32_t i = 0; i < chunks; i++) {
+    // Each chunk holds a reference to the shared state, like AsyncVerify
+    SharedRef();
+    status = napi_queue_async_work(env, queued[i]->work);
+    if (status != napi_ok) {
+      // Run the completion directly so that the batch still settles
+      AsyncChunk_complete(env, status, queued[i]);
+    }
+  }
+  free(queued);
+
+  return promise;
+}
+
+// A scheduler from createScheduler, which queues verifications and starts
+// them on the libuv thread pool as earlier ones finish.  It is only used from
+// the thread of the environment which created it, so it needs no locking.
+// self is a weak reference to its external, which is made strong by every
+// verification queued or running on it so that it is not finalized under
+// them.  running counts the verifications on the thread pool, which only
+// outlive the scheduler when the environment is torn down.  lanes is the
+// number of priority lanes it was created with
+struct Scheduler {
+  struct VF_sched *sched;
+  napi_ref self;
+  uint32_t lanes;
+  uint32_t running;
+  bool finalized;
+};
+
+// A verification on a scheduler.  The AsyncVerify comes first so that the
+// whole struct is freed by AsyncVerify_free.  expired is set on the worker
+// thread when the deadline has passed by the time the work starts
+struct ScheduledVerify {
+  struct AsyncVerify av;
+  struct VF_sched_job job;
+  struct Scheduler *scheduler;
+  bool expired;
+};
+
+// Reject the promise of a verification which was never verified, with an
+// Error whose shed property says why
+void RejectScheduled(napi_env env, struct ScheduledVerify *sv) {
+  const char *message, *shed;
+  napi_value value, error;
+
+  switch (sv->job.state) {
+  case VF_SCHED_SHED:
+    message = "verification was shed since the queue is full";
+    shed = "full";
+    break;
+  case VF_SCHED_EXPIRED:
+    message = "verification deadline passed before it started";
+    shed = "expired";
+    break;
+  default:
+    message = "verification was cancelled";
+    shed = "cancelled";
+  }
+
+  napi_create_string_utf8(env, message, NAPI_AUTO_LENGTH, &value);
+  napi_create_error(env, NULL, value, &error);
+  napi_create_string_utf8(env, shed, NAPI_AUTO_LENGTH, &value);
+  napi_set_named_property(env, error, "shed", value);
+  napi_reject_deferred(env, sv->av.deferred, error);
+}
+
+// Drop the reference of a finished verification to its scheduler, freeing
+// the scheduler when it was finalized and this was the last of them
+void SchedulerRelease(napi_env env, struct Scheduler *scheduler) {
+  if (!scheduler->finalized) {
+    napi_reference_unref(env, scheduler->self, NULL);
+  } else if (scheduler->running == 0) {
+    VF_sched_free(scheduler->sched);
+    free(scheduler);
+  }
+}
+
+// Reject and free a list of jobs dropped by the scheduler
+void SchedulerDrop(napi_env env, struct Scheduler *scheduler,
+                   struct VF_sched_job *dropped) {
+  while (dropped != NULL) {
+    struct ScheduledVerify *sv = dropped->data;
+    dropped = dropped->next;
+    RejectScheduled(env, sv);
+    AsyncVerify_free(env, &sv->av);
+    SchedulerRelease(env, scheduler);
+  }
+}
+
+// Runs on a worker thread, so this must not call any napi functions.  The
+// deadline is checked again since the work may have waited for a thread
+// behind other work on the pool
+void Scheduled_execute(napi_env env, void *data) {
+  struct ScheduledVerify *sv = data;
+  (void)env;
+
+  if (sv->job.deadline_ns != 0 && sv->job.deadline_ns <= VF_sched_now_ns()) {
+    sv->expired = true;
+    return;
+  }
+  VerifyItem(&sv->av.item);
+}
+
+void Scheduled_complete(napi_env env, napi_status status, void *data);
+
+// Start queued verifications until the scheduler's concurrency is reached,
+// rejecting those whose deadline has passed
+void SchedulerDispatch(napi_env env, struct Scheduler *scheduler) {
+  struct VF_sched_job *job, *dropped;
+  napi_value resource_name;
+  napi_status status;
+
+  for (;;) {
+    job = VF_sched_pop(scheduler->sched, VF_sched_now_ns(), &dropped);
+    SchedulerDrop(env, scheduler, dropped);
+    if (job == NULL) {
+      return;
+    }
+
+    struct ScheduledVerify *sv = job->data;
+    status = napi_create_string_utf8(env, "iid-verify:scheduler",
+                                     NAPI_AUTO_LENGTH, &resource_name);
+    if (status == napi_ok) {
+      status = napi_create_async_work(env, NULL, resource_name,
+                                      Scheduled_execute, Scheduled_complete,
+                                      sv, &sv->av.work);
+    }
+    // The work holds a reference to the shared state, like AsyncVerify
+    SharedRef();
+    if (status == napi_ok) {
+      status = napi_queue_async_work(env, sv->av.work);
+    }
+    if (status != napi_ok) {
+      SharedUnref();
+      job->state = VF_SCHED_DONE;
+      VF_sched_done(scheduler->sched, job);
+      napi_value value;
+      napi_create_string_utf8(env, "could not queue async work",
+                              NAPI_AUTO_LENGTH, &value);
+      napi_create_error(env, NULL, value, &value);
+      napi_reject_deferred(env, sv->av.deferred, value);
+      AsyncVerify_free(env, &sv->av);
+      SchedulerRelease(env, scheduler);
+      continue;
+    }
+    scheduler->running++;
+  }
+}
+
+// Runs on the main thread once Scheduled_execute has finished, or when the
+// work was cancelled before it started, and settles the promise like
+// AsyncVerify_complete, then starts the next verifications
+void Scheduled_complete(napi_env env, napi_status status, void *data) {
+  struct ScheduledVerify *sv = data;
+  struct Scheduler *scheduler = sv->scheduler;
+
+  if (status != napi_ok || sv->job.cancelled) {
+    sv->job.state = VF_SCHED_CANCELLED;
+  } else if (sv->expired) {
+    sv->job.state = VF_SCHED_EXPIRED;
+  } else {
+    sv->job.state = VF_SCHED_DONE;
+  }
+  scheduler->running--;
+  VF_sched_done(scheduler->sched, &sv->job);
+
+  if (sv->job.state == VF_SCHED_DONE) {
+    SettleItem(env, sv->av.deferred, &sv->av.item);
+  } else {
+    RejectScheduled(env, sv);
+  }
+  AsyncVerify_free(env, &sv->av);
+  SharedUnref();
+
+  if (!scheduler->finalized) {
+    SchedulerDispatch(env, scheduler);
+  }
+  SchedulerRelease(env, scheduler);
+}
+
+// Only reached with verifications still queued when the environment is torn
+// down, since otherwise they keep the external alive, and their promises can
+// no longer be observed.  The queued ones are freed, and the running ones free
+// the scheduler once they complete
+void FinalizeScheduler(napi_env env, void *data, void *hint) {
+  struct Scheduler *scheduler = data;
+  struct VF_sched_job *dropped = VF_sched_clear(scheduler->sched);
+  (void)hint;
+
+  while (dropped != NULL) {
+    struct ScheduledVerify *sv = dropped->data;
+    dropped = dropped->next;
+    AsyncVerify_free(env, &sv->av);
+  }
+
+  napi_delete_reference(env, scheduler->self);
+  scheduler->finalized = true;
+  SchedulerRelease(env, scheduler);
+}
+
+// Create a scheduler with a number of priority lanes, room for capacity
+// queued verifications and at most concurrency running at once
+napi_value Call_VF_sched_new(napi_env env, napi_callback_info info) {
+  napi_value handle = NULL;
+  napi_status status;
+  size_t argc = 3;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  uint32_t lanes, capacity, concurrency;
+  if (napi_ok != napi_get_value_uint32(env, argv[0], &lanes) || lanes < 1 ||
+      lanes > VF_SCHED_LANES) {
+    napi_throw_error(env, NULL, "lanes must be an integer from 1 to 8");
+    return NULL;
+  }
+  if (napi_ok != napi_get_value_uint32(env, argv[1], &capacity) ||
+      capacity < 1) {
+    napi_throw_error(env, NULL, "capacity must be a positive integer");
+    return NULL;
+  }
+  if (napi_ok != napi_get_value_uint32(env, argv[2], &concurrency) ||
+      concurrency < 1) {
+    napi_throw_error(env, NULL, "concurrency must be a positive integer");
+    return NULL;
+  }
+
+  struct Scheduler *scheduler = calloc(1, sizeof(struct Scheduler));
+  if (scheduler == NULL ||
+      VF_SUCCESS !=
+          VF_sched_new(lanes, capacity, concurrency, &scheduler->sched)) {
+    free(scheduler);
+    napi_throw_error(env, NULL, "could not allocate scheduler");
+    return NULL;
+  }
+  scheduler->lanes = lanes;
+
+  status = napi_create_external(env, scheduler, FinalizeScheduler, NULL,
+                                &handle);
+  if (status != napi_ok) {
+    VF_sched_free(scheduler->sched);
+    free(scheduler);
+    napi_throw_error(env, NULL, "could not create scheduler handle");
+    return NULL;
+  }
+
+  // Once the external exists, the finalizer frees the scheduler
+  status = napi_type_tag_object(env, handle, &SchedulerTag);
+  if (status == napi_ok) {
+    status = napi_create_reference(env, handle, 0, &scheduler->self);
+  }
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not reference scheduler");
+    return NULL;
+  }
+
+  return handle;
+}
+
+napi_status GetSchedulerArg(napi_env env, napi_value value,
+                            struct Scheduler **scheduler) {
+  napi_status status =
+      GetTaggedExternal(env, value, &SchedulerTag, (void **)scheduler);
+  if (status != napi_ok || *scheduler == NULL) {
+    napi_throw_error(env, NULL, "could not get scheduler");
+    return napi_generic_failure;
+  }
+  return napi_ok;
+}
+
+// Queue a verification on a scheduler, in a lane, with a timeout in
+// milliseconds after which it is dropped if it has not started, or 0 for
+// none, and an id to cancel it with.  Returns a promise which settles like
+// the one from Call_VF_verifyAsync, or rejects when the verification is
+// shed, expires or is cancelled
+napi_value Call_VF_sched_verify(napi_env env, napi_callback_info info) {
+  napi_value promise = NULL;
+  napi_status status;
+  size_t argc = 8;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  struct Scheduler *scheduler;
+  struct VF_policy *policy;
+  double priority;
+  double timeout;
+  int64_t id;
+
+  if (napi_ok != GetSchedulerArg(env, argv[0], &scheduler) ||
+      napi_ok != GetPolicyArg(env, argv[4], &policy)) {
+    return NULL;
+  }
+  if (napi_ok != napi_get_value_double(env, argv[5], &priority) ||
+      !(priority >= 0 && priority < scheduler->lanes) ||
+      priority != (uint32_t)priority) {
+    napi_throw_error(env, NULL, "priority must be a lane of the scheduler");
+    return NULL;
+  }
+  if (napi_ok != napi_get_value_double(env, argv[6], &timeout) ||
+      !(timeout >= 0)) {
+    napi_throw_error(env, NULL, "timeout must be a number of milliseconds");
+    return NULL;
+  }
+  if (napi_ok != napi_get_value_int64(env, argv[7], &id)) {
+    napi_throw_error(env, NULL, "id must be an integer");
+    return NULL;
+  }
+
+  struct ScheduledVerify *sv = calloc(1, sizeof(struct ScheduledVerify));
+  if (sv == NULL) {
+    napi_throw_error(env, NULL, "could not allocate verification state");
+    return NULL;
+  }
+
+  if (napi_ok != ReadItem(env, argv + 1, policy, &sv->av.item)) {
+    AsyncVerify_free(env, &sv->av);
+    return NULL;
+  }
+
+  // The arguments are referenced like those of verifyAsync, while it waits
+  // in the queue as well as while it runs
+  for (int i = 0; i < (policy != NULL ? 4 : 3); i++) {
+    status = napi_create_reference(env, argv[i + 1], 1, &sv->av.refs[i]);
+    if (status != napi_ok) {
+      AsyncVerify_free(env, &sv->av);
+      napi_throw_error(env, NULL, "could not reference argument buffer");
+      return NULL;
+    }
+  }
+
+  status = napi_create_promise(env, &sv->av.deferred, &promise);
+  if (status != napi_ok) {
+    AsyncVerify_free(env, &sv->av);
+    napi_throw_error(env, NULL, "could not create promise");
+    return NULL;
+  }
+
+  // A timeout of 0 or Infinity never expires, and a deadline too far off to
+  // be represented is saturated rather than converted or added past the end
+  uint64_t now = VF_sched_now_ns();
+  double timeout_ns = timeout * 1e6;
+  sv->scheduler = scheduler;
+  sv->job.id = id;
+  sv->job.lane = (uint32_t)priority;
+  if (timeout == 0 || isinf(timeout)) {
+    sv->job.deadline_ns = 0;
+  } else if (timeout_ns >= 18446744073709551616.0 ||
+             (uint64_t)timeout_ns > UINT64_MAX - now) {
+    sv->job.deadline_ns = UINT64_MAX;
+  } else {
+    sv->job.deadline_ns = now + (uint64_t)timeout_ns;
+  }
+  sv->job.data = sv;
+
+  // Every verification holds the scheduler from now until it is released,
+  // including one which is shed straight away
+  napi_reference_ref(env, scheduler->self, NULL);
+  SchedulerDrop(env, scheduler, VF_sched_push(scheduler->sched, &sv->job, now));
+  SchedulerDispatch(env, scheduler);
+
+  return promise;
+}
+
+// Cancel the verification with an id.  A queued verification is rejected
+// straight away and one which is running is rejected once it finishes,
+// unless it can still be taken back from the thread pool.  Returns whether
+// there was such a verification
+napi_value Call_VF_sched_cancel(napi_env env, napi_callback_info info) {
+  napi_value found = NULL;
+  napi_status status;
+  size_t argc = 2;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  struct Scheduler *scheduler;
+  int64_t id;
+
+  if (napi_ok != GetSchedulerArg(env, argv[0], &scheduler)) {
+    return NULL;
+  }
+  if (napi_ok != napi_get_value_int64(env, argv[1], &id)) {
+    napi_throw_error(env, NULL, "id must be an integer");
+    return NULL;
+  }
+
+  struct VF_sched_job *job = VF_sched_cancel(scheduler->sched, id);
+  if (job != NULL && job->state == VF_SCHED_RUNNING) {
+    struct ScheduledVerify *sv = job->data;
+    napi_cancel_async_work(env, sv->av.work);
+  } else if (job != NULL) {
+    SchedulerDrop(env, scheduler, job);
+  }
+
+  status = napi_get_boolean(env, job != NULL, &found);
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get reference to boolean");
+    return NULL;
+  }
+
+  return found;
+}
+
+// Cancel every queued verification.  Running verifications are left to
+// finish
+napi_value Call_VF_sched_clear(napi_env env, napi_callback_info info) {
+  napi_status status;
+  size_t argc = 1;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  struct Scheduler *scheduler;
+  if (napi_ok != GetSchedulerArg(env, argv[0], &scheduler)) {
+    return NULL;
+  }
+
+  SchedulerDrop(env, scheduler, VF_sched_clear(scheduler->sched));
+  return NULL;
+}
+
+// Find the shared key for a certificate and region, taking a reference to
+// it, or NULL when no environment has loaded it
+struct SharedKey *SharedKeyFind(const uint8_t *pubkey, size_t pubkey_l,
+                                const char *region) {
+  struct SharedKey *shared;
+
+  for (shared = shared_keys; shared != NULL; shared = shared->next) {
+    if (shared->pubkey_l == pubkey_l &&
+        0 == memcmp(shared->pubkey, pubkey, pubkey_l) &&
+        0 == strcmp(shared->region, region)) {
+      shared->refs++;
+      return shared;
+    }
+  }
+  return NULL;
+}
+
+// Return the shared key for a certificate and region with a reference taken,
+// loading it when no environment has yet.  The certificate is parsed without
+// the lock held, so when two environments load it at once, the key of the
+// one which loses is freed and it shares the winner's instead
+napi_status SharedKeyLoad(napi_env env, const uint8_t *pubkey,
+                          size_t pubkey_l, const char *region,
+                          size_t region_l, struct SharedKey **shared) {
+  napi_status status;
+  struct Error *err = NULL;
+  struct VF_key *key = NULL;
+  struct SharedKey *loaded;
+
+  pthread_mutex_lock(&shared_lock);
+  *shared = SharedKeyFind(pubkey, pubkey_l, region);
+  pthread_mutex_unlock(&shared_lock);
+  if (*shared != NULL) {
+    return napi_ok;
+  }
+
+  if (VF_SUCCESS != VF_key_load((uint8_t *)pubkey, pubkey_l, &key, &err)) {
+    status = HandleError(env, err);
+    VF_err_free(err);
+    if (status != napi_ok) {
+      napi_throw_error(env, NULL, "could not handle error");
+    }
+    return napi_generic_failure;
+  }
+
+  loaded = calloc(1, sizeof(struct SharedKey) + pubkey_l);
+  if (loaded == NULL ||
+      VF_SUCCESS != VF_key_set_region(key, region, region_l)) {
+    free(loaded);
+    VF_key_free(key);
+    napi_throw_error(env, NULL, "could not set region of key");
+    return napi_generic_failure;
+  }
+  loaded->key = key;
+  loaded->refs = 1;
+  memcpy(loaded->region, region, region_l + 1);
+  loaded->pubkey_l = pubkey_l;
+  memcpy(loaded->pubkey, pubkey, pubkey_l);
+
+  pthread_mutex_lock(&shared_lock);
+  *shared = SharedKeyFind(pubkey, pubkey_l, region);
+  if (*shared == NULL) {
+    loaded->next = shared_keys;
+    shared_keys = loaded;
+    *shared = loaded;
+    loaded = NULL;
+  }
+  pthread_mutex_unlock(&shared_lock);
+
+  if (loaded != NULL) {
+    VF_key_free(loaded->key);
+    free(loaded);
+  }
+  return napi_ok;
+}
+
+// Drop the reference of an external to its shared key, which is freed along
+// with the last one
+void FinalizeKey(napi_env env, void *data, void *hint) {
+  struct SharedKey *shared = hint;
+  struct SharedKey **link;
+  (void)env;
+  (void)data;
+
+  pthread_mutex_lock(&shared_lock);
+  if (--shared->refs > 0) {
+    shared = NULL;
+  } else {
+    for (link = &shared_keys; *link != shared; link = &(*link)->next) {
+    }
+    *link = shared->next;
+  }
+  pthread_mutex_unlock(&shared_lock);
+
+  if (shared != NULL) {
+    VF_key_free(shared->key);
+    free(shared);
+  }
+}
+
+napi_value Call_VF_key_load(napi_env env, napi_callback_info info) {
+  napi_value handle = NULL;
+  napi_status status;
+  size_t argc = 2;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  size_t pubkey_l;
+  uint8_t *pubkey;
+  char region[VF_REGION_SIZE];
+  size_t region_l = 0;
+
+  if (napi_ok != GetBufferArg(env, argv[0], "pubkey", &pubkey, &pubkey_l) ||
+      napi_ok != GetStringArg(env, argv[1], "region", region, sizeof(region),
+                              &region_l)) {
+    return NULL;
+  }
+
+  struct SharedKey *shared;
+
+  if (napi_ok !=
+      SharedKeyLoad(env, pubkey, pubkey_l, region, region_l, &shared)) {
+    return NULL;
+  }
+
+  // The reference is dropped when the js garbage collector collects the
+  // external, and the key is freed once every environment's are
+  status = napi_create_external(env, shared->key, FinalizeKey, shared,
+                                &handle);
+  if (status != napi_ok) {
+    FinalizeKey(env, shared->key, shared);
+    napi_throw_error(env, NULL, "could not create key handle");
+    return NULL;
+  }
+  if (napi_ok != napi_type_tag_object(env, handle, &KeyTag)) {
+    napi_throw_error(env, NULL, "could not tag key handle");
+    return NULL;
+  }
+
+  return handle;
+}
+
+void FinalizeStream(napi_env env, void *data, void *hint) {
+  (void)env;
+  (void)hint;
+  VF_stream_free(data);
+}
+
+// Throw the js Error for an exception in an errbuf
+void ThrowErrbuf(napi_env env, const struct VF_errbuf *errbuf) {
+  napi_value error;
+
+  if (napi_ok != CreateErrbufError(env, errbuf, &error) ||
+      napi_ok != napi_throw(env, error)) {
+    napi_throw_error(env, NULL, "could not handle error");
+  }
+}
+
+// Read the stream argument, which is an external returned by streamBegin
+napi_status GetStreamArg(napi_env env, napi_value value,
+                         struct VF_stream **stream) {
+  napi_status status =
+      GetTaggedExternal(env, value, &StreamTag, (void **)stream);
+
+  if (status != napi_ok || *stream == NULL) {
+    napi_throw_error(env, NULL, "could not get stream");
+    return napi_generic_failure;
+  }
+
+  return napi_ok;
+}
+
+// Begin verifying a document which is passed in pieces, given a key from
+// loadKey and the signature.  The stream lives until the returned external
+// is collected, and the caller must keep the key alive for as long
+napi_value Call_VF_stream_begin(napi_env env, napi_callback_info info) {
+  napi_value handle = NULL;
+  napi_status status;
+  size_t argc = 2;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  struct VF_key *key;
+  uint8_t *pkcs7;
+  size_t pkcs7_l;
+
+  if (napi_ok != GetTaggedExternal(env, argv[0], &KeyTag, (void **)&key) ||
+      key == NULL) {
+    napi_throw_error(env, NULL, "could not get key");
+    return NULL;
+  }
+  if (napi_ok != GetBufferArg(env, argv[1], "signature", &pkcs7, &pkcs7_l)) {
+    return NULL;
+  }
+
+  struct VF_errbuf errbuf;
+  struct VF_stream *stream;
+
+  if (VF_SUCCESS != VF_stream_begin(key, pkcs7, pkcs7_l, &stream, &errbuf)) {
+    ThrowErrbuf(env, &errbuf);
+    return NULL;
+  }
+
+  status = napi_create_external(env, stream, FinalizeStream, NULL, &handle);
+  if (status != napi_ok) {
+    VF_stream_free(stream);
+    napi_throw_error(env, NULL, "could not create stream handle");
+    return NULL;
+  }
+  if (napi_ok != napi_type_tag_object(env, handle, &StreamTag)) {
+    napi_throw_error(env, NULL, "could not tag stream handle");
+    return NULL;
+  }
+
+  return handle;
+}
+
+napi_value Call_VF_stream_update(napi_env env, napi_callback_info info) {
+  napi_status status;
+  size_t argc = 2;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  struct VF_stream *stream;
+  struct VF_errbuf errbuf;
+  uint8_t *chunk;
+  size_t chunk_l;
+
+  if (napi_ok != GetStreamArg(env, argv[0], &stream) ||
+      napi_ok != GetBufferArg(env, argv[1], "chunk", &chunk, &chunk_l)) {
+    return NULL;
+  }
+
+  if (VF_SUCCESS != VF_stream_update(stream, chunk, chunk_l, &errbuf)) {
+    ThrowErrbuf(env, &errbuf);
+  }
+
+  return NULL;
+}
+
+napi_value Call_VF_stream_final(napi_env env, napi_callback_info info) {
+  napi_value outcome = NULL;
+  napi_status status;
+  size_t argc = 1;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  struct VF_stream *stream;
+  struct VF_errbuf errbuf;
+  VF_return_t rv;
+
+  if (napi_ok != GetStreamArg(env, argv[0], &stream)) {
+    return NULL;
+  }
+
+  rv = VF_stream_final(stream, &errbuf);
+  if (rv == VF_EXCEPTION) {
+    ThrowErrbuf(env, &errbuf);
+    return NULL;
+  }
+
+  status = napi_get_boolean(env, rv == VF_SUCCESS, &outcome);
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get reference to boolean");
+    return NULL;
+  }
+
+  return outcome;
+}
+
+void FinalizePolicy(napi_env env, void *data, void *hint) {
+  (void)env;
+  (void)hint;
+  VF_policy_free(data);
+}
+
+void FinalizeSeen(napi_env env, void *data, void *hint) {
+  (void)env;
+  (void)hint;
+  VF_seen_free(data);
+}
+
+// Create a seen set with room for a number of documents and a maximum false
+// positive rate.  The set lives until the returned external is collected and
+// every policy using it has been freed
+napi_value Call_VF_seen_new(napi_env env, napi_callback_info info) {
+  napi_value handle = NULL;
+  napi_status status;
+  size_t argc = 2;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  int64_t capacity;
+  double fp_rate;
+  if (napi_ok != napi_get_value_int64(env, argv[0], &capacity) ||
+      capacity < 1) {
+    napi_throw_error(env, NULL, "capacity must be a positive integer");
+    return NULL;
+  }
+  if (napi_ok != napi_get_value_double(env, argv[1], &fp_rate) ||
+      !(fp_rate > 0 && fp_rate < 1)) {
+    napi_throw_error(env, NULL, "falsePositiveRate must be between 0 and 1");
+    return NULL;
+  }
+
+  struct VF_seen *seen;
+  if (VF_SUCCESS != VF_seen_new(capacity, fp_rate, &seen)) {
+    napi_throw_error(env, NULL, "could not allocate seen set");
+    return NULL;
+  }
+
+  status = napi_create_external(env, seen, FinalizeSeen, NULL, &handle);
+  if (status != napi_ok) {
+    VF_seen_free(seen);
+    napi_throw_error(env, NULL, "could not create seen set handle");
+    return NULL;
+  }
+  if (napi_ok != napi_type_tag_object(env, handle, &SeenTag)) {
+    napi_throw_error(env, NULL, "could not tag seen set handle");
+    return NULL;
+  }
+
+  return handle;
+}
+
+// Read a seen set argument, which is an external returned by createSeenSet,
+// or undefined for no set
+napi_status GetSeenArg(napi_env env, napi_value value, struct VF_seen **seen) {
+  napi_valuetype type;
+  napi_status status;
+
+  *seen = NULL;
+
+  status = napi_typeof(env, value, &type);
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get type of seen set");
+    return status;
+  }
+  if (type == napi_undefined) {
+    return napi_ok;
+  }
+
+  status = GetTaggedExternal(env, value, &SeenTag, (void **)seen);
+  if (status != napi_ok || *seen == NULL) {
+    napi_throw_error(env, NULL, "could not get seen set");
+    return napi_invalid_arg;
+  }
+  return napi_ok;
+}
+
+// Build a policy from an array of claim names, an array holding an array of
+// allowed strings for each of those claims, whether the region must match the
+// key, the maximum age of the pendingTime in milliseconds, which is 0 to not
+// check it, and a seen set to accept each document only once, which may be
+// undefined.  The policy lives until the returned external is collected
+napi_value Call_VF_policy_compile(napi_env env, napi_callback_info info) {
+  napi_value handle = NULL;
+  napi_status status;
+  size_t argc = 5;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  uint32_t nclaims;
+  bool match_region;
+  int64_t max_age;
+  struct VF_seen *seen;
+
+  if (napi_ok != napi_get_array_length(env, argv[0], &nclaims) ||
+      nclaims > VF_POLICY_MAX_SETS) {
+    napi_throw_error(env, NULL, "a policy can allow values for at most 16 "
+                                "claims");
+    return NULL;
+  }
+  if (napi_ok != napi_get_value_bool(env, argv[2], &match_region)) {
+    napi_throw_error(env, NULL, "regionMatchesKey must be a boolean");
+    return NULL;
+  }
+  if (napi_ok != napi_get_value_int64(env, argv[3], &max_age) ||
+      max_age < 0) {
+    napi_throw_error(env, NULL, "maxAge must be a non-negative integer");
+    return NULL;
+  }
+  if (napi_ok != GetSeenArg(env, argv[4], &seen)) {
+    return NULL;
+  }
+
+  struct VF_policy *policy = NULL;
+  if (VF_SUCCESS != VF_policy_new(&policy)) {
+    napi_throw_error(env, NULL, "could not allocate policy");
+    return NULL;
+  }
+  VF_policy_match_region(policy, match_region);
+  VF_policy_max_age(policy, max_age);
+  VF_policy_first_use(policy, seen);
+
+  for (uint32_t i = 0; i < nclaims; i++) {
+    napi_value name, values, value;
+    char claim[VF_POLICY_MAX_VALUE + 1];
+    char allowed[VF_POLICY_MAX_VALUE + 1];
+    size_t claim_l, allowed_l;
+    uint32_t nvalues;
+
+    if (napi_ok != napi_get_element(env, argv[0], i, &name) ||
+        napi_ok != GetStringArg(env, name, "claim", claim, sizeof(claim),
+                                &claim_l) ||
+        napi_ok != napi_get_element(env, argv[1], i, &values)) {
+      VF_policy_free(policy);
+      return NULL;
+    }
+    if (napi_ok != napi_get_array_length(env, values, &nvalues)) {
+      VF_policy_free(policy);
+      napi_throw_error(env, NULL, "allowed values must be an array");
+      return NULL;
+    }
+
+    for (uint32_t j = 0; j < nvalues; j++) {
+      if (napi_ok != napi_get_element(env, values, j, &value) ||
+          napi_ok != GetStringArg(env, value, "allowed value", allowed,
+                                  sizeof(allowed), &allowed_l)) {
+        VF_policy_free(policy);
+        return NULL;
+      }
+      if (VF_SUCCESS != VF_policy_allow(policy, claim, claim_l,
+                                        (uint8_t *)allowed, allowed_l)) {
+        VF_policy_free(policy);
+        napi_throw_error(env, NULL, "could not add allowed value to policy");
+        return NULL;
+      }
+    }
+  }
+
+  status = napi_create_external(env, policy, FinalizePolicy, NULL, &handle);
+  if (status != napi_ok) {
+    VF_policy_free(policy);
+    napi_throw_error(env, NULL, "could not create policy handle");
+    return NULL;
+  }
+  if (napi_ok != napi_type_tag_object(env, handle, &PolicyTag)) {
+    napi_throw_error(env, NULL, "could not tag policy handle");
+    return NULL;
+  }
+
+  return handle;
+}
+
+void FinalizeRegistry(napi_env env, void *data, void *hint) {
+  (void)env;
+  (void)hint;
+  VF_registry_free(data);
+}
+
+// Load a registry from either a Buffer holding a PEM bundle or a string
+// naming a directory.  The first argument is the object returned by an
+// earlier call, whose keys are replaced, or undefined to create a new
+// registry.  Returns the object wrapping the registry, which is freed when
+// the object is collected
+napi_value Call_VF_registry_load(napi_env env, napi_callback_info info) {
+  napi_value handle = NULL;
+  napi_status status;
+  napi_valuetype type;
+  size_t argc = 2;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  struct VF_registry *registry = NULL;
+  struct VF_errbuf errbuf;
+  VF_return_t rv;
+
+  status = napi_typeof(env, argv[0], &type);
+  if (status == napi_ok && type != napi_undefined) {
+    handle = argv[0];
+    status = GetTaggedWrap(env, handle, &RegistryTag, (void **)&registry);
+  }
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get registry");
+    return NULL;
+  }
+
+  if (registry == NULL) {
+    if (VF_SUCCESS != VF_registry_new(&registry) ||
+        napi_ok != napi_create_object(env, &handle)) {
+      VF_registry_free(registry);
+      napi_throw_error(env, NULL, "could not create registry");
+      return NULL;
+    }
+    status = napi_wrap(env, handle, registry, FinalizeRegistry, NULL, NULL);
+    if (status != napi_ok) {
+      VF_registry_free(registry);
+      napi_throw_error(env, NULL, "could not wrap registry");
+      return NULL;
+    }
+    // Once the object is wrapped, the finalizer frees the registry
+    if (napi_ok != napi_type_tag_object(env, handle, &RegistryTag)) {
+      napi_throw_error(env, NULL, "could not tag registry");
+      return NULL;
+    }
+  }
+
+  status = napi_typeof(env, argv[1], &type);
+  if (status == napi_ok && type == napi_string) {
+    char path[4096];
+    size_t path_l;
+    if (napi_ok != GetStringArg(env, argv[1], "directory", path, sizeof(path),
+                                &path_l)) {
+      return NULL;
+    }
+    rv = VF_registry_load_dir(registry, path, &errbuf);
+  } else {
+    uint8_t *bundle;
+    size_t bundle_l;
+    if (napi_ok != GetBufferArg(env, argv[1], "bundle", &bundle, &bundle_l)) {
+      return NULL;
+    }
+    rv = VF_registry_load_bundle(registry, bundle, bundle_l, &errbuf);
+  }
+
+  if (rv != VF_SUCCESS) {
+    napi_value error;
+    if (napi_ok != CreateErrbufError(env, &errbuf, &error) ||
+        napi_ok != napi_throw(env, error)) {
+      napi_throw_error(env, NULL, "could not handle error");
+    }
+    return NULL;
+  }
+
+  return handle;
+}
+
+napi_value Call_VF_registry_count(napi_env env, napi_callback_info info) {
+  napi_value count = NULL;
+  napi_status status;
+  size_t argc = 1;
+  napi_value argv[argc];
+  struct VF_registry *registry;
+
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+  if (status == napi_ok) {
+    status = GetTaggedWrap(env, argv[0], &RegistryTag, (void **)&registry);
+  }
+  if (status == napi_ok) {
+    status = napi_create_uint32(env, VF_registry_count(registry), &count);
+  }
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not count keys in registry");
+    return NULL;
+  }
+
+  return count;
+}
+
+napi_value Call_VF_cache_configure(napi_env env, napi_callback_info info) {
+  napi_status status;
+  size_t argc = 2;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  int64_t capacity;
+  int64_t ttl;
+
+  // napi_get_value_int64 saturates, so a capacity too large for an int64_t is
+  // still larger than the maximum
+  if (napi_ok != napi_get_value_int64(env, argv[0], &capacity) ||
+      capacity < 0 || (uint64_t)capacity > VF_CACHE_MAX_CAPACITY) {
+    napi_throw_error(env, NULL,
+                     "capacity must be a non-negative integer no larger "
+                     "than 2^32");
+    return NULL;
+  }
+
+  if (napi_ok != napi_get_value_int64(env, argv[1], &ttl) || ttl < 0) {
+    napi_throw_error(env, NULL, "ttl must be a non-negative integer");
+    return NULL;
+  }
+
+  // The lock orders this with the cache being created again, so that the
+  // configuration which is kept is always the one the cache has
+  pthread_mutex_lock(&shared_lock);
+  bool ok = VF_SUCCESS == VF_cache_configure(cache, capacity, ttl);
+  if (ok) {
+    cache_capacity = capacity;
+    cache_ttl = ttl;
+  }
+  pthread_mutex_unlock(&shared_lock);
+
+  if (!ok) {
+    napi_throw_error(env, NULL, "could not configure cache");
+    return NULL;
+  }
+
+  return NULL;
+}
+
+// Set a named property on an object to a number
+napi_status SetNumber(napi_env env, napi_value object, const char *name,
+                      double number) {
+  napi_status status;
+  napi_value value;
+
+  status = napi_create_double(env, number, &value);
+  if (status != napi_ok) {
+    return status;
+  }
+
+  return napi_set_named_property(env, object, name, value);
+}
+
+napi_value Call_VF_limits_configure(napi_env env, napi_callback_info info) {
+  napi_status status;
+  size_t argc = 4;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  int64_t document_l, pkcs7_l, pubkey_l;
+  bool structure;
+
+  if (napi_ok != napi_get_value_int64(env, argv[0], &document_l) ||
+      napi_ok != napi_get_value_int64(env, argv[1], &pkcs7_l) ||
+      napi_ok != napi_get_value_int64(env, argv[2], &pubkey_l) ||
+      document_l < 0 || pkcs7_l < 0 || pubkey_l < 0) {
+    napi_throw_error(env, NULL, "lengths must be non-negative integers");
+    return NULL;
+  }
+
+  if (napi_ok != napi_get_value_bool(env, argv[3], &structure)) {
+    napi_throw_error(env, NULL, "structure must be a boolean");
+    return NULL;
+  }
+
+  struct VF_limits limits = {document_l, pkcs7_l, pubkey_l, structure};
+  VF_limits_set(&limits);
+  return NULL;
+}
+
+napi_value Call_VF_limits_get(napi_env env, napi_callback_info info) {
+  napi_value result = NULL, structure;
+  struct VF_limits limits;
+  (void)info;
+
+  VF_limits_get(&limits);
+  if (napi_ok != napi_create_object(env, &result) ||
+      napi_ok != SetNumber(env, result, "documentLength", limits.document_l) ||
+      napi_ok != SetNumber(env, result, "signatureLength", limits.pkcs7_l) ||
+      napi_ok != SetNumber(env, result, "pubkeyLength", limits.pubkey_l) ||
+      napi_ok != napi_get_boolean(env, limits.structure != 0, &structure) ||
+      napi_ok != napi_set_named_property(env, result, "structure",
+                                         structure)) {
+    napi_throw_error(env, NULL, "could not return limits");
+    return NULL;
+  }
+
+  return result;
+}
+
+napi_value Call_VF_cache_stats(napi_env env, napi_callback_info info) {
+  napi_value result = NULL;
+  napi_status status;
+  size_t argc = 1;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  bool reset = false;
+  if (argc > 0 && napi_ok != napi_get_value_bool(env, argv[0], &reset)) {
+    napi_throw_error(env, NULL, "reset must be a boolean");
+    return NULL;
+  }
+
+  struct VF_cache_stats stats;
+  VF_cache_stats(cache, &stats, reset);
+
+  if (napi_ok != napi_create_object(env, &result) ||
+      napi_ok != SetNumber(env, result, "hits", stats.hits) ||
+      napi_ok != SetNumber(env, result, "misses", stats.misses) ||
+      napi_ok != SetNumber(env, result, "insertions", stats.insertions) ||
+      napi_ok != SetNumber(env, result, "evictions", stats.evictions) ||
+      napi_ok != SetNumber(env, result, "expirations", stats.expirations) ||
+      napi_ok != SetNumber(env, result, "size", stats.size) ||
+      napi_ok != SetNumber(env, result, "capacity", stats.capacity) ||
+      napi_ok != SetNumber(env, result, "ttl", stats.ttl_ms)) {
+    napi_throw_error(env, NULL, "could not create cache stats");
+    return NULL;
+  }
+
+  return result;
+}
+
+// Count the keys from loadKey which any environment in the process holds,
+// and the references to them
+napi_value Call_key_store_stats(napi_env env, napi_callback_info info) {
+  napi_value result = NULL;
+  uint32_t keys = 0, references = 0;
+  (void)info;
+
+  pthread_mutex_lock(&shared_lock);
+  for (struct SharedKey *shared = shared_keys; shared != NULL;
+       shared = shared->next) {
+    keys++;
+    references += shared->refs;
+  }
+  pthread_mutex_unlock(&shared_lock);
+
+  if (napi_ok != napi_create_object(env, &result) ||
+      napi_ok != SetNumber(env, result, "keys", keys) ||
+      napi_ok != SetNumber(env, result, "references", references)) {
+    napi_throw_error(env, NULL, "could not create key store stats");
+    return NULL;
+  }
+
+  return result;
+}
+
+napi_value Call_VF_seen_stats(napi_env env, napi_callback_info info) {
+  napi_value result = NULL;
+  napi_status status;
+  size_t argc = 2;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  struct VF_seen *seen;
+  if (napi_ok != GetSeenArg(env, argv[0], &seen)) {
+    return NULL;
+  }
+  if (seen == NULL) {
+    napi_throw_error(env, NULL, "seen set must be provided");
+    return NULL;
+  }
+
+  bool reset = false;
+  if (argc > 1 && napi_ok != napi_get_value_bool(env, argv[1], &reset)) {
+    napi_throw_error(env, NULL, "reset must be a boolean");
+    return NULL;
+  }
+
+  struct VF_seen_stats stats;
+  VF_seen_stats(seen, &stats, reset);
+
+  if (napi_ok != napi_create_object(env, &result) ||
+      napi_ok != SetNumber(env, result, "capacity", stats.capacity) ||
+      napi_ok != SetNumber(env, result, "memory", stats.memory) ||
+      napi_ok != SetNumber(env, result, "bits", stats.bits) ||
+      napi_ok != SetNumber(env, result, "falsePositiveRate", stats.fp_rate) ||
+      napi_ok != SetNumber(env, result, "falsePositiveEstimate",
+                           stats.fp_estimate) ||
+      napi_ok != SetNumber(env, result, "size", stats.size) ||
+      napi_ok != SetNumber(env, result, "insertions", stats.insertions) ||
+      napi_ok != SetNumber(env, result, "replays", stats.replays) ||
+      napi_ok != SetNumber(env, result, "evictions", stats.evictions)) {
+    napi_throw_error(env, NULL, "could not create seen set stats");
+    return NULL;
+  }
+
+  return result;
+}
+
+napi_value Call_VF_sched_stats(napi_env env, napi_callback_info info) {
+  napi_value result = NULL, lanes;
+  napi_status status;
+  size_t argc = 2;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  struct Scheduler *scheduler;
+  if (napi_ok != GetSchedulerArg(env, argv[0], &scheduler)) {
+    return NULL;
+  }
+
+  bool reset = false;
+  if (argc > 1 && napi_ok != napi_get_value_bool(env, argv[1], &reset)) {
+    napi_throw_error(env, NULL, "reset must be a boolean");
+    return NULL;
+  }
+
+  struct VF_sched_stats stats;
+  VF_sched_stats(scheduler->sched, &stats, reset);
+
+  status = napi_create_array_with_length(env, stats.lanes, &lanes);
+  for (uint32_t i = 0; status == napi_ok && i < stats.lanes; i++) {
+    napi_value depth;
+    status = napi_create_uint32(env, stats.depth[i], &depth);
+    if (status == napi_ok) {
+      status = napi_set_element(env, lanes, i, depth);
+    }
+  }
+
+  if (status != napi_ok || napi_ok != napi_create_object(env, &result) ||
+      napi_ok != SetNumber(env, result, "concurrency", stats.concurrency) ||
+      napi_ok != SetNumber(env, result, "capacity", stats.capacity) ||
+      napi_ok != SetNumber(env, result, "running", stats.running) ||
+      napi_ok != SetNumber(env, result, "queued", stats.queued) ||
+      napi_ok != napi_set_named_property(env, result, "lanes", lanes) ||
+      napi_ok != SetNumber(env, result, "admitted", stats.admitted) ||
+      napi_ok != SetNumber(env, result, "completed", stats.completed) ||
+      napi_ok != SetNumber(env, result, "shed", stats.shed) ||
+      napi_ok != SetNumber(env, result, "expired", stats.expired) ||
+      napi_ok != SetNumber(env, result, "cancelled", stats.cancelled)) {
+    napi_throw_error(env, NULL, "could not create scheduler stats");
+    return NULL;
+  }
+
+  return result;
+}
+
+napi_value Call_VF_stats(napi_env env, napi_callback_info info) {
+  static const char *code_names[VF_STATS_CODES] = {
+      "NONE",   "PUBKEY",   "ENVELOPE", "SIGNATURE",
+      "VERIFY", "INTERNAL", "NOKEY",    "MALFORMED",
+  };
+  napi_value result = NULL, codes, libraries, latency;
+  napi_status status;
+  size_t argc = 1;
+  napi_value argv[argc];
+  status = napi_get_cb_info(env, info, &argc, argv, NULL, NULL);
+
+  if (status != napi_ok) {
+    napi_throw_error(env, NULL, "could not get callback information");
+    return NULL;
+  }
+
+  bool reset = false;
+  if (argc > 0 && napi_ok != napi_get_value_bool(env, argv[0], &reset)) {
+    napi_throw_error(env, NULL, "reset must be a boolean");
+    return NULL;
+  }
+
+  struct VF_stats stats;
+  VF_stats_snapshot(&stats, reset);
+  uint64_t count = stats.success + stats.fail + stats.exception;
+
+  status = napi_create_object(env, &codes);
+  for (uint32_t i = 1; status == napi_ok && i < VF_STATS_CODES; i++) {
+    status = SetNumber(env, codes, code_names[i], stats.codes[i]);
+  }
+
+  if (status == napi_ok) {
+    status = napi_create_object(env, &libraries);
+  }
+  for (uint32_t i = 0; status == napi_ok && i < VF_STATS_LIBS; i++) {
+    if (stats.libs[i] > 0) {
+      status = SetNumber(env, libraries, VF_stats_library(i), stats.libs[i]);
+    }
+  }
+
+  // Latencies are given in microseconds, which suit the times of
+  // verifications better than the nanoseconds they are counted in
+  if (status != napi_ok || napi_ok != napi_create_object(env, &latency) ||
+      napi_ok != SetNumber(env, latency, "count", count) ||
+      napi_ok != SetNumber(env, latency, "mean",
+                           count > 0 ? stats.latency_sum_ns / 1e3 / count
+                                     : 0) ||
+      napi_ok != SetNumber(env, latency, "p50",
+                           VF_stats_percentile(&stats, 0.5) / 1e3) ||
+      napi_ok != SetNumber(env, latency, "p90",
+                           VF_stats_percentile(&stats, 0.9) / 1e3) ||
+      napi_ok != SetNumber(env, latency, "p99",
+                           VF_stats_percentile(&stats, 0.99) / 1e3) ||
+      napi_ok != SetNumber(env, latency, "p999",
+                           VF_stats_percentile(&stats, 0.999) / 1e3) ||
+      napi_ok != SetNumber(env, latency, "max",
+                           VF_stats_percentile(&stats, 1) / 1e3) ||
+      napi_ok != napi_create_object(env, &result) ||
+      napi_ok != SetNumber(env, result, "success", stats.success) ||
+      napi_ok != SetNumber(env, result, "fail", stats.fail) ||
+      napi_ok != SetNumber(env, result, "exception", stats.exception) ||
+      napi_ok != napi_set_named_property(env, result, "codes", codes) ||
+      napi_ok != napi_set_named_property(env, result, "libraries", libraries) ||
+      napi_ok != napi_set_named_property(env, result, "latency", latency)) {
+    napi_throw_error(env, NULL, "could not create verification stats");
+    return NULL;
+  }
+
+  return result;
+}
+
+napi_value Call_VF_stats_prometheus(napi_env env, napi_callback_info info) {
+  napi_value result = NULL;
+  struct VF_stats stats;
+  char *text;
+  int text_l;
+
+  (void)info;
+  VF_stats_snapshot(&stats, 0);
+
+  text_l = VF_stats_prometheus(&stats, NULL, 0);
+  text = malloc(text_l + 1);
+  if (text == NULL) {
+    napi_throw_error(env, NULL, "could not allocate metrics");
+    return NULL;
+  }
+  VF_stats_prometheus(&stats, text, text_l + 1);
+
+  if (napi_ok != napi_create_string_utf8(env, text, text_l, &result)) {
+    napi_throw_error(env, NULL, "could not create metrics");
+    result = NULL;
+  }
+
+  free(text);
+  return result;
+}
+
+// Attach a native function to the exports object under the given name
+napi_status SetFunction(napi_env env, napi_value exports, const char *name,
+                        napi_callback cb) {
+  napi_status status;
+  napi_value fn;
+
+  status = napi_create_function(env, NULL, 0, cb, NULL, &fn);
+  if (status != napi_ok) {
+    return status;
+  }
+
+  return napi_set_named_property(env, exports, name, fn);
+}
+
+napi_value init(napi_env env, napi_value exports) {
+  napi_status status;
+
+  // Our verification code requires us to initialise the OpenSSL library
+  // which we're built against
+  if (VF_SUCCESS != VF_init()) {
+    napi_throw_error(env, NULL, "Unable to initialize OpenSSL library");
+    return NULL;
+  }
+
+  if (!SharedRef()) {
+    napi_throw_error(env, NULL, "Unable to create outcome cache");
+    return NULL;
+  }
+  status = napi_set_instance_data(env, cache, FinalizeInstance, NULL);
+  if (status != napi_ok) {
+    SharedUnref();
+    napi_throw_error(env, NULL, "Unable to set instance data");
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "verify", Call_VF_verify);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status =
+      SetFunction(env, exports, "verifyAndExtract", Call_VF_verify_extract);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "verifyPolicy", Call_VF_verify_policy);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "verifyRaw", Call_VF_verify_raw);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "compilePolicy", Call_VF_policy_compile);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "loadRegistry", Call_VF_registry_load);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "registrySize", Call_VF_registry_count);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "verifyAsync", Call_VF_verifyAsync);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "loadKey", Call_VF_key_load);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "streamBegin", Call_VF_stream_begin);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "streamUpdate", Call_VF_stream_update);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "streamFinal", Call_VF_stream_final);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "verifyMany", Call_VF_verify_many);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status =
+      SetFunction(env, exports, "verifyManyAsync", Call_VF_verify_many_async);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "configureCache", Call_VF_cache_configure);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "cacheStats", Call_VF_cache_stats);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status =
+      SetFunction(env, exports, "configureLimits", Call_VF_limits_configure);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "limits", Call_VF_limits_get);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "createSeenSet", Call_VF_seen_new);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "keyStoreStats", Call_key_store_stats);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "createScheduler", Call_VF_sched_new);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "schedulerVerify", Call_VF_sched_verify);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "schedulerCancel", Call_VF_sched_cancel);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "schedulerClear", Call_VF_sched_clear);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "schedulerStats", Call_VF_sched_stats);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "seenStats", Call_VF_seen_stats);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "stats", Call_VF_stats);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  status = SetFunction(env, exports, "prometheus", Call_VF_stats_prometheus);
+  if (status != napi_ok) {
+    return NULL;
+  }
+
+  // The values of Error.code for errors thrown by verification
+  napi_value codes;
+  if (napi_ok != napi_create_object(env, &codes) ||
+      napi_ok != SetNumber(env, codes, "NONE", VF_E_NONE) ||
+      napi_ok != SetNumber(env, codes, "PUBKEY", VF_E_PUBKEY) ||
+      napi_ok != SetNumber(env, codes, "ENVELOPE", VF_E_ENVELOPE) ||
+      napi_ok != SetNumber(env, codes, "SIGNATURE", VF_E_SIGNATURE) ||
+      napi_ok != SetNumber(env, codes, "VERIFY", VF_E_VERIFY) ||
+      napi_ok != SetNumber(env, codes, "INTERNAL", VF_E_INTERNAL) ||
+      napi_ok != SetNumber(env, codes, "NOKEY", VF_E_NOKEY) ||
+      napi_ok != SetNumber(env, codes, "MALFORMED", VF_E_MALFORMED) ||
+      napi_ok != napi_set_named_property(env, exports, "codes", codes)) {
+    return NULL;
+  }
+
+  // The reasons returned by verification with a policy
+  napi_value reasons;
+  if (napi_ok != napi_create_object(env, &reasons) ||
+      napi_ok != SetNumber(env, reasons, "ACCEPT", VF_P_ACCEPT) ||
+      napi_ok != SetNumber(env, reasons, "SIGNATURE", VF_P_SIGNATURE) ||
+      napi_ok != SetNumber(env, reasons, "DOCUMENT", VF_P_DOCUMENT) ||
+      napi_ok != SetNumber(env, reasons, "CLAIM", VF_P_CLAIM) ||
+      napi_ok != SetNumber(env, reasons, "ALLOWLIST", VF_P_ALLOWLIST) ||
+      napi_ok != SetNumber(env, reasons, "REGION", VF_P_REGION) ||
+      napi_ok != SetNumber(env, reasons, "AGE", VF_P_AGE) ||
+      napi_ok != SetNumber(env, reasons, "REPLAY", VF_P_REPLAY) ||
+      napi_ok != napi_set_named_property(env, exports, "reasons", reasons)) {
     return NULL;
   }
 
@@ -0,0 +1,371 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "./verify.h"
+
+// An allowed value, which is stored in the same allocation as its bytes
+struct VF_policy_value {
+  uint64_t hash;
+  size_t value_l;
+  uint8_t value[];
+};
+
+// The allowed values of one claim, in an open addressing hash table which is
+// kept at most half full so that probes stay short
+struct VF_policy_set {
+  char *claim;
+  size_t claim_l;
+  struct VF_policy_value **slots;
+  uint64_t mask;
+  uint64_t count;
+};
+
+struct VF_policy {
+  struct VF_policy_set sets[VF_POLICY_MAX_SETS];
+  uint32_t nsets;
+  int region;
+  uint64_t max_age_ms;
+  struct VF_seen *seen;
+};
+
+// FNV-1a, which is plenty for short identifiers chosen by whoever writes the
+// policy rather than by the documents being checked
+static uint64_t VF_policy_hash(const uint8_t *value, size_t value_l) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < value_l; i++) {
+    hash = (hash ^ value[i]) * 0x100000001b3;
+  }
+  return hash;
+}
+
+static struct VF_policy_value **
+VF_policy_find(const struct VF_policy_set *set, uint64_t hash,
+               const uint8_t *value, size_t value_l) {
+  uint64_t i = hash & set->mask;
+  while (set->slots[i] != NULL) {
+    struct VF_policy_value *v = set->slots[i];
+    if (v->hash == hash && v->value_l == value_l &&
+        0 == memcmp(v->value, value, value_l)) {
+      break;
+    }
+    i = (i + 1) & set->mask;
+  }
+  return &set->slots[i];
+}
+
+// Move every value into a table with room for twice as many
+static VF_return_t VF_policy_grow(struct VF_policy_set *set) {
+  struct VF_policy_set grown = *set;
+  grown.mask = set->mask * 2 + 1;
+  grown.slots = calloc(grown.mask + 1, sizeof(struct VF_policy_value *));
+  if (grown.slots == NULL) {
+    VF_ERROR("could not allocate policy values\n");
+    return VF_EXCEPTION;
+  }
+
+  for (uint64_t i = 0; i <= set->mask; i++) {
+    struct VF_policy_value *v = set->slots[i];
+    if (v != NULL) {
+      *VF_policy_find(&grown, v->hash, v->value, v->value_l) = v;
+    }
+  }
+
+  free(set->slots);
+  *set = grown;
+  return VF_SUCCESS;
+}
+
+VF_return_t VF_policy_new(struct VF_policy **policy) {
+  *policy = calloc(1, sizeof(struct VF_policy));
+  if (*policy == NULL) {
+    VF_ERROR("could not allocate policy\n");
+    return VF_EXCEPTION;
+  }
+  return VF_SUCCESS;
+}
+
+void VF_policy_free(struct VF_policy *policy) {
+  if (policy == NULL) {
+    return;
+  }
+  for (uint32_t i = 0; i < policy->nsets; i++) {
+    struct VF_policy_set *set = &policy->sets[i];
+    for (uint64_t j = 0; j <= set->mask; j++) {
+      free(set->slots[j]);
+    }
+    free(set->slots);
+    free(set->claim);
+  }
+  VF_seen_free(policy->seen);
+  free(policy);
+}
+
+VF_return_t VF_policy_allow(struct VF_policy *policy, const char *claim,
+                            size_t claim_l, const uint8_t *value,
+                            size_t value_l) {
+  struct VF_policy_set *set = NULL;
+
+  if (value_l > VF_POLICY_MAX_VALUE) {
+    VF_ERROR("allowed value is too long\n");
+    return VF_EXCEPTION;
+  }
+
+  for (uint32_t i = 0; i < policy->nsets; i++) {
+    if (policy->sets[i].claim_l == claim_l &&
+        0 == memcmp(policy->sets[i].claim, claim, claim_l)) {
+      set = &policy->sets[i];
+      break;
+    }
+  }
+
+  if (set == NULL) {
+    if (policy->nsets == VF_POLICY_MAX_SETS) {
+      VF_ERROR("too many claims in policy\n");
+      return VF_EXCEPTION;
+    }
+    set = &policy->sets[policy->nsets];
+    set->claim = malloc(claim_l + 1);
+    set->slots = calloc(8, sizeof(struct VF_policy_value *));
+    if (set->claim == NULL || set->slots == NULL) {
+      VF_ERROR("could not allocate policy claim\n");
+      free(set->claim);
+      free(set->slots);
+      memset(set, 0, sizeof(struct VF_policy_set));
+      return VF_EXCEPTION;
+    }
+    memcpy(set->claim, claim, claim_l);
+    set->claim[claim_l] = '\0';
+    set->claim_l = claim_l;
+    set->mask = 7;
+    policy->nsets++;
+  }
+
+  uint64_t hash = VF_policy_hash(value, value_l);
+  struct VF_policy_value **slot = VF_policy_find(set, hash, value, value_l);
+  if (*slot != NULL) {
+    return VF_SUCCESS;
+  }
+
+  if ((set->count + 1) * 2 > set->mask + 1) {
+    if (VF_SUCCESS != VF_policy_grow(set)) {
+      return VF_EXCEPTION;
+    }
+    slot = VF_policy_find(set, hash, value, value_l);
+  }
+
+  struct VF_policy_value *v = malloc(sizeof(struct VF_policy_value) + value_l);
+  if (v == NULL) {
+    VF_ERROR("could not allocate policy value\n");
+    return VF_EXCEPTION;
+  }
+  v->hash = hash;
+  v->value_l = value_l;
+  memcpy(v->value, value, value_l);
+  *slot = v;
+  set->count++;
+  return VF_SUCCESS;
+}
+
+void VF_policy_match_region(struct VF_policy *policy, int match) {
+  policy->region = match;
+}
+
+void VF_policy_max_age(struct VF_policy *policy, uint64_t max_age_ms) {
+  policy->max_age_ms = max_age_ms;
+}
+
+void VF_policy_first_use(struct VF_policy *policy, struct VF_seen *seen) {
+  VF_seen_free(policy->seen);
+  policy->seen = seen != NULL ? VF_seen_ref(seen) : NULL;
+}
+
+// Read a fixed number of decimal digits
+static int VF_policy_digits(const uint8_t *p, int n, int *out) {
+  *out = 0;
+  for (int i = 0; i < n; i++) {
+    if (p[i] < '0' || p[i] > '9') {
+      return 0;
+    }
+    *out = *out * 10 + (p[i] - '0');
+  }
+  return 1;
+}
+
+// Convert a UTC time like "2018-02-22T17:03:46Z", with optional fractions of
+// a second, which is how the metadata service writes pendingTime, into
+// milliseconds since the epoch.  The days are counted with Howard Hinnant's
+// days_from_civil, since timegm is not in C99
+static int VF_policy_parse_time(const uint8_t *p, uint64_t p_l,
+                                int64_t *ms) {
+  int year, month, day, hour, minute, second, frac = 0;
+  uint64_t i = 19;
+
+  if (p_l < 20 || !VF_policy_digits(p, 4, &year) || p[4] != '-' ||
+      !VF_policy_digits(p + 5, 2, &month) || p[7] != '-' ||
+      !VF_policy_digits(p + 8, 2, &day) || p[10] != 'T' ||
+      !VF_policy_digits(p + 11, 2, &hour) || p[13] != ':' ||
+      !VF_policy_digits(p + 14, 2, &minute) || p[16] != ':' ||
+      !VF_policy_digits(p + 17, 2, &second)) {
+    return 0;
+  }
+
+  if (p[i] == '.') {
+    int scale = 100;
+    for (i++; i < p_l && p[i] >= '0' && p[i] <= '9'; i++) {
+      frac += (p[i] - '0') * scale;
+      scale /= 10;
+    }
+  }
+  if (i + 1 != p_l || p[i] != 'Z' || month < 1 || month > 12 || day < 1 ||
+      day > 31 || hour > 23 || minute > 59 || second > 60) {
+    return 0;
+  }
+
+  int64_t y = year - (month <= 2);
+  int64_t era = y / 400;
+  int64_t yoe = y - era * 400;
+  int64_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  int64_t days = era * 146097 + doe - 719468;
+
+  *ms = ((days * 24 + hour) * 60 + minute) * 60000 + second * 1000 + frac;
+  return 1;
+}
+
+// Copy a string claim into buf with its escapes decoded.  Returns 0 when it
+// is too long to ever match, or is not a valid string
+static int VF_policy_string(const struct VF_claim *claim, uint8_t *buf,
+                            const uint8_t **value, uint64_t *value_l) {
+  if (claim->type == VF_CLAIM_STRING) {
+    *value = claim->value;
+    *value_l = claim->value_l;
+    return 1;
+  }
+  if (claim->value_l > VF_POLICY_MAX_VALUE ||
+      VF_SUCCESS !=
+          VF_claim_unescape(claim->value, claim->value_l, buf, value_l)) {
+    return 0;
+  }
+  *value = buf;
+  return 1;
+}
+
+int VF_policy_check_at(const struct VF_policy *policy,
+                       const struct VF_key *key, const uint8_t *document,
+                       uint64_t document_l, int64_t now_ms) {
+  // One claim for each allowlist, then the region, the pendingTime and the
+  // instanceId
+  struct VF_claim claims[VF_POLICY_MAX_SETS + 3];
+  uint32_t nclaims = policy->nsets;
+  uint8_t buf[VF_POLICY_MAX_VALUE];
+  const uint8_t *value;
+  uint64_t value_l;
+
+  for (uint32_t i = 0; i < policy->nsets; i++) {
+    claims[i].name = policy->sets[i].claim;
+    claims[i].name_l = policy->sets[i].claim_l;
+  }
+  claims[nclaims].name = "region";
+  claims[nclaims++].name_l = 6;
+  claims[nclaims].name = "pendingTime";
+  claims[nclaims++].name_l = 11;
+  claims[nclaims].name = "instanceId";
+  claims[nclaims++].name_l = 10;
+
+  if (VF_SUCCESS != VF_claims_scan(document, document_l, claims, nclaims)) {
+    return VF_P_DOCUMENT;
+  }
+
+  for (uint32_t i = 0; i < nclaims; i++) {
+    int checked = i < policy->nsets ||
+                  (i == policy->nsets && policy->region) ||
+                  (i == policy->nsets + 1 &&
+                   (policy->max_age_ms > 0 || policy->seen != NULL)) ||
+                  (i == policy->nsets + 2 && policy->seen != NULL);
+    if (checked && claims[i].type != VF_CLAIM_STRING &&
+        claims[i].type != VF_CLAIM_ESCAPED) {
+      return VF_P_CLAIM;
+    }
+  }
+
+  for (uint32_t i = 0; i < policy->nsets; i++) {
+    const struct VF_policy_set *set = &policy->sets[i];
+    if (!VF_policy_string(&claims[i], buf, &value, &value_l) ||
+        NULL == *VF_policy_find(set, VF_policy_hash(value, value_l), value,
+                                value_l)) {
+      return VF_P_ALLOWLIST;
+    }
+  }
+
+  if (policy->region) {
+    const struct VF_claim *region = &claims[policy->nsets];
+    const char *expected = key != NULL ? VF_key_region(key) : "";
+    if (expected[0] == '\0' ||
+        !VF_policy_string(region, buf, &value, &value_l) ||
+        value_l != strlen(expected) ||
+        0 != memcmp(value, expected, value_l)) {
+      return VF_P_REGION;
+    }
+  }
+
+  if (policy->max_age_ms > 0) {
+    const struct VF_claim *pending = &claims[policy->nsets + 1];
+    int64_t pending_ms;
+    if (!VF_policy_string(pending, buf, &value, &value_l) ||
+        !VF_policy_parse_time(value, value_l, &pending_ms)) {
+      return VF_P_CLAIM;
+    }
+    // Instances whose clock is ahead of ours are not rejected, only those
+    // which have been pending for too long
+    if (now_ms - pending_ms > (int64_t)policy->max_age_ms) {
+      return VF_P_AGE;
+    }
+  }
+
+  // The document is only added to the seen set once it has passed every other
+  // check, so that a rejected document does not use up its first use.  The
+  // claims are decoded so that escaping them differently is not a new
+  // document
+  if (policy->seen != NULL) {
+    uint8_t pending_buf[VF_POLICY_MAX_VALUE];
+    const uint8_t *pending;
+    uint64_t pending_l;
+    if (!VF_policy_string(&claims[policy->nsets + 1], pending_buf, &pending,
+                          &pending_l) ||
+        !VF_policy_string(&claims[policy->nsets + 2], buf, &value,
+                          &value_l)) {
+      return VF_P_CLAIM;
+    }
+    // When the digest can not be computed the set can not tell whether the
+    // document is new, so it is rejected like a replay
+    if (VF_SUCCESS !=
+        VF_seen_add(policy->seen, value, value_l, pending, pending_l)) {
+      return VF_P_REPLAY;
+    }
+  }
+
+  return VF_P_ACCEPT;
+}
+
+int VF_policy_check(const struct VF_policy *policy, const struct VF_key *key,
+                    const uint8_t *document, uint64_t document_l) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return VF_policy_check_at(policy, key, document, document_l,
+                            (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+int VF_policy_reason(VF_return_t result, const struct VF_policy *policy,
+                     const struct VF_key *key, const uint8_t *document,
+                     uint64_t document_l) {
+  if (result == VF_SUCCESS) {
+    return policy != NULL
+               ? VF_policy_check(policy, key, document, document_l)
+               : VF_P_ACCEPT;
+  }
+  return result == VF_FAIL ? VF_P_SIGNATURE : VF_P_EXCEPTION;
+}
@@ -0,0 +1,575 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <openssl/obj_mac.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "./verify.h"
+
+static const char *VF_endpoint_names[] = {NULL, "pkcs7", "rsa2048"};
+
+// A key in the registry, along with the endpoint it is for.  The region is
+// stored on the key itself so that policies can match it
+struct VF_registry_entry {
+  struct VF_key *key;
+  int endpoint;
+};
+
+// One loaded set of keys.  A set is never modified once it has been
+// published, so verifications only have to hold a reference to it, and a
+// reload publishes a whole new set.  The indexes are open addressing tables of
+// entry numbers plus one, so that zero is an empty slot, and are kept at most
+// half full
+struct VF_registry_keys {
+  uint64_t refs;
+  struct VF_registry_entry *entries;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t *signers;
+  uint32_t *regions;
+  uint64_t mask;
+};
+
+struct VF_registry {
+  pthread_mutex_t lock;
+  struct VF_registry_keys *keys;
+};
+
+static void VF_registry_keys_free(struct VF_registry_keys *keys) {
+  if (keys == NULL) {
+    return;
+  }
+  for (uint32_t i = 0; i < keys->count; i++) {
+    VF_key_free(keys->entries[i].key);
+  }
+  free(keys->entries);
+  free(keys->signers);
+  free(keys->regions);
+  free(keys);
+}
+
+static uint64_t VF_registry_region_hash(const char *region, size_t region_l,
+                                        int endpoint) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < region_l; i++) {
+    hash = (hash ^ (uint8_t)region[i]) * 0x100000001b3;
+  }
+  return (hash ^ (uint64_t)endpoint) * 0x100000001b3;
+}
+
+// The signer ids are SHA-256 digests, so their first bytes are already a
+// good hash
+static uint64_t VF_registry_signer_hash(const uint8_t *signer) {
+  uint64_t hash = 0;
+  memcpy(&hash, signer, sizeof(hash));
+  return hash;
+}
+
+static struct VF_registry_entry *
+VF_registry_find_region(const struct VF_registry_keys *keys,
+                        const char *region, size_t region_l, int endpoint) {
+  if (keys->count == 0) {
+    return NULL;
+  }
+  uint64_t i = VF_registry_region_hash(region, region_l, endpoint) & keys->mask;
+  for (; keys->regions[i] != 0; i = (i + 1) & keys->mask) {
+    struct VF_registry_entry *entry = &keys->entries[keys->regions[i] - 1];
+    const char *entry_region = VF_key_region(entry->key);
+    if (entry->endpoint == endpoint && strlen(entry_region) == region_l &&
+        0 == memcmp(entry_region, region, region_l)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static struct VF_registry_entry *
+VF_registry_find_signer(const struct VF_registry_keys *keys,
+                        const uint8_t *signer) {
+  if (keys->count == 0) {
+    return NULL;
+  }
+  uint64_t i = VF_registry_signer_hash(signer) & keys->mask;
+  for (; keys->signers[i] != 0; i = (i + 1) & keys->mask) {
+    struct VF_registry_entry *entry = &keys->entries[keys->signers[i] - 1];
+    if (0 == memcmp(VF_key_signer(entry->key), signer, VF_FINGERPRINT_SIZE)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+// Build the indexes once every key has been added.  When several keys share
+// a region and endpoint, or a signer, the first one loaded is found
+static VF_return_t VF_registry_index(struct VF_registry_keys *keys) {
+  uint64_t slots = 8;
+  while (slots < (uint64_t)keys->count * 2) {
+    slots <<= 1;
+  }
+
+  keys->mask = slots - 1;
+  keys->signers = calloc(slots, sizeof(uint32_t));
+  keys->regions = calloc(slots, sizeof(uint32_t));
+  if (keys->signers == NULL || keys->regions == NULL) {
+    VF_ERROR("could not allocate registry indexes\n");
+    return VF_EXCEPTION;
+  }
+
+  for (uint32_t n = 0; n < keys->count; n++) {
+    struct VF_registry_entry *entry = &keys->entries[n];
+    const char *region = VF_key_region(entry->key);
+    uint64_t i;
+
+    if (NULL == VF_registry_find_signer(keys, VF_key_signer(entry->key))) {
+      i = VF_registry_signer_hash(VF_key_signer(entry->key)) & keys->mask;
+      while (keys->signers[i] != 0) {
+        i = (i + 1) & keys->mask;
+      }
+      keys->signers[i] = n + 1;
+    }
+
+    if (region[0] != '\0' &&
+        NULL == VF_registry_find_region(keys, region, strlen(region),
+                                        entry->endpoint)) {
+      i = VF_registry_region_hash(region, strlen(region), entry->endpoint) &
+          keys->mask;
+      while (keys->regions[i] != 0) {
+        i = (i + 1) & keys->mask;
+      }
+      keys->regions[i] = n + 1;
+    }
+  }
+
+  return VF_SUCCESS;
+}
+
+static VF_return_t VF_registry_add(struct VF_registry_keys *keys,
+                                   const uint8_t *pem, uint64_t pem_l,
+                                   const char *region, size_t region_l,
+                                   int endpoint, struct VF_errbuf *errbuf) {
+  struct VF_key *key = NULL;
+
+  if (keys->count == keys->capacity) {
+    uint32_t capacity = keys->capacity > 0 ? keys->capacity * 2 : 16;
+    struct VF_registry_entry *entries =
+        realloc(keys->entries, capacity * sizeof(struct VF_registry_entry));
+    if (entries == NULL) {
+      VF_ERROR("could not allocate registry entries\n");
+      return VF_errbuf_exception(VF_E_INTERNAL, errbuf);
+    }
+    keys->entries = entries;
+    keys->capacity = capacity;
+  }
+
+  if (VF_SUCCESS != VF_key_load_errbuf((uint8_t *)pem, pem_l, &key, errbuf)) {
+    return VF_EXCEPTION;
+  }
+  if (VF_SUCCESS != VF_key_set_region(key, region, region_l)) {
+    VF_key_free(key);
+    return VF_errbuf_exception(VF_E_PUBKEY, errbuf);
+  }
+
+  keys->entries[keys->count].key = key;
+  keys->entries[keys->count].endpoint = endpoint;
+  keys->count++;
+  return VF_SUCCESS;
+}
+
+// Find the next occurrence of needle at or after *pos, which is set to the
+// start of it.  Returns 0 when there is none
+static int VF_registry_search(const uint8_t *haystack, uint64_t haystack_l,
+                              const char *needle, uint64_t *pos) {
+  size_t needle_l = strlen(needle);
+  for (uint64_t i = *pos; i + needle_l <= haystack_l; i++) {
+    if (haystack[i] == (uint8_t)needle[0] &&
+        0 == memcmp(haystack + i, needle, needle_l)) {
+      *pos = i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Parse a label comment of the form "# <region> <endpoint>".  Returns 0 for
+// any other comment, which is then ignored
+static int VF_registry_label(const uint8_t *line, uint64_t line_l,
+                             const char **region, size_t *region_l,
+                             int *endpoint) {
+  uint64_t i = 1;
+  uint64_t start;
+
+  while (i < line_l && (line[i] == ' ' || line[i] == '\t')) {
+    i++;
+  }
+  for (start = i; i < line_l && line[i] != ' ' && line[i] != '\t'; i++) {
+  }
+  *region = (const char *)line + start;
+  *region_l = i - start;
+
+  while (i < line_l && (line[i] == ' ' || line[i] == '\t')) {
+    i++;
+  }
+  for (start = i; i < line_l && line[i] != ' ' && line[i] != '\t' &&
+                  line[i] != '\r';
+       i++) {
+  }
+
+  for (int e = VF_ENDPOINT_PKCS7; e <= VF_ENDPOINT_RSA2048; e++) {
+    size_t name_l = strlen(VF_endpoint_names[e]);
+    if (*region_l > 0 && i - start == name_l &&
+        0 == memcmp(line + start, VF_endpoint_names[e], name_l)) {
+      *endpoint = e;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Add every certificate in a bundle.  Certificates without a label comment
+// get the default region and endpoint
+static VF_return_t VF_registry_add_bundle(struct VF_registry_keys *keys,
+                                          const uint8_t *bundle,
+                                          uint64_t bundle_l,
+                                          const char *default_region,
+                                          size_t default_region_l,
+                                          int default_endpoint,
+                                          struct VF_errbuf *errbuf) {
+  static const char begin[] = "-----BEGIN CERTIFICATE-----";
+  static const char end[] = "-----END CERTIFICATE-----";
+  const char *region = default_region;
+  size_t region_l = default_region_l;
+  int endpoint = default_endpoint;
+  uint64_t pos = 0;
+
+  while (pos < bundle_l) {
+    uint64_t line_end = pos;
+    while (line_end < bundle_l && bundle[line_end] != '\n') {
+      line_end++;
+    }
+
+    if (bundle[pos] == '#') {
+      if (!VF_registry_label(bundle + pos, line_end - pos, &region, &region_l,
+                             &endpoint)) {
+        region = default_region;
+        region_l = default_region_l;
+        endpoint = default_endpoint;
+      }
+    } else if (line_end - pos >= sizeof(begin) - 1 &&
+               0 == memcmp(bundle + pos, begin, sizeof(begin) - 1)) {
+      uint64_t cert_end = pos;
+      if (!VF_registry_search(bundle, bundle_l, end, &cert_end)) {
+        VF_ERROR("certificate in bundle is not terminated\n");
+        return VF_errbuf_exception(VF_E_PUBKEY, errbuf);
+      }
+      cert_end += sizeof(end) - 1;
+      if (VF_SUCCESS != VF_registry_add(keys, bundle + pos, cert_end - pos,
+                                        region, region_l, endpoint, errbuf)) {
+        return VF_EXCEPTION;
+      }
+      region = default_region;
+      region_l = default_region_l;
+      endpoint = default_endpoint;
+      line_end = cert_end;
+      while (line_end < bundle_l && bundle[line_end] != '\n') {
+        line_end++;
+      }
+    }
+
+    pos = line_end + 1;
+  }
+
+  return VF_SUCCESS;
+}
+
+static struct VF_registry_keys *
+VF_registry_acquire(struct VF_registry *registry) {
+  struct VF_registry_keys *keys;
+  pthread_mutex_lock(&registry->lock);
+  keys = registry->keys;
+  keys->refs++;
+  pthread_mutex_unlock(&registry->lock);
+  return keys;
+}
+
+static void VF_registry_release(struct VF_registry *registry,
+                                struct VF_registry_keys *keys) {
+  uint64_t refs;
+  pthread_mutex_lock(&registry->lock);
+  refs = --keys->refs;
+  pthread_mutex_unlock(&registry->lock);
+  if (refs == 0) {
+    VF_registry_keys_free(keys);
+  }
+}
+
+// Index a new set of keys and publish it, releasing the old set once the
+// verifications which are still using it have finished.  The new set is
+// freed if it can not be indexed
+static VF_return_t VF_registry_publish(struct VF_registry *registry,
+                                       struct VF_registry_keys *keys,
+                                       struct VF_errbuf *errbuf) {
+  struct VF_registry_keys *old;
+
+  if (VF_SUCCESS != VF_registry_index(keys)) {
+    VF_registry_keys_free(keys);
+    return VF_errbuf_exception(VF_E_INTERNAL, errbuf);
+  }
+
+  keys->refs = 1;
+  pthread_mutex_lock(&registry->lock);
+  old = registry->keys;
+  registry->keys = keys;
+  pthread_mutex_unlock(&registry->lock);
+
+  VF_registry_release(registry, old);
+  return VF_SUCCESS;
+}
+
+VF_return_t VF_registry_new(struct VF_registry **registry) {
+  struct VF_registry *r = calloc(1, sizeof(struct VF_registry));
+  *registry = NULL;
+  if (r == NULL) {
+    VF_ERROR("could not allocate registry\n");
+    return VF_EXCEPTION;
+  }
+
+  r->keys = calloc(1, sizeof(struct VF_registry_keys));
+  if (r->keys == NULL || 0 != pthread_mutex_init(&r->lock, NULL)) {
+    VF_ERROR("could not initialize registry\n");
+    free(r->keys);
+    free(r);
+    return VF_EXCEPTION;
+  }
+  r->keys->refs = 1;
+
+  *registry = r;
+  return VF_SUCCESS;
+}
+
+void VF_registry_free(struct VF_registry *registry) {
+  if (registry == NULL) {
+    return;
+  }
+  VF_registry_release(registry, registry->keys);
+  pthread_mutex_destroy(&registry->lock);
+  free(registry);
+}
+
+uint32_t VF_registry_count(struct VF_registry *registry) {
+  struct VF_registry_keys *keys = VF_registry_acquire(registry);
+  uint32_t count = keys->count;
+  VF_registry_release(registry, keys);
+  return count;
+}
+
+VF_return_t VF_registry_load_bundle(struct VF_registry *registry,
+                                    const uint8_t *bundle, uint64_t bundle_l,
+                                    struct VF_errbuf *errbuf) {
+  struct VF_registry_keys *keys = calloc(1, sizeof(struct VF_registry_keys));
+  if (keys == NULL) {
+    VF_ERROR("could not allocate registry keys\n");
+    return VF_errbuf_exception(VF_E_INTERNAL, errbuf);
+  }
+
+  if (VF_SUCCESS != VF_registry_add_bundle(keys, bundle, bundle_l, "", 0,
+                                           VF_ENDPOINT_RSA2048, errbuf)) {
+    VF_registry_keys_free(keys);
+    return VF_EXCEPTION;
+  }
+
+  return VF_registry_publish(registry, keys, errbuf);
+}
+
+// Read a whole file into a newly allocated buffer
+static VF_return_t VF_registry_read_file(const char *path, uint8_t **data,
+                                         uint64_t *data_l) {
+  FILE *file = fopen(path, "rb");
+  uint64_t capacity = 4096;
+
+  *data = NULL;
+  *data_l = 0;
+
+  if (file == NULL) {
+    VF_ERROR("could not open %s\n", path);
+    return VF_EXCEPTION;
+  }
+
+  for (;;) {
+    uint8_t *grown = realloc(*data, capacity);
+    if (grown == NULL) {
+      break;
+    }
+    *data = grown;
+    *data_l += fread(*data + *data_l, 1, capacity - *data_l, file);
+    if (*data_l < capacity) {
+      break;
+    }
+    capacity *= 2;
+  }
+
+  if (ferror(file) || *data == NULL || *data_l == capacity) {
+    VF_ERROR("could not read %s\n", path);
+    fclose(file);
+    free(*data);
+    *data = NULL;
+    return VF_EXCEPTION;
+  }
+
+  fclose(file);
+  return VF_SUCCESS;
+}
+
+// Order the files of a directory by the bytes of their names, rather than by
+// the locale as alphasort does, so that the same files always load the same
+static int VF_registry_name_cmp(const struct dirent **a,
+                                const struct dirent **b) {
+  return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+VF_return_t VF_registry_load_dir(struct VF_registry *registry,
+                                 const char *path,
+                                 struct VF_errbuf *errbuf) {
+  char file_path[4096];
+  struct dirent **names;
+  struct stat st;
+  VF_return_t rv = VF_SUCCESS;
+
+  // The order of readdir is not defined, and the first key loaded for a
+  // region and endpoint or a signer is the one found, so the files are read
+  // in order of their names
+  int count = scandir(path, &names, NULL, VF_registry_name_cmp);
+  if (count < 0) {
+    VF_ERROR("could not read directory %s\n", path);
+    return VF_errbuf_exception(VF_E_PUBKEY, errbuf);
+  }
+
+  struct VF_registry_keys *keys = calloc(1, sizeof(struct VF_registry_keys));
+  if (keys == NULL) {
+    VF_ERROR("could not allocate registry keys\n");
+    rv = VF_errbuf_exception(VF_E_INTERNAL, errbuf);
+  }
+
+  for (int n = 0; rv == VF_SUCCESS && n < count; n++) {
+    const char *name = names[n]->d_name;
+    size_t name_l = strlen(name);
+    const char *region = "";
+    size_t region_l = 0;
+    int endpoint = VF_ENDPOINT_RSA2048;
+    uint8_t *data;
+    uint64_t data_l;
+
+    if (name_l < 5 || name[0] == '.' ||
+        0 != strcmp(name + name_l - 4, ".pem") ||
+        (size_t)snprintf(file_path, sizeof(file_path), "%s/%s", path, name) >=
+            sizeof(file_path) ||
+        0 != stat(file_path, &st) || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+
+    // A file named <region>.<endpoint>.pem labels the certificates in it
+    const char *dot = memchr(name, '.', name_l - 4);
+    if (dot != NULL) {
+      for (int e = VF_ENDPOINT_PKCS7; e <= VF_ENDPOINT_RSA2048; e++) {
+        size_t endpoint_l = name + name_l - 4 - (dot + 1);
+        if (dot > name && endpoint_l == strlen(VF_endpoint_names[e]) &&
+            0 == memcmp(dot + 1, VF_endpoint_names[e], endpoint_l)) {
+          region = name;
+          region_l = dot - name;
+          endpoint = e;
+        }
+      }
+    }
+
+    if (VF_SUCCESS != VF_registry_read_file(file_path, &data, &data_l)) {
+      rv = VF_errbuf_exception(VF_E_PUBKEY, errbuf);
+      break;
+    }
+    rv = VF_registry_add_bundle(keys, data, data_l, region, region_l, endpoint,
+                                errbuf);
+    free(data);
+  }
+
+  for (int n = 0; n < count; n++) {
+    free(names[n]);
+  }
+  free(names);
+
+  if (rv != VF_SUCCESS) {
+    VF_registry_keys_free(keys);
+    return rv;
+  }
+
+  return VF_registry_publish(registry, keys, errbuf);
+}
+
+// Choose the key for an envelope.  AWS uses the same certificate for many
+// regions, so the region claim is used to pick which of the keys with the
+// envelope's signer is used, which is the one a policy matches the region
+// of.  Failing that, any key with the signer is used, and failing that, the
+// key for the region claim, which PKCS7_verify then reports the mismatch of
+static struct VF_key *VF_registry_select(void *ctx, const uint8_t *signer,
+                                         int digest_nid,
+                                         const uint8_t *document,
+                                         uint64_t document_l) {
+  const struct VF_registry_keys *keys = ctx;
+  struct VF_claim region = {"region", 6, VF_CLAIM_MISSING, NULL, 0};
+  struct VF_registry_entry *entry;
+  int endpoint = digest_nid == NID_sha1 ? VF_ENDPOINT_PKCS7
+                                        : VF_ENDPOINT_RSA2048;
+
+  if (VF_SUCCESS != VF_claims_scan(document, document_l, &region, 1) ||
+      region.type != VF_CLAIM_STRING) {
+    region.value_l = 0;
+  }
+
+  if (signer != NULL && region.value_l > 0) {
+    for (int e = VF_ENDPOINT_PKCS7; e <= VF_ENDPOINT_RSA2048; e++) {
+      entry = VF_registry_find_region(keys, (const char *)region.value,
+                                      region.value_l, e);
+      if (entry != NULL && 0 == memcmp(VF_key_signer(entry->key), signer,
+                                       VF_FINGERPRINT_SIZE)) {
+        return entry->key;
+      }
+    }
+  }
+
+  if (signer != NULL &&
+      NULL != (entry = VF_registry_find_signer(keys, signer))) {
+    return entry->key;
+  }
+
+  if (region.value_l > 0 &&
+      NULL != (entry = VF_registry_find_region(
+                   keys, (const char *)region.value, region.value_l,
+                   endpoint))) {
+    return entry->key;
+  }
+
+  return NULL;
+}
+
+VF_return_t VF_registry_verify(struct VF_registry *registry,
+                               const struct VF_policy *policy,
+                               uint8_t *document, uint64_t document_l,
+                               uint8_t *pkcs7, uint64_t pkcs7_l,
+                               struct VF_errbuf *errbuf, int *reason) {
+  struct VF_registry_keys *keys = VF_registry_acquire(registry);
+  struct VF_key *key;
+
+  VF_return_t rv =
+      VF_verify_select_errbuf(VF_registry_select, keys, document, document_l,
+                              pkcs7, pkcs7_l, errbuf, &key);
+
+  // The policy is checked while the key is still referenced, since its
+  // region is read from it
+  if (reason != NULL) {
+    *reason = VF_policy_reason(rv, policy, key, document, document_l);
+  }
+
+  VF_registry_release(registry, keys);
+  return rv;
+}
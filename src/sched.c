@@ -0,0 +1,269 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "./verify.h"
+
+struct VF_sched_list {
+  struct VF_sched_job *head;
+  struct VF_sched_job *tail;
+  uint32_t length;
+};
+
+// The waiting jobs are kept in a list for each lane and the running jobs in
+// one more, so that any of them can be found by VF_sched_cancel
+struct VF_sched {
+  uint32_t lanes;
+  uint32_t capacity;
+  uint32_t concurrency;
+  uint32_t queued;
+  struct VF_sched_list lane[VF_SCHED_LANES];
+  struct VF_sched_list running;
+
+  uint64_t admitted;
+  uint64_t completed;
+  uint64_t shed;
+  uint64_t expired;
+  uint64_t cancelled;
+};
+
+static void VF_sched_append(struct VF_sched_list *list,
+                            struct VF_sched_job *job) {
+  job->next = NULL;
+  job->prev = list->tail;
+  if (list->tail != NULL) {
+    list->tail->next = job;
+  } else {
+    list->head = job;
+  }
+  list->tail = job;
+  list->length++;
+}
+
+static void VF_sched_unlink(struct VF_sched_list *list,
+                            struct VF_sched_job *job) {
+  if (job->prev != NULL) {
+    job->prev->next = job->next;
+  } else {
+    list->head = job->next;
+  }
+  if (job->next != NULL) {
+    job->next->prev = job->prev;
+  } else {
+    list->tail = job->prev;
+  }
+  job->prev = NULL;
+  job->next = NULL;
+  list->length--;
+}
+
+// Take a queued job out of its lane and push it onto a list of dropped jobs,
+// which is only linked through next
+static void VF_sched_drop(struct VF_sched *sched, struct VF_sched_job *job,
+                          int state, struct VF_sched_job **dropped) {
+  VF_sched_unlink(&sched->lane[job->lane], job);
+  sched->queued--;
+  job->state = state;
+  job->next = *dropped;
+  *dropped = job;
+}
+
+static int VF_sched_expired(const struct VF_sched_job *job, uint64_t now_ns) {
+  return job->deadline_ns != 0 && job->deadline_ns <= now_ns;
+}
+
+VF_return_t VF_sched_new(uint32_t lanes, uint32_t capacity,
+                         uint32_t concurrency, struct VF_sched **sched) {
+  *sched = NULL;
+
+  if (lanes == 0 || lanes > VF_SCHED_LANES || capacity == 0 ||
+      concurrency == 0) {
+    VF_ERROR("scheduler needs 1 to %d lanes, a capacity and a concurrency\n",
+             VF_SCHED_LANES);
+    return VF_EXCEPTION;
+  }
+
+  *sched = calloc(1, sizeof(struct VF_sched));
+  if (*sched == NULL) {
+    VF_ERROR("error while allocating scheduler\n");
+    return VF_EXCEPTION;
+  }
+
+  (*sched)->lanes = lanes;
+  (*sched)->capacity = capacity;
+  (*sched)->concurrency = concurrency;
+  return VF_SUCCESS;
+}
+
+void VF_sched_free(struct VF_sched *sched) {
+  free(sched);
+}
+
+uint64_t VF_sched_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct VF_sched_job *VF_sched_push(struct VF_sched *sched,
+                                   struct VF_sched_job *job, uint64_t now_ns) {
+  struct VF_sched_job *dropped = NULL;
+
+  job->state = VF_SCHED_QUEUED;
+  job->cancelled = 0;
+
+  // A lane the scheduler does not have is a mistake of the caller, and the
+  // job is refused rather than queued somewhere it did not ask for
+  if (job->lane >= sched->lanes) {
+    VF_ERROR("job lane %u is not below %u\n", job->lane, sched->lanes);
+    sched->shed++;
+    job->state = VF_SCHED_SHED;
+    job->prev = NULL;
+    job->next = NULL;
+    return job;
+  }
+
+  // Expired jobs would only be dropped when they reach the front, so they
+  // are dropped now instead of shedding a job which could still be useful.
+  // Only the ends of each lane are looked at, so that a full queue costs no
+  // more than the jobs dropped, and an expired job in the middle of a lane
+  // waits until it reaches the front
+  for (uint32_t l = 0; sched->queued >= sched->capacity && l < sched->lanes;
+       l++) {
+    struct VF_sched_job *j;
+    while ((j = sched->lane[l].head) != NULL && VF_sched_expired(j, now_ns)) {
+      VF_sched_drop(sched, j, VF_SCHED_EXPIRED, &dropped);
+      sched->expired++;
+    }
+    while ((j = sched->lane[l].tail) != NULL && VF_sched_expired(j, now_ns)) {
+      VF_sched_drop(sched, j, VF_SCHED_EXPIRED, &dropped);
+      sched->expired++;
+    }
+  }
+
+  if (sched->queued >= sched->capacity) {
+    uint32_t l = sched->lanes - 1;
+    while (l > job->lane && sched->lane[l].tail == NULL) {
+      l--;
+    }
+    if (l == job->lane) {
+      sched->shed++;
+      job->state = VF_SCHED_SHED;
+      job->prev = NULL;
+      job->next = dropped;
+      return job;
+    }
+    VF_sched_drop(sched, sched->lane[l].tail, VF_SCHED_SHED, &dropped);
+    sched->shed++;
+  }
+
+  VF_sched_append(&sched->lane[job->lane], job);
+  sched->queued++;
+  sched->admitted++;
+  return dropped;
+}
+
+struct VF_sched_job *VF_sched_pop(struct VF_sched *sched, uint64_t now_ns,
+                                  struct VF_sched_job **dropped) {
+  *dropped = NULL;
+
+  if (sched->running.length >= sched->concurrency) {
+    return NULL;
+  }
+
+  for (uint32_t l = 0; l < sched->lanes; l++) {
+    struct VF_sched_job *job;
+    while ((job = sched->lane[l].head) != NULL) {
+      if (VF_sched_expired(job, now_ns)) {
+        VF_sched_drop(sched, job, VF_SCHED_EXPIRED, dropped);
+        sched->expired++;
+        continue;
+      }
+      VF_sched_unlink(&sched->lane[l], job);
+      sched->queued--;
+      job->state = VF_SCHED_RUNNING;
+      VF_sched_append(&sched->running, job);
+      return job;
+    }
+  }
+
+  return NULL;
+}
+
+void VF_sched_done(struct VF_sched *sched, struct VF_sched_job *job) {
+  VF_sched_unlink(&sched->running, job);
+  switch (job->state) {
+  case VF_SCHED_EXPIRED:
+    sched->expired++;
+    break;
+  case VF_SCHED_CANCELLED:
+    sched->cancelled++;
+    break;
+  default:
+    sched->completed++;
+  }
+}
+
+struct VF_sched_job *VF_sched_cancel(struct VF_sched *sched, uint64_t id) {
+  struct VF_sched_job *dropped = NULL;
+
+  for (uint32_t l = 0; l < sched->lanes; l++) {
+    for (struct VF_sched_job *j = sched->lane[l].head; j != NULL;
+         j = j->next) {
+      if (j->id == id) {
+        VF_sched_drop(sched, j, VF_SCHED_CANCELLED, &dropped);
+        sched->cancelled++;
+        return dropped;
+      }
+    }
+  }
+
+  for (struct VF_sched_job *j = sched->running.head; j != NULL; j = j->next) {
+    if (j->id == id) {
+      j->cancelled = 1;
+      return j;
+    }
+  }
+
+  return NULL;
+}
+
+struct VF_sched_job *VF_sched_clear(struct VF_sched *sched) {
+  struct VF_sched_job *dropped = NULL;
+
+  for (uint32_t l = 0; l < sched->lanes; l++) {
+    while (sched->lane[l].head != NULL) {
+      VF_sched_drop(sched, sched->lane[l].head, VF_SCHED_CANCELLED, &dropped);
+      sched->cancelled++;
+    }
+  }
+
+  return dropped;
+}
+
+void VF_sched_stats(struct VF_sched *sched, struct VF_sched_stats *stats,
+                    int reset) {
+  stats->lanes = sched->lanes;
+  stats->capacity = sched->capacity;
+  stats->concurrency = sched->concurrency;
+  stats->queued = sched->queued;
+  for (uint32_t l = 0; l < VF_SCHED_LANES; l++) {
+    stats->depth[l] = l < sched->lanes ? sched->lane[l].length : 0;
+  }
+  stats->running = sched->running.length;
+  stats->admitted = sched->admitted;
+  stats->completed = sched->completed;
+  stats->shed = sched->shed;
+  stats->expired = sched->expired;
+  stats->cancelled = sched->cancelled;
+
+  if (reset) {
+    sched->admitted = 0;
+    sched->completed = 0;
+    sched->shed = 0;
+    sched->expired = 0;
+    sched->cancelled = 0;
+  }
+}
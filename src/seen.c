@@ -0,0 +1,408 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "./verify.h"
+
+#define VF_SEEN_NONE UINT64_MAX
+
+// The longest chain of fingerprints which is moved to make room in a bucket
+#define VF_SEEN_KICKS 128
+
+// The fingerprints are stored as an array of 16, 32 or 64 bit integers,
+// depending on the false positive rate, where zero marks an empty slot.  The
+// slots of bucket b are b * VF_SEEN_BUCKET up to the next bucket.  The
+// counters are only updated with atomic adds, and are only approximately
+// consistent with each other while other threads are adding documents.  The
+// lock is only taken to move fingerprints between buckets, and moves counts
+// the fingerprints which have been moved, so that a lookup can tell when one
+// may have moved past it
+struct VF_seen {
+  uint32_t refs;
+  uint8_t secret[16];
+  uint32_t width;
+  uint64_t nbuckets;
+  void *slots;
+  pthread_mutex_t lock;
+  uint64_t moves;
+
+  uint64_t size;
+  uint64_t insertions;
+  uint64_t replays;
+  uint64_t evictions;
+};
+
+// The false positive rate of a lookup with fingerprints of the given width in
+// bytes.  A lookup compares against every slot in two full buckets, each of
+// which matches a random fingerprint with a chance of one in 2^bits
+static double VF_seen_fp_rate(uint32_t width) {
+  double rate = 2 * VF_SEEN_BUCKET;
+  for (uint32_t i = 0; i < width; i++) {
+    rate /= 256;
+  }
+  return rate;
+}
+
+VF_return_t VF_seen_new(uint64_t capacity, double fp_rate,
+                        struct VF_seen **seen) {
+  struct VF_seen *s;
+  uint64_t nbuckets = (capacity + VF_SEEN_BUCKET - 1) / VF_SEEN_BUCKET;
+  uint32_t width = 2;
+
+  *seen = NULL;
+
+  // Buckets are picked with 32 bits of the digest
+  if (nbuckets == 0) {
+    nbuckets = 1;
+  }
+  if (nbuckets > UINT32_MAX) {
+    VF_ERROR("seen set capacity %lu is too large\n", (unsigned long)capacity);
+    return VF_EXCEPTION;
+  }
+
+  while (width < 8 && VF_seen_fp_rate(width) > fp_rate) {
+    width *= 2;
+  }
+
+  s = calloc(1, sizeof(struct VF_seen));
+  if (s == NULL) {
+    VF_ERROR("error while allocating seen set\n");
+    return VF_EXCEPTION;
+  }
+  s->slots = calloc(nbuckets * VF_SEEN_BUCKET, width);
+  if (s->slots == NULL) {
+    free(s);
+    VF_ERROR("error while allocating seen set of %lu documents\n",
+             (unsigned long)capacity);
+    return VF_EXCEPTION;
+  }
+
+  // The digests are keyed so that nobody can choose documents which collide
+  if (1 != RAND_bytes(s->secret, sizeof(s->secret))) {
+    free(s->slots);
+    free(s);
+    VF_ERROR("error while generating seen set secret\n");
+    return VF_EXCEPTION;
+  }
+
+  if (0 != pthread_mutex_init(&s->lock, NULL)) {
+    free(s->slots);
+    free(s);
+    VF_ERROR("error while initializing seen set lock\n");
+    return VF_EXCEPTION;
+  }
+
+  s->refs = 1;
+  s->width = width;
+  s->nbuckets = nbuckets;
+  *seen = s;
+  return VF_SUCCESS;
+}
+
+struct VF_seen *VF_seen_ref(struct VF_seen *seen) {
+  __atomic_add_fetch(&seen->refs, 1, __ATOMIC_RELAXED);
+  return seen;
+}
+
+void VF_seen_free(struct VF_seen *seen) {
+  if (seen == NULL ||
+      0 != __atomic_sub_fetch(&seen->refs, 1, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  pthread_mutex_destroy(&seen->lock);
+  free(seen->slots);
+  free(seen);
+}
+
+void VF_seen_stats(struct VF_seen *seen, struct VF_seen_stats *stats,
+                   int reset) {
+  stats->capacity = seen->nbuckets * VF_SEEN_BUCKET;
+  stats->memory = stats->capacity * seen->width;
+  stats->bits = seen->width * 8;
+  stats->fp_rate = VF_seen_fp_rate(seen->width);
+  stats->size = __atomic_load_n(&seen->size, __ATOMIC_RELAXED);
+  stats->fp_estimate = stats->fp_rate * stats->size / stats->capacity;
+  if (reset) {
+    stats->insertions = __atomic_exchange_n(&seen->insertions, 0,
+                                            __ATOMIC_RELAXED);
+    stats->replays = __atomic_exchange_n(&seen->replays, 0, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_exchange_n(&seen->evictions, 0,
+                                           __ATOMIC_RELAXED);
+  } else {
+    stats->insertions = __atomic_load_n(&seen->insertions, __ATOMIC_RELAXED);
+    stats->replays = __atomic_load_n(&seen->replays, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&seen->evictions, __ATOMIC_RELAXED);
+  }
+}
+
+static uint64_t VF_seen_load(struct VF_seen *seen, uint64_t slot) {
+  switch (seen->width) {
+  case 2:
+    return __atomic_load_n((uint16_t *)seen->slots + slot, __ATOMIC_SEQ_CST);
+  case 4:
+    return __atomic_load_n((uint32_t *)seen->slots + slot, __ATOMIC_SEQ_CST);
+  default:
+    return __atomic_load_n((uint64_t *)seen->slots + slot, __ATOMIC_SEQ_CST);
+  }
+}
+
+// Replace the fingerprint in a slot when it still holds expected
+static int VF_seen_swap(struct VF_seen *seen, uint64_t slot,
+                        uint64_t expected, uint64_t desired) {
+  switch (seen->width) {
+  case 2: {
+    uint16_t e = (uint16_t)expected;
+    return __atomic_compare_exchange_n((uint16_t *)seen->slots + slot, &e,
+                                       (uint16_t)desired, 0, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_SEQ_CST);
+  }
+  case 4: {
+    uint32_t e = (uint32_t)expected;
+    return __atomic_compare_exchange_n((uint32_t *)seen->slots + slot, &e,
+                                       (uint32_t)desired, 0, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_SEQ_CST);
+  }
+  default: {
+    uint64_t e = expected;
+    return __atomic_compare_exchange_n((uint64_t *)seen->slots + slot, &e,
+                                       desired, 0, __ATOMIC_SEQ_CST,
+                                       __ATOMIC_SEQ_CST);
+  }
+  }
+}
+
+// Return a slot in either bucket which holds value, other than skip, or
+// VF_SEEN_NONE when there is none.  A fingerprint which is moved is copied to
+// its other bucket before it is cleared from the first, but a search which
+// reads the other bucket first can still miss it, so a search which misses
+// while any fingerprint was moved is repeated
+static uint64_t VF_seen_find(struct VF_seen *seen, const uint64_t *buckets,
+                             uint64_t value, uint64_t skip) {
+  for (;;) {
+    uint64_t moves = __atomic_load_n(&seen->moves, __ATOMIC_SEQ_CST);
+    for (int b = 0; b < 2; b++) {
+      uint64_t slot = buckets[b] * VF_SEEN_BUCKET;
+      for (int i = 0; i < VF_SEEN_BUCKET; i++, slot++) {
+        if (slot != skip && VF_seen_load(seen, slot) == value) {
+          return slot;
+        }
+      }
+    }
+    if (moves == __atomic_load_n(&seen->moves, __ATOMIC_SEQ_CST)) {
+      return VF_SEEN_NONE;
+    }
+  }
+}
+
+// Return the first empty slot in a bucket, or VF_SEEN_NONE when it is full,
+// and count its empty slots in *empty
+static uint64_t VF_seen_empty(struct VF_seen *seen, uint64_t bucket,
+                              int *empty) {
+  uint64_t slot = VF_SEEN_NONE;
+
+  *empty = 0;
+  for (int i = 0; i < VF_SEEN_BUCKET; i++) {
+    if (0 == VF_seen_load(seen, bucket * VF_SEEN_BUCKET + i)) {
+      if (slot == VF_SEEN_NONE) {
+        slot = bucket * VF_SEEN_BUCKET + i;
+      }
+      *empty += 1;
+    }
+  }
+  return slot;
+}
+
+// The other bucket of a fingerprint stored in a bucket.  As in a cuckoo
+// filter, it only depends on the bucket and the fingerprint, so that a
+// fingerprint can be moved without knowing its digest.  Subtracting the
+// bucket from a hash of the fingerprint gives the first bucket back again
+// for any number of buckets
+static uint64_t VF_seen_other(struct VF_seen *seen, uint64_t bucket,
+                              uint64_t value) {
+  uint64_t hash = (((value * 0x9e3779b97f4a7c15) >> 32) * seen->nbuckets) >> 32;
+  return (hash + seen->nbuckets - bucket) % seen->nbuckets;
+}
+
+// Make room in one of the buckets by moving a chain of fingerprints, each to
+// its other bucket, which ends at a bucket with an empty slot.  The chain is
+// a random walk from the slots picked by seed, and is moved from its far end
+// so that each fingerprint is copied to an empty slot before it is cleared.
+// Returns the slot which was freed, or VF_SEEN_NONE when there is no chain
+// short enough or other threads changed its slots while it was being moved.
+// Moves are serialized by the lock, but lookups and inserts into empty slots
+// never wait for it
+static uint64_t VF_seen_relocate(struct VF_seen *seen, const uint64_t *buckets,
+                                 uint64_t seed) {
+  uint64_t path[VF_SEEN_KICKS], values[VF_SEEN_KICKS];
+  uint64_t bucket = buckets[seed & 1], target = VF_SEEN_NONE;
+  int n = 0, empty;
+
+  pthread_mutex_lock(&seen->lock);
+  seed |= 1;
+  for (int kicks = 0; kicks < VF_SEEN_KICKS; kicks++) {
+    uint64_t slot, value;
+
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    slot = bucket * VF_SEEN_BUCKET + seed % VF_SEEN_BUCKET;
+    value = VF_seen_load(seen, slot);
+    if (value == 0) {
+      target = slot;
+      break;
+    }
+
+    // A walk which comes back to a slot in the chain drops the loop
+    for (int i = 0; i < n; i++) {
+      if (path[i] == slot) {
+        n = i;
+        break;
+      }
+    }
+    path[n] = slot;
+    values[n++] = value;
+
+    bucket = VF_seen_other(seen, bucket, value);
+    target = VF_seen_empty(seen, bucket, &empty);
+    if (target != VF_SEEN_NONE) {
+      break;
+    }
+  }
+
+  // A fingerprint is briefly in both slots, which only makes concurrent adds
+  // of the same document report a replay.  When the slot it is moved from no
+  // longer holds it, another thread evicted it or backed out of adding it,
+  // so the copy is taken back too
+  while (target != VF_SEEN_NONE && n > 0) {
+    n--;
+    if (!VF_seen_swap(seen, target, 0, values[n])) {
+      target = VF_SEEN_NONE;
+      break;
+    }
+    __atomic_add_fetch(&seen->moves, 1, __ATOMIC_SEQ_CST);
+    if (!VF_seen_swap(seen, path[n], values[n], 0)) {
+      VF_seen_swap(seen, target, values[n], 0);
+      target = VF_SEEN_NONE;
+      break;
+    }
+    target = path[n];
+  }
+  pthread_mutex_unlock(&seen->lock);
+  return target;
+}
+
+// Compute the digest of a document.  The length of the instanceId keeps the
+// boundary between the claims unambiguous
+static VF_return_t VF_seen_digest(struct VF_seen *seen,
+                                  const uint8_t *instance_id,
+                                  uint64_t instance_id_l,
+                                  const uint8_t *pending_time,
+                                  uint64_t pending_time_l, uint8_t *digest) {
+  VF_return_t rv = VF_SUCCESS;
+  uint8_t length[8];
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+  for (int i = 0; i < 8; i++) {
+    length[i] = (uint8_t)(instance_id_l >> (i * 8));
+  }
+
+  if (ctx == NULL || 1 != EVP_DigestInit_ex(ctx, VF_md(NID_sha256), NULL) ||
+      1 != EVP_DigestUpdate(ctx, seen->secret, sizeof(seen->secret)) ||
+      1 != EVP_DigestUpdate(ctx, length, sizeof(length)) ||
+      1 != EVP_DigestUpdate(ctx, instance_id, instance_id_l) ||
+      1 != EVP_DigestUpdate(ctx, pending_time, pending_time_l) ||
+      1 != EVP_DigestFinal_ex(ctx, digest, NULL)) {
+    rv = VF_EXCEPTION;
+    VF_ERROR("error while computing seen set digest\n");
+  }
+
+  EVP_MD_CTX_free(ctx);
+  return rv;
+}
+
+VF_return_t VF_seen_add(struct VF_seen *seen, const uint8_t *instance_id,
+                        uint64_t instance_id_l, const uint8_t *pending_time,
+                        uint64_t pending_time_l) {
+  uint8_t digest[VF_FINGERPRINT_SIZE];
+  uint64_t words[4], buckets[2], value;
+
+  if (VF_SUCCESS != VF_seen_digest(seen, instance_id, instance_id_l,
+                                   pending_time, pending_time_l, digest)) {
+    return VF_EXCEPTION;
+  }
+  memcpy(words, digest, sizeof(words));
+
+  // The first bucket is picked by multiplying 32 bits of the digest by the
+  // number of buckets, which is uniform without rounding the table up to a
+  // power of two.  The fingerprint is never zero, since that marks an empty
+  // slot
+  buckets[0] = ((words[0] >> 32) * seen->nbuckets) >> 32;
+  value = seen->width == 8 ? words[2] : words[2] >> (64 - seen->width * 8);
+  if (value == 0) {
+    value = 1;
+  }
+  buckets[1] = VF_seen_other(seen, buckets[0], value);
+
+  for (;;) {
+    uint64_t slot, other, old = 0;
+    int empty, other_empty;
+
+    if (VF_SEEN_NONE != VF_seen_find(seen, buckets, value, VF_SEEN_NONE)) {
+      __atomic_add_fetch(&seen->replays, 1, __ATOMIC_RELAXED);
+      return VF_FAIL;
+    }
+
+    // Take an empty slot in the bucket with more of them, or make room by
+    // moving other fingerprints.  A fingerprint picked by the digest is only
+    // evicted when no room can be made
+    slot = VF_seen_empty(seen, buckets[0], &empty);
+    other = VF_seen_empty(seen, buckets[1], &other_empty);
+    if (other_empty > empty) {
+      slot = other;
+    }
+    if (slot == VF_SEEN_NONE) {
+      slot = VF_seen_relocate(seen, buckets, words[3]);
+    }
+    if (slot == VF_SEEN_NONE) {
+      slot = buckets[words[3] & 1] * VF_SEEN_BUCKET +
+             (words[3] >> 1) % VF_SEEN_BUCKET;
+      old = VF_seen_load(seen, slot);
+    }
+
+    // Another thread changed the slot since it was read, so look again
+    if (old == value || !VF_seen_swap(seen, slot, old, value)) {
+      continue;
+    }
+    if (old != 0) {
+      __atomic_add_fetch(&seen->evictions, 1, __ATOMIC_RELAXED);
+    } else {
+      __atomic_add_fetch(&seen->size, 1, __ATOMIC_RELAXED);
+    }
+
+    // Another thread adding the same document may have stored it in another
+    // slot between our search and our swap.  Whichever thread finds the
+    // other's fingerprint after storing its own backs out, so that at most
+    // one of them succeeds, and at worst both report a replay.  Backing out
+    // puts back the fingerprint which was evicted, if any, and only undoes
+    // the count which this thread made
+    if (VF_SEEN_NONE != VF_seen_find(seen, buckets, value, slot)) {
+      if (VF_seen_swap(seen, slot, value, old)) {
+        if (old != 0) {
+          __atomic_sub_fetch(&seen->evictions, 1, __ATOMIC_RELAXED);
+        } else {
+          __atomic_sub_fetch(&seen->size, 1, __ATOMIC_RELAXED);
+        }
+      }
+      __atomic_add_fetch(&seen->replays, 1, __ATOMIC_RELAXED);
+      return VF_FAIL;
+    }
+
+    __atomic_add_fetch(&seen->insertions, 1, __ATOMIC_RELAXED);
+    return VF_SUCCESS;
+  }
+}
@@ -0,0 +1,168 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <openssl/err.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "./verify.h"
+
+// The names of the VF_E_ codes, as used in the Prometheus labels
+static const char *VF_stats_code_names[VF_STATS_CODES] = {
+    "none", "pubkey", "envelope", "signature",
+    "verify", "internal", "nokey", "malformed",
+};
+
+const char *VF_stats_library(uint32_t lib) {
+  const char *name = ERR_lib_error_string(ERR_PACK(lib, 0, 0));
+
+  if (lib == 0) {
+    return "none";
+  }
+  if (name == NULL || lib >= VF_STATS_LIBS - 1) {
+    return "other";
+  }
+  return name;
+}
+
+uint64_t VF_stats_bucket_limit(uint32_t bucket) {
+  uint32_t exponent, sub;
+
+  if (bucket < VF_STATS_SUB_BUCKETS) {
+    return bucket;
+  }
+  if (bucket >= VF_STATS_BUCKETS - 1) {
+    return UINT64_MAX;
+  }
+  exponent = bucket / VF_STATS_SUB_BUCKETS + 2;
+  sub = bucket % VF_STATS_SUB_BUCKETS;
+  return ((uint64_t)(VF_STATS_SUB_BUCKETS + sub + 1) << (exponent - 3)) - 1;
+}
+
+static uint64_t VF_stats_count(const struct VF_stats *stats) {
+  return stats->success + stats->fail + stats->exception;
+}
+
+uint64_t VF_stats_percentile(const struct VF_stats *stats, double p) {
+  uint64_t count = VF_stats_count(stats), seen = 0, rank;
+
+  if (count == 0) {
+    return 0;
+  }
+
+  // The rank of the verification whose latency is wanted, counting from one
+  rank = (uint64_t)(p * count + 0.5);
+  if (rank < 1) {
+    rank = 1;
+  } else if (rank > count) {
+    rank = count;
+  }
+
+  for (uint32_t i = 0; i < VF_STATS_BUCKETS; i++) {
+    seen += stats->latency[i];
+    if (seen >= rank) {
+      return VF_stats_bucket_limit(i);
+    }
+  }
+  return VF_stats_bucket_limit(VF_STATS_BUCKETS - 1);
+}
+
+// Text being formatted into a buffer which may be too small, keeping count of
+// how long it would have been like snprintf does
+struct VF_stats_text {
+  char *buf;
+  size_t buf_l;
+  size_t length;
+};
+
+static void VF_stats_printf(struct VF_stats_text *text, const char *fmt,
+                            ...) {
+  va_list args;
+  int n;
+
+  va_start(args, fmt);
+  if (text->length < text->buf_l) {
+    n = vsnprintf(text->buf + text->length, text->buf_l - text->length, fmt,
+                  args);
+  } else {
+    n = vsnprintf(NULL, 0, fmt, args);
+  }
+  va_end(args);
+
+  if (n > 0) {
+    text->length += n;
+  }
+}
+
+static void VF_stats_header(struct VF_stats_text *text, const char *name,
+                            const char *type, const char *help) {
+  VF_stats_printf(text, "# HELP iid_verify_%s %s\n# TYPE iid_verify_%s %s\n",
+                  name, help, name, type);
+}
+
+int VF_stats_prometheus(const struct VF_stats *stats, char *buf,
+                        size_t buf_l) {
+  struct VF_stats_text text = {buf, buf_l, 0};
+  uint64_t cumulative = 0;
+  uint32_t i;
+
+  if (buf_l > 0) {
+    buf[0] = '\0';
+  }
+
+  VF_stats_header(&text, "verifications_total", "counter",
+                  "Verifications by outcome.");
+  VF_stats_printf(&text,
+                  "iid_verify_verifications_total{outcome=\"success\"} %llu\n"
+                  "iid_verify_verifications_total{outcome=\"fail\"} %llu\n"
+                  "iid_verify_verifications_total{outcome=\"exception\"} "
+                  "%llu\n",
+                  (unsigned long long)stats->success,
+                  (unsigned long long)stats->fail,
+                  (unsigned long long)stats->exception);
+
+  VF_stats_header(&text, "exceptions_total", "counter",
+                  "Exceptions by error code.");
+  for (i = 1; i < VF_STATS_CODES; i++) {
+    VF_stats_printf(&text, "iid_verify_exceptions_total{code=\"%s\"} %llu\n",
+                    VF_stats_code_names[i],
+                    (unsigned long long)stats->codes[i]);
+  }
+
+  // Only the libraries which have been seen are listed, since there are many
+  // which verification never uses
+  VF_stats_header(&text, "exception_libraries_total", "counter",
+                  "Exceptions by the OpenSSL library of the root cause.");
+  for (i = 0; i < VF_STATS_LIBS; i++) {
+    if (stats->libs[i] == 0) {
+      continue;
+    }
+    VF_stats_printf(&text,
+                    "iid_verify_exception_libraries_total{library=\"%s\"} "
+                    "%llu\n",
+                    VF_stats_library(i), (unsigned long long)stats->libs[i]);
+  }
+
+  // The histogram buckets of the exposition are one per power of two from
+  // about 2us, which keeps the labels the same from one scrape to the next
+  VF_stats_header(&text, "latency_seconds", "histogram",
+                  "Time taken by each verification.");
+  for (i = 0; i < VF_STATS_BUCKETS - 1; i++) {
+    cumulative += stats->latency[i];
+    if (i % VF_STATS_SUB_BUCKETS == VF_STATS_SUB_BUCKETS - 1 &&
+        i >= 8 * VF_STATS_SUB_BUCKETS) {
+      VF_stats_printf(&text,
+                      "iid_verify_latency_seconds_bucket{le=\"%.9g\"} %llu\n",
+                      (VF_stats_bucket_limit(i) + 1) / 1e9,
+                      (unsigned long long)cumulative);
+    }
+  }
+  VF_stats_printf(&text,
+                  "iid_verify_latency_seconds_bucket{le=\"+Inf\"} %llu\n"
+                  "iid_verify_latency_seconds_sum %.9g\n"
+                  "iid_verify_latency_seconds_count %llu\n",
+                  (unsigned long long)VF_stats_count(stats),
+                  stats->latency_sum_ns / 1e9,
+                  (unsigned long long)VF_stats_count(stats));
+
+  return text.length;
+}
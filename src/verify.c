@@ -1,20 +1,104 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <openssl/bio.h>
 #include <openssl/cms.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
 #include <openssl/pem.h>
 #include <openssl/safestack.h>
 #include <openssl/x509.h>
 #include <openssl/x509_vfy.h>
 
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
 #include "./verify.h"
 
-VF_return_t VF_init() {
+static pthread_once_t VF_init_once = PTHREAD_ONCE_INIT;
+static VF_return_t VF_init_rv = VF_EXCEPTION;
+
+// Each thread's VF_ctx for the functions which are not passed one
+static pthread_key_t VF_ctx_key;
+static int VF_ctx_key_ok = 0;
+
+static void VF_ctx_destroy(void *ctx) { VF_ctx_free(ctx); }
+
+// The library context which algorithms are fetched from.  This is the
+// default context, named explicitly, so that providers loaded by the OpenSSL
+// configuration, such as a FIPS provider, still apply, and so that the keys
+// of certificates parsed by PEM_read_bio_X509, which belong to the default
+// context, never have to be exported to another one
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static OSSL_LIB_CTX *VF_libctx = NULL;
+#endif
+
+// The digests that verifications use, fetched once by VF_init.  OpenSSL 3
+// looks up the implementation of a digest like EVP_sha256() in the provider
+// store on every EVP_DigestInit_ex, while a fetched one is used as it is.
+// Before 3.0, there is nothing to fetch and these are the built in digests
+#define VF_MDS 5
+static const int VF_md_nids[VF_MDS] = {NID_sha256, NID_sha1, NID_sha384,
+                                       NID_sha512, NID_sha224};
+static const EVP_MD *VF_mds[VF_MDS];
+
+static void VF_md_fetch_all() {
+  for (int i = 0; i < VF_MDS; i++) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    // A digest which the providers don't have, such as SHA-1 under some
+    // FIPS configurations, is left to fail when it is used instead
+    ERR_set_mark();
+    VF_mds[i] = EVP_MD_fetch(VF_libctx, OBJ_nid2sn(VF_md_nids[i]), NULL);
+    ERR_pop_to_mark();
+#else
+    VF_mds[i] = EVP_get_digestbynid(VF_md_nids[i]);
+#endif
+  }
+}
+
+const EVP_MD *VF_md(int nid) {
+  for (int i = 0; i < VF_MDS; i++) {
+    if (VF_md_nids[i] == nid && VF_mds[i] != NULL) {
+      return VF_mds[i];
+    }
+  }
+  return EVP_get_digestbynid(nid);
+}
+
+static void VF_init_openssl() {
+  // Without a key, every call uses a context of its own instead
+  VF_ctx_key_ok = 0 == pthread_key_create(&VF_ctx_key, VF_ctx_destroy);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  // Since 1.1.0, OpenSSL initializes itself in a thread-safe way and keeps
+  // its error queue per thread, so this only loads the error strings and
+  // algorithms up front instead of on first use
+  if (1 == OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CRYPTO_STRINGS |
+                                   OPENSSL_INIT_ADD_ALL_CIPHERS |
+                                   OPENSSL_INIT_ADD_ALL_DIGESTS,
+                               NULL)) {
+    VF_md_fetch_all();
+    VF_init_rv = VF_SUCCESS;
+  } else {
+    VF_ERROR("error while initializing OpenSSL\n");
+  }
+#else
   ERR_load_crypto_strings();
   OpenSSL_add_all_algorithms();
+  VF_md_fetch_all();
   // Since none of these functions return useful error messages, per the
   // openssl wiki documentation, we're just going to return success status.
   // If this changes in future, we have the option to start failing
-  return VF_SUCCESS;
+  VF_init_rv = VF_SUCCESS;
+#endif
+}
+
+VF_return_t VF_init() {
+  if (0 != pthread_once(&VF_init_once, VF_init_openssl)) {
+    VF_ERROR("error while running OpenSSL initialization once\n");
+    return VF_EXCEPTION;
+  }
+  return VF_init_rv;
 }
 
 void VF_err_free(struct Error *err) {
@@ -58,63 +142,803 @@ char *VF_err_fmt(struct Error *err) {
   return msg;
 }
 
-VF_return_t VF_verify(uint8_t *pubkey, uint64_t pubkey_l, uint8_t *document,
-                      uint64_t document_l, uint8_t *pkcs7, uint64_t pkcs7_l,
-                      struct Error **err) {
-  // We want to clear the OpenSSL Error queue so that we know when we're in the
-  // cleanup section, any errors we hit are the result of this invocation
-  ERR_clear_error();
-  VF_return_t rv;
+// The digests which a key sets up a public key context for when it is loaded.
+// The metadata service signs with SHA-256, and with SHA-1 for the DSA key of
+// the pkcs7 endpoint
+#define VF_KEY_TEMPLATES 2
+static const int VF_key_template_nids[VF_KEY_TEMPLATES] = {NID_sha256,
+                                                           NID_sha1};
+
+// A parsed public key.  The certificate, the stack used to look up the signer
+// and the store are all created once when the key is loaded, so that a key
+// can be reused for any number of VF_verify_key calls
+struct VF_key {
+  X509 *cert;
+  STACK_OF(X509) *certs;
+  X509_STORE *store;
+  EVP_PKEY *pkey;
+  EVP_PKEY_CTX *templates[VF_KEY_TEMPLATES];
+  int flags;
+  uint8_t fingerprint[VF_FINGERPRINT_SIZE];
+  uint8_t signer[VF_FINGERPRINT_SIZE];
+  char region[VF_REGION_SIZE];
+};
+
+// The objects that a verification needs besides the envelope, which are kept
+// between calls so that they are only allocated once.  The public key context
+// is set up for the one key and digest it was last used with, and holds a
+// reference to that EVP_PKEY, so a cached pkey can't be freed and its address
+// reused by another key while the context is still set up for it.  The
+// scratch buffer holds envelopes too large to decode on the stack and the
+// encoded signed attributes
+struct VF_ctx {
+  EVP_MD_CTX *md_ctx;
+  EVP_PKEY_CTX *pkey_ctx;
+  EVP_PKEY *pkey;
+  const EVP_MD *pkey_md;
+  uint8_t *scratch;
+  size_t scratch_l;
+
+  // The counters of the verifications made with this context, which only
+  // the thread using it writes to.  Every context is on the VF_stats_live
+  // list from VF_ctx_init until VF_ctx_clear
+  uint64_t start_ns;
+  struct VF_stats stats;
+  struct VF_ctx *stats_prev;
+  struct VF_ctx *stats_next;
+};
+
+// The counters of every context which has been freed are added to
+// VF_stats_retired, so that they are not lost, and VF_stats_base holds the
+// totals at the last reset.  All of these are guarded by VF_stats_lock
+static pthread_mutex_t VF_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct VF_ctx *VF_stats_live = NULL;
+static struct VF_stats VF_stats_retired;
+static struct VF_stats VF_stats_base;
+
+#define VF_STATS_COUNTERS (sizeof(struct VF_stats) / sizeof(uint64_t))
+
+// Returned by VF_verify_direct when an envelope is not one that it handles,
+// and it must be verified with PKCS7_verify instead
+#define VF_FALLBACK 2
+
+// Decoding table for the standard base64 alphabet.  Whitespace maps to 0x40
+// so that it can be skipped, '=' maps to 0x41 and everything else which is
+// not in the alphabet maps to 0xff
+static const uint8_t b64_table[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x40, 0x40, 0xff,
+    0xff, 0x40, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x40, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 62,   0xff, 0xff, 0xff, 63,
+    52,   53,   54,   55,   56,   57,   58,   59,   60,   61,   0xff, 0xff,
+    0xff, 0x41, 0xff, 0xff, 0xff, 0,    1,    2,    3,    4,    5,    6,
+    7,    8,    9,    10,   11,   12,   13,   14,   15,   16,   17,   18,
+    19,   20,   21,   22,   23,   24,   25,   0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 26,   27,   28,   29,   30,   31,   32,   33,   34,   35,   36,
+    37,   38,   39,   40,   41,   42,   43,   44,   45,   46,   47,   48,
+    49,   50,   51,   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff};
+
+VF_return_t VF_base64_decode(const uint8_t *in, uint64_t in_l, uint8_t *out,
+                             uint64_t *out_l) {
+  uint32_t acc = 0;
+  int bits = 0;
+  int padding = 0;
+  uint64_t n = 0;
+
+  for (uint64_t i = 0; i < in_l; i++) {
+    uint8_t v = b64_table[in[i]];
+    if (v == 0x40) {
+      continue;
+    } else if (v == 0x41) {
+      padding++;
+      continue;
+    } else if (v == 0xff || padding > 0) {
+      // Either not base64 at all or data after the padding
+      return VF_EXCEPTION;
+    }
+
+    acc = (acc << 6) | v;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out[n++] = (uint8_t)(acc >> bits);
+    }
+  }
+
+  // Leftover bits must be the zero bits of a partial final group, and the
+  // padding, if any, must complete the group
+  if (bits >= 6 || padding > 2 || (padding > 0 && (bits / 2 != padding))) {
+    return VF_EXCEPTION;
+  }
+
+  *out_l = n;
+  return VF_SUCCESS;
+}
+
+// Return the scratch buffer of a context, grown to at least size bytes, or
+// NULL when it can not be grown.  Its contents are not kept when it grows
+static uint8_t *VF_ctx_scratch(struct VF_ctx *ctx, size_t size) {
+  if (ctx->scratch_l < size) {
+    free(ctx->scratch);
+    ctx->scratch_l = 0;
+    ctx->scratch = malloc(size);
+    if (ctx->scratch != NULL) {
+      ctx->scratch_l = size;
+    }
+  }
+  return ctx->scratch;
+}
+
+static uint64_t VF_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Only the thread which owns a context writes its counters, so a plain load
+// and store is enough.  They are atomic so that a snapshot taken from
+// another thread at the same time reads whole values
+static void VF_stats_inc(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+// Add every counter of from to to, reading from atomically
+static void VF_stats_add(struct VF_stats *to, struct VF_stats *from) {
+  uint64_t *t = (uint64_t *)to, *f = (uint64_t *)from;
+  for (size_t i = 0; i < VF_STATS_COUNTERS; i++) {
+    t[i] += __atomic_load_n(&f[i], __ATOMIC_RELAXED);
+  }
+}
+
+static uint32_t VF_stats_bucket(uint64_t ns) {
+  uint32_t exponent = 0;
+  uint64_t v = ns;
+
+  if (ns < VF_STATS_SUB_BUCKETS) {
+    return ns;
+  }
+  while (v >>= 1) {
+    exponent++;
+  }
+  // Bucket 8 starts at 2^3, and each power of two after that has 8 buckets
+  // for the three bits after the leading one
+  uint64_t bucket = (exponent - 2) * VF_STATS_SUB_BUCKETS +
+                    ((ns >> (exponent - 3)) & (VF_STATS_SUB_BUCKETS - 1));
+  return bucket < VF_STATS_BUCKETS ? bucket : VF_STATS_BUCKETS - 1;
+}
+
+// Count the outcome of a verification made with ctx, which started at
+// ctx->start_ns.  lib is the OpenSSL library of the root-most error
+static void VF_stats_record(struct VF_ctx *ctx, VF_return_t rv, int code,
+                            int lib) {
+  uint64_t ns = VF_now_ns() - ctx->start_ns;
+
+  if (rv == VF_SUCCESS) {
+    VF_stats_inc(&ctx->stats.success, 1);
+  } else if (rv == VF_FAIL) {
+    VF_stats_inc(&ctx->stats.fail, 1);
+  } else {
+    VF_stats_inc(&ctx->stats.exception, 1);
+    VF_stats_inc(&ctx->stats.codes[code < VF_STATS_CODES ? code : 0], 1);
+    VF_stats_inc(&ctx->stats.libs[lib < VF_STATS_LIBS ? lib
+                                                      : VF_STATS_LIBS - 1],
+                 1);
+  }
+  VF_stats_inc(&ctx->stats.latency[VF_stats_bucket(ns)], 1);
+  VF_stats_inc(&ctx->stats.latency_sum_ns, ns);
+}
+
+void VF_stats_snapshot(struct VF_stats *stats, int reset) {
+  struct VF_stats total;
+  uint64_t *t = (uint64_t *)&total, *b = (uint64_t *)&VF_stats_base;
+  uint64_t *out = (uint64_t *)stats;
+
+  pthread_mutex_lock(&VF_stats_lock);
+  total = VF_stats_retired;
+  for (struct VF_ctx *ctx = VF_stats_live; ctx != NULL;
+       ctx = ctx->stats_next) {
+    VF_stats_add(&total, &ctx->stats);
+  }
+  for (size_t i = 0; i < VF_STATS_COUNTERS; i++) {
+    out[i] = t[i] - b[i];
+  }
+  if (reset) {
+    VF_stats_base = total;
+  }
+  pthread_mutex_unlock(&VF_stats_lock);
+}
+
+// Set up an empty context and start counting its verifications
+static void VF_ctx_init(struct VF_ctx *ctx) {
+  memset(ctx, 0, sizeof(struct VF_ctx));
+  pthread_mutex_lock(&VF_stats_lock);
+  ctx->stats_next = VF_stats_live;
+  if (VF_stats_live != NULL) {
+    VF_stats_live->stats_prev = ctx;
+  }
+  VF_stats_live = ctx;
+  pthread_mutex_unlock(&VF_stats_lock);
+}
+
+// Free everything a context holds, keeping its counters in the retired ones
+static void VF_ctx_clear(struct VF_ctx *ctx) {
+  pthread_mutex_lock(&VF_stats_lock);
+  VF_stats_add(&VF_stats_retired, &ctx->stats);
+  if (ctx->stats_prev != NULL) {
+    ctx->stats_prev->stats_next = ctx->stats_next;
+  } else {
+    VF_stats_live = ctx->stats_next;
+  }
+  if (ctx->stats_next != NULL) {
+    ctx->stats_next->stats_prev = ctx->stats_prev;
+  }
+  pthread_mutex_unlock(&VF_stats_lock);
+
+  EVP_MD_CTX_free(ctx->md_ctx);
+  EVP_PKEY_CTX_free(ctx->pkey_ctx);
+  free(ctx->scratch);
+  memset(ctx, 0, sizeof(struct VF_ctx));
+}
+
+VF_return_t VF_ctx_new(struct VF_ctx **ctx) {
+  *ctx = malloc(sizeof(struct VF_ctx));
+  if (*ctx == NULL) {
+    VF_ERROR("error while allocating verification context\n");
+    return VF_EXCEPTION;
+  }
+  VF_ctx_init(*ctx);
+  return VF_SUCCESS;
+}
+
+void VF_ctx_free(struct VF_ctx *ctx) {
+  if (ctx != NULL) {
+    VF_ctx_clear(ctx);
+    free(ctx);
+  }
+}
+
+// Return the calling thread's context, or local when the thread does not
+// have one and one can not be created for it.  local must be passed to
+// VF_ctx_release once the call is done with it
+static struct VF_ctx *VF_ctx_acquire(struct VF_ctx *local) {
+  struct VF_ctx *ctx = NULL;
+
+  if (VF_ctx_key_ok) {
+    ctx = pthread_getspecific(VF_ctx_key);
+    if (ctx == NULL && VF_SUCCESS == VF_ctx_new(&ctx) &&
+        0 != pthread_setspecific(VF_ctx_key, ctx)) {
+      VF_ctx_free(ctx);
+      ctx = NULL;
+    }
+  }
+  if (ctx == NULL) {
+    VF_ctx_init(local);
+    ctx = local;
+  }
+  return ctx;
+}
+
+static void VF_ctx_release(struct VF_ctx *ctx, struct VF_ctx *local) {
+  if (ctx == local) {
+    VF_ctx_clear(local);
+  }
+}
+
+// Digest data with the context's digest context, which keeps its memory
+// between calls unlike EVP_Digest
+static int VF_ctx_digest(struct VF_ctx *ctx, const void *data, size_t data_l,
+                         uint8_t *md_value, unsigned int *md_value_l,
+                         const EVP_MD *md) {
+  if (ctx->md_ctx == NULL) {
+    ctx->md_ctx = EVP_MD_CTX_new();
+    if (ctx->md_ctx == NULL) {
+      return 0;
+    }
+  }
+  return 1 == EVP_DigestInit_ex(ctx->md_ctx, md, NULL) &&
+         1 == EVP_DigestUpdate(ctx->md_ctx, data, data_l) &&
+         1 == EVP_DigestFinal_ex(ctx->md_ctx, md_value, md_value_l);
+}
+
+// Return a new public key context set up to verify signatures by pkey with md
+static EVP_PKEY_CTX *VF_pkey_ctx_new(EVP_PKEY *pkey, const EVP_MD *md) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  EVP_PKEY_CTX *pkey_ctx = EVP_PKEY_CTX_new_from_pkey(VF_libctx, pkey, NULL);
+#else
+  EVP_PKEY_CTX *pkey_ctx = EVP_PKEY_CTX_new(pkey, NULL);
+#endif
+  if (pkey_ctx != NULL && (1 != EVP_PKEY_verify_init(pkey_ctx) ||
+                           0 >= EVP_PKEY_CTX_set_signature_md(pkey_ctx, md))) {
+    EVP_PKEY_CTX_free(pkey_ctx);
+    pkey_ctx = NULL;
+  }
+  return pkey_ctx;
+}
+
+// Return a public key context set up to verify signatures by the key with md,
+// reusing the one from the last call when it was for the same key and digest.
+// Otherwise the key's template for md is copied, which is much cheaper than
+// fetching the algorithm and setting up a context from scratch, and only a
+// digest without a template needs that
+static EVP_PKEY_CTX *VF_ctx_pkey(struct VF_ctx *ctx, struct VF_key *key,
+                                 const EVP_MD *md) {
+  EVP_PKEY_CTX *template = NULL;
+
+  if (ctx->pkey_ctx != NULL && ctx->pkey == key->pkey && ctx->pkey_md == md) {
+    return ctx->pkey_ctx;
+  }
+
+  for (int i = 0; i < VF_KEY_TEMPLATES && template == NULL; i++) {
+    if (EVP_MD_type(md) == VF_key_template_nids[i]) {
+      template = key->templates[i];
+    }
+  }
+
+  // A context which could not be set up is not kept, so that the next call
+  // starts over instead of using it half set up
+  EVP_PKEY_CTX_free(ctx->pkey_ctx);
+  ctx->pkey = NULL;
+  ctx->pkey_md = NULL;
+  ctx->pkey_ctx = template != NULL ? EVP_PKEY_CTX_dup(template)
+                                   : VF_pkey_ctx_new(key->pkey, md);
+  if (ctx->pkey_ctx == NULL) {
+    return NULL;
+  }
+  ctx->pkey = key->pkey;
+  ctx->pkey_md = md;
+  return ctx->pkey_ctx;
+}
+
+// Envelopes which decode to no more than this many bytes are decoded into a
+// buffer on the stack.  Envelopes from the metadata service are about 1.5KB
+#define VF_DER_STACK_SIZE 4096
+
+// Read the PKCS#7 envelope, which can be PEM encoded, the bare base64 body of
+// a PEM file as returned by the metadata service or DER encoded.  Errors are
+// left in the OpenSSL error queue for VF_collect_errors
+static VF_return_t VF_read_pkcs7(struct VF_ctx *ctx, uint8_t *pkcs7,
+                                 uint64_t pkcs7_l, PKCS7 **p7) {
+  static const char pem_begin[] = "-----BEGIN";
+  VF_return_t rv = VF_SUCCESS;
+  uint8_t stack[VF_DER_STACK_SIZE];
+  uint8_t *der = stack;
+  uint64_t der_l;
+  const uint8_t *p;
+  int is_der;
+
+  *p7 = NULL;
+
+  // Leading whitespace is not part of the envelope.  A DER envelope is a
+  // SEQUENCE which is too long for the short form of length, so the second
+  // byte has the high bit set.  No base64 character has the high bit set, so
+  // this can't be confused with the other forms.  Trailing whitespace is only
+  // trimmed from the text forms, since the last byte of a DER envelope is
+  // part of the signature and can have any value
+  while (pkcs7_l > 0 && b64_table[pkcs7[0]] == 0x40) {
+    pkcs7++;
+    pkcs7_l--;
+  }
+  is_der = pkcs7_l >= 2 && pkcs7[0] == 0x30 && (pkcs7[1] & 0x80);
+  while (!is_der && pkcs7_l > 0 && b64_table[pkcs7[pkcs7_l - 1]] == 0x40) {
+    pkcs7_l--;
+  }
+
+  if (pkcs7_l == 0) {
+    VF_ERROR("empty pkcs#7 envelope\n");
+    return VF_EXCEPTION;
+  }
+
+  if (pkcs7_l >= sizeof(pem_begin) - 1 &&
+      0 == memcmp(pkcs7, pem_begin, sizeof(pem_begin) - 1)) {
+    BIO *bio_pkcs7 = BIO_new_mem_buf(pkcs7, pkcs7_l);
+
+    *p7 = PEM_read_bio_PKCS7(bio_pkcs7, NULL, NULL, NULL);
+    if (*p7 == NULL) {
+      rv = VF_EXCEPTION;
+      VF_ERROR("error while reading pem pkcs#7 envelope\n");
+    }
+
+    if (!BIO_free(bio_pkcs7)) {
+      rv = VF_EXCEPTION;
+      VF_ERROR("error while freeing pkcs7 signature OpenSSL buffer\n");
+    }
+
+    return rv;
+  }
+
+  if (is_der) {
+    p = pkcs7;
+    der_l = pkcs7_l;
+  } else {
+    if (pkcs7_l / 4 * 3 + 3 > VF_DER_STACK_SIZE) {
+      der = VF_ctx_scratch(ctx, pkcs7_l / 4 * 3 + 3);
+      if (der == NULL) {
+        VF_ERROR("error while allocating der buffer\n");
+        return VF_EXCEPTION;
+      }
+    }
+
+    if (VF_SUCCESS != VF_base64_decode(pkcs7, pkcs7_l, der, &der_l)) {
+      VF_ERROR("pkcs#7 envelope is not pem, base64 or der encoded\n");
+      return VF_EXCEPTION;
+    }
+    p = der;
+  }
+
+  *p7 = d2i_PKCS7(NULL, &p, der_l);
+  if (*p7 == NULL) {
+    rv = VF_EXCEPTION;
+    VF_ERROR("error while reading der pkcs#7 envelope\n");
+  }
 
-  // First, we need to convert from C-strings into BIOs backed by memory
+  return rv;
+}
+
+// Compute the id of a signer from its issuer name and serial number, which
+// is how both certificates and the signers of envelopes are identified
+static int VF_signer_id(X509_NAME *issuer, ASN1_INTEGER *serial,
+                        uint8_t *id) {
+  uint8_t *issuer_der = NULL;
+  uint8_t *serial_der = NULL;
+  int issuer_l = i2d_X509_NAME(issuer, &issuer_der);
+  int serial_l = i2d_ASN1_INTEGER(serial, &serial_der);
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  int ok = issuer_l > 0 && serial_l > 0 && ctx != NULL &&
+           1 == EVP_DigestInit_ex(ctx, VF_md(NID_sha256), NULL) &&
+           1 == EVP_DigestUpdate(ctx, issuer_der, issuer_l) &&
+           1 == EVP_DigestUpdate(ctx, serial_der, serial_l) &&
+           1 == EVP_DigestFinal_ex(ctx, id, NULL);
+
+  EVP_MD_CTX_free(ctx);
+  OPENSSL_free(issuer_der);
+  OPENSSL_free(serial_der);
+  return ok;
+}
+
+// Set up a public key context for each of the template digests, which
+// VF_ctx_pkey copies for a thread instead of setting one up from scratch, and
+// make one public key operation with the key so that it computes and caches
+// its Montgomery contexts now, rather than in the first verification.  The
+// operation is on a signature which can never be valid: zero for RSA, and
+// r = s = 1 for DSA and ECDSA, which still gets as far as the modular
+// exponentiation.  Anything which fails is left for the first verification
+// to do instead
+static void VF_key_prepare(struct VF_key *key) {
+  static const uint8_t dsa_signature[] = {0x30, 0x06, 0x02, 0x01,
+                                          0x01, 0x02, 0x01, 0x01};
+  uint8_t signature[1024] = {0};
+  uint8_t digest[EVP_MAX_MD_SIZE] = {0};
+  const uint8_t *sig = dsa_signature;
+  size_t sig_l = sizeof(dsa_signature);
+  EVP_PKEY_CTX *pkey_ctx;
+  const EVP_MD *md;
+
+  for (int i = 0; i < VF_KEY_TEMPLATES; i++) {
+    md = VF_md(VF_key_template_nids[i]);
+    key->templates[i] = md != NULL ? VF_pkey_ctx_new(key->pkey, md) : NULL;
+  }
+
+  if (EVP_PKEY_base_id(key->pkey) == EVP_PKEY_RSA) {
+    sig = signature;
+    sig_l = EVP_PKEY_size(key->pkey);
+  }
+  md = VF_md(VF_key_template_nids[0]);
+  if (key->templates[0] == NULL || sig_l > sizeof(signature)) {
+    return;
+  }
+  pkey_ctx = EVP_PKEY_CTX_dup(key->templates[0]);
+  if (pkey_ctx != NULL) {
+    EVP_PKEY_verify(pkey_ctx, sig, sig_l, digest, EVP_MD_size(md));
+  }
+  EVP_PKEY_CTX_free(pkey_ctx);
+}
+
+// Parse a PEM encoded certificate into a VF_key, which is prepared for many
+// verifications when prepare is set.  A key for a single verification isn't,
+// since that would cost more than it saves.  Errors are left in the OpenSSL
+// error queue for VF_collect_errors.  On failure, *key is NULL
+static VF_return_t VF_parse_key(uint8_t *pubkey, uint64_t pubkey_l,
+                                int prepare, struct VF_key **key) {
+  VF_return_t rv = VF_SUCCESS;
   BIO *bio_pubkey = BIO_new_mem_buf(pubkey, pubkey_l);
-  BIO *bio_document = BIO_new_mem_buf(document, document_l);
-  BIO *bio_pkcs7 = BIO_new_mem_buf(pkcs7, pkcs7_l);
+  struct VF_key *k = calloc(1, sizeof(struct VF_key));
 
-  // The data structures needed for verification
-  PKCS7 *p7 = NULL;
-  X509_STORE *store = NULL;
-  STACK_OF(X509) *certs = NULL;
-  X509 *cert = NULL;
+  *key = NULL;
 
-  p7 = PEM_read_bio_PKCS7(bio_pkcs7, NULL, NULL, NULL);
-  if (p7 == NULL) {
+  if (k == NULL) {
     rv = VF_EXCEPTION;
-    VF_ERROR("error while reading pkcs#7 envelope\n");
+    VF_ERROR("error while allocating key\n");
     goto end;
   }
 
-  store = X509_STORE_new();
-  if (store == NULL) {
+  k->store = X509_STORE_new();
+  if (k->store == NULL) {
     rv = VF_EXCEPTION;
     VF_ERROR("error while creating certificate store\n");
     goto end;
   }
 
-  certs = sk_X509_new_null();
-  if (certs == NULL) {
+  k->certs = sk_X509_new_null();
+  if (k->certs == NULL) {
     rv = VF_EXCEPTION;
     VF_ERROR("error while creating stack of certificates\n");
     goto end;
   }
 
-  cert = PEM_read_bio_X509(bio_pubkey, NULL, NULL, NULL);
-  if (cert == NULL) {
+  k->cert = PEM_read_bio_X509(bio_pubkey, NULL, NULL, NULL);
+  if (k->cert == NULL) {
     rv = VF_EXCEPTION;
     VF_ERROR("error while reading certificate\n");
     goto end;
   }
 
-  if (0 == sk_X509_push(certs, cert)) {
+  if (0 == sk_X509_push(k->certs, k->cert)) {
     rv = VF_EXCEPTION;
     VF_ERROR("error while inserting certificate into stack\n");
     goto end;
   }
 
+  if (1 != X509_digest(k->cert, VF_md(NID_sha256), k->fingerprint, NULL)) {
+    rv = VF_EXCEPTION;
+    VF_ERROR("error while computing certificate fingerprint\n");
+    goto end;
+  }
+
+  if (!VF_signer_id(X509_get_issuer_name(k->cert),
+                    X509_get_serialNumber(k->cert), k->signer)) {
+    rv = VF_EXCEPTION;
+    VF_ERROR("error while computing certificate signer id\n");
+    goto end;
+  }
+
+  // The public key is only needed by the direct verification path, which
+  // falls back to PKCS7_verify without it, so failing to decode it or to set
+  // up its contexts here is not an error.  It is owned by the certificate
+  ERR_set_mark();
+  k->pkey = X509_get0_pubkey(k->cert);
+  if (k->pkey != NULL && prepare) {
+    VF_key_prepare(k);
+  }
+  ERR_pop_to_mark();
+
+end:
+  if (!BIO_free(bio_pubkey)) {
+    rv = VF_EXCEPTION;
+    VF_ERROR("error while freeing public key OpenSSL buffer\n");
+  }
+
+  if (rv == VF_SUCCESS) {
+    *key = k;
+  } else {
+    VF_key_free(k);
+  }
+
+  return rv;
+}
+
+void VF_key_free(struct VF_key *key) {
+  if (key == NULL) {
+    return;
+  }
+  for (int i = 0; i < VF_KEY_TEMPLATES; i++) {
+    EVP_PKEY_CTX_free(key->templates[i]);
+  }
+  X509_STORE_free(key->store);
+  sk_X509_free(key->certs);
+  X509_free(key->cert);
+  free(key);
+}
+
+const uint8_t *VF_key_fingerprint(struct VF_key *key) {
+  return key->fingerprint;
+}
+
+const uint8_t *VF_key_signer(const struct VF_key *key) { return key->signer; }
+
+void VF_key_set_flags(struct VF_key *key, int flags) { key->flags = flags; }
+
+VF_return_t VF_key_set_region(struct VF_key *key, const char *region,
+                              size_t region_l) {
+  if (region_l >= VF_REGION_SIZE || memchr(region, '\0', region_l) != NULL) {
+    VF_ERROR("region is too long for a key\n");
+    return VF_EXCEPTION;
+  }
+  memcpy(key->region, region, region_l);
+  key->region[region_l] = '\0';
+  return VF_SUCCESS;
+}
+
+const char *VF_key_region(const struct VF_key *key) { return key->region; }
+
+// Find the signer and digest of an envelope which can be verified without
+// going through PKCS7_verify.  Envelopes from the metadata service are
+// signatures with a single signer, which is the certificate of the key, and a
+// single digest algorithm, so verifying one is a digest of the document, a
+// comparison with the messageDigest attribute and a single public key
+// operation over the signed attributes.  Anything else, including any
+// envelope which PKCS7_verify would treat as an exception rather than a failed
+// signature, returns VF_FALLBACK without touching the error queue
+static VF_return_t VF_direct_signer(struct VF_key *key, PKCS7 *p7,
+                                    PKCS7_SIGNER_INFO **si,
+                                    const EVP_MD **md) {
+  STACK_OF(PKCS7_SIGNER_INFO) *sinfos;
+
+  if (key->pkey == NULL || (key->flags & VF_KEY_GENERIC) ||
+      !PKCS7_type_is_signed(p7) || p7->d.sign == NULL) {
+    return VF_FALLBACK;
+  }
+
+  // PKCS7_verify digests the document with every algorithm in the envelope,
+  // and any it doesn't know is an exception, so only the case where the signer
+  // uses the one algorithm there is is handled here.  The digest has to be
+  // named by its own OID, rather than a signature OID which OpenSSL also
+  // accepts, so that the digest is the same one that PKCS7_verify uses
+  sinfos = PKCS7_get_signer_info(p7);
+  if (sk_PKCS7_SIGNER_INFO_num(sinfos) != 1 ||
+      sk_X509_ALGOR_num(p7->d.sign->md_algs) != 1) {
+    return VF_FALLBACK;
+  }
+  *si = sk_PKCS7_SIGNER_INFO_value(sinfos, 0);
+  *md = VF_md(OBJ_obj2nid((*si)->digest_alg->algorithm));
+  if (*md == NULL ||
+      OBJ_obj2nid((*si)->digest_alg->algorithm) != EVP_MD_type(*md) ||
+      OBJ_obj2nid(sk_X509_ALGOR_value(p7->d.sign->md_algs, 0)->algorithm) !=
+          EVP_MD_type(*md)) {
+    return VF_FALLBACK;
+  }
+
+  // A signer which is not the key's certificate is an exception, which is
+  // left to PKCS7_verify to report
+  if ((*si)->issuer_and_serial == NULL ||
+      0 != ASN1_INTEGER_cmp(X509_get_serialNumber(key->cert),
+                            (*si)->issuer_and_serial->serial) ||
+      0 != X509_NAME_cmp(X509_get_issuer_name(key->cert),
+                         (*si)->issuer_and_serial->issuer)) {
+    return VF_FALLBACK;
+  }
+
+  return VF_SUCCESS;
+}
+
+// Check the signature of a signer from VF_direct_signer given the digest of
+// the document.  This does exactly what PKCS7_signatureVerify does, and
+// returns the same outcome, or VF_FALLBACK when the public key context can't
+// be set up
+static VF_return_t VF_direct_signature(struct VF_ctx *ctx, struct VF_key *key,
+                                       PKCS7_SIGNER_INFO *si,
+                                       const EVP_MD *md,
+                                       const uint8_t *md_document,
+                                       unsigned int md_document_l) {
+  STACK_OF(X509_ATTRIBUTE) *attrs;
+  ASN1_OCTET_STRING *message_digest;
+  EVP_PKEY_CTX *pkey_ctx;
+  uint8_t md_attrs[EVP_MAX_MD_SIZE];
+  unsigned int md_attrs_l;
+  uint8_t *signed_attrs, *p;
+  int signed_attrs_l;
+  VF_return_t rv = VF_FALLBACK;
+
+  ERR_set_mark();
+
+  // With signed attributes, the signature is over the attributes, which have
+  // to include the digest of the document.  Without them, it is over the
+  // digest of the document itself.  A mismatch is a failed signature, just
+  // like any other failure in PKCS7_signatureVerify
+  attrs = si->auth_attr;
+  if (attrs != NULL && sk_X509_ATTRIBUTE_num(attrs) != 0) {
+    message_digest = PKCS7_digest_from_attributes(attrs);
+    if (message_digest == NULL ||
+        message_digest->length != (int)md_document_l ||
+        0 != memcmp(message_digest->data, md_document, md_document_l)) {
+      rv = VF_FAIL;
+      goto end;
+    }
+
+    // The attributes are measured first so that they can be encoded into
+    // the scratch buffer, instead of a buffer allocated by ASN1_item_i2d
+    signed_attrs_l = ASN1_item_i2d((ASN1_VALUE *)attrs, NULL,
+                                   ASN1_ITEM_rptr(PKCS7_ATTR_VERIFY));
+    signed_attrs =
+        signed_attrs_l > 0 ? VF_ctx_scratch(ctx, signed_attrs_l) : NULL;
+    p = signed_attrs;
+    if (signed_attrs == NULL ||
+        signed_attrs_l != ASN1_item_i2d((ASN1_VALUE *)attrs, &p,
+                                        ASN1_ITEM_rptr(PKCS7_ATTR_VERIFY)) ||
+        !VF_ctx_digest(ctx, signed_attrs, signed_attrs_l, md_attrs,
+                       &md_attrs_l, md)) {
+      rv = VF_FAIL;
+      goto end;
+    }
+  } else {
+    memcpy(md_attrs, md_document, md_document_l);
+    md_attrs_l = md_document_l;
+  }
+
+  pkey_ctx = VF_ctx_pkey(ctx, key, md);
+  if (pkey_ctx == NULL) {
+    goto end;
+  }
+
+  if (1 == EVP_PKEY_verify(pkey_ctx, si->enc_digest->data,
+                           si->enc_digest->length, md_attrs, md_attrs_l)) {
+    rv = VF_SUCCESS;
+  } else {
+    rv = VF_FAIL;
+  }
+
+end:
+  // A failed signature leaves nothing in the error queue, which matches what
+  // VF_verify_pkcs7 does with the errors from PKCS7_verify
+  ERR_pop_to_mark();
+  return rv;
+}
+
+// Verify an envelope without going through PKCS7_verify, when it is one that
+// VF_direct_signer accepts, and otherwise return VF_FALLBACK
+static VF_return_t VF_verify_direct(struct VF_ctx *ctx, struct VF_key *key,
+                                    PKCS7 *p7, uint8_t *document,
+                                    uint64_t document_l) {
+  PKCS7_SIGNER_INFO *si;
+  const EVP_MD *md;
+  uint8_t md_document[EVP_MAX_MD_SIZE];
+  unsigned int md_document_l;
+  VF_return_t rv;
+
+  // The document is always the one passed in, even when the envelope carries
+  // a copy of it, because PKCS7_verify digests its input instead of the
+  // content when it is given both
+  rv = VF_direct_signer(key, p7, &si, &md);
+  if (rv == VF_SUCCESS) {
+    ERR_set_mark();
+    rv = VF_ctx_digest(ctx, document, document_l, md_document,
+                       &md_document_l, md)
+             ? VF_SUCCESS
+             : VF_FALLBACK;
+    ERR_pop_to_mark();
+  }
+  if (rv == VF_SUCCESS) {
+    rv = VF_direct_signature(ctx, key, si, md, md_document, md_document_l);
+  }
+
+  if (rv == VF_FALLBACK) {
+    VF_LOG("falling back to PKCS7_verify\n");
+  }
+  return rv;
+}
+
+// Verify the signature in an already parsed envelope over the document
+static VF_return_t VF_verify_pkcs7(struct VF_ctx *ctx, struct VF_key *key,
+                                   PKCS7 *p7, uint8_t *document,
+                                   uint64_t document_l) {
+  VF_return_t rv = VF_verify_direct(ctx, key, p7, document, document_l);
+  if (rv != VF_FALLBACK) {
+    return rv;
+  }
+
+  // PKCS7_verify copies a memory BIO into a read only one of its own, and
+  // OpenSSL 3.0 leaks the copy when it can't set up the envelope's digests.
+  // The document is read through a null filter, which is not a memory BIO,
+  // so that no copy is made.  If the filter can't be allocated, BIO_push
+  // returns the memory BIO itself
+  BIO *bio_mem = BIO_new_mem_buf(document, document_l);
+  BIO *bio_document = BIO_push(BIO_new(BIO_f_null()), bio_mem);
+
   // NOVERIFY is set to avoid validating the certificate chain for signing.
   // Since the signatures this library is designed to verify will always be
   // self-signed, the NOVERIFY option is required for the verification to work
-  if (1 == PKCS7_verify(p7, certs, store, bio_document, NULL,
+  if (1 == PKCS7_verify(p7, key->certs, key->store, bio_document, NULL,
                         PKCS7_NOINTERN | PKCS7_NOVERIFY)) {
     rv = VF_SUCCESS;
   } else {
@@ -125,11 +949,12 @@ VF_return_t VF_verify(uint8_t *pubkey, uint64_t pubkey_l, uint8_t *document,
     // verification error or not.  If it is, mark this invocation of VF_verify
     // as VF_FAIL, then clear the error queue so that if future errors occur,
     // handle them as exceptions.  This also ensures that exceptions during
-    // verification are handled differently to invalid signatures
+    // verification are handled differently to invalid signatures.  OpenSSL 3
+    // has no function codes, but the reason is only ever raised by
+    // PKCS7_signatureVerify and PKCS7_verify, so it is enough on its own
     unsigned long errorNum = ERR_peek_last_error();
 
     if (ERR_GET_LIB(errorNum) == ERR_LIB_PKCS7 &&
-        ERR_GET_FUNC(errorNum) == PKCS7_F_PKCS7_VERIFY &&
         ERR_GET_REASON(errorNum) == PKCS7_R_SIGNATURE_FAILURE) {
       ERR_clear_error();
       rv = VF_FAIL;
@@ -139,79 +964,1186 @@ VF_return_t VF_verify(uint8_t *pubkey, uint64_t pubkey_l, uint8_t *document,
     }
   }
 
-end:
-  if (!BIO_free(bio_document)) {
-    rv = VF_EXCEPTION;
-    VF_ERROR("error while freeing document OpenSSL buffer\n");
-  }
+  BIO_free_all(bio_document);
 
-  if (!BIO_free(bio_pubkey)) {
-    rv = VF_EXCEPTION;
-    VF_ERROR("error while freeing public key OpenSSL buffer\n");
-  }
+  return rv;
+}
 
-  if (!BIO_free(bio_pkcs7)) {
-    rv = VF_EXCEPTION;
-    VF_ERROR("error while freeing pkcs7 signature OpenSSL buffer\n");
+// Take the oldest error from the thread's error queue, along with the file,
+// line and function which raised it.  Before OpenSSL 3, the function is the
+// name of the function code in the error
+static unsigned long VF_get_error(const char **file, int *line,
+                                  const char **func) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  return ERR_get_error_all(file, line, func, NULL, NULL);
+#else
+  unsigned long e = ERR_get_error_line(file, line);
+  *func = ERR_func_error_string(e);
+  return e;
+#endif
+}
+
+// Copy a function name into an errbuf entry, cutting it short if it does not
+// fit
+static void VF_errbuf_set_func(struct VF_errbuf_entry *entry,
+                               const char *func) {
+  if (func == NULL) {
+    func = "";
   }
+  snprintf(entry->func, VF_ERRBUF_FUNC_SIZE, "%s", func);
+}
 
-  PKCS7_free(p7);
-  X509_STORE_free(store);
-  sk_X509_free(certs);
-  X509_free(cert);
+// Copy a file name into an errbuf entry, keeping the end of the name if it
+// does not fit because that is the part which identifies the file
+static void VF_errbuf_set_file(struct VF_errbuf_entry *entry,
+                               const char *file) {
+  size_t file_l;
 
-  struct Error *head = NULL;
+  if (file == NULL) {
+    file = "";
+  }
+  file_l = strlen(file);
+  if (file_l >= VF_ERRBUF_FILE_SIZE) {
+    file += file_l - (VF_ERRBUF_FILE_SIZE - 1);
+    file_l = VF_ERRBUF_FILE_SIZE - 1;
+  }
+  memcpy(entry->file, file, file_l + 1);
+}
 
-  unsigned long errorNum = ERR_peek_error();
+// Drain the OpenSSL error queue into the errbuf, without allocating.  Any
+// error in the queue turns the outcome into a VF_EXCEPTION, which is
+// returned.  The code is the class of error to report for a VF_EXCEPTION
+static VF_return_t VF_collect_errors(struct VF_ctx *ctx, VF_return_t rv,
+                                     int code, struct VF_errbuf *errbuf) {
+  unsigned long errorNum;
+  const char *file, *func;
+  int line;
+  int lib = 0;
 
-  if (!errorNum && rv == VF_EXCEPTION) {
+  if (errbuf != NULL) {
+    errbuf->count = 0;
+    errbuf->dropped = 0;
+  }
+
+  if (ERR_peek_error() && rv != VF_EXCEPTION) {
+    rv = VF_EXCEPTION;
+    code = VF_E_INTERNAL;
+    VF_ERROR("error in error queue for VF_SUCCESS or VF_FAIL, marking "
+             "VF_EXCEPTION\n");
+  }
+
+  // The queue is oldest first, so the root-most cause is stored first.  When
+  // there are more errors than fit, the highest level ones are dropped
+  while (0 != (errorNum = VF_get_error(&file, &line, &func))) {
+    if (lib == 0) {
+      lib = ERR_GET_LIB(errorNum);
+    }
+    if (errbuf == NULL) {
+      continue;
+    } else if (errbuf->count < VF_ERRBUF_SIZE) {
+      struct VF_errbuf_entry *entry = &errbuf->entries[errbuf->count++];
+      entry->code = errorNum;
+      VF_errbuf_set_file(entry, file);
+      VF_errbuf_set_func(entry, func);
+      entry->line = line;
+      entry->reason = NULL;
+    } else {
+      errbuf->dropped++;
+    }
+  }
+
+  if (ctx != NULL) {
+    VF_stats_record(ctx, rv, code, lib);
+  }
+
+  if (errbuf == NULL) {
+    return rv;
+  }
+
+  if (rv == VF_EXCEPTION && errbuf->count == 0) {
     // This case is for there being an exception signaled in this file but
     // there isn't a corresponding error in the OpenSSL error queue.  Ideally,
     // we'd use ERR_put_error to insert error messages which we could use to
     // display using a single error reporting system.
-    head = malloc(sizeof(struct Error));
-    head->reason = "Exception";
-    head->file = __FILE__;
-    head->lib = "IID-Verify";
-    head->func = "VF_verify";
-    head->next = NULL;
-    head->line = __LINE__;
-    *err = head;
+    errbuf->entries[0].code = 0;
+    VF_errbuf_set_file(&errbuf->entries[0], __FILE__);
+    VF_errbuf_set_func(&errbuf->entries[0], "VF_verify");
+    errbuf->entries[0].line = __LINE__;
+    errbuf->entries[0].reason = NULL;
+    errbuf->count = 1;
     VF_ERROR(
         "unknown error occured during validation, using placeholder error\n");
-  } else if (errorNum && err == NULL) {
+  }
+
+  if (rv == VF_SUCCESS) {
+    errbuf->code = VF_E_NONE;
+  } else if (rv == VF_FAIL) {
+    errbuf->code = VF_E_SIGNATURE;
+  } else {
+    errbuf->code = code;
+  }
+
+  return rv;
+}
+
+VF_return_t VF_errbuf_exception(int code, struct VF_errbuf *errbuf) {
+  return VF_collect_errors(NULL, VF_EXCEPTION, code, errbuf);
+}
+
+// Return the library and reason strings for an errbuf entry.  An entry with
+// a code of zero is for an exception which did not have a corresponding
+// OpenSSL error
+static void VF_errbuf_strings(const struct VF_errbuf_entry *entry,
+                              const char **lib, const char **reason) {
+  if (entry->code == 0) {
+    *lib = "IID-Verify";
+    *reason = entry->reason != NULL ? entry->reason : "Exception";
+  } else {
+    *lib = ERR_lib_error_string(entry->code);
+    *reason = ERR_reason_error_string(entry->code);
+  }
+}
+
+int VF_errbuf_fmt(const struct VF_errbuf *errbuf, uint32_t i, char *buf,
+                  size_t buf_l) {
+  const char *lib, *reason;
+
+  if (i >= errbuf->count) {
+    return -1;
+  }
+
+  // The list is reported highest level first, which is the reverse of the
+  // order that the entries are stored
+  const struct VF_errbuf_entry *entry = &errbuf->entries[errbuf->count - 1 - i];
+  VF_errbuf_strings(entry, &lib, &reason);
+
+  return snprintf(buf, buf_l, "%s %s:%d %s %s", lib, entry->file, entry->line,
+                  entry->func, reason);
+}
+
+// Build the linked list of Error structs that VF_verify has always returned
+// from an errbuf filled in by VF_collect_errors.  No list is built unless the
+// outcome is VF_EXCEPTION
+static void VF_errbuf_to_list(VF_return_t rv, const struct VF_errbuf *errbuf,
+                              struct Error **err) {
+  struct Error *head = NULL;
+
+  if (err == NULL || rv != VF_EXCEPTION) {
+    return;
+  }
+
+  for (uint32_t i = 0; i < errbuf->count; i++) {
+    // The file and function names are stored in the same allocation as the
+    // struct so that VF_err_free still only has to free each struct
+    size_t file_l = strlen(errbuf->entries[i].file) + 1;
+    size_t func_l = strlen(errbuf->entries[i].func) + 1;
+    struct Error *new = malloc(sizeof(struct Error) + file_l + func_l);
+    if (new == NULL) {
+      VF_ERROR("could not allocate Error struct\n");
+      break;
+    }
+
+    VF_errbuf_strings(&errbuf->entries[i], &new->lib, &new->reason);
+    new->file = memcpy((char *)(new + 1), errbuf->entries[i].file, file_l);
+    new->func = memcpy((char *)(new + 1) + file_l, errbuf->entries[i].func,
+                       func_l);
+    new->line = errbuf->entries[i].line;
+    new->next = head;
+    head = new;
+    VF_ERROR("adding new error to list: %s %s %s\n", new->lib, new->func,
+             new->reason);
+  }
+
+  *err = head;
+}
+
+// The limits which inputs are checked against.  Each field is read and
+// written on its own with atomics, so that no lock is needed
+static struct VF_limits VF_limits_current = {0, 0, 0, 0};
+
+void VF_limits_set(const struct VF_limits *limits) {
+  __atomic_store_n(&VF_limits_current.document_l, limits->document_l,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&VF_limits_current.pkcs7_l, limits->pkcs7_l,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&VF_limits_current.pubkey_l, limits->pubkey_l,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&VF_limits_current.structure, limits->structure,
+                   __ATOMIC_RELAXED);
+}
+
+void VF_limits_get(struct VF_limits *limits) {
+  limits->document_l =
+      __atomic_load_n(&VF_limits_current.document_l, __ATOMIC_RELAXED);
+  limits->pkcs7_l = __atomic_load_n(&VF_limits_current.pkcs7_l,
+                                    __ATOMIC_RELAXED);
+  limits->pubkey_l = __atomic_load_n(&VF_limits_current.pubkey_l,
+                                     __ATOMIC_RELAXED);
+  limits->structure = __atomic_load_n(&VF_limits_current.structure,
+                                      __ATOMIC_RELAXED);
+}
+
+static int VF_limit_allows(uint64_t *limit, uint64_t length) {
+  uint64_t l = __atomic_load_n(limit, __ATOMIC_RELAXED);
+  return l == 0 || length <= l;
+}
+
+// Check the lengths of the inputs of a call, with 0 for an input which is
+// not given.  Returns NULL when they are within the limits, or the reason
+// that they are not.  The envelope is checked first, as it is read first
+static const char *VF_limits_lengths(uint64_t pubkey_l, uint64_t document_l,
+                                     uint64_t pkcs7_l) {
+  if (!VF_limit_allows(&VF_limits_current.pkcs7_l, pkcs7_l)) {
+    return "signature too long";
+  }
+  if (!VF_limit_allows(&VF_limits_current.document_l, document_l)) {
+    return "document too long";
+  }
+  if (!VF_limit_allows(&VF_limits_current.pubkey_l, pubkey_l)) {
+    return "public key too long";
+  }
+  return NULL;
+}
+
+int VF_limits_allow(uint64_t pubkey_l, uint64_t document_l, uint64_t pkcs7_l) {
+  return NULL == VF_limits_lengths(pubkey_l, document_l, pkcs7_l);
+}
+
+// The content type of a signedData envelope, without its tag and length
+static const uint8_t VF_signed_data[] = {0x2a, 0x86, 0x48, 0x86, 0xf7,
+                                         0x0d, 0x01, 0x07, 0x02};
+
+// The most of the start of an envelope which is decoded to check it, which
+// is enough for the SEQUENCE header with a length of up to 8 bytes and for
+// the content type with one of up to 8 bytes
+#define VF_PRECHECK_PREFIX 32
+#define VF_PRECHECK_INDEFINITE UINT64_MAX
+
+// Read the BER length at der + *i, which is VF_PRECHECK_INDEFINITE for the
+// indefinite form.  Lengths which don't fit in a long are rejected, as
+// OpenSSL does
+static const char *VF_precheck_length(const uint8_t *der, uint64_t der_l,
+                                      uint64_t *i, uint64_t *length) {
+  uint8_t n;
+
+  if (*i >= der_l) {
+    return "envelope truncated";
+  }
+  n = der[(*i)++];
+  if (!(n & 0x80)) {
+    *length = n;
+    return NULL;
+  }
+
+  n &= 0x7f;
+  if (n == 0) {
+    *length = VF_PRECHECK_INDEFINITE;
+    return NULL;
+  }
+  if (n > 8) {
+    return "bad length";
+  }
+  for (*length = 0; n > 0; n--) {
+    if (*i >= der_l) {
+      return "envelope truncated";
+    }
+    *length = *length << 8 | der[(*i)++];
+  }
+  return *length > INT64_MAX ? "bad length" : NULL;
+}
+
+// Check the start of a DER envelope, of which der_l bytes are given, and
+// which is at most total_l bytes long: a SEQUENCE whose length fits, which
+// starts with the signedData content type
+static const char *VF_precheck_der(const uint8_t *der, uint64_t der_l,
+                                   uint64_t total_l) {
+  uint64_t i = 1, length;
+  const char *reason;
+
+  if (der_l == 0) {
+    return "envelope truncated";
+  }
+  if (der[0] != 0x30) {
+    return "not a sequence";
+  }
+  if (NULL != (reason = VF_precheck_length(der, der_l, &i, &length))) {
+    return reason;
+  }
+  if (length != VF_PRECHECK_INDEFINITE && i + length > total_l) {
+    return "bad length";
+  }
+
+  if (i >= der_l) {
+    return "envelope truncated";
+  }
+  if (der[i++] != 0x06) {
+    return "not signed data";
+  }
+  if (NULL != (reason = VF_precheck_length(der, der_l, &i, &length))) {
+    return reason;
+  }
+  if (length != sizeof(VF_signed_data)) {
+    return "not signed data";
+  }
+  if (der_l - i < sizeof(VF_signed_data)) {
+    return "envelope truncated";
+  }
+  if (0 != memcmp(der + i, VF_signed_data, sizeof(VF_signed_data))) {
+    return "not signed data";
+  }
+  return NULL;
+}
+
+// The start of an envelope, decoded from base64 one character at a time
+struct VF_precheck_prefix {
+  uint8_t der[VF_PRECHECK_PREFIX];
+  uint64_t der_l;
+  uint32_t acc;
+  int bits;
+  int done;
+};
+
+// Decode one character of base64 text into the prefix, which is rejected
+// where VF_base64_decode would reject it.  Decoding stops once the prefix is
+// full or at padding.  In the body of a PEM file, every control character is
+// taken as whitespace, since OpenSSL drops them from the end of each line,
+// and a '-' starts the END line
+static const char *VF_precheck_decode(struct VF_precheck_prefix *prefix,
+                                      uint8_t c, int pem) {
+  uint8_t v = b64_table[c];
+
+  if (prefix->done) {
+    return NULL;
+  } else if (pem && c == '-') {
+    prefix->done = 1;
+    return NULL;
+  } else if (v == 0x40 || (pem && c <= ' ')) {
+    return NULL;
+  } else if (v == 0x41) {
+    // Whatever follows the padding is left to the decoder
+    prefix->done = 1;
+    return NULL;
+  } else if (v == 0xff) {
+    return "invalid base64";
+  }
+
+  prefix->acc = (prefix->acc << 6) | v;
+  prefix->bits += 6;
+  if (prefix->bits >= 8) {
+    prefix->bits -= 8;
+    prefix->der[prefix->der_l++] = (uint8_t)(prefix->acc >> prefix->bits);
+    prefix->done = prefix->der_l == VF_PRECHECK_PREFIX;
+  }
+  return NULL;
+}
+
+static int VF_precheck_starts(const uint8_t *in, uint64_t in_l,
+                              const char *prefix) {
+  size_t prefix_l = strlen(prefix);
+  return in_l >= prefix_l && 0 == memcmp(in, prefix, prefix_l);
+}
+
+// OpenSSL reads a PEM file in pieces of up to this many bytes, so a longer
+// line can hold a BEGIN or END line which OpenSSL finds and this doesn't
+#define VF_PRECHECK_PEM_LINE 254
+
+// Check a PEM file in one pass over its lines.  It must have a label which
+// OpenSSL reads PKCS#7 from, including CERTIFICATE, which some CAs use, and
+// which it looks for past any other labels.  The block must have an END line
+// and the start of its body is decoded and checked.  A PEM file with
+// headers, or with lines too long to tell where OpenSSL finds its labels, is
+// left to OpenSSL
+static const char *VF_precheck_pem(const uint8_t *pem, uint64_t pem_l) {
+  struct VF_precheck_prefix prefix = {{0}, 0, 0, 0, 0};
+  uint64_t body = 0;
+  int long_line = 0;
+  const char *reason;
+
+  for (uint64_t i = 0; i < pem_l;) {
+    const uint8_t *line = pem + i;
+    uint64_t line_l = 0, rest = pem_l - i;
+    int label = 0;
+
+    if (body == 0) {
+      label = VF_precheck_starts(line, rest, "-----BEGIN PKCS7-----") ||
+              VF_precheck_starts(line, rest,
+                                 "-----BEGIN PKCS #7 SIGNED DATA-----") ||
+              VF_precheck_starts(line, rest, "-----BEGIN CERTIFICATE-----");
+    } else if (VF_precheck_starts(line, rest, "-----END ")) {
+      return VF_precheck_der(prefix.der, prefix.der_l, (i - body) / 4 * 3);
+    }
+
+    for (; line_l < rest && line[line_l] != '\n'; line_l++) {
+      if (body == 0 || prefix.done) {
+        continue;
+      } else if (line[line_l] == ':') {
+        return NULL;
+      } else if (NULL !=
+                 (reason = VF_precheck_decode(&prefix, line[line_l], 1))) {
+        return reason;
+      }
+    }
+
+    long_line |= line_l >= VF_PRECHECK_PEM_LINE;
+    i += line_l + 1;
+    if (label) {
+      body = i;
+    }
+  }
+
+  if (long_line) {
+    return NULL;
+  }
+  return body == 0 ? "no pkcs7 pem label" : "no pem end line";
+}
+
+// Check that an envelope looks like one, in the way that VF_read_pkcs7 reads
+// it.  DER and base64 envelopes are only read as far as the start which is
+// checked, and PEM files are read once up to their END line
+static const char *VF_precheck_pkcs7(const uint8_t *pkcs7, uint64_t pkcs7_l) {
+  static const char pem_begin[] = "-----BEGIN";
+  struct VF_precheck_prefix prefix = {{0}, 0, 0, 0, 0};
+  const char *reason;
+
+  // The envelope is trimmed and classified as VF_read_pkcs7 does, which
+  // keeps trailing whitespace bytes which are part of a DER envelope
+  while (pkcs7_l > 0 && b64_table[pkcs7[0]] == 0x40) {
+    pkcs7++;
+    pkcs7_l--;
+  }
+  if (pkcs7_l >= 2 && pkcs7[0] == 0x30 && (pkcs7[1] & 0x80)) {
+    return VF_precheck_der(
+        pkcs7, pkcs7_l < VF_PRECHECK_PREFIX ? pkcs7_l : VF_PRECHECK_PREFIX,
+        pkcs7_l);
+  }
+  while (pkcs7_l > 0 && b64_table[pkcs7[pkcs7_l - 1]] == 0x40) {
+    pkcs7_l--;
+  }
+
+  if (pkcs7_l == 0) {
+    return "empty envelope";
+  }
+
+  if (pkcs7_l >= sizeof(pem_begin) - 1 &&
+      0 == memcmp(pkcs7, pem_begin, sizeof(pem_begin) - 1)) {
+    return VF_precheck_pem(pkcs7, pkcs7_l);
+  }
+
+  for (uint64_t i = 0; i < pkcs7_l && !prefix.done; i++) {
+    if (NULL != (reason = VF_precheck_decode(&prefix, pkcs7[i], 0))) {
+      return reason;
+    }
+  }
+  return VF_precheck_der(prefix.der, prefix.der_l, pkcs7_l / 4 * 3);
+}
+
+// Check the inputs of a call against the limits before any of them is
+// parsed, with a pubkey_l or document_l of 0 for an input which is not given
+// and a NULL pkcs7 for a raw signature.  Returns NULL when they pass, or the
+// reason that they don't
+static const char *VF_precheck(uint64_t pubkey_l, uint64_t document_l,
+                               const uint8_t *pkcs7, uint64_t pkcs7_l) {
+  const char *reason = VF_limits_lengths(pubkey_l, document_l, pkcs7_l);
+
+  if (reason == NULL && pkcs7 != NULL &&
+      __atomic_load_n(&VF_limits_current.structure, __ATOMIC_RELAXED)) {
+    reason = VF_precheck_pkcs7(pkcs7, pkcs7_l);
+  }
+  return reason;
+}
+
+// Record an input rejected by VF_precheck as a VF_EXCEPTION with the code
+// VF_E_MALFORMED.  Nothing was given to OpenSSL, so the only error is one
+// with the reason.  ctx is NULL when the call is not a verification, which
+// is not counted
+static VF_return_t VF_reject(struct VF_ctx *ctx, const char *reason,
+                             struct VF_errbuf *errbuf) {
+  VF_ERROR("input rejected before parsing: %s\n", reason);
+  if (ctx != NULL) {
+    VF_stats_record(ctx, VF_EXCEPTION, VF_E_MALFORMED, 0);
+  }
+  if (errbuf != NULL) {
+    errbuf->code = VF_E_MALFORMED;
+    errbuf->count = 1;
+    errbuf->dropped = 0;
+    errbuf->entries[0].code = 0;
+    VF_errbuf_set_file(&errbuf->entries[0], __FILE__);
+    VF_errbuf_set_func(&errbuf->entries[0], "VF_precheck");
+    errbuf->entries[0].line = __LINE__;
+    errbuf->entries[0].reason = reason;
+  }
+  return VF_EXCEPTION;
+}
+
+VF_return_t VF_key_load_errbuf(uint8_t *pubkey, uint64_t pubkey_l,
+                               struct VF_key **key, struct VF_errbuf *errbuf) {
+  ERR_clear_error();
+  const char *malformed = VF_precheck(pubkey_l, 0, NULL, 0);
+  if (malformed != NULL) {
+    *key = NULL;
+    return VF_reject(NULL, malformed, errbuf);
+  }
+
+  VF_return_t rv = VF_parse_key(pubkey, pubkey_l, 1, key);
+  rv = VF_collect_errors(NULL, rv, VF_E_PUBKEY, errbuf);
+  if (rv != VF_SUCCESS) {
+    // An error can be left in the queue even when parsing succeeded, and in
+    // that case the key must not be handed out
+    VF_key_free(*key);
+    *key = NULL;
+  }
+  return rv;
+}
+
+VF_return_t VF_key_load(uint8_t *pubkey, uint64_t pubkey_l,
+                        struct VF_key **key, struct Error **err) {
+  struct VF_errbuf errbuf;
+  VF_return_t rv = VF_key_load_errbuf(pubkey, pubkey_l, key, &errbuf);
+  VF_errbuf_to_list(rv, &errbuf, err);
+  return rv;
+}
+
+VF_return_t VF_ctx_verify(struct VF_ctx *ctx, struct VF_key *key,
+                          uint8_t *document, uint64_t document_l,
+                          uint8_t *pkcs7, uint64_t pkcs7_l,
+                          struct VF_errbuf *errbuf) {
+  // We want to clear the OpenSSL Error queue so that we know when we're in the
+  // cleanup section, any errors we hit are the result of this invocation
+  ERR_clear_error();
+  PKCS7 *p7 = NULL;
+  int code = VF_E_ENVELOPE;
+
+  ctx->start_ns = VF_now_ns();
+  const char *malformed = VF_precheck(0, document_l, pkcs7, pkcs7_l);
+  if (malformed != NULL) {
+    return VF_reject(ctx, malformed, errbuf);
+  }
+
+  VF_return_t rv = VF_read_pkcs7(ctx, pkcs7, pkcs7_l, &p7);
+  if (rv == VF_SUCCESS) {
+    code = VF_E_VERIFY;
+    rv = VF_verify_pkcs7(ctx, key, p7, document, document_l);
+  }
+
+  PKCS7_free(p7);
+
+  return VF_collect_errors(ctx, rv, code, errbuf);
+}
+
+VF_return_t VF_verify_key_errbuf(struct VF_key *key, uint8_t *document,
+                                 uint64_t document_l, uint8_t *pkcs7,
+                                 uint64_t pkcs7_l, struct VF_errbuf *errbuf) {
+  struct VF_ctx local;
+  struct VF_ctx *ctx = VF_ctx_acquire(&local);
+  VF_return_t rv = VF_ctx_verify(ctx, key, document, document_l, pkcs7,
+                                 pkcs7_l, errbuf);
+  VF_ctx_release(ctx, &local);
+  return rv;
+}
+
+VF_return_t VF_verify_select_errbuf(VF_key_select_t select, void *ctx,
+                                    uint8_t *document, uint64_t document_l,
+                                    uint8_t *pkcs7, uint64_t pkcs7_l,
+                                    struct VF_errbuf *errbuf,
+                                    struct VF_key **key) {
+  ERR_clear_error();
+  PKCS7 *p7 = NULL;
+  struct VF_key *selected = NULL;
+  struct VF_ctx local;
+  struct VF_ctx *vf_ctx = VF_ctx_acquire(&local);
+  int code = VF_E_ENVELOPE;
+
+  vf_ctx->start_ns = VF_now_ns();
+  const char *malformed = VF_precheck(0, document_l, pkcs7, pkcs7_l);
+  if (malformed != NULL) {
+    if (key != NULL) {
+      *key = NULL;
+    }
+    VF_return_t rv = VF_reject(vf_ctx, malformed, errbuf);
+    VF_ctx_release(vf_ctx, &local);
+    return rv;
+  }
+
+  VF_return_t rv = VF_read_pkcs7(vf_ctx, pkcs7, pkcs7_l, &p7);
+  if (rv == VF_SUCCESS) {
+    // Only an envelope with a single signer has a signer to look up, and
+    // looking it up must not leave anything in the error queue
+    STACK_OF(PKCS7_SIGNER_INFO) *sinfos = PKCS7_get_signer_info(p7);
+    PKCS7_SIGNER_INFO *si = NULL;
+    uint8_t signer[VF_FINGERPRINT_SIZE];
+    int have_signer = 0;
+    int digest_nid = NID_undef;
+
+    ERR_set_mark();
+    if (sk_PKCS7_SIGNER_INFO_num(sinfos) == 1) {
+      si = sk_PKCS7_SIGNER_INFO_value(sinfos, 0);
+      digest_nid = OBJ_obj2nid(si->digest_alg->algorithm);
+      have_signer = si->issuer_and_serial != NULL &&
+                    VF_signer_id(si->issuer_and_serial->issuer,
+                                 si->issuer_and_serial->serial, signer);
+    }
+    ERR_pop_to_mark();
+
+    selected = select(ctx, have_signer ? signer : NULL, digest_nid, document,
+                      document_l);
+    if (selected == NULL) {
+      rv = VF_EXCEPTION;
+      code = VF_E_NOKEY;
+      VF_ERROR("no key for the signer of the envelope\n");
+    } else {
+      code = VF_E_VERIFY;
+      rv = VF_verify_pkcs7(vf_ctx, selected, p7, document, document_l);
+    }
+  }
+
+  PKCS7_free(p7);
+
+  if (key != NULL) {
+    *key = selected;
+  }
+
+  rv = VF_collect_errors(vf_ctx, rv, code, errbuf);
+  VF_ctx_release(vf_ctx, &local);
+  return rv;
+}
+
+VF_return_t VF_verify_key(struct VF_key *key, uint8_t *document,
+                          uint64_t document_l, uint8_t *pkcs7,
+                          uint64_t pkcs7_l, struct Error **err) {
+  struct VF_errbuf errbuf;
+  VF_return_t rv = VF_verify_key_errbuf(key, document, document_l, pkcs7,
+                                        pkcs7_l, &errbuf);
+  VF_errbuf_to_list(rv, &errbuf, err);
+  return rv;
+}
+
+// A verification of a document which is passed in pieces.  An envelope which
+// VF_direct_signer accepts is verified by digesting each piece as it arrives,
+// with a digest context of the stream's own since the thread's context is
+// used by other verifications in between.  Any other envelope has to go
+// through PKCS7_verify, which needs the whole document, so the pieces are
+// copied into document instead.  busy_ns is the time spent in the calls so
+// far, which is counted as the latency instead of the time between calls
+struct VF_stream {
+  struct VF_key *key;
+  PKCS7 *p7;
+  PKCS7_SIGNER_INFO *si;
+  const EVP_MD *md;
+  EVP_MD_CTX *md_ctx;
+  uint8_t *document;
+  uint64_t document_l;
+  uint64_t document_cap;
+  uint64_t received_l;
+  uint64_t busy_ns;
+  int done;
+};
+
+// The smallest buffer that a stream which has to copy the document allocates
+#define VF_STREAM_MIN_BUFFER 4096
+
+void VF_stream_free(struct VF_stream *stream) {
+  if (stream == NULL) {
+    return;
+  }
+  PKCS7_free(stream->p7);
+  EVP_MD_CTX_free(stream->md_ctx);
+  free(stream->document);
+  free(stream);
+}
+
+// Finish with a stream, keeping only what is needed to report that it is
+// done, and count the outcome of the whole verification
+static VF_return_t VF_stream_done(struct VF_stream *stream,
+                                  struct VF_ctx *ctx, VF_return_t rv, int code,
+                                  uint64_t start_ns,
+                                  struct VF_errbuf *errbuf) {
+  stream->done = 1;
+  EVP_MD_CTX_free(stream->md_ctx);
+  stream->md_ctx = NULL;
+  free(stream->document);
+  stream->document = NULL;
+
+  ctx->start_ns = start_ns - stream->busy_ns;
+  return VF_collect_errors(ctx, rv, code, errbuf);
+}
+
+VF_return_t VF_stream_begin(struct VF_key *key, uint8_t *pkcs7,
+                            uint64_t pkcs7_l, struct VF_stream **stream,
+                            struct VF_errbuf *errbuf) {
+  ERR_clear_error();
+  struct VF_ctx local;
+  struct VF_ctx *ctx = VF_ctx_acquire(&local);
+  struct VF_stream *new = NULL;
+  int code = VF_E_ENVELOPE;
+  VF_return_t rv;
+
+  ctx->start_ns = VF_now_ns();
+  *stream = NULL;
+
+  const char *malformed = VF_precheck(0, 0, pkcs7, pkcs7_l);
+  if (malformed != NULL) {
+    rv = VF_reject(ctx, malformed, errbuf);
+    VF_ctx_release(ctx, &local);
+    return rv;
+  }
+
+  new = calloc(1, sizeof(struct VF_stream));
+  if (new == NULL) {
+    VF_ERROR("could not allocate stream\n");
     rv = VF_EXCEPTION;
-    VF_ERROR("error in error queue for VF_SUCCESS or VF_FAIL, marking "
-             "VF_EXCEPTION\n");
-  } else if (errorNum && err != NULL) {
+    code = VF_E_INTERNAL;
+    goto end;
+  }
+  new->key = key;
+
+  rv = VF_read_pkcs7(ctx, pkcs7, pkcs7_l, &new->p7);
+  if (rv != VF_SUCCESS) {
+    goto end;
+  }
+
+  if (VF_SUCCESS != VF_direct_signer(key, new->p7, &new->si, &new->md)) {
+    VF_LOG("stream will be verified with PKCS7_verify\n");
+    new->si = NULL;
+    goto end;
+  }
+
+  code = VF_E_VERIFY;
+  new->md_ctx = EVP_MD_CTX_new();
+  if (new->md_ctx == NULL || 1 != EVP_DigestInit_ex(new->md_ctx, new->md,
+                                                    NULL)) {
     rv = VF_EXCEPTION;
-    VF_ERROR("error in error queue for VF_SUCCESS or VF_FAIL, marking "
-             "VF_EXCEPTION\n");
-    for (;;) {
-      struct Error *new = malloc(sizeof(struct Error));
-      errorNum = ERR_get_error_line(&new->file, &new->line);
-
-      // This break should *not* be needed because before this invocation, only
-      // the ERR_peek_error() function has been called at that point.  There
-      // shouldn't have been any removals from the error queue.  Sadly, this is
-      // not the case, since the call to ERR_get_error_line here returns a
-      // falsy value, which means that the error queue doesn't work as
-      // documented in the man page.
-      if (!errorNum) {
-        free(new);
-        break;
+  }
+
+end:
+  if (rv != VF_SUCCESS || ERR_peek_error()) {
+    VF_stream_free(new);
+    rv = VF_collect_errors(ctx, rv, code, errbuf);
+  } else {
+    // The verification isn't counted until its outcome is known
+    new->busy_ns = VF_now_ns() - ctx->start_ns;
+    *stream = new;
+    rv = VF_collect_errors(NULL, rv, code, errbuf);
+  }
+  VF_ctx_release(ctx, &local);
+  return rv;
+}
+
+VF_return_t VF_stream_update(struct VF_stream *stream, const uint8_t *chunk,
+                             uint64_t chunk_l, struct VF_errbuf *errbuf) {
+  ERR_clear_error();
+  uint64_t start_ns = VF_now_ns();
+  VF_return_t rv = VF_SUCCESS;
+  uint64_t cap;
+  uint8_t *grown;
+
+  if (stream->done) {
+    VF_ERROR("stream has already finished\n");
+    return VF_errbuf_exception(VF_E_INTERNAL, errbuf);
+  }
+
+  // The limit is on the whole document, however it is split up
+  const char *malformed =
+      VF_precheck(0, stream->received_l + chunk_l, NULL, 0);
+  if (malformed != NULL) {
+    struct VF_ctx local;
+    struct VF_ctx *ctx = VF_ctx_acquire(&local);
+    VF_stream_done(stream, ctx, VF_EXCEPTION, VF_E_MALFORMED, start_ns, NULL);
+    VF_ctx_release(ctx, &local);
+    return VF_reject(NULL, malformed, errbuf);
+  }
+  stream->received_l += chunk_l;
+
+  if (stream->si != NULL) {
+    if (1 != EVP_DigestUpdate(stream->md_ctx, chunk, chunk_l)) {
+      rv = VF_EXCEPTION;
+    }
+  } else {
+    if (stream->document_l + chunk_l > stream->document_cap) {
+      cap = stream->document_cap > 0 ? stream->document_cap
+                                     : VF_STREAM_MIN_BUFFER;
+      while (cap < stream->document_l + chunk_l) {
+        cap *= 2;
+      }
+      grown = realloc(stream->document, cap);
+      if (grown == NULL) {
+        VF_ERROR("could not grow stream document buffer\n");
+        rv = VF_EXCEPTION;
+      } else {
+        stream->document = grown;
+        stream->document_cap = cap;
       }
+    }
+    if (rv == VF_SUCCESS && chunk_l > 0) {
+      memcpy(stream->document + stream->document_l, chunk, chunk_l);
+      stream->document_l += chunk_l;
+    }
+  }
 
-      new->reason = ERR_reason_error_string(errorNum);
-      new->lib = ERR_lib_error_string(errorNum);
-      new->func = ERR_func_error_string(errorNum);
-      new->next = head;
-      head = new;
-      VF_ERROR("adding new error to list: %s %s %s\n", new->lib, new->func,
-               new->reason);
-    };
-    *err = head;
+  // A piece which can't be taken in leaves a document that can never be
+  // verified, so the stream finishes with the exception
+  if (rv != VF_SUCCESS || ERR_peek_error()) {
+    struct VF_ctx local;
+    struct VF_ctx *ctx = VF_ctx_acquire(&local);
+    rv = VF_stream_done(stream, ctx, VF_EXCEPTION,
+                        stream->si != NULL ? VF_E_VERIFY : VF_E_INTERNAL,
+                        start_ns, errbuf);
+    VF_ctx_release(ctx, &local);
+    return rv;
   }
 
+  stream->busy_ns += VF_now_ns() - start_ns;
+  return VF_collect_errors(NULL, rv, VF_E_NONE, errbuf);
+}
+
+VF_return_t VF_stream_final(struct VF_stream *stream,
+                            struct VF_errbuf *errbuf) {
+  ERR_clear_error();
+  uint64_t start_ns = VF_now_ns();
+  uint8_t md_document[EVP_MAX_MD_SIZE];
+  unsigned int md_document_l;
+  struct VF_ctx local;
+  struct VF_ctx *ctx;
+  VF_return_t rv;
+
+  if (stream->done) {
+    VF_ERROR("stream has already finished\n");
+    return VF_errbuf_exception(VF_E_INTERNAL, errbuf);
+  }
+
+  ctx = VF_ctx_acquire(&local);
+  if (stream->si == NULL) {
+    rv = VF_verify_pkcs7(ctx, stream->key, stream->p7, stream->document,
+                         stream->document_l);
+  } else if (1 != EVP_DigestFinal_ex(stream->md_ctx, md_document,
+                                     &md_document_l)) {
+    rv = VF_EXCEPTION;
+  } else {
+    // The document is gone by now, so there is nothing to fall back to
+    rv = VF_direct_signature(ctx, stream->key, stream->si, stream->md,
+                             md_document, md_document_l);
+    if (rv == VF_FALLBACK) {
+      VF_ERROR("could not set up public key context for stream\n");
+      rv = VF_EXCEPTION;
+    }
+  }
+
+  rv = VF_stream_done(stream, ctx, rv, VF_E_VERIFY, start_ns, errbuf);
+  VF_ctx_release(ctx, &local);
   return rv;
 }
+
+void VF_shared_key_clear(struct VF_shared_key *shared) {
+  VF_key_free(shared->key);
+  shared->key = NULL;
+  shared->parsed = 0;
+}
+
+// Parse the certificate of shared the first time it is needed.  A key which
+// is shared is prepared, since it is expected to verify more than once.  The
+// errors of parsing it are kept to report again for each verification
+static VF_return_t VF_shared_key_parse(struct VF_shared_key *shared) {
+  if (!shared->parsed) {
+    shared->parsed = 1;
+    shared->rv = VF_parse_key(shared->pubkey, shared->pubkey_l, 1,
+                              &shared->key);
+    if (shared->rv != VF_SUCCESS) {
+      shared->rv = VF_collect_errors(NULL, shared->rv, VF_E_PUBKEY,
+                                     &shared->errbuf);
+    }
+  }
+  return shared->rv;
+}
+
+// The verification of VF_verify_errbuf and VF_verify_shared_errbuf, which
+// parses the certificate from pubkey when shared is NULL
+static VF_return_t VF_verify_pubkey(struct VF_shared_key *shared,
+                                    uint8_t *pubkey, uint64_t pubkey_l,
+                                    uint8_t *document, uint64_t document_l,
+                                    uint8_t *pkcs7, uint64_t pkcs7_l,
+                                    struct VF_errbuf *errbuf) {
+  // We want to clear the OpenSSL Error queue so that we know when we're in the
+  // cleanup section, any errors we hit are the result of this invocation
+  ERR_clear_error();
+  PKCS7 *p7 = NULL;
+  struct VF_key *key = NULL;
+  struct VF_ctx local;
+  struct VF_ctx *ctx = VF_ctx_acquire(&local);
+  int code = VF_E_ENVELOPE;
+
+  ctx->start_ns = VF_now_ns();
+  const char *malformed = VF_precheck(pubkey_l, document_l, pkcs7, pkcs7_l);
+  if (malformed != NULL) {
+    VF_return_t rv = VF_reject(ctx, malformed, errbuf);
+    VF_ctx_release(ctx, &local);
+    return rv;
+  }
+
+  // The envelope is read before the certificate so that when both are
+  // invalid, the envelope errors are the ones reported
+  VF_return_t rv = VF_read_pkcs7(ctx, pkcs7, pkcs7_l, &p7);
+  if (rv == VF_SUCCESS) {
+    code = VF_E_PUBKEY;
+    if (shared == NULL) {
+      rv = VF_parse_key(pubkey, pubkey_l, 0, &key);
+    } else if (VF_SUCCESS != VF_shared_key_parse(shared)) {
+      // The errors were collected when it was parsed, so they are copied
+      // and counted as VF_collect_errors would have, by the library of the
+      // root-most error
+      const struct VF_errbuf *parsed = &shared->errbuf;
+      int lib = parsed->count > 0 ? ERR_GET_LIB(parsed->entries[0].code) : 0;
+      PKCS7_free(p7);
+      VF_stats_record(ctx, shared->rv, parsed->code, lib);
+      if (errbuf != NULL) {
+        memcpy(errbuf, parsed, sizeof(struct VF_errbuf));
+      }
+      VF_ctx_release(ctx, &local);
+      return shared->rv;
+    }
+  }
+  if (rv == VF_SUCCESS) {
+    code = VF_E_VERIFY;
+    rv = VF_verify_pkcs7(ctx, shared != NULL ? shared->key : key, p7, document,
+                         document_l);
+  }
+
+  PKCS7_free(p7);
+  VF_key_free(key);
+
+  rv = VF_collect_errors(ctx, rv, code, errbuf);
+  VF_ctx_release(ctx, &local);
+  return rv;
+}
+
+VF_return_t VF_verify_errbuf(uint8_t *pubkey, uint64_t pubkey_l,
+                             uint8_t *document, uint64_t document_l,
+                             uint8_t *pkcs7, uint64_t pkcs7_l,
+                             struct VF_errbuf *errbuf) {
+  return VF_verify_pubkey(NULL, pubkey, pubkey_l, document, document_l, pkcs7,
+                          pkcs7_l, errbuf);
+}
+
+VF_return_t VF_verify_shared_errbuf(struct VF_shared_key *shared,
+                                    uint8_t *document, uint64_t document_l,
+                                    uint8_t *pkcs7, uint64_t pkcs7_l,
+                                    struct VF_errbuf *errbuf) {
+  return VF_verify_pubkey(shared, shared->pubkey, shared->pubkey_l, document,
+                          document_l, pkcs7, pkcs7_l, errbuf);
+}
+
+// The longest raw signature which is accepted, which is enough for an RSA key
+// of 8192 bits, with room for the whitespace of its base64 encoding
+#define VF_RAW_SIGNATURE_SIZE 1024
+#define VF_RAW_BASE64_SIZE (VF_RAW_SIGNATURE_SIZE * 3 / 2)
+
+// Decode the base64 text of a raw signature.  Whitespace is ignored, like the
+// line breaks in the response of the metadata service
+static VF_return_t VF_read_raw(const uint8_t *signature, uint64_t signature_l,
+                               uint8_t *raw, uint64_t *raw_l) {
+  while (signature_l > 0 && b64_table[signature[0]] == 0x40) {
+    signature++;
+    signature_l--;
+  }
+  while (signature_l > 0 && b64_table[signature[signature_l - 1]] == 0x40) {
+    signature_l--;
+  }
+
+  if (signature_l == 0) {
+    VF_ERROR("empty raw signature\n");
+    return VF_EXCEPTION;
+  }
+  if (signature_l > VF_RAW_BASE64_SIZE) {
+    VF_ERROR("raw signature is too long\n");
+    return VF_EXCEPTION;
+  }
+  if (VF_SUCCESS != VF_base64_decode(signature, signature_l, raw, raw_l)) {
+    VF_ERROR("raw signature is not base64 encoded\n");
+    return VF_EXCEPTION;
+  }
+  return VF_SUCCESS;
+}
+
+// Check a PKCS#1 v1.5 signature of the SHA-256 digest of the document.  This
+// is what EVP_DigestVerify does for an RSA key, but through the public key
+// context of the thread, which is copied from the template of the key when it
+// was last used for another key
+static VF_return_t VF_raw_signature(struct VF_ctx *ctx, struct VF_key *key,
+                                    const uint8_t *document,
+                                    uint64_t document_l, const uint8_t *raw,
+                                    uint64_t raw_l) {
+  const EVP_MD *md = VF_md(NID_sha256);
+  uint8_t digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_l;
+  EVP_PKEY_CTX *pkey_ctx;
+  VF_return_t rv;
+
+  if (key->pkey == NULL || EVP_PKEY_base_id(key->pkey) != EVP_PKEY_RSA) {
+    VF_ERROR("raw signatures can only be verified with an RSA key\n");
+    return VF_EXCEPTION;
+  }
+
+  if (!VF_ctx_digest(ctx, document, document_l, digest, &digest_l, md)) {
+    VF_ERROR("error while computing document digest\n");
+    return VF_EXCEPTION;
+  }
+
+  pkey_ctx = VF_ctx_pkey(ctx, key, md);
+  if (pkey_ctx == NULL) {
+    VF_ERROR("error while setting up public key context\n");
+    return VF_EXCEPTION;
+  }
+
+  // A signature which doesn't match, including one of the wrong length, is a
+  // failed signature and leaves nothing in the error queue, as for envelopes
+  ERR_set_mark();
+  rv = 1 == EVP_PKEY_verify(pkey_ctx, raw, raw_l, digest, digest_l)
+           ? VF_SUCCESS
+           : VF_FAIL;
+  ERR_pop_to_mark();
+  return rv;
+}
+
+// Verify a raw signature with a key, which is either a key from VF_key_load
+// or, when key is NULL, the certificate in pubkey
+static VF_return_t VF_raw_verify(struct VF_key *key, uint8_t *pubkey,
+                                 uint64_t pubkey_l, uint8_t *document,
+                                 uint64_t document_l, uint8_t *signature,
+                                 uint64_t signature_l,
+                                 struct VF_errbuf *errbuf) {
+  ERR_clear_error();
+  uint8_t raw[VF_RAW_BASE64_SIZE / 4 * 3 + 3];
+  uint64_t raw_l;
+  struct VF_key *owned = NULL;
+  struct VF_ctx local;
+  struct VF_ctx *ctx = VF_ctx_acquire(&local);
+  int code = VF_E_ENVELOPE;
+
+  ctx->start_ns = VF_now_ns();
+  const char *malformed = VF_precheck(key == NULL ? pubkey_l : 0, document_l,
+                                      NULL, signature_l);
+  if (malformed != NULL) {
+    VF_return_t rv = VF_reject(ctx, malformed, errbuf);
+    VF_ctx_release(ctx, &local);
+    return rv;
+  }
+
+  // The signature is read before the certificate, as the envelope is
+  VF_return_t rv = VF_read_raw(signature, signature_l, raw, &raw_l);
+  if (rv == VF_SUCCESS && key == NULL) {
+    code = VF_E_PUBKEY;
+    rv = VF_parse_key(pubkey, pubkey_l, 0, &owned);
+    key = owned;
+  }
+  if (rv == VF_SUCCESS) {
+    code = VF_E_VERIFY;
+    rv = VF_raw_signature(ctx, key, document, document_l, raw, raw_l);
+  }
+
+  VF_key_free(owned);
+
+  rv = VF_collect_errors(ctx, rv, code, errbuf);
+  VF_ctx_release(ctx, &local);
+  return rv;
+}
+
+VF_return_t VF_verify_raw(uint8_t *pubkey, uint64_t pubkey_l,
+                          uint8_t *document, uint64_t document_l,
+                          uint8_t *signature, uint64_t signature_l,
+                          struct VF_errbuf *errbuf) {
+  return VF_raw_verify(NULL, pubkey, pubkey_l, document, document_l,
+                       signature, signature_l, errbuf);
+}
+
+VF_return_t VF_verify_raw_key(struct VF_key *key, uint8_t *document,
+                              uint64_t document_l, uint8_t *signature,
+                              uint64_t signature_l,
+                              struct VF_errbuf *errbuf) {
+  return VF_raw_verify(key, NULL, 0, document, document_l, signature,
+                       signature_l, errbuf);
+}
+
+VF_return_t VF_verify(uint8_t *pubkey, uint64_t pubkey_l, uint8_t *document,
+                      uint64_t document_l, uint8_t *pkcs7, uint64_t pkcs7_l,
+                      struct Error **err) {
+  struct VF_errbuf errbuf;
+  VF_return_t rv = VF_verify_errbuf(pubkey, pubkey_l, document, document_l,
+                                    pkcs7, pkcs7_l, &errbuf);
+  VF_errbuf_to_list(rv, &errbuf, err);
+  return rv;
+}
+
+// Whether two pubkeys have the same bytes, which they usually do because
+// they are the same buffer
+static int VF_same_bytes(const uint8_t *a, uint64_t a_l, const uint8_t *b,
+                         uint64_t b_l) {
+  return a_l == b_l && (a_l == 0 || a == b || 0 == memcmp(a, b, a_l));
+}
+
+// Whether items[i], which has pubkey bytes, is in a run of items with the
+// same bytes, because shared already holds them or the next item has them
+// too.  In the second case, shared is pointed at the bytes of items[i]
+static int VF_shared_key_run(struct VF_shared_key *shared,
+                             const struct VF_item *items, uint64_t count,
+                             uint64_t i) {
+  const struct VF_item *item = &items[i], *next = &items[i + 1];
+
+  if (shared->pubkey != NULL &&
+      VF_same_bytes(shared->pubkey, shared->pubkey_l, item->pubkey,
+                    item->pubkey_l)) {
+    return 1;
+  }
+  if (i + 1 >= count || next->key != NULL || next->registry != NULL ||
+      !VF_same_bytes(item->pubkey, item->pubkey_l, next->pubkey,
+                     next->pubkey_l)) {
+    return 0;
+  }
+
+  VF_shared_key_clear(shared);
+  shared->pubkey = item->pubkey;
+  shared->pubkey_l = item->pubkey_l;
+  return 1;
+}
+
+void VF_verify_many(struct VF_item *items, uint64_t count,
+                    struct VF_cache *cache) {
+  struct VF_shared_key shared;
+
+  shared.pubkey = NULL;
+  shared.pubkey_l = 0;
+  shared.parsed = 0;
+  shared.key = NULL;
+
+  for (uint64_t i = 0; i < count; i++) {
+    struct VF_item *item = &items[i];
+
+    if (item->registry != NULL) {
+      item->result = VF_registry_verify(
+          item->registry, item->policy, item->document, item->document_l,
+          item->pkcs7, item->pkcs7_l, &item->errbuf, &item->reason);
+      continue;
+    }
+
+    // An item with pubkey bytes goes through the same path as a single call,
+    // so that it has the same outcome, error code and counters, except that
+    // a run of items with the same bytes parses the certificate once.  A key
+    // parsed from pubkey has no region, so the policy is checked without one
+    if (item->key != NULL) {
+      item->result = VF_verify_key_cached(cache, item->key, item->document,
+                                          item->document_l, item->pkcs7,
+                                          item->pkcs7_l, &item->errbuf);
+    } else if (VF_shared_key_run(&shared, items, count, i)) {
+      item->result = VF_verify_shared_cached(cache, &shared, item->document,
+                                             item->document_l, item->pkcs7,
+                                             item->pkcs7_l, &item->errbuf);
+    } else {
+      item->result = VF_verify_cached(cache, item->pubkey, item->pubkey_l,
+                                      item->document, item->document_l,
+                                      item->pkcs7, item->pkcs7_l,
+                                      &item->errbuf);
+    }
+
+    item->reason = VF_policy_reason(item->result, item->policy, item->key,
+                                    item->document, item->document_l);
+  }
+
+  VF_shared_key_clear(&shared);
+}
@@ -1,5 +1,6 @@
 #ifndef VERIFY_H
 #define VERIFY_H
+#include <stddef.h>
 #include <stdint.h>
 
 // Store the return value of the code.  Like command line tools, a value >=1
@@ -26,10 +27,73 @@ struct Error {
   struct Error *next;
 };
 
+// A fixed-capacity record of the errors from a single call, which is filled
+// in without allocating any memory.  The entries hold the OpenSSL error codes
+// with the root-most cause first, and are only formatted into strings when
+// VF_errbuf_fmt is called.  When there are more than VF_ERRBUF_SIZE errors,
+// the highest level ones are counted in dropped instead of being stored
+#define VF_ERRBUF_SIZE 16
+#define VF_ERRBUF_FILE_SIZE 64
+#define VF_ERRBUF_FUNC_SIZE 48
+
+// The class of error in a VF_errbuf, so that callers can tell the common
+// failures apart without formatting or matching strings
+#define VF_E_NONE 0      // VF_SUCCESS
+#define VF_E_PUBKEY 1    // the public key certificate could not be read
+#define VF_E_ENVELOPE 2  // the PKCS#7 envelope or raw signature could not
+                         // be read
+#define VF_E_SIGNATURE 3 // VF_FAIL, the signature does not match
+#define VF_E_VERIFY 4    // an exception while checking the signature
+#define VF_E_INTERNAL 5  // an unexpected OpenSSL error
+#define VF_E_NOKEY 6     // no key in the registry matches the envelope
+#define VF_E_MALFORMED 7 // an input was rejected by the limits of
+                         // VF_limits_set before it was parsed
+
+// The file and function names are copied into the entry because OpenSSL 3
+// keeps its own copies in the thread's error queue, which are freed once the
+// slot is reused.  File names longer than the entry keep their last
+// VF_ERRBUF_FILE_SIZE - 1 characters, and function names their first.  The
+// function is the one which raised the error, which OpenSSL 3 records instead
+// of a function code, and is empty when OpenSSL doesn't know it.  An entry
+// with a code of zero was not raised by OpenSSL, and its reason is a static
+// string, or NULL for the generic placeholder error
+struct VF_errbuf_entry {
+  unsigned long code;
+  char file[VF_ERRBUF_FILE_SIZE];
+  char func[VF_ERRBUF_FUNC_SIZE];
+  int line;
+  const char *reason;
+};
+
+struct VF_errbuf {
+  int code;
+  uint32_t count;
+  uint32_t dropped;
+  struct VF_errbuf_entry entries[VF_ERRBUF_SIZE];
+};
+
 // Call this function before calling any others.  This is required to
-// initialize the OpenSSL library for use in this program
+// initialize the OpenSSL library for use in this program.  It is safe to call
+// more than once and from more than one thread; only the first call does any
+// work, and every call returns its outcome
 VF_return_t VF_init();
 
+// Return the digest with an OpenSSL NID, which for the digests that the
+// metadata service uses is the one fetched once by VF_init, so that OpenSSL 3
+// does not look it up again every time it is used.  The type is EVP_MD
+struct evp_md_st;
+const struct evp_md_st *VF_md(int nid);
+
+// Threading: once VF_init has returned VF_SUCCESS, every function in this
+// file can be called concurrently from any number of threads, as long as the
+// objects passed to a call are not being freed by another thread.  A VF_key
+// can be shared by any number of concurrent verifications.  Each call uses
+// only the calling thread's OpenSSL error queue, which it clears before
+// starting, so the errors reported for a call never include those from
+// another thread.  This requires OpenSSL 1.1.0 or newer, or an OpenSSL 1.0.x
+// with locking callbacks installed by the application, such as the one in
+// Node.js
+
 // Calls to the VF_verify function which pass a non-NULL value for the Error
 // struct pointer pointer will allocate heap memory to store the structures in
 // the linked list.  This function must be called on the value with the Error
@@ -42,10 +106,26 @@ void VF_err_free(struct Error *err);
 // This function does not do any linked list traversal.
 char *VF_err_fmt(struct Error *err);
 
+// Format error i of an errbuf into buf, in the same format as VF_err_fmt.
+// Errors are numbered from the highest level, 0, to the root-most cause,
+// count - 1, which is the same order as the Error list.  Returns the value of
+// the snprintf call, or -1 when i is out of range
+int VF_errbuf_fmt(const struct VF_errbuf *errbuf, uint32_t i, char *buf,
+                  size_t buf_l);
+
+// Record a VF_EXCEPTION which was not raised by OpenSSL in errbuf, with the
+// given VF_E_ code.  Any errors in the OpenSSL error queue are recorded along
+// with it, and when there are none, a placeholder error is.  errbuf may be
+// NULL.  Returns VF_EXCEPTION
+VF_return_t VF_errbuf_exception(int code, struct VF_errbuf *errbuf);
+
 // Verify an instance identity document.  The three required parts are the
 // public key, cleartext document and the signature in a PKCS#7 file.  The
-// PKCS#7 file must have the PEM headers already.  Each of these documents is
-// pass in as a pointer to a memory buffer and the length of the buffer.
+// PKCS#7 file can be PEM encoded, DER encoded or the bare base64 body of a PEM
+// file, which is what the metadata service returns.  Each of these documents
+// is pass in as a pointer to a memory buffer and the length of the buffer.
+// The public key is parsed on every call, and nothing is kept once it returns,
+// so a key which is used many times should be loaded once with VF_key_load.
 //
 // If there are errors encountered during the invocation, they will be stored
 // in the **errors list out-parameter.  This memory is allocated in the
@@ -55,4 +135,666 @@ VF_return_t VF_verify(uint8_t *pubkey, uint64_t pubkey_l, uint8_t *document,
                       uint64_t document_l, uint8_t *pkcs7, uint64_t pkcs7_l,
                       struct Error **err);
 
+// Identical to VF_verify, except that errors are recorded in *errbuf instead
+// of an allocated list.  For VF_SUCCESS and VF_FAIL, errbuf->count is zero.
+// For VF_EXCEPTION, it is at least one.  errbuf may be NULL
+VF_return_t VF_verify_errbuf(uint8_t *pubkey, uint64_t pubkey_l,
+                             uint8_t *document, uint64_t document_l,
+                             uint8_t *pkcs7, uint64_t pkcs7_l,
+                             struct VF_errbuf *errbuf);
+
+// A certificate shared by consecutive verifications with the same pubkey
+// bytes, which is parsed by the first of them that gets that far and freed by
+// VF_shared_key_clear.  The caller sets pubkey and pubkey_l, and sets parsed
+// to zero.  When the certificate can't be parsed, errbuf holds the errors,
+// which every verification with it reports
+struct VF_shared_key {
+  uint8_t *pubkey;
+  uint64_t pubkey_l;
+  int parsed;
+  VF_return_t rv;
+  struct VF_key *key;
+  struct VF_errbuf errbuf;
+};
+
+void VF_shared_key_clear(struct VF_shared_key *shared);
+
+// Identical to VF_verify_errbuf with the pubkey bytes of shared, except that
+// the certificate is only parsed once.  The envelope is still read first, and
+// the outcome counted, for every verification
+VF_return_t VF_verify_shared_errbuf(struct VF_shared_key *shared,
+                                    uint8_t *document, uint64_t document_l,
+                                    uint8_t *pkcs7, uint64_t pkcs7_l,
+                                    struct VF_errbuf *errbuf);
+
+// Decode base64 in into out, ignoring whitespace.  The out buffer must be at
+// least in_l / 4 * 3 + 3 bytes long.  Returns VF_EXCEPTION without touching
+// *out_l if in is not valid base64.  This does not allocate memory or use the
+// OpenSSL error queue
+VF_return_t VF_base64_decode(const uint8_t *in, uint64_t in_l, uint8_t *out,
+                             uint64_t *out_l);
+
+// A public key which has been parsed once so that it can be used for many
+// verifications.  The contents are private to verify.c
+struct VF_key;
+
+// Parse a PEM encoded public key certificate into *key.  The key is owned by
+// the caller and must be freed with VF_key_free.  On VF_EXCEPTION, *key is set
+// to NULL and the errors are stored in the **err list as for VF_verify
+VF_return_t VF_key_load(uint8_t *pubkey, uint64_t pubkey_l,
+                        struct VF_key **key, struct Error **err);
+
+// Free a key returned by VF_key_load.  Passing NULL is a no-op
+void VF_key_free(struct VF_key *key);
+
+// The SHA-256 digest of the DER encoded certificate of a key, which is
+// VF_FINGERPRINT_SIZE bytes long and lives as long as the key
+#define VF_FINGERPRINT_SIZE 32
+const uint8_t *VF_key_fingerprint(struct VF_key *key);
+
+// Envelopes with a single signer and a detached document, like the ones from
+// the metadata service, are verified directly instead of with the generic
+// PKCS7_verify, with the same outcome.  Setting the VF_KEY_GENERIC flag on a
+// key makes every verification with it use PKCS7_verify.  Flags must not be
+// changed while the key is being used by another thread
+#define VF_KEY_GENERIC 1
+void VF_key_set_flags(struct VF_key *key, int flags);
+
+// The region a key is used for, such as "us-west-2".  EC2 certificates do
+// not name their region, so it is set by whoever loads the key, and is the
+// empty string until then.  Returns VF_EXCEPTION if the region does not fit
+// in VF_REGION_SIZE - 1 bytes.  Like the flags, the region must not be
+// changed while the key is being used by another thread
+#define VF_REGION_SIZE 32
+VF_return_t VF_key_set_region(struct VF_key *key, const char *region,
+                              size_t region_l);
+const char *VF_key_region(const struct VF_key *key);
+
+// Identical to VF_key_load, except that errors are recorded in *errbuf as for
+// VF_verify_errbuf.  errbuf may be NULL
+VF_return_t VF_key_load_errbuf(uint8_t *pubkey, uint64_t pubkey_l,
+                               struct VF_key **key, struct VF_errbuf *errbuf);
+
+// A SHA-256 digest of the DER encoded issuer name and serial number of the
+// certificate of a key, which is VF_FINGERPRINT_SIZE bytes long.  It is the
+// same for the signer of any envelope signed by the key, so it can be used to
+// find the key for an envelope
+const uint8_t *VF_key_signer(const struct VF_key *key);
+
+// Chooses the key for an envelope in VF_verify_select_errbuf.  signer is the
+// id of the envelope's signer, in the same form as VF_key_signer, or NULL
+// when the envelope does not have exactly one signer.  digest_nid is the
+// OpenSSL NID of the signer's digest algorithm, or NID_undef.  Returns NULL
+// when there is no key for the envelope
+typedef struct VF_key *(*VF_key_select_t)(void *ctx, const uint8_t *signer,
+                                          int digest_nid,
+                                          const uint8_t *document,
+                                          uint64_t document_l);
+
+// Identical to VF_verify_key_errbuf, except that the key is chosen by select
+// once the envelope has been read, so that the envelope is only read once.
+// When select returns NULL, the outcome is VF_EXCEPTION with a code of
+// VF_E_NOKEY.  When key is not NULL, the chosen key is returned in *key
+VF_return_t VF_verify_select_errbuf(VF_key_select_t select, void *ctx,
+                                    uint8_t *document, uint64_t document_l,
+                                    uint8_t *pkcs7, uint64_t pkcs7_l,
+                                    struct VF_errbuf *errbuf,
+                                    struct VF_key **key);
+
+// Identical to VF_verify and VF_verify_errbuf, except that the public key has
+// already been parsed with VF_key_load.  A key is not modified by these
+// functions
+VF_return_t VF_verify_key(struct VF_key *key, uint8_t *document,
+                          uint64_t document_l, uint8_t *pkcs7,
+                          uint64_t pkcs7_l, struct Error **err);
+VF_return_t VF_verify_key_errbuf(struct VF_key *key, uint8_t *document,
+                                 uint64_t document_l, uint8_t *pkcs7,
+                                 uint64_t pkcs7_l, struct VF_errbuf *errbuf);
+
+// Verify a document against the value of the metadata service's signature
+// endpoint, which is the base64 encoded PKCS#1 v1.5 RSA signature of the
+// SHA-256 digest of the document, without any envelope.  Whitespace around
+// and within the base64 is ignored.  The outcomes and errors are the same as
+// for VF_verify_errbuf, with a signature that can not be decoded reported as
+// VF_E_ENVELOPE, and a key which is not an RSA key as VF_E_VERIFY.
+// VF_verify_raw_key is identical, except that it takes a key from VF_key_load
+VF_return_t VF_verify_raw(uint8_t *pubkey, uint64_t pubkey_l,
+                          uint8_t *document, uint64_t document_l,
+                          uint8_t *signature, uint64_t signature_l,
+                          struct VF_errbuf *errbuf);
+VF_return_t VF_verify_raw_key(struct VF_key *key, uint8_t *document,
+                              uint64_t document_l, uint8_t *signature,
+                              uint64_t signature_l,
+                              struct VF_errbuf *errbuf);
+
+// The memory that a verification uses besides the envelope itself, such as
+// the digest and public key contexts and a scratch buffer, which is kept from
+// one call to the next instead of being allocated and freed every time.  The
+// public key context is kept set up for the last key verified with, so runs
+// of verifications with the same key are cheapest.  A context may only be
+// used by one thread at a time.  The functions which are not passed a
+// context use one which belongs to the calling thread and is freed when the
+// thread exits, so VF_ctx_verify is only needed to control when that memory
+// is freed.  A context can hold a reference to the last key's public key
+// after VF_key_free, until it is used with another key or freed
+struct VF_ctx;
+
+VF_return_t VF_ctx_new(struct VF_ctx **ctx);
+void VF_ctx_free(struct VF_ctx *ctx);
+
+// Identical to VF_verify_key_errbuf, except that the given context is used
+VF_return_t VF_ctx_verify(struct VF_ctx *ctx, struct VF_key *key,
+                          uint8_t *document, uint64_t document_l,
+                          uint8_t *pkcs7, uint64_t pkcs7_l,
+                          struct VF_errbuf *errbuf);
+
+// Verify a document which arrives in pieces, such as over HTTP, without
+// holding the whole of it.  VF_stream_begin reads the envelope, and then the
+// document is passed to VF_stream_update in any number of pieces, in order,
+// and VF_stream_final returns the outcome, which is the same as that of
+// VF_verify_key for the whole document.  An exception from VF_stream_update
+// finishes the stream.  Once it has finished, any further update or final
+// call is an exception, and the stream must still be freed with
+// VF_stream_free, which may also be called to abandon a stream at any time
+//
+// Envelopes in the form that the metadata service returns are digested as
+// the pieces arrive, so final is a single public key operation.  Any other
+// envelope, or a key with the VF_KEY_GENERIC flag, needs PKCS7_verify, and
+// for those the pieces are copied until final.  The key must not be freed
+// before the stream, and a stream may only be used by one thread at a time,
+// though not always the same one
+struct VF_stream;
+
+VF_return_t VF_stream_begin(struct VF_key *key, uint8_t *pkcs7,
+                            uint64_t pkcs7_l, struct VF_stream **stream,
+                            struct VF_errbuf *errbuf);
+VF_return_t VF_stream_update(struct VF_stream *stream, const uint8_t *chunk,
+                             uint64_t chunk_l, struct VF_errbuf *errbuf);
+VF_return_t VF_stream_final(struct VF_stream *stream,
+                            struct VF_errbuf *errbuf);
+void VF_stream_free(struct VF_stream *stream);
+
+// Limits which every input is checked against before any of it is parsed,
+// so that a hostile input is turned away before OpenSSL allocates anything
+// for it.  The lengths are the largest accepted, in bytes, with 0 for no
+// limit, and document_l applies to the whole of a streamed document.  When
+// structure is non-zero, an envelope must also look like a PKCS#7 signedData
+// envelope: PEM with a label which OpenSSL reads PKCS#7 from, base64 or DER
+// which decodes to a SEQUENCE whose length fits the input, starting with the
+// signedData content type.
+// This is checked in a single pass without allocating, which only decodes
+// the start of the envelope and reads a PEM file up to its END line, and raw
+// signatures are only checked against pkcs7_l.
+// Rejected inputs are VF_EXCEPTION with VF_E_MALFORMED, which is counted in
+// the codes of VF_stats like any other exception.  Every limit is off until
+// VF_limits_set is called, so that no input which verified before is
+// rejected unless the application asks for it
+struct VF_limits {
+  uint64_t document_l;
+  uint64_t pkcs7_l;
+  uint64_t pubkey_l;
+  int structure;
+};
+
+// Change the limits for every later call from any thread.  Calls which have
+// already started may still use the old limits
+void VF_limits_set(const struct VF_limits *limits);
+void VF_limits_get(struct VF_limits *limits);
+
+// Returns non-zero when inputs of these lengths are within the limits, with 0
+// for an input which is not given
+int VF_limits_allow(uint64_t pubkey_l, uint64_t document_l, uint64_t pkcs7_l);
+
+// Counters and a latency histogram for every verification made by the
+// VF_verify functions, which are always kept.  Outcomes returned from a
+// VF_cache are not verifications and are not counted.  Each thread counts in
+// its own VF_ctx without any locking or atomic read-modify-write, and a
+// snapshot adds up every thread's counters.  The latency is the time from the
+// start of a call to its outcome, in nanoseconds
+//
+// codes counts exceptions by their VF_E_ code.  libs counts exceptions by the
+// OpenSSL library of their root-most error, with 0 for an exception which had
+// no OpenSSL error and libraries numbered VF_STATS_LIBS - 1 and up counted
+// together in the last entry.  The histogram has VF_STATS_SUB_BUCKETS
+// buckets for every power of two, so a latency is known to within 12.5%, and
+// latencies of 2^36ns, about 69 seconds, and up are counted in the last
+#define VF_STATS_CODES 8
+#define VF_STATS_LIBS 64
+#define VF_STATS_SUB_BUCKETS 8
+#define VF_STATS_BUCKETS 272
+
+// Every member is a uint64_t counter, which VF_stats_snapshot relies on
+struct VF_stats {
+  uint64_t success;
+  uint64_t fail;
+  uint64_t exception;
+  uint64_t codes[VF_STATS_CODES];
+  uint64_t libs[VF_STATS_LIBS];
+  uint64_t latency[VF_STATS_BUCKETS];
+  uint64_t latency_sum_ns;
+};
+
+// Copy the counters into *stats.  When reset is non-zero, later snapshots
+// count from this one instead of from the start of the process
+void VF_stats_snapshot(struct VF_stats *stats, int reset);
+
+// The name of the OpenSSL library which an entry of libs counts, "none" for
+// the first entry and "other" for the last
+const char *VF_stats_library(uint32_t lib);
+
+// The largest latency, in nanoseconds, which is counted in a bucket
+uint64_t VF_stats_bucket_limit(uint32_t bucket);
+
+// An upper bound on the latency of fraction p of the verifications in a
+// snapshot, such as 0.99 for the p99, in nanoseconds.  Returns 0 for a
+// snapshot without any verifications
+uint64_t VF_stats_percentile(const struct VF_stats *stats, double p);
+
+// Format a snapshot in the Prometheus text exposition format.  Returns the
+// value of the snprintf calls, so the text was cut short when the return
+// value is at least buf_l, and buf may be NULL when buf_l is zero
+int VF_stats_prometheus(const struct VF_stats *stats, char *buf,
+                        size_t buf_l);
+
+// A bounded, least recently used cache of verification outcomes, which can be
+// shared between threads.  Entries are keyed by a SHA-256 digest of the key,
+// document and signature, and only VF_SUCCESS and VF_FAIL outcomes are stored
+// so that a transient VF_EXCEPTION is never returned from the cache
+struct VF_cache;
+
+struct VF_cache_stats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t insertions;
+  uint64_t evictions;
+  uint64_t expirations;
+  uint64_t size;
+  uint64_t capacity;
+  uint64_t ttl_ms;
+};
+
+// The largest capacity of a cache.  Larger capacities are VF_EXCEPTION
+#define VF_CACHE_MAX_CAPACITY ((uint64_t)1 << 32)
+
+// Create a cache holding at most capacity outcomes, each for at most ttl_ms
+// milliseconds.  A ttl_ms of 0 means that entries never expire, and a
+// capacity of 0 creates a disabled cache which never stores anything
+VF_return_t VF_cache_new(uint64_t capacity, uint64_t ttl_ms,
+                         struct VF_cache **cache);
+
+// Change the capacity and ttl of a cache, dropping every stored outcome.
+// This is safe to call while other threads are using the cache
+VF_return_t VF_cache_configure(struct VF_cache *cache, uint64_t capacity,
+                               uint64_t ttl_ms);
+
+// Free a cache.  No other thread may be using the cache
+void VF_cache_free(struct VF_cache *cache);
+
+// Copy the counters of a cache into *stats.  When reset is non-zero, the hit,
+// miss, insertion, eviction and expiration counters are set back to zero
+void VF_cache_stats(struct VF_cache *cache, struct VF_cache_stats *stats,
+                    int reset);
+
+// Identical to VF_verify_errbuf and VF_verify_key_errbuf, except that a
+// cached outcome is returned without verifying when the same key, document
+// and signature have been verified before.  A NULL cache verifies every time
+VF_return_t VF_verify_cached(struct VF_cache *cache, uint8_t *pubkey,
+                             uint64_t pubkey_l, uint8_t *document,
+                             uint64_t document_l, uint8_t *pkcs7,
+                             uint64_t pkcs7_l, struct VF_errbuf *errbuf);
+VF_return_t VF_verify_key_cached(struct VF_cache *cache, struct VF_key *key,
+                                 uint8_t *document, uint64_t document_l,
+                                 uint8_t *pkcs7, uint64_t pkcs7_l,
+                                 struct VF_errbuf *errbuf);
+VF_return_t VF_verify_shared_cached(struct VF_cache *cache,
+                                    struct VF_shared_key *shared,
+                                    uint8_t *document, uint64_t document_l,
+                                    uint8_t *pkcs7, uint64_t pkcs7_l,
+                                    struct VF_errbuf *errbuf);
+
+// A bounded set of the documents which have been accepted, so that a policy
+// can accept each document only once and a leaked document and signature can
+// not be replayed.  A document is identified by a keyed SHA-256 digest of its
+// instanceId and pendingTime claims, and the set stores a short fingerprint
+// of the digest in one of two buckets, as in a cuckoo filter.  When both
+// buckets are full, fingerprints are moved to their other buckets to make
+// room, and only when that fails is a fingerprint in one of them evicted, so
+// memory stays fixed and nothing is forgotten until the set is about 98%
+// full.  Lookups and inserts are lock-free, using atomic loads and
+// compare-and-swap on the fingerprints, and only moves take a lock, so a set
+// can be shared by any number of threads
+struct VF_seen;
+
+// The fingerprints in each bucket
+#define VF_SEEN_BUCKET 8
+
+struct VF_seen_stats {
+  uint64_t capacity;     // fingerprint slots, at least the requested capacity
+  uint64_t memory;       // bytes of fingerprints
+  uint32_t bits;         // bits in each fingerprint, 16, 32 or 64
+  double fp_rate;        // false positive rate of a lookup in a full set
+  double fp_estimate;    // false positive rate at the current size
+  uint64_t size;         // slots which hold a fingerprint
+  uint64_t insertions;   // documents seen for the first time
+  uint64_t replays;      // documents which had already been seen
+  uint64_t evictions;    // fingerprints evicted to make room for others
+};
+
+// Create a set with room for capacity documents, with the shortest
+// fingerprint whose false positive rate is at most fp_rate.  A false positive
+// rejects a document seen for the first time as a replay.  The set is
+// reference counted, starting with one reference for the caller
+VF_return_t VF_seen_new(uint64_t capacity, double fp_rate,
+                        struct VF_seen **seen);
+
+// Take another reference to a set, and drop one.  The set is freed when its
+// last reference is dropped.  Passing NULL to VF_seen_free is a no-op
+struct VF_seen *VF_seen_ref(struct VF_seen *seen);
+void VF_seen_free(struct VF_seen *seen);
+
+// Add the document with the given instanceId and pendingTime to the set.
+// Returns VF_SUCCESS when it was not already in the set, VF_FAIL when it was,
+// and VF_EXCEPTION when the digest can not be computed.  When the same
+// document is added by two threads at once, at most one of them succeeds
+VF_return_t VF_seen_add(struct VF_seen *seen, const uint8_t *instance_id,
+                        uint64_t instance_id_l, const uint8_t *pending_time,
+                        uint64_t pending_time_l);
+
+// Copy the size and counters of a set into *stats.  When reset is non-zero,
+// the insertion, replay and eviction counters are set back to zero
+void VF_seen_stats(struct VF_seen *seen, struct VF_seen_stats *stats,
+                   int reset);
+
+// A member of the top level object of an instance identity document.  The
+// caller sets name and name_l, and VF_claims_scan sets the rest.  The value
+// points into the document: for strings it is the text between the quotes,
+// which still has to be passed to VF_claim_unescape when the type is
+// VF_CLAIM_ESCAPED, and for anything else it is the JSON text of the value
+#define VF_CLAIM_MISSING 0
+#define VF_CLAIM_STRING 1
+#define VF_CLAIM_ESCAPED 2
+#define VF_CLAIM_NUMBER 3
+#define VF_CLAIM_TRUE 4
+#define VF_CLAIM_FALSE 5
+#define VF_CLAIM_NULL 6
+#define VF_CLAIM_OBJECT 7
+#define VF_CLAIM_ARRAY 8
+
+struct VF_claim {
+  const char *name;
+  size_t name_l;
+  int type;
+  const uint8_t *value;
+  uint64_t value_l;
+};
+
+// Find the named claims in a document with a single pass over it, without
+// allocating or building anything for the members which were not asked for.
+// Nested objects and arrays are skipped over, only checking that their
+// brackets match.  Member names are compared once they are unescaped.
+// Returns VF_EXCEPTION if the document is not a JSON object or a member name
+// has an invalid escape
+VF_return_t VF_claims_scan(const uint8_t *document, uint64_t document_l,
+                           struct VF_claim *claims, uint32_t nclaims);
+
+// Decode the escapes in a string claim into out as UTF-8.  The out buffer must
+// be at least in_l bytes long.  Returns VF_EXCEPTION for an invalid escape or
+// a lone surrogate
+VF_return_t VF_claim_unescape(const uint8_t *in, uint64_t in_l, uint8_t *out,
+                              uint64_t *out_l);
+
+// A policy which is checked against the claims of a document once its
+// signature has been verified.  A policy is built once, with allowlists of
+// string values for any number of claims up to VF_POLICY_MAX_SETS, whether
+// the region claim must match the region of the key, the oldest
+// pendingTime which is accepted and whether a document is accepted only once.
+// Once built, a policy is not modified by checking it, other than through its
+// seen set, so it can be shared by any number of threads
+struct VF_policy;
+
+#define VF_POLICY_MAX_SETS 16
+#define VF_POLICY_MAX_VALUE 256
+
+// The outcome of a policy check.  VF_P_SIGNATURE and VF_P_EXCEPTION are never
+// returned by VF_policy_check, but are used for a VF_FAIL or VF_EXCEPTION
+// outcome wherever a reason is reported along with the result of a
+// verification
+#define VF_P_ACCEPT 0    // the document satisfies the policy
+#define VF_P_SIGNATURE 1 // the signature of the document does not match
+#define VF_P_DOCUMENT 2  // the document is not a JSON object
+#define VF_P_CLAIM 3     // a checked claim is missing or is not a string
+#define VF_P_ALLOWLIST 4 // a claim is not one of its allowed values
+#define VF_P_REGION 5    // the region claim is not the region of the key
+#define VF_P_AGE 6       // the pendingTime claim is too old
+#define VF_P_REPLAY 7    // the document has already been accepted
+#define VF_P_EXCEPTION 8 // the verification was an exception, whose errors
+                         // are in its errbuf
+
+// Create an empty policy, which accepts every JSON object, and free one.
+// Passing NULL to VF_policy_free is a no-op
+VF_return_t VF_policy_new(struct VF_policy **policy);
+void VF_policy_free(struct VF_policy *policy);
+
+// Add value to the allowed values of a claim.  A claim with an allowlist is
+// only accepted if it is a string equal to one of its allowed values.
+// Returns VF_EXCEPTION for a value longer than VF_POLICY_MAX_VALUE, when
+// there are already VF_POLICY_MAX_SETS claims with allowlists, or when memory
+// can not be allocated
+VF_return_t VF_policy_allow(struct VF_policy *policy, const char *claim,
+                            size_t claim_l, const uint8_t *value,
+                            size_t value_l);
+
+// Require the region claim to equal VF_key_region of the verifying key.  A
+// key without a region never matches
+void VF_policy_match_region(struct VF_policy *policy, int match);
+
+// Reject documents whose pendingTime claim is more than max_age_ms in the
+// past.  Zero, the default, does not check the pendingTime
+void VF_policy_max_age(struct VF_policy *policy, uint64_t max_age_ms);
+
+// Accept each document only once, by adding it to a seen set once every
+// other check has passed.  The policy takes a reference to the set, which
+// replaces any set it already had, and NULL stops checking for replays.
+// Documents without string instanceId and pendingTime claims are rejected
+// with VF_P_CLAIM
+void VF_policy_first_use(struct VF_policy *policy, struct VF_seen *seen);
+
+// Check a document, which must already have been verified with key, against
+// a policy and return one of the VF_P_ reasons.  key may be NULL when the
+// policy does not match the region.  VF_policy_check_at takes the current
+// time in milliseconds since the epoch instead of reading the clock
+int VF_policy_check(const struct VF_policy *policy, const struct VF_key *key,
+                    const uint8_t *document, uint64_t document_l);
+int VF_policy_check_at(const struct VF_policy *policy,
+                       const struct VF_key *key, const uint8_t *document,
+                       uint64_t document_l, int64_t now_ms);
+
+// The VF_P_ reason for the result of verifying a document with key: the
+// outcome of the policy for VF_SUCCESS, or VF_P_ACCEPT when policy is NULL,
+// VF_P_SIGNATURE for VF_FAIL and VF_P_EXCEPTION for VF_EXCEPTION.  Every
+// reason reported along with a result comes from here
+int VF_policy_reason(VF_return_t result, const struct VF_policy *policy,
+                     const struct VF_key *key, const uint8_t *document,
+                     uint64_t document_l);
+
+// A registry of the keys for many regions and endpoints, so that documents
+// can be verified without passing the key.  The key for an envelope is found
+// by the issuer and serial number of its signer, and the region claim of the
+// document picks between keys which share a certificate.  A registry can be
+// reloaded while other threads are verifying with it: a verification uses
+// the keys which were loaded when it started, and they are freed once the
+// last verification using them has finished
+struct VF_registry;
+
+// The metadata service endpoints whose envelopes a key signs
+#define VF_ENDPOINT_PKCS7 1
+#define VF_ENDPOINT_RSA2048 2
+
+// Create an empty registry, and free one.  Passing NULL to VF_registry_free
+// is a no-op.  No other thread may be using a registry which is being freed
+VF_return_t VF_registry_new(struct VF_registry **registry);
+void VF_registry_free(struct VF_registry *registry);
+
+// Replace the keys of a registry with the certificates in a PEM bundle.  A
+// certificate can be labelled by a comment line of the form
+// "# <region> <endpoint>" before it, where the endpoint is pkcs7 or rsa2048.
+// Other comments and text are ignored.  When any certificate can not be
+// loaded, the registry is left unchanged and the errors are recorded in
+// errbuf, which may be NULL
+VF_return_t VF_registry_load_bundle(struct VF_registry *registry,
+                                    const uint8_t *bundle, uint64_t bundle_l,
+                                    struct VF_errbuf *errbuf);
+
+// Identical to VF_registry_load_bundle, except that the certificates are read
+// from every file in a directory whose name ends in .pem, in byte order of
+// their names.  The certificates in a file named <region>.<endpoint>.pem which
+// have no label comment are labelled with that region and endpoint
+VF_return_t VF_registry_load_dir(struct VF_registry *registry,
+                                 const char *path, struct VF_errbuf *errbuf);
+
+// The number of keys in a registry
+uint32_t VF_registry_count(struct VF_registry *registry);
+
+// Identical to VF_verify_key_errbuf, except that the key is chosen from the
+// registry.  When reason is not NULL, it is set as for VF_item.reason, with
+// VF_P_ACCEPT for a valid document when policy is NULL
+VF_return_t VF_registry_verify(struct VF_registry *registry,
+                               const struct VF_policy *policy,
+                               uint8_t *document, uint64_t document_l,
+                               uint8_t *pkcs7, uint64_t pkcs7_l,
+                               struct VF_errbuf *errbuf, int *reason);
+
+// One verification in a batch passed to VF_verify_many.  The inputs are set
+// by the caller.  Either key is set to a key from VF_key_load, registry is
+// set to a registry to choose the key from, or both are NULL and pubkey holds
+// the PEM encoded certificate.  The result and errbuf fields
+// are set by VF_verify_many with the same meaning as the return value and
+// *errbuf out-parameter of VF_verify_errbuf, and reason is set to the reason
+// for the result from VF_policy_reason
+struct VF_item {
+  struct VF_key *key;
+  struct VF_registry *registry;
+  uint8_t *pubkey;
+  uint64_t pubkey_l;
+  uint8_t *document;
+  uint64_t document_l;
+  uint8_t *pkcs7;
+  uint64_t pkcs7_l;
+  const struct VF_policy *policy;
+
+  VF_return_t result;
+  int reason;
+  struct VF_errbuf errbuf;
+};
+
+// Verify count items in order.  Each item has the same outcome, errbuf and
+// counters as the single call for it, VF_verify_cached for pubkey bytes or
+// VF_verify_key_cached for a key.  A failure of one item does not affect the
+// others.  Consecutive items with the same pubkey bytes share one parse of
+// the certificate.  When cache is not NULL, it is used as for
+// VF_verify_cached
+void VF_verify_many(struct VF_item *items, uint64_t count,
+                    struct VF_cache *cache);
+
+// A bounded queue of pending verifications in priority lanes, which decides
+// when each one may start so that no more than concurrency run at once.  Lane
+// 0 is the most urgent, and a job is only started when every lane before its
+// own is empty.  Jobs are taken from each lane in the order they were pushed.
+// When the queue is full, a job pushed into a more urgent lane than some
+// queued job evicts the newest job of the least urgent lane, and is shed
+// itself otherwise.  A job whose deadline has passed is dropped instead of
+// being started, and the expired jobs at either end of a lane are dropped
+// first to make room when the queue is full.  The caller owns the jobs, which
+// are linked into the queue, and the scheduler does no locking, so it must
+// only be used from one thread
+struct VF_sched;
+
+// The most priority lanes of a scheduler
+#define VF_SCHED_LANES 8
+
+// The state of a job, which says why it left the queue when it is dropped
+#define VF_SCHED_QUEUED 0
+#define VF_SCHED_RUNNING 1
+#define VF_SCHED_DONE 2      // it finished running
+#define VF_SCHED_SHED 3      // the queue was full
+#define VF_SCHED_EXPIRED 4   // its deadline passed before it started
+#define VF_SCHED_CANCELLED 5 // VF_sched_cancel or VF_sched_clear removed it
+
+// The caller sets id, lane, deadline_ns and data before pushing a job.  The
+// lane must be below the lanes of the scheduler.  A deadline_ns of 0 means the
+// job never expires.  cancelled is set when a
+// running job is cancelled, since it can't be taken back from its thread
+struct VF_sched_job {
+  uint64_t id;
+  uint32_t lane;
+  uint64_t deadline_ns;
+  void *data;
+
+  int state;
+  int cancelled;
+  struct VF_sched_job *prev;
+  struct VF_sched_job *next;
+};
+
+struct VF_sched_stats {
+  uint32_t lanes;
+  uint32_t capacity;
+  uint32_t concurrency;
+  uint32_t queued;                 // jobs waiting in every lane
+  uint32_t depth[VF_SCHED_LANES];  // jobs waiting in each lane
+  uint32_t running;                // jobs started and not yet done
+  uint64_t admitted;               // jobs pushed without being shed
+  uint64_t completed;              // jobs done which ran to the end
+  uint64_t shed;                   // jobs refused or evicted for room
+  uint64_t expired;                // jobs dropped after their deadline
+  uint64_t cancelled;              // jobs cancelled, queued or running
+};
+
+// Create a scheduler with lanes priority lanes, up to VF_SCHED_LANES, room
+// for capacity waiting jobs and concurrency running ones.  Every argument
+// must be at least 1
+VF_return_t VF_sched_new(uint32_t lanes, uint32_t capacity,
+                         uint32_t concurrency, struct VF_sched **sched);
+
+// Free a scheduler.  Jobs still queued or running are left to the caller
+void VF_sched_free(struct VF_sched *sched);
+
+// The monotonic clock that deadlines are measured with, in nanoseconds
+uint64_t VF_sched_now_ns(void);
+
+// Queue a job, or shed it when the queue is full or it names a lane which the
+// scheduler does not have.  Returns the jobs that were
+// dropped to make room, and the job itself when it was shed, linked through
+// next with their state set to why
+struct VF_sched_job *VF_sched_push(struct VF_sched *sched,
+                                   struct VF_sched_job *job, uint64_t now_ns);
+
+// Take the next job to start, from the most urgent lane, and count it as
+// running.  Returns NULL when concurrency jobs are already running or the
+// queue is empty.  The expired jobs which were passed over are linked into
+// *dropped, which is set to NULL when there are none
+struct VF_sched_job *VF_sched_pop(struct VF_sched *sched, uint64_t now_ns,
+                                  struct VF_sched_job **dropped);
+
+// Count a running job as no longer running, by the state which the caller
+// has set it to: VF_SCHED_DONE, VF_SCHED_EXPIRED when it noticed the deadline
+// had passed before verifying, or VF_SCHED_CANCELLED
+void VF_sched_done(struct VF_sched *sched, struct VF_sched_job *job);
+
+// Cancel the job with the given id.  A queued job is removed and returned
+// with its state set to VF_SCHED_CANCELLED.  A running job has cancelled set
+// and is returned, and is still passed to VF_sched_done once it finishes.
+// Returns NULL when there is no such job
+struct VF_sched_job *VF_sched_cancel(struct VF_sched *sched, uint64_t id);
+
+// Remove every queued job, returning them linked through next with their
+// state set to VF_SCHED_CANCELLED
+struct VF_sched_job *VF_sched_clear(struct VF_sched *sched);
+
+// Copy the depths and counters of a scheduler into *stats.  When reset is
+// non-zero, the admitted, completed, shed, expired and cancelled counters
+// are set back to zero
+void VF_sched_stats(struct VF_sched *sched, struct VF_sched_stats *stats,
+                    int reset);
+
 #endif
@@ -0,0 +1,264 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./verifyd.h"
+
+// A load generator for iid-verifyd.  Each connection is driven by its own
+// thread, which keeps up to window requests in flight at once and records the
+// time from sending each request to reading its response.  The throughput and
+// latency percentiles over every connection are printed at the end, and the
+// exit status is non-zero if any response had an outcome other than the
+// expected one
+
+struct load_conn {
+  pthread_t thread;
+  int fd;
+  uint8_t *frame;
+  size_t frame_l;
+  uint64_t *sent_at;
+  uint64_t *latencies;
+  unsigned long requests;
+  unsigned long unexpected;
+  int failed;
+};
+
+static int expected = VFD_OUTCOME_SUCCESS;
+static unsigned long window = 32;
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s -s socket -k id -d document -p pkcs7 [-c connections]\n"
+          "          [-n requests] [-w window] [-e success|fail|exception]\n",
+          name);
+  exit(2);
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint8_t *read_file(const char *name, size_t *len) {
+  FILE *fd = fopen(name, "rb");
+  uint8_t *buf = NULL;
+  long size;
+
+  if (fd == NULL) {
+    fprintf(stderr, "could not open %s\n", name);
+    exit(1);
+  }
+  if (0 != fseek(fd, 0, SEEK_END) || (size = ftell(fd)) < 0 ||
+      0 != fseek(fd, 0, SEEK_SET) ||
+      NULL == (buf = malloc(size > 0 ? size : 1)) ||
+      fread(buf, 1, size, fd) != (size_t)size) {
+    fprintf(stderr, "could not read %s\n", name);
+    exit(1);
+  }
+  fclose(fd);
+  *len = size;
+  return buf;
+}
+
+static void *run_conn(void *arg) {
+  struct load_conn *conn = arg;
+  uint8_t response[VFD_RESPONSE_HEADER_SIZE + VFD_MAX_MESSAGE];
+  unsigned long sent = 0, received = 0;
+
+  while (received < conn->requests) {
+    // Top up the requests in flight before waiting for the next response
+    while (sent < conn->requests && sent - received < window) {
+      vfd_put_u32(conn->frame + 4, sent);
+      conn->sent_at[sent] = now_ns();
+      if (0 != vfd_write_full(conn->fd, conn->frame, conn->frame_l)) {
+        fprintf(stderr, "error while sending request\n");
+        conn->failed = 1;
+        return NULL;
+      }
+      sent++;
+    }
+
+    uint32_t length, id;
+    if (0 != vfd_read_full(conn->fd, response, 4) ||
+        (length = vfd_get_u32(response)) < VFD_RESPONSE_HEADER_SIZE - 4 ||
+        length > sizeof(response) - 4 ||
+        0 != vfd_read_full(conn->fd, response + 4, length) ||
+        (id = vfd_get_u32(response + 4)) >= sent) {
+      fprintf(stderr, "error while reading response\n");
+      conn->failed = 1;
+      return NULL;
+    }
+
+    conn->latencies[received++] = now_ns() - conn->sent_at[id];
+    if (response[8] != expected) {
+      if (conn->unexpected++ == 0) {
+        fprintf(stderr, "unexpected outcome %d code %d: %.*s\n", response[8],
+                response[9], (int)(length + 4 - VFD_RESPONSE_HEADER_SIZE),
+                (char *)response + VFD_RESPONSE_HEADER_SIZE);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_us(uint64_t *sorted, size_t n, double p) {
+  size_t i = (size_t)(p * (n - 1));
+  return sorted[i] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+  const char *path = NULL, *key = NULL, *document_file = NULL,
+             *pkcs7_file = NULL;
+  unsigned long connections = 4, requests = 10000;
+  uint8_t *document, *pkcs7;
+  size_t document_l, pkcs7_l, key_l, frame_l;
+  struct load_conn *conns;
+  struct sockaddr_un addr;
+  uint64_t *latencies, start, elapsed;
+  unsigned long unexpected = 0;
+  int failed = 0, opt;
+
+  while (-1 != (opt = getopt(argc, argv, "s:k:d:p:c:n:w:e:"))) {
+    switch (opt) {
+    case 's':
+      path = optarg;
+      break;
+    case 'k':
+      key = optarg;
+      break;
+    case 'd':
+      document_file = optarg;
+      break;
+    case 'p':
+      pkcs7_file = optarg;
+      break;
+    case 'c':
+      connections = strtoul(optarg, NULL, 10);
+      break;
+    case 'n':
+      requests = strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      window = strtoul(optarg, NULL, 10);
+      break;
+    case 'e':
+      if (0 == strcmp(optarg, "success")) {
+        expected = VFD_OUTCOME_SUCCESS;
+      } else if (0 == strcmp(optarg, "fail")) {
+        expected = VFD_OUTCOME_FAIL;
+      } else if (0 == strcmp(optarg, "exception")) {
+        expected = VFD_OUTCOME_EXCEPTION;
+      } else {
+        usage(argv[0]);
+      }
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (path == NULL || key == NULL || document_file == NULL ||
+      pkcs7_file == NULL || optind != argc || connections < 1 ||
+      requests < 1 || requests > UINT32_MAX || window < 1) {
+    usage(argv[0]);
+  }
+
+  key_l = strlen(key);
+  document = read_file(document_file, &document_l);
+  pkcs7 = read_file(pkcs7_file, &pkcs7_l);
+  frame_l = VFD_REQUEST_HEADER_SIZE + key_l + document_l + pkcs7_l;
+  if (key_l > UINT16_MAX || frame_l - 4 > VFD_MAX_FRAME ||
+      strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "request is too large\n");
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  conns = calloc(connections, sizeof(struct load_conn));
+  latencies = calloc(connections * requests, sizeof(uint64_t));
+  if (conns == NULL || latencies == NULL) {
+    fprintf(stderr, "could not allocate memory\n");
+    return 1;
+  }
+
+  // Every request is the same apart from its id, so each connection builds
+  // its frame once and only rewrites the id before sending it
+  for (unsigned long i = 0; i < connections; i++) {
+    struct load_conn *conn = &conns[i];
+    conn->frame_l = frame_l;
+    conn->frame = malloc(frame_l);
+    conn->sent_at = calloc(requests, sizeof(uint64_t));
+    conn->latencies = latencies + i * requests;
+    conn->requests = requests;
+    if (conn->frame == NULL || conn->sent_at == NULL) {
+      fprintf(stderr, "could not allocate memory\n");
+      return 1;
+    }
+    vfd_put_u32(conn->frame, frame_l - 4);
+    vfd_put_u16(conn->frame + 8, key_l);
+    vfd_put_u32(conn->frame + 10, document_l);
+    memcpy(conn->frame + VFD_REQUEST_HEADER_SIZE, key, key_l);
+    memcpy(conn->frame + VFD_REQUEST_HEADER_SIZE + key_l, document, document_l);
+    memcpy(conn->frame + VFD_REQUEST_HEADER_SIZE + key_l + document_l, pkcs7,
+           pkcs7_l);
+
+    conn->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn->fd < 0 ||
+        0 != connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+      perror(path);
+      return 1;
+    }
+  }
+
+  start = now_ns();
+  for (unsigned long i = 0; i < connections; i++) {
+    if (0 != pthread_create(&conns[i].thread, NULL, run_conn, &conns[i])) {
+      fprintf(stderr, "could not start connection thread\n");
+      return 1;
+    }
+  }
+  for (unsigned long i = 0; i < connections; i++) {
+    pthread_join(conns[i].thread, NULL);
+    failed |= conns[i].failed;
+    unexpected += conns[i].unexpected;
+    close(conns[i].fd);
+  }
+  elapsed = now_ns() - start;
+
+  if (failed) {
+    return 1;
+  }
+
+  size_t total = connections * requests;
+  qsort(latencies, total, sizeof(uint64_t), compare_u64);
+
+  printf("%lu requests over %lu connections with a window of %lu\n",
+         (unsigned long)total, connections, window);
+  printf("%.3f seconds, %.0f requests/s\n", elapsed / 1e9,
+         total / (elapsed / 1e9));
+  printf("latency p50 %.1fus p99 %.1fus p999 %.1fus max %.1fus\n",
+         percentile_us(latencies, total, 0.5),
+         percentile_us(latencies, total, 0.99),
+         percentile_us(latencies, total, 0.999),
+         latencies[total - 1] / 1000.0);
+  printf("%lu unexpected outcomes\n", unexpected);
+
+  return unexpected == 0 ? 0 : 1;
+}
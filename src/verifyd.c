@@ -0,0 +1,506 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "./verify.h"
+#include "./verifyd.h"
+
+// iid-verifyd keeps the public keys parsed and the OpenSSL library warm in a
+// single long running process, so that services which are not written in
+// Node, or many Node processes, can share one verifier.  Each connection has a
+// reader thread which splits the stream into requests and queues them for a
+// pool of worker threads, which verify them and write the responses back.  See
+// verifyd.h for the protocol
+
+struct vfd_key {
+  char *id;
+  size_t id_l;
+  struct VF_key *key;
+};
+
+// A connection is shared by its reader thread and every queued request made
+// on it, and is only freed once all of them are done with it
+struct vfd_conn {
+  int fd;
+  pthread_mutex_t lock;
+  int refs;
+};
+
+struct vfd_job {
+  struct vfd_conn *conn;
+  uint32_t id;
+  struct VF_key *key;
+  uint8_t *frame;
+  uint8_t *document;
+  uint32_t document_l;
+  uint8_t *pkcs7;
+  uint32_t pkcs7_l;
+  struct vfd_job *next;
+};
+
+// The queue of requests waiting for a worker.  It is bounded so that a client
+// which sends faster than the workers can verify is slowed down by its reader
+// thread blocking, instead of growing the queue without limit
+struct vfd_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  struct vfd_job *head;
+  struct vfd_job *tail;
+  size_t length;
+  size_t capacity;
+};
+
+static struct vfd_key *keys = NULL;
+static size_t nkeys = 0;
+static struct VF_cache *cache = NULL;
+static struct vfd_queue queue;
+static volatile sig_atomic_t stopping = 0;
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s -s socket -k id=pubkey [-k id=pubkey ...] [-t threads]\n"
+          "          [-q queue] [-c cache-capacity] [-T cache-ttl-ms]\n",
+          name);
+  exit(2);
+}
+
+static VF_return_t read_file(const char *name, uint8_t **buf, size_t *len) {
+  FILE *fd = fopen(name, "rb");
+  VF_return_t rv = VF_SUCCESS;
+  long size;
+
+  *buf = NULL;
+  if (fd == NULL) {
+    return VF_EXCEPTION;
+  }
+  if (0 != fseek(fd, 0, SEEK_END) || (size = ftell(fd)) < 0 ||
+      0 != fseek(fd, 0, SEEK_SET)) {
+    rv = VF_EXCEPTION;
+    goto end;
+  }
+  *buf = malloc(size > 0 ? size : 1);
+  if (*buf == NULL || fread(*buf, 1, size, fd) != (size_t)size) {
+    free(*buf);
+    *buf = NULL;
+    rv = VF_EXCEPTION;
+    goto end;
+  }
+  *len = size;
+
+end:
+  fclose(fd);
+  return rv;
+}
+
+// Load a key given on the command line as id=file
+static VF_return_t load_key(const char *arg) {
+  const char *eq = strchr(arg, '=');
+  struct vfd_key *grown;
+  struct Error *err = NULL;
+  uint8_t *pubkey;
+  size_t pubkey_l;
+  VF_return_t rv;
+
+  if (eq == NULL || eq == arg || eq - arg > UINT16_MAX) {
+    fprintf(stderr, "key must be given as id=file: %s\n", arg);
+    return VF_EXCEPTION;
+  }
+
+  if (VF_SUCCESS != read_file(eq + 1, &pubkey, &pubkey_l)) {
+    fprintf(stderr, "could not read public key %s\n", eq + 1);
+    return VF_EXCEPTION;
+  }
+
+  grown = realloc(keys, (nkeys + 1) * sizeof(struct vfd_key));
+  if (grown == NULL) {
+    free(pubkey);
+    return VF_EXCEPTION;
+  }
+  keys = grown;
+
+  rv = VF_key_load(pubkey, pubkey_l, &keys[nkeys].key, &err);
+  free(pubkey);
+  if (rv != VF_SUCCESS) {
+    char *msg = err == NULL ? NULL : VF_err_fmt(err);
+    fprintf(stderr, "could not load public key %s: %s\n", eq + 1,
+            msg == NULL ? "unknown error" : msg);
+    free(msg);
+    VF_err_free(err);
+    return VF_EXCEPTION;
+  }
+
+  keys[nkeys].id_l = eq - arg;
+  keys[nkeys].id = strndup(arg, keys[nkeys].id_l);
+  if (keys[nkeys].id == NULL) {
+    VF_key_free(keys[nkeys].key);
+    return VF_EXCEPTION;
+  }
+  nkeys++;
+  return VF_SUCCESS;
+}
+
+static struct VF_key *find_key(const uint8_t *id, size_t id_l) {
+  for (size_t i = 0; i < nkeys; i++) {
+    if (keys[i].id_l == id_l && 0 == memcmp(keys[i].id, id, id_l)) {
+      return keys[i].key;
+    }
+  }
+  return NULL;
+}
+
+static void conn_release(struct vfd_conn *conn) {
+  int refs;
+
+  pthread_mutex_lock(&conn->lock);
+  refs = --conn->refs;
+  pthread_mutex_unlock(&conn->lock);
+
+  if (refs == 0) {
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn);
+  }
+}
+
+static void queue_push(struct vfd_job *job) {
+  pthread_mutex_lock(&queue.lock);
+  while (queue.length >= queue.capacity) {
+    pthread_cond_wait(&queue.not_full, &queue.lock);
+  }
+  job->next = NULL;
+  if (queue.tail == NULL) {
+    queue.head = job;
+  } else {
+    queue.tail->next = job;
+  }
+  queue.tail = job;
+  queue.length++;
+  pthread_cond_signal(&queue.not_empty);
+  pthread_mutex_unlock(&queue.lock);
+}
+
+static struct vfd_job *queue_pop() {
+  struct vfd_job *job;
+
+  pthread_mutex_lock(&queue.lock);
+  while (queue.head == NULL) {
+    pthread_cond_wait(&queue.not_empty, &queue.lock);
+  }
+  job = queue.head;
+  queue.head = job->next;
+  if (queue.head == NULL) {
+    queue.tail = NULL;
+  }
+  queue.length--;
+  pthread_cond_signal(&queue.not_full);
+  pthread_mutex_unlock(&queue.lock);
+  return job;
+}
+
+// Verify a single request and write its response.  Responses from different
+// workers for the same connection are serialized by the connection's lock so
+// that frames are never interleaved
+static void run_job(struct vfd_job *job) {
+  uint8_t response[VFD_RESPONSE_HEADER_SIZE + VFD_MAX_MESSAGE];
+  struct VF_errbuf errbuf;
+  size_t message_l = 0;
+  uint8_t outcome;
+  VF_return_t rv;
+
+  if (job->key == NULL) {
+    rv = VF_EXCEPTION;
+    errbuf.code = VF_E_PUBKEY;
+    message_l = snprintf((char *)response + VFD_RESPONSE_HEADER_SIZE,
+                         VFD_MAX_MESSAGE, "unknown key id");
+  } else {
+    rv = VF_verify_key_cached(cache, job->key, job->document, job->document_l,
+                              job->pkcs7, job->pkcs7_l, &errbuf);
+    if (rv == VF_EXCEPTION && errbuf.count > 0) {
+      int n = VF_errbuf_fmt(&errbuf, errbuf.count - 1,
+                            (char *)response + VFD_RESPONSE_HEADER_SIZE,
+                            VFD_MAX_MESSAGE);
+      if (n > 0) {
+        message_l = n < VFD_MAX_MESSAGE ? n : VFD_MAX_MESSAGE - 1;
+      }
+    }
+  }
+
+  if (rv == VF_SUCCESS) {
+    outcome = VFD_OUTCOME_SUCCESS;
+  } else if (rv == VF_FAIL) {
+    outcome = VFD_OUTCOME_FAIL;
+  } else {
+    outcome = VFD_OUTCOME_EXCEPTION;
+  }
+
+  vfd_put_u32(response, VFD_RESPONSE_HEADER_SIZE - 4 + message_l);
+  vfd_put_u32(response + 4, job->id);
+  response[8] = outcome;
+  response[9] = errbuf.code;
+
+  pthread_mutex_lock(&job->conn->lock);
+  if (0 != vfd_write_full(job->conn->fd, response,
+                          VFD_RESPONSE_HEADER_SIZE + message_l)) {
+    // The client has gone away, so wake up the reader to tear down the
+    // connection.  The other queued requests will fail to write as well
+    VF_ERROR("error while writing response %u\n", job->id);
+    shutdown(job->conn->fd, SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&job->conn->lock);
+}
+
+static void *worker(void *arg) {
+  (void)arg;
+  for (;;) {
+    struct vfd_job *job = queue_pop();
+    run_job(job);
+    conn_release(job->conn);
+    free(job->frame);
+    free(job);
+  }
+  return NULL;
+}
+
+// Parse the body of a request frame, which is everything after the length,
+// into a job.  The job takes ownership of the frame
+static VF_return_t parse_request(uint8_t *frame, uint32_t frame_l,
+                                 struct vfd_job *job) {
+  uint32_t key_l, document_l;
+
+  if (frame_l < VFD_REQUEST_HEADER_SIZE - 4) {
+    return VF_EXCEPTION;
+  }
+
+  job->id = vfd_get_u32(frame);
+  key_l = vfd_get_u16(frame + 4);
+  document_l = vfd_get_u32(frame + 6);
+  frame_l -= VFD_REQUEST_HEADER_SIZE - 4;
+
+  if (key_l > frame_l || document_l > frame_l - key_l) {
+    return VF_EXCEPTION;
+  }
+
+  job->frame = frame;
+  job->key = find_key(frame + 10, key_l);
+  job->document = frame + 10 + key_l;
+  job->document_l = document_l;
+  job->pkcs7 = job->document + document_l;
+  job->pkcs7_l = frame_l - key_l - document_l;
+  return VF_SUCCESS;
+}
+
+static void *reader(void *arg) {
+  struct vfd_conn *conn = arg;
+  uint8_t length[4];
+
+  for (;;) {
+    uint32_t frame_l;
+    uint8_t *frame;
+    struct vfd_job *job;
+
+    if (0 != vfd_read_full(conn->fd, length, sizeof(length))) {
+      break;
+    }
+
+    frame_l = vfd_get_u32(length);
+    if (frame_l > VFD_MAX_FRAME) {
+      VF_ERROR("closing connection after frame of %u bytes\n", frame_l);
+      break;
+    }
+
+    frame = malloc(frame_l > 0 ? frame_l : 1);
+    job = calloc(1, sizeof(struct vfd_job));
+    if (frame == NULL || job == NULL ||
+        0 != vfd_read_full(conn->fd, frame, frame_l) ||
+        VF_SUCCESS != parse_request(frame, frame_l, job)) {
+      VF_ERROR("closing connection after unreadable frame\n");
+      free(frame);
+      free(job);
+      break;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    conn->refs++;
+    pthread_mutex_unlock(&conn->lock);
+    job->conn = conn;
+    queue_push(job);
+  }
+
+  shutdown(conn->fd, SHUT_RDWR);
+  conn_release(conn);
+  return NULL;
+}
+
+static void on_signal(int sig) {
+  (void)sig;
+  stopping = 1;
+}
+
+int main(int argc, char **argv) {
+  const char *path = NULL;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned long capacity = 1024;
+  unsigned long cache_capacity = 0;
+  unsigned long cache_ttl = 0;
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  sigset_t signals, old;
+  pthread_attr_t attr;
+  char *end;
+  int opt, listener;
+
+  if (VF_SUCCESS != VF_init()) {
+    fprintf(stderr, "could not initialize OpenSSL\n");
+    return 1;
+  }
+
+  while (-1 != (opt = getopt(argc, argv, "s:k:t:q:c:T:"))) {
+    switch (opt) {
+    case 's':
+      path = optarg;
+      break;
+    case 'k':
+      if (VF_SUCCESS != load_key(optarg)) {
+        return 1;
+      }
+      break;
+    case 't':
+      threads = strtol(optarg, NULL, 10);
+      break;
+    case 'q':
+      capacity = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      errno = 0;
+      cache_capacity = strtoul(optarg, &end, 10);
+      if (errno != 0 || *end != '\0' || optarg[0] == '-' ||
+          cache_capacity > VF_CACHE_MAX_CAPACITY) {
+        usage(argv[0]);
+      }
+      break;
+    case 'T':
+      cache_ttl = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (path == NULL || nkeys == 0 || optind != argc || threads < 1 ||
+      capacity < 1) {
+    usage(argv[0]);
+  }
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path is too long: %s\n", path);
+    return 1;
+  }
+
+  if (VF_SUCCESS != VF_cache_new(cache_capacity, cache_ttl, &cache)) {
+    fprintf(stderr, "could not create cache\n");
+    return 1;
+  }
+
+  queue.capacity = capacity;
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.not_empty, NULL);
+  pthread_cond_init(&queue.not_full, NULL);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    perror("socket");
+    return 1;
+  }
+  unlink(path);
+  if (0 != bind(listener, (struct sockaddr *)&addr, sizeof(addr)) ||
+      0 != listen(listener, 128)) {
+    perror(path);
+    return 1;
+  }
+
+  // A client going away while a response is being written must not kill the
+  // daemon, and only the main thread handles the signals which stop it, so
+  // that they interrupt its wait for a connection
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &old);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (long i = 0; i < threads; i++) {
+    pthread_t thread;
+    if (0 != pthread_create(&thread, &attr, worker, NULL)) {
+      fprintf(stderr, "could not start worker thread\n");
+      return 1;
+    }
+  }
+
+  fprintf(stderr, "iid-verifyd listening on %s with %lu keys and %ld workers\n",
+          path, (unsigned long)nkeys, threads);
+
+  while (!stopping) {
+    struct vfd_conn *conn;
+    pthread_t thread;
+    int fd;
+
+    fd_set ready;
+
+    // The signals are only unblocked while waiting, so one which arrives
+    // just before waiting is not missed
+    FD_ZERO(&ready);
+    FD_SET(listener, &ready);
+    if (pselect(listener + 1, &ready, NULL, NULL, NULL, &old) < 0) {
+      continue;
+    }
+
+    fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+
+    conn = calloc(1, sizeof(struct vfd_conn));
+    if (conn == NULL) {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->refs = 1;
+    pthread_mutex_init(&conn->lock, NULL);
+
+    if (0 != pthread_create(&thread, &attr, reader, conn)) {
+      VF_ERROR("could not start connection thread\n");
+      pthread_mutex_destroy(&conn->lock);
+      close(fd);
+      free(conn);
+    }
+  }
+
+  // Requests which are still queued are abandoned, since their clients will
+  // see the socket close either way
+  close(listener);
+  unlink(path);
+  return 0;
+}
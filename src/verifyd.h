@@ -0,0 +1,94 @@
+#ifndef VERIFYD_H
+#define VERIFYD_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+// The wire protocol spoken by iid-verifyd over its Unix domain socket.  Every
+// integer is unsigned and big endian, and every frame starts with a 4 byte
+// length which counts the bytes of the frame after the length itself.
+//
+// A request frame is:
+//
+//   length (4) | id (4) | key_l (2) | document_l (4) | key id | document |
+//   pkcs7
+//
+// where the pkcs7 signature is the rest of the frame.  The id is chosen by
+// the client and is sent back unchanged in the response, so that a client can
+// send any number of requests without waiting.  Responses are sent as soon as
+// each verification finishes, which is not necessarily the order that the
+// requests were sent in.  A response frame is:
+//
+//   length (4) | id (4) | outcome (1) | code (1) | message
+//
+// The outcome is one of the VFD_ values below and the code is the VF_E_ class
+// of the error.  For VFD_EXCEPTION the message is the root-most error, and it
+// is empty otherwise.  A request for a key id which the daemon has not loaded
+// is a VFD_EXCEPTION with the VF_E_PUBKEY code.  A frame which cannot be
+// parsed causes the connection to be closed, since the framing of anything
+// after it can't be trusted
+#define VFD_OUTCOME_SUCCESS 0
+#define VFD_OUTCOME_FAIL 1
+#define VFD_OUTCOME_EXCEPTION 2
+
+#define VFD_REQUEST_HEADER_SIZE 14
+#define VFD_RESPONSE_HEADER_SIZE 10
+#define VFD_MAX_FRAME (1024 * 1024)
+#define VFD_MAX_MESSAGE 512
+
+static inline void vfd_put_u16(uint8_t *buf, uint16_t value) {
+  buf[0] = value >> 8;
+  buf[1] = value;
+}
+
+static inline void vfd_put_u32(uint8_t *buf, uint32_t value) {
+  buf[0] = value >> 24;
+  buf[1] = value >> 16;
+  buf[2] = value >> 8;
+  buf[3] = value;
+}
+
+static inline uint16_t vfd_get_u16(const uint8_t *buf) {
+  return (uint16_t)buf[0] << 8 | buf[1];
+}
+
+static inline uint32_t vfd_get_u32(const uint8_t *buf) {
+  return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+         (uint32_t)buf[2] << 8 | buf[3];
+}
+
+// Read exactly len bytes.  Returns 0 when they were read, 1 when the peer
+// closed the connection before the first byte and -1 on any other error
+static inline int vfd_read_full(int fd, uint8_t *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = read(fd, buf + done, len - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n == 0 && done == 0) {
+      return 1;
+    } else if (n <= 0) {
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+// Write exactly len bytes.  Returns 0 when they were written and -1 otherwise
+static inline int vfd_write_full(int fd, const uint8_t *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = write(fd, buf + done, len - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,62 @@
+#!/bin/bash
+
+# This test script builds an archive of valid, invalid and malformed records
+# with iid-audit, audits it with a bundle of the test keys and checks the
+# summary and the results bitmap.
+
+set -e
+
+rm -rf .audit-test
+mkdir .audit-test
+cd .audit-test
+
+cp ../test-files/* .
+sed 's/"/'"'"'/' document > incorrect-document
+cat pkcs7-pubkey rsa2048-pubkey > bundle
+
+append() {
+  ../iid-audit -a archive -d "$1" -p "$2"
+}
+
+for i in {1..600} ; do
+  append document pkcs7
+  append document rsa2048-with-header
+done
+append incorrect-document rsa2048
+append document not-valid-datastructure
+
+expect() {
+  if ! grep -q "$1" summary ; then
+    echo "expected '$1' in the summary:"
+    cat summary
+    exit 1
+  fi
+}
+
+if ../iid-audit -b bundle -i archive -o results -t 4 > summary ; then
+  echo iid-audit succeeded with invalid records
+  exit 1
+fi
+expect '^records 1202 valid 1200 invalid 1 exceptions 1$'
+expect '^invalid 1200 at '
+expect '^exception 1201 at '
+expect '^  IID-Verify .* Exception$'
+
+# The header and count are 16 bytes, and the bitmap ends with two clear bits
+# for the last two records
+if [ "$(stat -c %s results)" != 167 ] ||
+   [ "$(od -An -tx1 -N1 -j 166 results | tr -d ' ')" != 00 ] ||
+   [ "$(od -An -tx1 -N1 -j 165 results | tr -d ' ')" != ff ] ; then
+  echo the results bitmap is not correct
+  exit 1
+fi
+
+# A record which was cut off while being appended is reported, not verified
+head -c -10 archive > truncated
+if ../iid-audit -b bundle -i truncated -t 2 > summary ; then
+  echo iid-audit succeeded with a truncated archive
+  exit 1
+fi
+expect '^records 1201 valid 1200 invalid 1 exceptions 0 truncated$'
+
+echo iid-audit outcomes are correct
@@ -24,15 +24,3 @@ if [ $? -eq 0 ] ; then echo PKCS7 file validates ;  else echo PKCS7 Failed ; exi
 # Test the rsa2048 endpoint
 openssl smime -verify -in real-rsa2048 -inform PEM -content document -certfile rsa2048-pubkey -noverify > /dev/null
 if [ $? -eq 0 ] ; then echo RSA2048 file validates ; else echo RSA2048 Failed ; exit 1 ; fi
-
-# Benchmark RSA2048
-s="$(date +%s)"
-for i in {0..1000} ; do
-  openssl smime -verify -in real-rsa2048 -inform PEM -content document -certfile rsa2048-pubkey -noverify &> /dev/null
-done
-e="$(date +%s)"
-
-echo Did 1000 iterations in $((e - s)) seconds
-
-
-
@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# This test script verifies the seed corpus of the fuzz target, and inputs
+# mutated from it, with both iid-fuzz and `openssl smime -verify`, in the same
+# way as test-cmdline.sh, and fails if they disagree about whether any input
+# is valid.  Whether an invalid input is a failed signature or an exception
+# is not compared, since smime reports both with the same exit status.
+# -nointern is given because this library only ever verifies with the key it
+# is given, never with a certificate in the envelope
+#
+# usage: ./test-fuzz-differential.sh [mutated inputs]
+
+set -e
+
+runs=${1:-500}
+
+rm -rf .fuzz-test
+mkdir .fuzz-test
+
+./iid-fuzz -c .fuzz-test/corpus > /dev/null
+./iid-fuzz -n "$runs" -o .fuzz-test/mutated .fuzz-test/corpus
+
+inputs=0
+mismatches=0
+for input in .fuzz-test/corpus/* .fuzz-test/mutated/* ; do
+  read -r inform key outcome < <(./iid-fuzz -w .fuzz-test "$input")
+
+  smime=1
+  if [ "$inform" != none ] && openssl smime -verify -binary -nointern \
+      -noverify -in .fuzz-test/pkcs7 -inform "$inform" \
+      -content .fuzz-test/document -certfile "test-files/$key" \
+      > /dev/null 2>&1 ; then
+    smime=0
+  fi
+
+  native=1
+  if [ "$outcome" -eq 0 ] ; then
+    native=0
+  fi
+
+  inputs=$((inputs + 1))
+  if [ $native -ne $smime ] ; then
+    echo "$input: iid-fuzz outcome $outcome, openssl smime exit $smime"
+    mismatches=$((mismatches + 1))
+  fi
+done
+
+echo "$inputs inputs compared with openssl smime, $mismatches disagreed"
+if [ $mismatches -ne 0 ] ; then exit 1 ; fi
@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# This test script starts iid-verifyd with the test keys and checks that the
+# outcomes it sends back for valid, invalid and malformed requests are correct,
+# using the load generator as the client.
+
+set -e
+
+rm -rf .verifyd-test
+mkdir .verifyd-test
+cd .verifyd-test
+
+cp ../test-files/* .
+sed 's/"/'"'"'/' document > incorrect-document
+
+../iid-verifyd -s verifyd.sock -k pkcs7=pkcs7-pubkey -k rsa2048=rsa2048-pubkey \
+  -t 4 &
+pid=$!
+trap 'kill $pid' EXIT
+
+for i in {0..50} ; do
+  if [ -S verifyd.sock ] ; then break ; fi
+  sleep 0.1
+done
+
+load() {
+  ../iid-verifyd-load -s verifyd.sock -c 4 -n 1000 "$@"
+}
+
+load -k pkcs7 -d document -p pkcs7 -e success
+load -k rsa2048 -d document -p rsa2048-with-header -e success
+load -k rsa2048 -d incorrect-document -p rsa2048 -e fail
+load -k rsa2048 -d document -p not-valid-datastructure -e exception
+load -k unknown -d document -p rsa2048 -e exception
+
+echo iid-verifyd outcomes are correct